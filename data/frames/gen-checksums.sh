@@ -0,0 +1,24 @@
+#!/bin/bash
+
+#
+# Generate the checksums manifest of the reference frames used by the exact
+# frame comparisons of the test suite.
+#
+# Usage: gen-checksums.sh <vsp-tests directory>
+#
+# The manifest is written to stdout, one "checksum options" line per frame.
+# The options reference files relative to the parent directory, as on the
+# target. The checksums are computed in strict mode.
+#
+
+topdir=$(cd $1 && pwd)
+genimage=$topdir/src/gen-image
+
+./list-references.sh $topdir | sed -n 's/^exact //p' | (
+	cd .. &&
+	while read options ; do
+		checksum=$($genimage $options --strict --checksum \
+			frames/frame-reference-1024x768.pnm.gz) || exit 1
+		echo "$checksum $options"
+	done
+)
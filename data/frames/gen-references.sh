@@ -0,0 +1,50 @@
+#!/bin/bash
+
+#
+# Generate a makefile that creates the reference frames of the test suite in
+# the references directory, named by reference_file() from vsp-lib.sh.
+#
+# Usage: gen-references.sh <vsp-tests directory>
+#
+# The makefile is written to stdout. The reference frames are generated by the
+# gen-image binary set in the GENIMAGE variable in strict mode, and stored
+# compressed.
+#
+
+topdir=$(cd $1 && pwd)
+
+. $topdir/scripts/vsp-lib.sh
+
+references=()
+rules=()
+
+while read options ; do
+	file=$(reference_file $options)
+	file=${file#frames/}
+
+	# Quote the options as they can contain shell special characters, and
+	# depend on the files they reference.
+	quoted=
+	deps=
+	for option in $options ; do
+		quoted="$quoted '$option'"
+		[[ $option = frames/* ]] && deps="$deps ${option#frames/}"
+	done
+
+	references+=($file)
+	rules+=("$file: \$(GENIMAGE) frame-reference-1024x768.pnm.gz$deps | references
+	cd .. && \$(GENIMAGE)$quoted --strict -z -o frames/$file frames/frame-reference-1024x768.pnm.gz
+")
+done < <(./list-references.sh $topdir | cut -d ' ' -f 2- | sort -u)
+
+echo ".DELETE_ON_ERROR:"
+echo
+echo "all: ${references[@]}"
+echo
+echo "references:"
+echo "	mkdir -p \$@"
+echo
+
+for rule in "${rules[@]}" ; do
+	echo "$rule"
+done
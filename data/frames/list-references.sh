@@ -0,0 +1,110 @@
+#!/bin/bash
+
+#
+# List the reference frames of the test suite.
+#
+# The gen-image options of the reference frames depend on the formats and
+# sizes configured by the tests. To collect them the tests are run against a
+# stub of the vsp-lib.sh hardware access functions that records the formats
+# configured on the pads, for both VSP1 and VSP2 models. Tests that suspend the
+# system or load it with stress are skipped, their reference frames are then
+# generated on the target as all frames missing from the list.
+#
+# Usage: list-references.sh <vsp-tests directory>
+#
+# The list is written to stdout, one "method options" line per frame, where
+# method is the exact or fuzzy comparison method.
+#
+
+topdir=$(cd $1 && pwd)
+framesdir=$(pwd)
+workdir=$(mktemp -d)
+
+trap "rm -rf $workdir" EXIT
+
+ln -s $framesdir $workdir/frames
+
+cat > $workdir/vsp-lib.sh << EOF
+VSP_SIMULATOR=
+. $topdir/scripts/vsp-lib.sh
+EOF
+
+cat >> $workdir/vsp-lib.sh << 'EOF'
+
+mediactl=references_mediactl
+
+# Record the size of the formats set on pads, ignore all other requests.
+references_mediactl() {
+	[ "$3" = -V ] || return 0
+
+	local pad=$(echo "$4" | sed "s/^'[^ ]* \([^']*\)':\([0-9]*\).*/\1_\2/" | tr . _)
+	local size=$(echo "$4" | sed 's/.*fmt:[^/]*\/\([0-9x]*\).*/\1/')
+
+	eval __references_size_$pad=$size
+}
+
+vsp1_entity_get_size() {
+	local pad=$(echo $1_$2 | tr . _)
+
+	eval echo \$__references_size_$pad
+}
+
+vsp1_model() { echo $references_model; }
+vsp1_has_feature() { return 0; }
+vsp1_count_rpfs() { echo 5; }
+vsp1_count_wpfs() { echo 4; }
+vsp1_set_control() { :; }
+vsp1_reset_controls() { :; }
+
+__vsp1_count_brx_inputs() {
+	case $1 in
+	bru)
+		echo 5
+		;;
+	*)
+		echo 2
+		;;
+	esac
+}
+
+vsp_runner() { :; }
+vsp_runner_wait() { :; }
+vsp_runner_resume() { :; }
+
+test_init() {
+	logfile=/dev/null
+	mdev=/dev/media0
+	dev=vsp
+}
+
+test_start() { :; }
+test_complete() { :; }
+test_run() { test_main > /dev/null; }
+
+# Output the comparison method and reference frame options to fd 3.
+compare_frames() {
+	local size=$(vsp1_entity_get_size wpf.$__vsp_wpf_index 1)
+	local method=exact
+
+	reference_options $__vsp_rpf_format $__vsp_wpf_format $size $*
+
+	[ x$__vsp_pixel_perfect = xtrue ] || method=fuzzy
+	echo $method $__vsp_ref_options >&3
+
+	echo pass
+}
+
+compare_histograms() { echo pass; }
+EOF
+
+cd $workdir
+
+for test in $topdir/tests/vsp-unit-test-*.sh ; do
+	grep -q '/sys/power\|stress ' $test && continue
+
+	for model in VSP1-D VSP2-BC ; do
+		references_model=$model bash $test 3>> options > /dev/null 2>&1
+	done
+done
+
+sort -u options
@@ -1,40 +1,24 @@
 #!/bin/sh
 
-FILE=${1:-.}
+#
+# Convert raw frames to PNG images with gen-image. Frames are converted from
+# the current directory by default.
+#
 
-convert_image() {
-	local file=$1
-	local pnm=${file%bin}pnm
-	local png=${file%bin}png
+genimage=$(dirname $0)/gen-image
+compare=
 
-	local format=$(echo $file | sed -e 's|.*-\([[:alnum:]]*\)-\([0-9]*x[0-9]*\).*.bin|\1|' | tr '[:lower:]' '[:upper:]')
-	local size=$(echo $file   | sed -e 's|.*-\([[:alnum:]]*\)-\([0-9]*x[0-9]*\).*.bin|\2|')
+case "$1" in
+-h|--help)
+	echo "Usage: $0 [--decode-compare side|diff] [file or directory]..."
+	exit 0
+	;;
+--decode-compare)
+	compare="$1 $2"
+	shift 2
+	;;
+esac
 
-	case $format in
-	YUV*|YVU*)
-		format=$(echo $format | tr 'M' 'P')
-		;;
-	NV*)
-		format=$(echo $format | tr -d 'M')
-		;;
-	*RGB*)
-		format=$(echo $format | tr -d 'AX')
-		;;
-	esac
+[ $# = 0 ] && set -- .
 
-	raw2rgbpnm -f $format -s $size $file $pnm && \
-		convert $pnm $png
-	rm $pnm
-}
-
-if [ -d $FILE ] ; then
-	if [ $(ls $FILE/vsp-unit-test-00*-*frame*.bin 2>/dev/null | wc -l) != 0 ] ; then
-		for f in $FILE/vsp-unit-test-00*-*frame*.bin ; do
-			convert_image $f
-		done
-	fi
-elif [ -f $FILE ] ; then
-	convert_image $FILE
-else
-	echo "Usage: $0 <file or directory>"
-fi
+exec $genimage --decode $compare "$@"
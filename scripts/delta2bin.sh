@@ -0,0 +1,26 @@
+#!/bin/sh
+
+#
+# Reconstruct the frames stored as deltas by the tests, from the directory
+# where the test suite is installed. Each frame is stored next to its delta,
+# with the reference frame regenerated from the identity recorded in the delta.
+#
+
+. ./vsp-lib.sh
+
+if [ $# = 0 ] ; then
+	echo "Usage: $0 <delta>..."
+	exit 1
+fi
+
+for delta in "$@" ; do
+	reference=${delta%frame-*.delta}ref-frame.bin
+
+	if [ ! -f $reference ] ; then
+		__vsp_ref_options=$($framedelta --info $delta | \
+			sed -n 's/^Identity: //p')
+		reference_generate $reference || exit 1
+	fi
+
+	$framedelta --apply -o ${delta%.delta}.bin $delta $reference || exit 1
+done
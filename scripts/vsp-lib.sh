@@ -1,9 +1,23 @@
 #!/bin/sh
 
 genimage='./gen-image'
+framedelta='./frame-delta'
 mediactl='media-ctl'
 yavta='yavta'
+yavta_pids='pidof yavta'
+media_devices='/dev/media*'
 frames_dir=/tmp/
+# Generate images in strict mode, bit-identical to the checksums and references
+# pre-generated on the build host.
+source_image="--strict --source-cache $frames_dir frames/frame-reference-1024x768.pnm.gz"
+
+# Run the tests on the simulated devices of vsp-sim.sh instead of the hardware.
+if [ x$VSP_SIMULATOR = x1 ] ; then
+	mediactl='./vsp-sim.sh media-ctl'
+	yavta='./vsp-sim.sh yavta'
+	yavta_pids='pidof -x vsp-sim.sh'
+	media_devices=$(./vsp-sim.sh devices)
+fi
 
 # ------------------------------------------------------------------------------
 # Miscellaneous
@@ -106,12 +120,15 @@ vsp1_reset_controls() {
 # Reference frame generation
 #
 
-reference_frame() {
-	local file=$1
-	local in_format=$2
-	local out_format=$3
-	local size=$4
-	shift 4
+#
+# Compute the gen-image options for the reference frame and store them in
+# __vsp_ref_options.
+#
+reference_options() {
+	local in_format=$1
+	local out_format=$2
+	local size=$3
+	shift 3
 
 	local alpha=
 	local options=
@@ -193,8 +210,66 @@ reference_frame() {
 
 	[ x$__vsp_brx_inputs != x ] && options="$options -c $__vsp_brx_inputs"
 
-	$genimage -i $in_format -f $out_format -s $size -a $alpha $options -o $file \
-		frames/frame-reference-1024x768.pnm
+	__vsp_ref_options="-i $in_format -f $out_format -s $size -a $alpha $options"
+}
+
+#
+# Print the name of the reference frame file for the gen-image options, as
+# pre-generated by make references.
+#
+reference_file() {
+	echo frames/references/$(echo $* | \
+		sed 's|frames/||g; s/\.bin//g; s/^-*//; s/ -*/-/g; s/[^A-Za-z0-9.-]/_/g').bin
+}
+
+#
+# Store the reference frame for the gen-image options in __vsp_ref_options to
+# file, copying the pre-generated frame if available.
+#
+reference_generate() {
+	local file=$1
+	local reference=$(reference_file $__vsp_ref_options)
+
+	if [ -f $reference ] ; then
+		cp $reference $file
+	else
+		$genimage $__vsp_ref_options -z -o $file \
+			$source_image
+	fi
+}
+
+reference_frame() {
+	local file=$1
+	shift 1
+
+	reference_options $*
+	reference_generate $file
+}
+
+#
+# Look up the checksum of the reference frame for the gen-image options in the
+# manifest generated by make checksums, or compute it from the pre-generated
+# reference frame if available.
+#
+reference_checksum() {
+	local options=$(echo $*)
+	local reference=$(reference_file $options)
+	local checksum
+
+	[ -f frames/checksums ] && checksum=$(awk -v options="$options" '{
+		checksum = $1;
+		$1 = "";
+		sub(/^ /, "");
+		if ($0 == options) {
+			print checksum;
+			exit;
+		}
+	}' frames/checksums)
+
+	[ x$checksum = x -a -f $reference ] && \
+		checksum=$($genimage --checksum-frames $reference | cut -d ' ' -f 1)
+
+	echo $checksum
 }
 
 reference_histogram() {
@@ -208,68 +283,48 @@ reference_histogram() {
 	[[ "x$hgt_hue_areas" != x ]] && hue="--histogram-areas $hgt_hue_areas"
 
 	$genimage -i $format -f $format -s $size -H $file --histogram-type $type $hue \
-		frames/frame-reference-1024x768.pnm
+		$source_image
 }
 
 # ------------------------------------------------------------------------------
 # Image and histogram comparison
 #
 
-#
-# Compare the two frames for exact match.
-#
-compare_frame_exact() {
-	local img_a=$3
-	local img_b=$4
-
-	local match='fail'
-	diff -q $img_a $img_b > /dev/null && match='pass'
-
-	echo "Compared $img_a and $img_b: $match" | ./logger.sh check >> $logfile
-
-	if [ $match = 'pass' ] ; then
-		return 0
-	else
-		return 1
-	fi
-}
-
 #
 # Compare the two frames using a fuzzy match algorithm to account for errors
 # introduced by the YUV packing. Accept a maximum 1% mean average error over
 # the whole frame with no more than 5% of the pixels differing.
 #
 compare_frame_fuzzy() {
-	local fmt=$(echo $1 | sed 's/M$/P/')
+	local fmt=$1
 	local size=$2
 	local img_a=$3
 	local img_b=$4
 
-	local pnm_a=${img_a/bin/pnm}
-	local pnm_b=${img_b/bin/pnm}
+	local output
+	local ret
 
-	raw2rgbpnm -f $fmt -s $size $img_a $pnm_a > /dev/null
-	raw2rgbpnm -f $fmt -s $size $img_b $pnm_b > /dev/null
+	output=$($genimage -f $fmt -s $size --compare $img_a $img_b)
+	ret=$?
 
-	local ae=$(compare -metric ae $pnm_a $pnm_b /dev/null 2>&1)
-	local mae=$(compare -metric mae $pnm_a $pnm_b /dev/null 2>&1 | sed 's/.*(\(.*\))/\1/')
+	echo "$output" | ./logger.sh check >> $logfile
 
-	rm $pnm_a
-	rm $pnm_b
-
-	local width=$(echo $size | cut -d 'x' -f 1)
-	local height=$(echo $size | cut -d 'x' -f 2)
-
-	local ae_match=$(echo $ae $width $height | awk '{ if ($1 / $2 / $3 < 0.05) { print "pass" } else { print "fail" } }')
-	local mae_match=$(echo $mae | awk '{ if ($1 < 0.01) { print "pass" } else { print "fail" } }')
+	return $ret
+}
 
-	echo "Compared $img_a and $img_b: ae $ae ($ae_match) mae $mae ($mae_match)" | ./logger.sh check >> $logfile
+#
+# Move a captured frame out of the frames directory, compressed with the
+# gen-image frame codec to reduce the storage I/O. Frames that can't be
+# compressed are kept raw.
+#
+keep_frame() {
+	local frame=$1
+	local file=$2
+	local format=$3
+	local size=$4
 
-	if [ $ae_match = 'pass' -a $mae_match = 'pass' ] ; then
-		return 0
-	else
-		return 1
-	fi
+	$genimage -f $format -s $size --compress-frames $frame > /dev/null
+	mv $frame $file
 }
 
 compare_frames() {
@@ -283,10 +338,12 @@ compare_frames() {
 	local out_fmt=$(echo $out_format | tr '[:upper:]' '[:lower:]')
 	local size=$(vsp1_entity_get_size wpf.$wpf 1)
 
-	reference_frame ${frames_dir}ref-frame.bin $in_format $out_format $size $args
+	reference_options $in_format $out_format $size $args
 
 	local method=exact
 	local result="pass"
+	local failed=
+	local keep=$VSP_KEEP_FRAMES
 	local params=${args// /-}
 	params=${params:+-$params}
 	params=${params//\//_}
@@ -303,20 +360,70 @@ compare_frames() {
 		method=fuzzy
 	fi
 
+	# Exact comparison hashes the captured frames when the reference frame
+	# checksum is known or the reference frame pre-generated, and is
+	# otherwise performed by gen-image for all frames at once. The reference
+	# frame is only generated if a frame differs or the frames are kept.
+	if [ $method = exact ] ; then
+		local checksum=$(reference_checksum $__vsp_ref_options)
+
+		if [ x$checksum != x ] ; then
+			$genimage --checksum-frames ${frames_dir}frame-*.bin | \
+				awk -v checksum=$checksum '{
+					print "Compared " $2 ": " ($1 == checksum ? "pass" : "fail")
+				}' > ${frames_dir}verify.log
+		else
+			$genimage $__vsp_ref_options -z -o ${frames_dir}ref-frame.bin \
+				--verify ${frames_dir}frame-*.bin \
+				$source_image > ${frames_dir}verify.log
+		fi
+		./logger.sh check < ${frames_dir}verify.log >> $logfile
+	else
+		reference_generate ${frames_dir}ref-frame.bin
+	fi
+
 	for frame in ${frames_dir}frame-*.bin ; do
 		local match="true"
 
-		(compare_frame_$method $out_format $size $frame ${frames_dir}ref-frame.bin) ||  {
+		if [ $method = exact ] ; then
+			grep -qxF "Compared $frame: pass" ${frames_dir}verify.log
+		else
+			compare_frame_$method $out_format $size $frame ${frames_dir}ref-frame.bin
+		fi || {
 			match="false" ;
 			result="fail" ;
 		}
 
-		if [ $match = "false" -o x$VSP_KEEP_FRAMES = x1 ] ; then
-			mv $frame ${0/.sh/}-$params-$(basename ${frame})
+		if [ x$VSP_KEEP_FRAMES = x1 ] ; then
+			keep_frame $frame ${0/.sh/}-$params-$(basename ${frame}) \
+				$out_format $size
+		elif [ $match = "false" ] ; then
+			failed="$failed $frame"
 		fi
 	done
 
+	rm -f ${frames_dir}verify.log
+
 	if [ x$VSP_KEEP_FRAMES = x1 -o $result = "fail" ] ; then
+		[ -f ${frames_dir}ref-frame.bin ] || \
+			reference_generate ${frames_dir}ref-frame.bin
+	fi
+
+	# Failed frames are stored as the tiles that differ from the reference
+	# frame, which delta2bin.sh regenerates from the gen-image options
+	# recorded in the delta. The full frames and the reference frame are
+	# only stored with VSP_KEEP_FRAMES, or if the delta can't be computed.
+	for frame in $failed ; do
+		$framedelta -f $out_format -s $size -i "$(echo $__vsp_ref_options)" \
+			-o ${0/.sh/}-$params-$(basename ${frame} .bin).delta \
+			$frame ${frames_dir}ref-frame.bin > /dev/null || {
+			keep_frame $frame ${0/.sh/}-$params-$(basename ${frame}) \
+				$out_format $size ;
+			keep=1 ;
+		}
+	done
+
+	if [ x$keep = x1 ] ; then
 		mv ${frames_dir}ref-frame.bin ${0/.sh/}-$params-ref-frame.bin
 	else
 		rm -f ${frames_dir}ref-frame.bin
@@ -894,7 +1001,7 @@ generate_input_frame() {
 	$(format_v4l2_is_yuv $format) && options="$options -C -i YUV444M"
 
 	$genimage -f $format -s $size -a $alpha $options -o $file \
-		frames/frame-reference-1024x768.pnm
+		$source_image
 }
 
 vsp_runner() {
@@ -998,8 +1105,8 @@ vsp_runner_find() {
 
 	local pid
 
-	for pid in $(pidof yavta) ; do
-		(ls -l /proc/$pid/fd/ | grep -q "$videodev$") && {
+	for pid in $($yavta_pids) ; do
+		(ls -l /proc/$pid/fd/ 2>/dev/null | grep -q "$videodev$") && {
 			echo $pid ;
 			break
 		}
@@ -1045,7 +1152,7 @@ test_init() {
 	local best_features_count=0
 	local best_mdev=
 
-	for mdev in /dev/media* ; do
+	for mdev in $media_devices ; do
 		dev=$(vsp1_device $mdev)
 
 		local match='true'
@@ -0,0 +1,1393 @@
+#!/bin/bash
+
+#
+# Simulate VSP devices in software, standing in for media-ctl and yavta to run
+# the test suite on machines without VSP hardware.
+#
+# Usage: vsp-sim.sh devices
+#        vsp-sim.sh media-ctl [media-ctl options]
+#        vsp-sim.sh yavta [yavta options] <device>
+#
+# The devices command creates one simulated media device per model listed in
+# VSP_SIM_MODELS and prints their paths, to be used as the -d argument of
+# media-ctl. Every media-ctl and yavta call runs in a separate process, the
+# media graph (links and pad formats) and the controls of each device are thus
+# stored in files in the device directory.
+#
+# The VSP doesn't process the frames read from memory by the RPFs. When the WPF
+# capture starts, the pipeline is validated as the kernel does, and its output
+# frames and histograms are computed by gen-image from the source image of the
+# tests, with options derived from the video node formats, the pad formats and
+# selection rectangles, and the controls. This models a bit-exact VSP: a test
+# fails when the test scripts configure the pipeline or compute the reference
+# frames incorrectly, not when they expose a hardware or driver issue.
+#
+
+sim_dir=/tmp/vsp-sim
+models=${VSP_SIM_MODELS:-VSP2-BC VSP2-BD VSP2-I VSP2-DL}
+genimage=./gen-image
+source_image=frames/frame-reference-1024x768.pnm.gz
+timeout=10
+
+declare -a sim_entities
+declare -A sim_pads
+declare -A sim_node
+declare -A sim_fmt
+declare -A sim_ctrl
+declare -a sim_link_src
+declare -a sim_link_spad
+declare -a sim_link_sink
+declare -a sim_link_dpad
+declare -a sim_link_flags
+sim_link_count=0
+
+# ------------------------------------------------------------------------------
+# Device models
+#
+
+#
+# Print the base address and the entities of a VSP model, followed by the
+# optional WPF flipping and rotation controls. Entities instantiated multiple
+# times are specified as name:count. The models approximate the R-Car Gen2 and
+# Gen3 VSP instances.
+#
+sim_model() {
+	case $1 in
+	VSP1-D)
+		echo "fe930000 rpf:4 wpf:4 bru:4 hgo hsi hst lif:1 lut uds:1 vflip"
+		;;
+	VSP1-S)
+		echo "fe928000 rpf:5 wpf:4 bru:4 clu hgo hgt hsi hst lut sru uds:3 hflip vflip"
+		;;
+	VSP2-BC)
+		echo "fe920000 rpf:5 wpf:1 bru:5 clu hgo hsi hst lut uds:1 vflip"
+		;;
+	VSP2-BD)
+		echo "fe960000 rpf:5 wpf:1 bru:5 hsi hst vflip"
+		;;
+	VSP2-I)
+		echo "fe9a0000 rpf:1 wpf:1 clu hgo hgt hsi hst lut sru uds:1 hflip vflip rotate"
+		;;
+	VSP2-DL)
+		echo "fea28000 rpf:5 wpf:2 brs:2 bru:5 hsi hst lif:2 vflip"
+		;;
+	esac
+}
+
+sim_model_has() {
+	local spec=" $(sim_model $model) "
+
+	[[ $spec == *" $1 "* ]]
+}
+
+#
+# Print the controls of an entity, one "id min max default name" line per
+# control. Array controls have no range.
+#
+sim_controls() {
+	case $1 in
+	rpf.*)
+		echo "0x00980929 0 255 255 Alpha Component"
+		;;
+	wpf.*)
+		echo "0x00980929 0 255 255 Alpha Component"
+		sim_model_has hflip && echo "0x00980914 0 1 0 Horizontal Flip"
+		sim_model_has vflip && echo "0x00980915 0 1 0 Vertical Flip"
+		sim_model_has rotate && echo "0x00980922 0 270 0 Rotate"
+		;;
+	clu | lut)
+		echo "0x00981902 - - - Look-Up Table"
+		;;
+	hgt)
+		echo "0x00981901 - - {0,255,255,255,255,255,255,255,255,255,255,255} Boundary Values for Hue Area"
+		;;
+	sru)
+		echo "0x00981901 1 6 1 Intensity"
+		;;
+	esac
+}
+
+# Print the current value of a control.
+sim_control() {
+	local entity=$1
+	local id=$2
+	local value=${sim_ctrl[$entity $id]}
+
+	[ -z "$value" ] && \
+		value=$(sim_controls $entity | awk -v id=$id '$1 == id { print $4 }')
+	echo $value
+}
+
+sim_device_create() {
+	local mdev=$1
+	local model=$2
+	local spec=$(sim_model $model)
+
+	if [ -z "$spec" ] ; then
+		echo "Unknown VSP model $model" >&2
+		return 1
+	fi
+
+	mkdir -p $mdev/streams
+	echo $model > $mdev/model
+	echo ${spec%% *}.vsp > $mdev/bus
+	: > $mdev/links
+	: > $mdev/controls
+
+	local token
+	local i
+
+	for token in ${spec#* } ; do
+		local name=${token%:*}
+		local count=${token#*:}
+
+		case $name in
+		rpf | wpf)
+			local node="input"
+			[ $name = wpf ] && node="output"
+
+			for i in $(seq 0 $((count-1))) ; do
+				printf "$name.$i\t2\t$mdev/v4l-subdev-$name.$i\n"
+				printf "$name.$i $node\t1\t$mdev/video-$name.$i\n"
+			done
+			;;
+		bru | brs)
+			printf "$name\t$((count+1))\t$mdev/v4l-subdev-$name\n"
+			;;
+		lif | uds)
+			for i in $(seq 0 $((count-1))) ; do
+				printf "$name.$i\t2\t$mdev/v4l-subdev-$name.$i\n"
+			done
+			;;
+		hgo | hgt)
+			printf "$name\t2\t$mdev/v4l-subdev-$name\n"
+			printf "$name histo\t1\t$mdev/video-$name\n"
+			;;
+		hflip | vflip | rotate)
+			;;
+		*)
+			printf "$name\t2\t$mdev/v4l-subdev-$name\n"
+			;;
+		esac
+	done > $mdev/entities
+
+	# Create the device nodes, and initialize the subdev pad formats.
+	local pads
+	local node
+	local pad
+
+	while IFS=$'\t' read name pads node ; do
+		touch $node
+		[ $pads = 1 ] && continue
+
+		for pad in $(seq 0 $((pads-1))) ; do
+			local code=ARGB32
+
+			case $name:$pad in
+			hst:1 | hsi:0 | hgt:0)
+				code=AHSV8888_1X32
+				;;
+			esac
+
+			echo "$name:$pad $code 1920x1080 - -"
+		done
+	done < $mdev/entities > $mdev/formats
+}
+
+#
+# Create the simulated devices if they don't exist yet, and print their paths.
+#
+sim_devices() {
+	if [ "$(cat $sim_dir/models 2>/dev/null)" != "$models" ] ; then
+		rm -rf $sim_dir
+
+		local index=0
+		local model
+
+		for model in $models ; do
+			sim_device_create $sim_dir/media$index $model || exit 1
+			index=$((index+1))
+		done
+
+		echo "$models" > $sim_dir/models
+	fi
+
+	ls -d $sim_dir/media*
+}
+
+# ------------------------------------------------------------------------------
+# Device state
+#
+
+sim_load() {
+	if [ ! -f $mdev/model ] ; then
+		echo "Failed to open media device $mdev" >&2
+		return 1
+	fi
+
+	read model < $mdev/model
+	read bus < $mdev/bus
+
+	local name
+	local pads
+	local node
+
+	while IFS=$'\t' read name pads node ; do
+		sim_entities+=("$name")
+		sim_pads[$name]=$pads
+		sim_node[$name]=$node
+
+		# Immutable links between the RPFs and HGO/HGT and their video
+		# nodes.
+		case $name in
+		*" input")
+			sim_link_add "$name" 0 "${name% input}" 0 ENABLED,IMMUTABLE
+			;;
+		*" histo")
+			sim_link_add "${name% histo}" 1 "$name" 0 ENABLED,IMMUTABLE
+			;;
+		esac
+	done < $mdev/entities
+
+	local src
+	local spad
+	local sink
+	local dpad
+
+	while IFS=$'\t' read src spad sink dpad ; do
+		sim_link_add "$src" $spad "$sink" $dpad ENABLED
+	done < $mdev/links
+
+	local pad
+	local format
+
+	while read pad format ; do
+		sim_fmt[$pad]=$format
+	done < $mdev/formats
+
+	local entity
+	local id
+	local value
+
+	while read entity id value ; do
+		sim_ctrl["$entity $id"]=$value
+	done < $mdev/controls
+}
+
+sim_save_links() {
+	local i
+
+	for i in ${!sim_link_src[@]} ; do
+		[ ${sim_link_flags[$i]} = ENABLED,IMMUTABLE ] && continue
+		printf "%s\t%s\t%s\t%s\n" "${sim_link_src[$i]}" ${sim_link_spad[$i]} \
+			"${sim_link_sink[$i]}" ${sim_link_dpad[$i]}
+	done > $mdev/links.tmp
+
+	mv $mdev/links.tmp $mdev/links
+}
+
+sim_save_formats() {
+	local pad
+
+	for pad in ${!sim_fmt[@]} ; do
+		echo "$pad ${sim_fmt[$pad]}"
+	done > $mdev/formats.tmp
+
+	mv $mdev/formats.tmp $mdev/formats
+}
+
+sim_save_controls() {
+	local key
+
+	for key in "${!sim_ctrl[@]}" ; do
+		echo "$key ${sim_ctrl[$key]}"
+	done > $mdev/controls.tmp
+
+	mv $mdev/controls.tmp $mdev/controls
+}
+
+sim_link_add() {
+	local i=$sim_link_count
+
+	sim_link_count=$((i+1))
+	sim_link_src[$i]=$1
+	sim_link_spad[$i]=$2
+	sim_link_sink[$i]=$3
+	sim_link_dpad[$i]=$4
+	sim_link_flags[$i]=$5
+}
+
+#
+# Find the link connected to a sink pad and store its index in sim_link.
+#
+sim_link_find() {
+	local entity=$1
+	local pad=$2
+
+	for sim_link in ${!sim_link_src[@]} ; do
+		[ "${sim_link_sink[$sim_link]}" = "$entity" -a \
+		  ${sim_link_dpad[$sim_link]} = $pad ] && return 0
+	done
+
+	return 1
+}
+
+#
+# Strip the device name from a full entity name and store the result in
+# sim_name, or fail if the entity doesn't exist.
+#
+sim_entity_parse() {
+	sim_name=${1#$bus }
+
+	[ "$sim_name" != "$1" -a -n "${sim_pads[$sim_name]}" ]
+}
+
+sim_pad_is_source() {
+	local entity=$1
+	local pad=$2
+	local pads=${sim_pads[$entity]}
+
+	if [ $pads = 1 ] ; then
+		[[ "$entity" == *" input" ]]
+	else
+		[ $pad = $((pads-1)) ]
+	fi
+}
+
+# Print the media bus code corresponding to a V4L2 pixel format.
+sim_format_code() {
+	case $1 in
+	RGB332 | ARGB555 | XRGB555 | RGB565 | BGR24 | RGB24 | XBGR32 | XRGB32 | ABGR32 | ARGB32)
+		echo ARGB32
+		;;
+	HSV24 | HSV32)
+		echo AHSV8888_1X32
+		;;
+	UYVY | VYUY | YUYV | YVYU | NV12M | NV16M | NV21M | NV61M | YUV420M | YUV422M | YUV444M | YVU420M | YVU422M | YVU444M)
+		echo AYUV32
+		;;
+	esac
+}
+
+# ------------------------------------------------------------------------------
+# Pad formats
+#
+
+#
+# Update the format of the WPF source pad. Its size is the sink crop rectangle,
+# rotated by the Rotate control.
+#
+sim_wpf_update_source() {
+	local entity=$1
+	local sink=(${sim_fmt[$entity:0]})
+	local source=(${sim_fmt[$entity:1]})
+	local size=${sink[1]}
+
+	[ ${sink[2]} != - ] && size=${sink[2]#*/}
+
+	case ${sim_ctrl[$entity 0x00980922]} in
+	90 | 270)
+		size=${size#*x}x${size%x*}
+		;;
+	esac
+
+	sim_fmt[$entity:1]="${source[0]} $size - -"
+}
+
+#
+# Set the format of a pad, adjusting it to the entity capabilities and
+# propagating it from sink to source pads as the driver does.
+#
+sim_set_format() {
+	local entity=$1
+	local pad=$2
+	local code=$3
+	local size=$4
+	local crop=${5:--}
+	local compose=${6:--}
+	local source=$((${sim_pads[$entity]}-1))
+	local type=${entity%.*}
+
+	# The HST converts RGB to HSV, the HSI HSV to RGB, and the HGT computes
+	# histograms on HSV only.
+	case $type:$pad in
+	hst:0 | hsi:1)
+		code=ARGB32
+		;;
+	hst:1 | hsi:0 | hgt:0)
+		code=AHSV8888_1X32
+		;;
+	esac
+
+	if [ $pad != $source ] ; then
+		sim_fmt[$entity:$pad]="$code $size $crop $compose"
+
+		case $type in
+		bru | brs)
+			# The BRx can't convert formats, propagate the code to
+			# the source pad only.
+			local fmt=(${sim_fmt[$entity:$source]})
+			sim_fmt[$entity:$source]="$code ${fmt[1]} - -"
+			;;
+		rpf | wpf)
+			[ $crop != - ] && size=${crop#*/}
+			sim_fmt[$entity:$source]="$code $size - -"
+			[ $type = wpf ] && sim_wpf_update_source $entity
+			;;
+		hst)
+			sim_fmt[$entity:$source]="AHSV8888_1X32 $size - -"
+			;;
+		hsi)
+			sim_fmt[$entity:$source]="ARGB32 $size - -"
+			;;
+		*)
+			sim_fmt[$entity:$source]="$code $size - -"
+			;;
+		esac
+		return
+	fi
+
+	local sink=(${sim_fmt[$entity:0]})
+
+	case $type in
+	rpf)
+		# The RPF can convert between RGB and YUV only, the source size
+		# is the sink crop rectangle.
+		size=${sink[1]}
+		[ ${sink[2]} != - ] && size=${sink[2]#*/}
+		sim_fmt[$entity:$pad]="$code $size - -"
+		;;
+	wpf)
+		sim_fmt[$entity:$pad]="$code $size - -"
+		sim_wpf_update_source $entity
+		;;
+	uds | sru)
+		# The scalers can't convert formats, only the size can be set.
+		sim_fmt[$entity:$pad]="${sink[0]} $size - -"
+		;;
+	bru | brs)
+		sim_fmt[$entity:$pad]="$code $size - -"
+		;;
+	*)
+		# The format of the source pad of all other entities is fixed by
+		# the sink pad format.
+		;;
+	esac
+}
+
+# ------------------------------------------------------------------------------
+# media-ctl
+#
+
+sim_print_pad_links() {
+	local entity=$1
+	local pad=$2
+	local i
+
+	for i in ${!sim_link_src[@]} ; do
+		if [ "${sim_link_sink[$i]}" = "$entity" -a ${sim_link_dpad[$i]} = $pad ] ; then
+			printf '\t\t<- "%s":%u [%s]\n' "$bus ${sim_link_src[$i]}" \
+				${sim_link_spad[$i]} ${sim_link_flags[$i]}
+		elif [ "${sim_link_src[$i]}" = "$entity" -a ${sim_link_spad[$i]} = $pad ] ; then
+			printf '\t\t-> "%s":%u [%s]\n' "$bus ${sim_link_sink[$i]}" \
+				${sim_link_dpad[$i]} ${sim_link_flags[$i]}
+		fi
+	done
+}
+
+sim_print_topology() {
+	cat << EOF
+Media controller API version 0.1.0
+
+Media device information
+------------------------
+driver          vsp1
+model           $model
+serial
+bus info        platform:$bus
+hw revision     0x0
+driver version  0.1.0
+
+Device topology
+EOF
+
+	local id=1
+	local entity
+
+	for entity in "${sim_entities[@]}" ; do
+		local pads=${sim_pads[$entity]}
+		local links=0
+		local i
+
+		for i in ${!sim_link_src[@]} ; do
+			[ "${sim_link_src[$i]}" = "$entity" -o "${sim_link_sink[$i]}" = "$entity" ] && \
+				links=$((links+1))
+		done
+
+		printf -- "- entity %u: %s (%u pad%s, %u link%s)\n" $id "$bus $entity" \
+			$pads "$([ $pads != 1 ] && echo s)" \
+			$links "$([ $links != 1 ] && echo s)"
+
+		if [ $pads = 1 ] ; then
+			echo "            type Node subtype V4L flags 0"
+		else
+			echo "            type V4L2 subdev subtype Unknown flags 0"
+		fi
+		echo "            device node name ${sim_node[$entity]}"
+
+		local pad
+
+		for pad in $(seq 0 $((pads-1))) ; do
+			if sim_pad_is_source "$entity" $pad ; then
+				printf '\tpad%u: Source\n' $pad
+			else
+				printf '\tpad%u: Sink\n' $pad
+			fi
+
+			if [ $pads != 1 ] ; then
+				local fmt=(${sim_fmt[$entity:$pad]})
+				local sel=
+
+				[ ${fmt[2]} != - ] && sel="$sel crop:${fmt[2]}"
+				[ ${fmt[3]} != - ] && sel="$sel compose:${fmt[3]}"
+				printf '\t\t[fmt:%s/%s field:none%s]\n' ${fmt[0]} ${fmt[1]} "$sel"
+			fi
+
+			sim_print_pad_links "$entity" $pad
+		done
+
+		echo
+		id=$((id+1))
+	done
+}
+
+sim_media_ctl_link() {
+	local regex="^'([^']+)':([0-9]+) *-> *'([^']+)':([0-9]+) *\[([01])\]$"
+
+	if [[ ! $1 =~ $regex ]] ; then
+		echo "Unable to parse link '$1'" >&2
+		return 1
+	fi
+
+	local spad=${BASH_REMATCH[2]}
+	local dpad=${BASH_REMATCH[4]}
+	local enable=${BASH_REMATCH[5]}
+	local src
+	local sink
+
+	sim_entity_parse "${BASH_REMATCH[1]}" && src=$sim_name
+	sim_entity_parse "${BASH_REMATCH[3]}" && sink=$sim_name
+
+	if [ -z "$src" -o -z "$sink" ] || \
+	   [ $spad -ge ${sim_pads[$src]} -o $dpad -ge ${sim_pads[$sink]} ] || \
+	   ! sim_pad_is_source "$src" $spad || sim_pad_is_source "$sink" $dpad ; then
+		echo "Unable to parse link '$1'" >&2
+		return 1
+	fi
+
+	if sim_link_find "$sink" $dpad ; then
+		if [ "${sim_link_src[$sim_link]}" != "$src" -o \
+		     ${sim_link_spad[$sim_link]} != $spad ] ; then
+			[ $enable = 0 ] && return 0
+			echo "Unable to setup link: Device or resource busy (16)" >&2
+			return 1
+		fi
+
+		[ ${sim_link_flags[$sim_link]} = ENABLED,IMMUTABLE ] && return 0
+		[ $enable = 1 ] && return 0
+
+		unset sim_link_src[$sim_link]
+	else
+		[ $enable = 0 ] && return 0
+
+		sim_link_add "$src" $spad "$sink" $dpad ENABLED
+	fi
+
+	sim_save_links
+}
+
+sim_media_ctl_format() {
+	local regex="^'([^']+)':([0-9]+) *\[(.*)\]$"
+
+	if [[ ! $1 =~ $regex ]] || ! sim_entity_parse "${BASH_REMATCH[1]}" || \
+	   [ ${BASH_REMATCH[2]} -ge ${sim_pads[$sim_name]} -o ${sim_pads[$sim_name]} = 1 ] ; then
+		echo "Unable to parse format '$1'" >&2
+		return 1
+	fi
+
+	local entity=$sim_name
+	local pad=${BASH_REMATCH[2]}
+	local fmt=(${sim_fmt[$entity:$pad]})
+	local code=${fmt[0]}
+	local size=${fmt[1]}
+	local crop=
+	local compose=
+	local token
+	local rect='^\([0-9]+,[0-9]+\)/[0-9]+x[0-9]+$'
+
+	for token in ${BASH_REMATCH[3]} ; do
+		case $token in
+		fmt:*/*)
+			code=${token#fmt:}
+			size=${code#*/}
+			code=${code%/*}
+			;;
+		crop:*)
+			crop=${token#crop:}
+			;;
+		compose:*)
+			compose=${token#compose:}
+			;;
+		field:* | colorspace:*)
+			;;
+		*)
+			echo "Unable to parse format '$1'" >&2
+			return 1
+			;;
+		esac
+	done
+
+	case $code in
+	ARGB32 | ARGB8888_1X32)
+		code=ARGB32
+		;;
+	AYUV32 | AYUV8_1X32)
+		code=AYUV32
+		;;
+	AHSV8888_1X32)
+		;;
+	*)
+		echo "Invalid media bus code $code" >&2
+		return 1
+		;;
+	esac
+
+	if [[ ! $size =~ ^[0-9]+x[0-9]+$ || \
+	      ( -n $crop && ! $crop =~ $rect ) || \
+	      ( -n $compose && ! $compose =~ $rect ) ]] ; then
+		echo "Unable to parse format '$1'" >&2
+		return 1
+	fi
+
+	sim_set_format $entity $pad $code $size "$crop" "$compose"
+	sim_save_formats
+}
+
+sim_media_ctl() {
+	local action=
+	local arg=
+
+	while [ $# != 0 ] ; do
+		case $1 in
+		-d | --device)
+			mdev=$2
+			shift
+			;;
+		-p | --print-topology | -r | --reset)
+			action=$1
+			;;
+		-e | --entity | -l | --links | -V | --set-v4l2 | --get-v4l2)
+			action=$1
+			arg=$2
+			shift
+			;;
+		*)
+			echo "media-ctl: unsupported option $1" >&2
+			return 1
+			;;
+		esac
+		shift
+	done
+
+	sim_load || return 1
+
+	case $action in
+	-p | --print-topology)
+		sim_print_topology
+		;;
+	-r | --reset)
+		: > $mdev/links
+		;;
+	-e | --entity)
+		if ! sim_entity_parse "$arg" ; then
+			echo "Entity '$arg' not found" >&2
+			return 1
+		fi
+		echo ${sim_node[$sim_name]}
+		;;
+	-l | --links)
+		sim_media_ctl_link "$arg"
+		;;
+	-V | --set-v4l2)
+		sim_media_ctl_format "$arg"
+		;;
+	--get-v4l2)
+		local regex="^'([^']+)':([0-9]+)$"
+
+		if [[ ! $arg =~ $regex ]] || ! sim_entity_parse "${BASH_REMATCH[1]}" || \
+		   [ -z "${sim_fmt[$sim_name:${BASH_REMATCH[2]}]}" ] ; then
+			echo "Unable to parse pad '$arg'" >&2
+			return 1
+		fi
+
+		local fmt=(${sim_fmt[$sim_name:${BASH_REMATCH[2]}]})
+		printf '\t\t[fmt:%s/%s field:none]\n' ${fmt[0]} ${fmt[1]}
+		;;
+	esac
+}
+
+# ------------------------------------------------------------------------------
+# yavta controls
+#
+
+sim_yavta_list() {
+	local entity=$1
+	local count=0
+	local id
+	local min
+	local max
+	local default
+	local name
+
+	while read id min max default name ; do
+		local value=${sim_ctrl[$entity $id]:-$default}
+
+		if [ $min = - ] ; then
+			echo "control $id \`$name' min 0 max 255 step 1 default 0 current $value."
+		else
+			echo "control $id \`$name' min $min max $max step 1 default $default current $value."
+		fi
+		count=$((count+1))
+	done < <(sim_controls $entity)
+
+	echo "$count controls found."
+}
+
+sim_yavta_write() {
+	local entity=$1
+	local id=${2%% *}
+	local value=${2#* }
+	local min
+	local max
+
+	read min max < <(sim_controls $entity | awk -v id=$id '$1 == id { print $2, $3 }')
+
+	if [ -z "$min" ] ; then
+		echo "unable to set control $id: Invalid argument (22)."
+		return 1
+	fi
+
+	case $value in
+	\<*)
+		# Array controls are read from a file, store a copy of its
+		# contents as the driver would.
+		value=${value#<}
+		if [ ! -f "$value" ] ; then
+			echo "Unable to open $value"
+			return 1
+		fi
+		cp "$value" $mdev/ctrl-$entity-$id.bin
+		value=$mdev/ctrl-$entity-$id.bin
+		;;
+	*)
+		if [ $min != - ] && \
+		   [[ ! $value =~ ^[0-9]+$ || $value -lt $min || $value -gt $max ]] ; then
+			echo "unable to set control $id: Numerical result out of range (34)."
+			return 1
+		fi
+		;;
+	esac
+
+	sim_ctrl["$entity $id"]=$value
+	sim_save_controls
+
+	echo "Control $id set to $value, is $value"
+}
+
+# ------------------------------------------------------------------------------
+# yavta streaming
+#
+
+#
+# Walk the pipeline upstream from an entity, validating the links between
+# subdevs, and store the entities in sim_pipe.
+#
+sim_pipeline_walk() {
+	local entity=$1
+	local pads=${sim_pads[$entity]}
+	local pad
+
+	sim_pipe+=("$entity")
+
+	[ $pads = 1 ] && return 0
+
+	for pad in $(seq 0 $((pads-2))) ; do
+		if ! sim_link_find "$entity" $pad ; then
+			# BRx inputs can be left unconnected.
+			case $entity in
+			bru | brs)
+				continue
+				;;
+			esac
+
+			echo "Pad '$entity':$pad not connected"
+			return 1
+		fi
+
+		local src=${sim_link_src[$sim_link]}
+		local spad=${sim_link_spad[$sim_link]}
+
+		if [ ${sim_pads[$src]} != 1 ] ; then
+			local sfmt=(${sim_fmt[$src:$spad]})
+			local dfmt=(${sim_fmt[$entity:$pad]})
+
+			if [ ${sfmt[0]} != ${dfmt[0]} -o ${sfmt[1]} != ${dfmt[1]} ] ; then
+				echo "Link validation failed: '$src':$spad ${sfmt[0]}/${sfmt[1]} -> '$entity':$pad ${dfmt[0]}/${dfmt[1]}"
+				return 1
+			fi
+		fi
+
+		sim_pipeline_walk "$src" || return 1
+	done
+}
+
+#
+# Wait for the video nodes of the pipeline to start streaming, and mark their
+# streams as active.
+#
+sim_pipeline_wait() {
+	local entity
+	local time=0
+
+	for entity in "${sim_pipe[@]}" ; do
+		local stream=$mdev/streams/${entity%% *}
+
+		[ ${sim_pads[$entity]} = 1 ] || continue
+		[[ "$entity" == *" output" ]] && continue
+
+		while [ ! -f $stream ] ; do
+			if [ $time -ge $((timeout*10)) ] ; then
+				echo "Unable to dequeue buffer: video node '$entity' not streaming"
+				return 1
+			fi
+			sleep 0.1
+			time=$((time+1))
+		done
+
+		mv $stream $stream.active
+	done
+}
+
+sim_pipeline_stop() {
+	rm -f $mdev/streams/*.active
+}
+
+#
+# Print the alpha value of the first pixel of a frame in memory, for the
+# formats that store alpha.
+#
+sim_memory_alpha() {
+	local format=$1
+	local file=$2
+	local byte
+
+	case $format in
+	ARGB555)
+		byte=$(od -An -tu1 -j1 -N1 $file)
+		echo $(( byte & 0x80 ? 255 : 0 ))
+		;;
+	ARGB32)
+		echo $(od -An -tu1 -j0 -N1 $file)
+		;;
+	ABGR32)
+		echo $(od -An -tu1 -j3 -N1 $file)
+		;;
+	esac
+}
+
+#
+# Compute the gen-image options for the frames captured on the WPF from the
+# pipeline configuration, and store them in sim_options.
+#
+sim_frame_options() {
+	local wpf=$1
+	local in_format=$sim_rpf_format
+	local crop=
+	local layers=
+	local alpha
+	local entity
+
+	# gen-image can't process HSV images. HSV inputs are only used without
+	# processing, use RGB instead.
+	case $in_format in
+	HSV24 | HSV32)
+		in_format=ARGB32
+		;;
+	esac
+
+	# The RPF takes alpha from memory, or from its control.
+	alpha=$(sim_memory_alpha $sim_rpf_format $sim_rpf_file)
+	alpha=${alpha:-${sim_ctrl[$sim_rpf 0x00980929]:-255}}
+
+	# The WPF packs the pipeline alpha in formats that store alpha, and
+	# uses its control otherwise.
+	case $sim_wpf_format in
+	ARGB555 | ABGR32 | ARGB32)
+		;;
+	XRGB555)
+		alpha=0
+		;;
+	*)
+		alpha=${sim_ctrl[$wpf 0x00980929]:-255}
+		;;
+	esac
+
+	sim_options="-i $in_format -f $sim_wpf_format -s $sim_wpf_size -a $alpha"
+
+	for entity in "${sim_pipe[@]}" ; do
+		local fmt=(${sim_fmt[$entity:0]})
+
+		case $entity in
+		bru | brs)
+			local pad
+
+			for pad in $(seq 0 $((${sim_pads[$entity]}-2))) ; do
+				sim_link_find $entity $pad || continue
+				fmt=(${sim_fmt[$entity:$pad]})
+				local compose=${fmt[3]}
+				[ $compose = - ] && compose="(0,0)"
+				layers="$layers --layer -:${compose%/*}"
+			done
+
+			# A single input at the origin is passed through.
+			[ "$layers" = " --layer -:(0,0)" ] && layers=
+			sim_options="$sim_options$layers"
+			;;
+		clu | lut)
+			local table=${sim_ctrl[$entity 0x00981902]}
+
+			if [ -z "$table" ] ; then
+				# The table is initialized to zero.
+				table=$mdev/ctrl-$entity-0x00981902.bin
+				[ $entity = lut ] && head -c 1024 /dev/zero > $table
+				[ $entity = clu ] && head -c $((17*17*17*4)) /dev/zero > $table
+			fi
+			sim_options="$sim_options --$entity $table"
+			;;
+		rpf.[0-9] | wpf.[0-9])
+			# Combine the RPF and WPF crop rectangles.
+			[ ${fmt[2]} = - ] && continue
+
+			local rect=${fmt[2]}
+			local x=${rect%%,*}
+			local y=${rect#*,}
+
+			x=${x#(}
+			y=${y%%)*}
+			if [ -n "$crop" ] ; then
+				local cx=${crop%%,*}
+				local cy=${crop#*,}
+				x=$((x+${cx#(}))
+				y=$((y+${cy%%)*}))
+			fi
+			crop="($x,$y)/${rect#*/}"
+			;;
+		esac
+	done
+
+	[ -n "$crop" ] && sim_options="$sim_options --crop $crop"
+
+	local hflip=${sim_ctrl[$wpf 0x00980914]:-0}
+	local vflip=${sim_ctrl[$wpf 0x00980915]:-0}
+
+	# A rotation by 180 degrees is a horizontal and vertical flip.
+	case ${sim_ctrl[$wpf 0x00980922]:-0} in
+	90)
+		sim_options="$sim_options --rotate"
+		;;
+	180)
+		hflip=$((!hflip))
+		vflip=$((!vflip))
+		;;
+	270)
+		sim_options="$sim_options --rotate"
+		hflip=$((!hflip))
+		vflip=$((!vflip))
+		;;
+	esac
+
+	[ $hflip = 1 ] && sim_options="$sim_options --hflip"
+	[ $vflip = 1 ] && sim_options="$sim_options --vflip"
+}
+
+#
+# Compute the gen-image options for the histograms of an HGO or HGT, and store
+# them in sim_options.
+#
+sim_histo_options() {
+	local entity=$1
+	local fmt=(${sim_fmt[$entity:0]})
+
+	sim_options="-i $sim_rpf_format -f $sim_rpf_format -s ${fmt[1]} --histogram-type $entity"
+
+	if [ $entity = hgt ] ; then
+		local areas=$(sim_control hgt 0x00981901)
+
+		areas=${areas#\{}
+		sim_options="$sim_options --histogram-areas ${areas%\}}"
+	fi
+
+	# The crop and compose rectangles select the histogram window and its
+	# subsampling factor.
+	if [ ${fmt[2]} != - ] ; then
+		local width=${fmt[2]#*/}
+		local factor=1
+
+		if [ ${fmt[3]} != - ] ; then
+			local compose=${fmt[3]#*/}
+			factor=$((${width%x*} / ${compose%x*}))
+		fi
+		sim_options="$sim_options --histogram-window ${fmt[2]}:$factor"
+	fi
+}
+
+# Print a file name with the frame sequence number replacing '#'.
+sim_frame_file() {
+	local file=$1
+	local seq=$(printf "%06u" $2)
+
+	echo ${file//#/$seq}
+}
+
+#
+# Pause after a number of frames, until resumed by SIGUSR1. The device node is
+# kept open while paused for vsp_runner_find to identify the process.
+#
+sim_pause() {
+	local videodev=$1
+
+	sim_resumed=
+	trap 'sim_resumed=1' USR1
+
+	exec 3< $videodev
+	touch .yavta.wait.$$
+
+	while [ -z "$sim_resumed" ] ; do
+		sleep 0.1
+	done
+
+	rm -f .yavta.wait.$$
+	exec 3<&-
+}
+
+#
+# Run the pipeline of a WPF, computing the frames captured by the WPF and the
+# histograms captured by the HGO and HGT.
+#
+sim_capture() {
+	local wpf=$1
+	local videodev=$2
+	local entity
+	local i
+
+	sim_wpf_format=$format
+	sim_wpf_size=$size
+	sim_pipe=()
+
+	if ! sim_link_find "$wpf output" 0 ; then
+		echo "Unable to start streaming: Broken pipe (32)."
+		return 1
+	fi
+
+	sim_pipeline_walk $wpf || {
+		echo "Unable to start streaming: Broken pipe (32)."
+		return 1
+	}
+
+	# Add the histogram generators connected to the pipeline.
+	for i in ${!sim_link_src[@]} ; do
+		case ${sim_link_sink[$i]} in
+		hgo | hgt)
+			for entity in "${sim_pipe[@]}" ; do
+				[ "$entity" = "${sim_link_src[$i]}" ] || continue
+				sim_pipe+=(${sim_link_sink[$i]} "${sim_link_sink[$i]} histo")
+				break
+			done
+			;;
+		esac
+	done
+
+	sim_pipeline_wait || {
+		sim_pipeline_stop
+		return 1
+	}
+
+	# Validate the memory formats against the formats of the pads.
+	local fmt=(${sim_fmt[$wpf:1]})
+	local histos=
+	local frames=$count
+
+	if [ "$(sim_format_code $format)" != ${fmt[0]} -o $size != ${fmt[1]} ] ; then
+		echo "Unable to start streaming: Broken pipe (32)."
+		sim_pipeline_stop
+		return 1
+	fi
+
+	for entity in "${sim_pipe[@]}" ; do
+		local stream=$mdev/streams/${entity%% *}.active
+
+		case $entity in
+		"rpf."*" input")
+			local rpf=${entity% input}
+			local args=($(cat $stream))
+
+			fmt=(${sim_fmt[$rpf:0]})
+			if [ "$(sim_format_code ${args[0]})" != ${fmt[0]} -o ${args[1]} != ${fmt[1]} ] ; then
+				echo "Unable to start streaming: Broken pipe (32)."
+				sim_pipeline_stop
+				return 1
+			fi
+
+			[ ${args[2]} -lt $frames ] && frames=${args[2]}
+
+			# Use the first RPF for the gen-image input format.
+			if [ -z "$sim_rpf" ] ; then
+				sim_rpf=$rpf
+				sim_rpf_format=${args[0]}
+				sim_rpf_file=${args[3]}
+			fi
+			;;
+		*" histo")
+			histos="$histos ${entity% histo}"
+			;;
+		esac
+	done
+
+	echo "Device $videodev opened."
+	echo "Video format: $format ($size)"
+
+	local options=
+	local last=
+	local seq
+
+	for seq in $(seq 0 $((frames-1))) ; do
+		[ x$seq = x$pause ] && sim_pause $videodev
+
+		# Controls can be modified while streaming, reload them.
+		sim_ctrl=()
+		while read entity i value ; do
+			sim_ctrl["$entity $i"]=$value
+		done < $mdev/controls
+
+		if [ $seq -ge $skip -a -n "$file" ] ; then
+			local frame=$(sim_frame_file $file $seq)
+
+			sim_frame_options $wpf
+			if [ "$sim_options" = "$options" ] ; then
+				cp $last $frame
+			else
+				$genimage $sim_options -o $frame --strict \
+					--source-cache $sim_dir/ $source_image || {
+					echo "Unable to compute frame $seq"
+					sim_pipeline_stop
+					return 1
+				}
+				options=$sim_options
+				last=$frame
+			fi
+		fi
+
+		for entity in $histos ; do
+			local args=($(cat $mdev/streams/$entity.active))
+
+			[ $seq -lt ${args[0]} -a $seq -ge ${args[1]} ] || continue
+
+			sim_histo_options $entity
+			$genimage $sim_options -H $(sim_frame_file ${args[2]} $seq) \
+				--strict --source-cache $sim_dir/ $source_image
+		done
+
+		echo "$seq ($seq) [-] none $seq"
+	done
+
+	sim_pipeline_stop
+
+	if [ $frames != $count ] ; then
+		echo "Unable to dequeue buffer: timeout"
+		return 1
+	fi
+
+	echo "Captured $count frames."
+}
+
+#
+# Start streaming on an RPF input or a histogram video node, and wait for the
+# WPF capture to run the pipeline.
+#
+sim_stream() {
+	local entity=$1
+	local videodev=$2
+	local stream=$mdev/streams/${entity%% *}
+	local time=0
+
+	case $entity in
+	*" input")
+		if [ ! -f "$file" ] ; then
+			echo "Unable to open $file"
+			return 1
+		fi
+		echo "$format $size $count $file" > $stream.tmp
+		;;
+	*)
+		echo "$count $skip $file" > $stream.tmp
+		;;
+	esac
+
+	echo "Device $videodev opened."
+	mv $stream.tmp $stream
+
+	while [ -f $stream ] ; do
+		if [ $time -ge $((timeout*10)) ] ; then
+			rm -f $stream
+			echo "Unable to dequeue buffer: timeout"
+			return 1
+		fi
+		sleep 0.1
+		time=$((time+1))
+	done
+
+	while [ -f $stream.active ] ; do
+		sleep 0.1
+	done
+
+	echo "Done."
+}
+
+sim_yavta() {
+	local count=
+	local skip=0
+	local format=
+	local size=
+	local file=
+	local pause=
+	local action=
+	local arg=
+	local device=
+
+	while [ $# != 0 ] ; do
+		case $1 in
+		-c*)
+			count=${1#-c}
+			;;
+		-n | --nbufs)
+			shift
+			;;
+		-f | --format)
+			format=$2
+			shift
+			;;
+		-s | --size)
+			size=$2
+			shift
+			;;
+		--skip)
+			skip=$2
+			shift
+			;;
+		--file=*)
+			file=${1#--file=}
+			;;
+		-p*)
+			pause=${1#-p}
+			;;
+		--no-query | --queue-late)
+			;;
+		-l | --list-controls | --reset-controls)
+			action=$1
+			;;
+		-w | --set-control)
+			action=$1
+			arg=$2
+			shift
+			;;
+		-*)
+			echo "yavta: unsupported option $1"
+			return 1
+			;;
+		*)
+			device=$1
+			;;
+		esac
+		shift
+	done
+
+	mdev=${device%/*}
+	sim_load || return 1
+
+	local entity
+
+	for entity in "${sim_entities[@]}" ; do
+		[ "${sim_node[$entity]}" = "$device" ] && break
+	done
+
+	if [ "${sim_node[$entity]}" != "$device" ] ; then
+		echo "Error opening device $device: No such file or directory (2)."
+		return 1
+	fi
+
+	case $action in
+	-l | --list-controls)
+		sim_yavta_list $entity
+		;;
+	-w | --set-control)
+		sim_yavta_write $entity "$arg" || return 1
+		[[ $entity == wpf.* ]] && {
+			sim_wpf_update_source $entity
+			sim_save_formats
+		}
+		;;
+	--reset-controls)
+		local key
+
+		for key in "${!sim_ctrl[@]}" ; do
+			[ "${key% *}" = $entity ] && unset "sim_ctrl[$key]"
+		done
+		sim_save_controls
+
+		[[ $entity == wpf.* ]] && {
+			sim_wpf_update_source $entity
+			sim_save_formats
+		}
+		;;
+	*)
+		case $entity in
+		*" output")
+			sim_capture "${entity% output}" $device
+			;;
+		*)
+			sim_stream "$entity" $device
+			;;
+		esac
+		;;
+	esac
+}
+
+case $1 in
+devices)
+	sim_devices
+	;;
+media-ctl)
+	shift
+	sim_media_ctl "$@"
+	;;
+yavta)
+	shift
+	sim_yavta "$@"
+	;;
+*)
+	echo "Usage: $0 devices"
+	echo "       $0 media-ctl [media-ctl options]"
+	echo "       $0 yavta [yavta options] <device>"
+	exit 1
+	;;
+esac
@@ -33,11 +33,11 @@ run_test() {
 		num_test=$((num_test+1))
 	done
 
-	if [ $(ls *.bin 2>/dev/null | wc -l) != 0 ] ; then
+	if [ $(ls *.bin *.delta 2>/dev/null | wc -l) != 0 ] ; then
 		local dir=$KERNEL_VERSION/test-$script/$iteration/
 
 		mkdir -p $dir
-		mv *.bin $dir
+		mv *.bin *.delta $dir 2>/dev/null
 	fi
 }
 
@@ -0,0 +1,215 @@
+/*
+ * Copyright (C) 2016 Laurent Pinchart <laurent.pinchart@ideasonboard.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "vspref.h"
+
+struct options {
+	bool apply;
+	bool info;
+	const char *format;
+	unsigned int width;
+	unsigned int height;
+	const char *identity;
+	const char *output_filename;
+	char **files;
+	unsigned int num_files;
+};
+
+/* -----------------------------------------------------------------------------
+ * Usage, argument parsing and main
+ */
+
+static void usage(const char *argv0)
+{
+	printf("Usage: %s -f format -s WxH [-i identity] -o delta <frame> <reference>\n", argv0);
+	printf("       %s --apply -o frame <delta> <reference>\n", argv0);
+	printf("       %s --info <delta>...\n\n", argv0);
+	printf("Store the differences between a raw frame and its raw reference frame\n");
+	printf("in a delta file, or reconstruct the frame from the delta and the\n");
+	printf("reference\n\n");
+	printf("Supported options:\n");
+	printf("-a, --apply			Reconstruct the frame from the delta and the reference\n");
+	printf("-f, --format format		Set the frame format\n");
+	printf("-h, --help			Show this help screen\n");
+	printf("-i, --identity string		Set the reference identity stored in the delta\n");
+	printf("    --info			Print the format, size, number of differing tiles and\n");
+	printf("				reference identity of deltas\n");
+	printf("-o, --output file		Store the delta or the reconstructed frame to file\n");
+	printf("-s, --size WxH			Set the frame size\n");
+}
+
+#define OPT_INFO		256
+
+static struct option opts[] = {
+	{"apply", 0, 0, 'a'},
+	{"format", 1, 0, 'f'},
+	{"help", 0, 0, 'h'},
+	{"identity", 1, 0, 'i'},
+	{"info", 0, 0, OPT_INFO},
+	{"output", 1, 0, 'o'},
+	{"size", 1, 0, 's'},
+	{0, 0, 0, 0}
+};
+
+static int parse_args(struct options *options, int argc, char *argv[])
+{
+	char *endptr;
+	int c;
+
+	memset(options, 0, sizeof(*options));
+
+	if (argc < 2) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	opterr = 0;
+	while ((c = getopt_long(argc, argv, "af:hi:o:s:", opts, NULL)) != -1) {
+
+		switch (c) {
+		case 'a':
+			options->apply = true;
+			break;
+
+		case 'f':
+			options->format = optarg;
+			break;
+
+		case 'h':
+			usage(argv[0]);
+			exit(0);
+			break;
+
+		case 'i':
+			options->identity = optarg;
+			break;
+
+		case 'o':
+			options->output_filename = optarg;
+			break;
+
+		case 's':
+			options->width = strtoul(optarg, &endptr, 10);
+			if (*endptr != 'x' || endptr == optarg) {
+				printf("Invalid size '%s'\n", optarg);
+				return 1;
+			}
+
+			options->height = strtoul(endptr + 1, &endptr, 10);
+			if (*endptr != 0) {
+				printf("Invalid size '%s'\n", optarg);
+				return 1;
+			}
+			break;
+
+		case OPT_INFO:
+			options->info = true;
+			break;
+
+		default:
+			printf("Invalid option -%c\n", c);
+			printf("Run %s -h for help.\n", argv[0]);
+			return 1;
+		}
+	}
+
+	options->files = &argv[optind];
+	options->num_files = argc - optind;
+
+	if (options->info ? !options->num_files
+			  : options->num_files != 2 || !options->output_filename) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (!options->info && !options->apply &&
+	    (!options->format || !options->width || !options->height)) {
+		printf("The frame format and size are required\n");
+		return 1;
+	}
+
+	return 0;
+}
+
+/* Store the delta between a frame and its reference. */
+static int create(const struct options *options)
+{
+	struct vspref_image *frame;
+	struct vspref_image *reference;
+	int ret = -EINVAL;
+
+	frame = vspref_image_read_raw(options->files[0], options->format,
+				      options->width, options->height);
+	reference = vspref_image_read_raw(options->files[1], options->format,
+					  options->width, options->height);
+	if (frame && reference)
+		ret = vspref_delta_create(frame, reference, options->identity,
+					  options->output_filename);
+
+	vspref_image_delete(frame);
+	vspref_image_delete(reference);
+	return ret < 0 ? ret : 0;
+}
+
+/* Reconstruct a frame from a delta and its reference. */
+static int apply(const struct options *options)
+{
+	struct vspref_image *frame;
+	int ret;
+
+	frame = vspref_delta_apply(options->files[0], options->files[1]);
+	if (!frame)
+		return -EINVAL;
+
+	ret = vspref_image_write(frame, options->output_filename);
+
+	vspref_image_delete(frame);
+	return ret;
+}
+
+static int info(const struct options *options)
+{
+	unsigned int i;
+	int ret = 0;
+
+	for (i = 0; i < options->num_files && !ret; ++i) {
+		if (options->num_files > 1)
+			printf("%s%s:\n", i ? "\n" : "", options->files[i]);
+
+		ret = vspref_delta_info(options->files[i]);
+	}
+
+	return ret;
+}
+
+int main(int argc, char *argv[])
+{
+	struct options options;
+	int ret;
+
+	ret = parse_args(&options, argc, argv);
+	if (ret)
+		return 1;
+
+	if (options.info)
+		ret = info(&options);
+	else if (options.apply)
+		ret = apply(&options);
+	else
+		ret = create(&options);
+
+	return ret ? 1 : 0;
+}
@@ -0,0 +1,11783 @@
+/*
+ * Copyright (C) 2016 Laurent Pinchart <laurent.pinchart@ideasonboard.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+
+#include <linux/perf_event.h>
+#include <linux/videodev2.h>
+
+#include "vspref.h"
+
+#if defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#define ARRAY_SIZE(a)		(sizeof(a) / sizeof(a[0]))
+
+#define min(a, b)		({	\
+	typeof(a) _a = (a);		\
+	typeof(b) _b = (b);		\
+	_a < _b ? _a : _b;		\
+})
+
+#define max(a, b)		({	\
+	typeof(a) _a = (a);		\
+	typeof(b) _b = (b);		\
+	_a > _b ? _a : _b;		\
+})
+
+#define clamp(val, low, high)	max(low, min(high, val));
+
+#define swap(a, b)			\
+do {	\
+	typeof(a) __tmp = (a);		\
+	(a) = (b);			\
+	(b) = __tmp;			\
+} while (0)
+
+#define div_round_up(n, d)	(((n) + (d) - 1) / (d))
+
+/*
+ * SIMD kernels are written with GCC vector extensions, which the compiler maps
+ * to SSE/AVX on x86 and NEON on ARM. Vectors hold VEC_LANES elements, wider than
+ * the hardware registers on purpose to give the compiler room to interleave
+ * operations.
+ */
+#define VEC_LANES		16
+
+typedef int32_t vec_s32 __attribute__((vector_size(VEC_LANES * 4)));
+typedef uint32_t vec_u32 __attribute__((vector_size(VEC_LANES * 4)));
+typedef uint64_t vec_u64 __attribute__((vector_size(VEC_LANES * 8)));
+typedef uint8_t vec_u8 __attribute__((vector_size(VEC_LANES)));
+typedef uint8_t vec_u8x16 __attribute__((vector_size(16)));
+typedef uint16_t vec_u16x16 __attribute__((vector_size(32)));
+
+/* Vector comparisons return masks with all bits set in lanes that compare true. */
+#define vec_select(mask, a, b)	(((mask) & (a)) | (~(mask) & (b)))
+#define vec_max(a, b)		vec_select((a) > (b), a, b)
+#define vec_min(a, b)		vec_select((a) < (b), a, b)
+
+/*
+ * Select bytes from 48 bytes stored in three vectors, typically 16 packed
+ * 24-bit pixels. Mask values range from 0 to 47.
+ */
+static inline vec_u8x16 vec_shuffle48(const vec_u8x16 in[3], vec_u8x16 mask)
+{
+	vec_u8x16 lo = __builtin_shuffle(in[0], in[1], mask & 31);
+	vec_u8x16 hi = __builtin_shuffle(in[1], in[2], (mask - 16) & 31);
+
+	return (vec_u8x16)vec_select(mask < 32, lo, hi);
+}
+
+/* Average two vectors of bytes, rounding down, without overflow. */
+static inline vec_u8x16 vec_avg_u8(vec_u8x16 a, vec_u8x16 b)
+{
+	return (a >> 1) + (b >> 1) + (a & b & 1);
+}
+
+enum format_type {
+	FORMAT_RGB,
+	FORMAT_YUV,
+	FORMAT_HSV,
+};
+
+struct format_color_component {
+	unsigned char length;
+	unsigned char offset;
+};
+
+struct format_rgb_info {
+	unsigned int bpp;
+	struct format_color_component red;
+	struct format_color_component green;
+	struct format_color_component blue;
+	struct format_color_component alpha;
+};
+
+struct format_hsv_info {
+	unsigned int bpp;
+	struct format_color_component hue;
+	struct format_color_component saturation;
+	struct format_color_component value;
+	struct format_color_component alpha;
+};
+
+enum format_yuv_order {
+	YUV_YCbCr = 1,
+	YUV_YCrCb = 2,
+	YUV_YC = 4,
+	YUV_CY = 8,
+};
+
+struct format_yuv_info {
+	unsigned int num_planes;
+	enum format_yuv_order order;
+	unsigned int xsub;
+	unsigned int ysub;
+};
+
+struct format_info {
+	const char *name;
+	enum format_type type;
+	struct format_rgb_info rgb;
+	struct format_hsv_info hsv;
+	struct format_yuv_info yuv;
+};
+
+struct image_rect {
+	int left;
+	int top;
+	unsigned int width;
+	unsigned int height;
+};
+
+struct histogram_window {
+	struct image_rect crop;
+	unsigned int subsample;
+};
+
+#define COMPOSE_MAX_LAYERS	VSPREF_MAX_LAYERS
+
+struct layer_spec {
+	char *spec;
+	const char *filename;
+	const char *mask_filename;
+	int left;
+	int top;
+	unsigned int width;
+	unsigned int height;
+	uint8_t alpha;
+};
+
+struct image {
+	const struct format_info *format;
+	unsigned int width;
+	unsigned int height;
+	unsigned int size;
+	void *data;
+	bool wrapped;
+};
+
+struct params {
+	unsigned int alpha;
+	enum v4l2_ycbcr_encoding encoding;
+	enum v4l2_quantization quantization;
+	bool no_chroma_average;
+	bool fixed_point;
+	bool strict;
+};
+
+enum histogram_type {
+	HISTOGRAM_HGO,
+	HISTOGRAM_HGT,
+};
+
+struct options {
+	char *clu_filename;
+	char *lut_filename;
+
+	const struct format_info *input_format;
+	const struct format_info *output_format;
+	unsigned int output_height;
+	unsigned int output_width;
+
+	bool hflip;
+	bool vflip;
+	bool rotate;
+	unsigned int compose;
+	struct layer_spec layers[COMPOSE_MAX_LAYERS];
+	unsigned int num_layers;
+	struct params params;
+	bool crop;
+	struct image_rect inputcrop;
+	enum histogram_type histo_type;
+	uint8_t histo_areas[12];
+	struct histogram_window *histo_windows;
+	unsigned int num_histo_windows;
+
+	bool profile;
+	bool profile_json;
+	bool compress;
+};
+
+/*
+ * The public types are the internal structures, the wrappers only give them a
+ * distinct name in the API.
+ */
+struct vspref_image {
+	struct image image;
+};
+
+struct vspref_plan {
+	struct options options;
+};
+
+/* -----------------------------------------------------------------------------
+ * Format information
+ */
+
+#define MAKE_HSV_INFO(hl, ho, sl, so, vl, vo, al, ao) \
+	.hue = { (hl), (ho) }, .saturation = { (sl), (so) }, \
+	.value = { (vl), (vo) }, .alpha = { (al), (ao) }
+
+#define MAKE_RGB_INFO(rl, ro, gl, go, bl, bo, al, ao) \
+	.red = { (rl), (ro) }, .green = { (gl), (go) }, \
+	.blue = { (bl), (bo) }, .alpha = { (al), (ao) }
+
+static const struct format_info format_info[] = {
+	/*
+	 * The alpha channel maps to the X (don't care) bits for the XRGB
+	 * formats.
+	 */
+	{ "RGB332",	FORMAT_RGB, .rgb = { 8,  MAKE_RGB_INFO(3, 5, 3, 2, 2, 0, 0, 0) } },
+	{ "ARGB444",	FORMAT_RGB, .rgb = { 16, MAKE_RGB_INFO(4, 8, 4, 4, 4, 0, 4, 12) } },
+	{ "XRGB444",	FORMAT_RGB, .rgb = { 16, MAKE_RGB_INFO(4, 8, 4, 4, 4, 0, 4, 12) } },
+	{ "ARGB555",	FORMAT_RGB, .rgb = { 16, MAKE_RGB_INFO(5, 10, 5, 5, 5, 0, 1, 15) } },
+	{ "XRGB555",	FORMAT_RGB, .rgb = { 16, MAKE_RGB_INFO(5, 10, 5, 5, 5, 0, 1, 15) } },
+	{ "RGB565",	FORMAT_RGB, .rgb = { 16, MAKE_RGB_INFO(5, 11, 6, 5, 5, 0, 0, 0) } },
+	{ "BGR24",	FORMAT_RGB, .rgb = { 24, MAKE_RGB_INFO(8, 16, 8, 8, 8, 0, 0, 0) } },
+	{ "RGB24",	FORMAT_RGB, .rgb = { 24, MAKE_RGB_INFO(8, 0, 8, 8, 8, 16, 0, 0) } },
+	{ "ABGR32",	FORMAT_RGB, .rgb = { 32, MAKE_RGB_INFO(8, 16, 8, 8, 8, 0, 8, 24) } },
+	{ "XBGR32",	FORMAT_RGB, .rgb = { 32, MAKE_RGB_INFO(8, 16, 8, 8, 8, 0, 8, 24) } },
+	{ "ARGB32",	FORMAT_RGB, .rgb = { 32, MAKE_RGB_INFO(8, 8, 8, 16, 8, 24, 8, 0) } },
+	{ "XRGB32",	FORMAT_RGB, .rgb = { 32, MAKE_RGB_INFO(8, 8, 8, 16, 8, 24, 8, 0) } },
+	{ "HSV24",	FORMAT_HSV, .hsv = { 24, MAKE_HSV_INFO(8, 0, 8, 8, 8, 16, 0, 0) } },
+	{ "HSV32",	FORMAT_HSV, .hsv = { 32, MAKE_HSV_INFO(8, 8, 8, 16, 8, 24, 8, 0) } },
+	{ "UYVY",	FORMAT_YUV, .yuv = { 1, YUV_YCbCr | YUV_CY, 2, 1 } },
+	{ "VYUY",	FORMAT_YUV, .yuv = { 1, YUV_YCrCb | YUV_CY, 2, 1 } },
+	{ "YUYV",	FORMAT_YUV, .yuv = { 1, YUV_YCbCr | YUV_YC, 2, 1 } },
+	{ "YVYU",	FORMAT_YUV, .yuv = { 1, YUV_YCrCb | YUV_YC, 2, 1 } },
+	{ "NV12M",	FORMAT_YUV, .yuv = { 2, YUV_YCbCr, 2, 2 } },
+	{ "NV21M",	FORMAT_YUV, .yuv = { 2, YUV_YCrCb, 2, 2 } },
+	{ "NV16M",	FORMAT_YUV, .yuv = { 2, YUV_YCbCr, 2, 1 } },
+	{ "NV61M",	FORMAT_YUV, .yuv = { 2, YUV_YCrCb, 2, 1 } },
+	{ "YUV420M",	FORMAT_YUV, .yuv = { 3, YUV_YCbCr, 2, 2 } },
+	{ "YVU420M",	FORMAT_YUV, .yuv = { 3, YUV_YCrCb, 2, 2 } },
+	{ "YUV422M",	FORMAT_YUV, .yuv = { 3, YUV_YCbCr, 2, 1 } },
+	{ "YVU422M",	FORMAT_YUV, .yuv = { 3, YUV_YCrCb, 2, 1 } },
+	{ "YUV444M",	FORMAT_YUV, .yuv = { 3, YUV_YCbCr, 1, 1 } },
+	{ "YVU444M",	FORMAT_YUV, .yuv = { 3, YUV_YCrCb, 1, 1 } },
+	{ "YUV24",	FORMAT_YUV, .yuv = { 1, YUV_YCbCr | YUV_YC, 1, 1 } },
+};
+
+static const struct format_info *format_by_name(const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(format_info); i++) {
+		if (!strcmp(name, format_info[i].name))
+			return &format_info[i];
+	}
+
+	return NULL;
+}
+
+/* -----------------------------------------------------------------------------
+ * File I/O
+ */
+
+static int file_read(int fd, void *buffer, size_t size)
+{
+	unsigned int offset = 0;
+
+	while (offset < size) {
+		ssize_t nbytes;
+
+		nbytes = read(fd, buffer + offset, size - offset);
+		if (nbytes < 0) {
+			if (errno == EINTR)
+				continue;
+
+			return -errno;
+		}
+
+		if (nbytes == 0)
+			return offset;
+
+		offset += nbytes;
+	}
+
+	return size;
+}
+
+static int file_write(int fd, const void *buffer, size_t size)
+{
+	unsigned int offset = 0;
+
+	while (offset < size) {
+		ssize_t nbytes;
+
+		nbytes = write(fd, buffer + offset, size - offset);
+		if (nbytes < 0) {
+			if (errno == EINTR)
+				continue;
+
+			return -errno;
+		}
+
+		offset += nbytes;
+	}
+
+	return 0;
+}
+
+/* -----------------------------------------------------------------------------
+ * Parallel processing
+ *
+ * Kernels that can be split in independent slices run them in parallel, one
+ * thread per slice, and merge the results in slice order to keep the output
+ * deterministic regardless of the number of threads.
+ */
+
+struct parallel_slice {
+	void (*func)(void *priv, unsigned int index);
+	void *priv;
+	unsigned int index;
+};
+
+static unsigned int parallel_threads;
+
+static unsigned int parallel_num_slices(unsigned int size)
+{
+	unsigned int count = parallel_threads;
+
+	if (!count) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+		count = cpus > 0 ? cpus : 1;
+	}
+
+	return max(1U, min(count, size));
+}
+
+/* Compute the [start, end[ range of slice index out of count slices. */
+static void parallel_slice_range(unsigned int size, unsigned int count,
+				 unsigned int index, unsigned int *start,
+				 unsigned int *end)
+{
+	*start = (uint64_t)size * index / count;
+	*end = (uint64_t)size * (index + 1) / count;
+}
+
+static void *parallel_worker(void *arg)
+{
+	struct parallel_slice *slice = arg;
+
+	slice->func(slice->priv, slice->index);
+	return NULL;
+}
+
+/*
+ * Run func for all slices from 0 to count - 1. Slice 0 runs in the calling
+ * thread. If a thread can't be created its slice runs in the calling thread as
+ * well.
+ */
+static void parallel_run(unsigned int count,
+			 void (*func)(void *priv, unsigned int index),
+			 void *priv)
+{
+	struct parallel_slice slices[count];
+	pthread_t threads[count];
+	bool started[count];
+	unsigned int i;
+
+	for (i = 0; i < count; ++i) {
+		slices[i].func = func;
+		slices[i].priv = priv;
+		slices[i].index = i;
+		started[i] = i && !pthread_create(&threads[i], NULL,
+						  parallel_worker, &slices[i]);
+	}
+
+	for (i = 0; i < count; ++i) {
+		if (!started[i])
+			func(priv, i);
+	}
+
+	for (i = 1; i < count; ++i) {
+		if (started[i])
+			pthread_join(threads[i], NULL);
+	}
+}
+
+/* -----------------------------------------------------------------------------
+ * Kernel registry
+ *
+ * Stages with multiple implementations list them in a table of variants, the
+ * first one being the default. Every such stage has a "scalar" variant that
+ * processes one pixel at a time in the most straightforward way, and serves as
+ * the reference the other variants are verified against (--verify-kernels).
+ * The variant used by a stage can be selected with --kernel stage=variant.
+ */
+
+enum kernel_stage_id {
+	KERNEL_COLORSPACE,
+	KERNEL_HST,
+	KERNEL_FORMAT,
+	KERNEL_SCALE,
+	KERNEL_COMPOSE,
+	KERNEL_ROTATE,
+	KERNEL_FLIP,
+	KERNEL_LUT,
+	KERNEL_CLU,
+	KERNEL_HGO,
+	KERNEL_HGT,
+	KERNEL_COMPARE,
+	KERNEL_CHECKSUM,
+	KERNEL_NUM_STAGES,
+};
+
+typedef void (*kernel_func)(void);
+
+struct kernel_variant {
+	const char *name;
+	kernel_func func;
+};
+
+#define KERNEL_VARIANT(n, f)	{ .name = (n), .func = (kernel_func)(f) }
+
+/*
+ * Index of the selected variant of each stage, the first one by default. Some
+ * vector kernels are only fast when the compiler can map their operations to
+ * the instruction sets enabled by the build, and are otherwise lowered to
+ * scalar code slower than the scalar variant. Select the scalar variant of
+ * those stages, listed second, in that case. Byte shuffles require SSSE3 or
+ * NEON, and the 64-bit multiplies of the RGB to HSV conversion AVX-512 or NEON.
+ */
+#define KERNEL_SCALAR		1
+
+static unsigned int kernel_selection[KERNEL_NUM_STAGES] = {
+#if !defined(__AVX512F__) && !defined(__ARM_NEON)
+	[KERNEL_HST] = KERNEL_SCALAR,
+#endif
+#if !defined(__SSSE3__) && !defined(__ARM_NEON)
+	[KERNEL_FORMAT] = KERNEL_SCALAR,
+	[KERNEL_FLIP] = KERNEL_SCALAR,
+#endif
+};
+
+/*
+ * Return the selected variant of a stage as a pointer to a function with the
+ * same prototype as proto.
+ */
+#define kernel_get(variants, id, proto) \
+	((typeof(&(proto)))(variants)[kernel_selection[id]].func)
+
+/* -----------------------------------------------------------------------------
+ * Profiling
+ *
+ * When enabled, the processing stages are timed with CLOCK_MONOTONIC. Hardware
+ * and software counters are collected through perf_event_open() when the
+ * system permits it, and reported as unavailable otherwise. Stages executed
+ * multiple times (for instance reading the input image and the compositor
+ * layers) are accumulated.
+ */
+
+enum profile_counter {
+	PROFILE_CYCLES,
+	PROFILE_INSTRUCTIONS,
+	PROFILE_CACHE_MISSES,
+	PROFILE_PAGE_FAULTS,
+	PROFILE_NUM_COUNTERS,
+};
+
+static const struct {
+	const char *name;
+	uint32_t type;
+	uint64_t config;
+} profile_counters[PROFILE_NUM_COUNTERS] = {
+	[PROFILE_CYCLES] = { "cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+	[PROFILE_INSTRUCTIONS] = { "instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+	[PROFILE_CACHE_MISSES] = { "cache_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+	[PROFILE_PAGE_FAULTS] = { "page_faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS },
+};
+
+#define PROFILE_MAX_STAGES	16
+
+struct profile_mark {
+	uint64_t ns;
+	uint64_t counters[PROFILE_NUM_COUNTERS];
+};
+
+struct profile_stage {
+	const char *name;
+	uint64_t ns;
+	uint64_t pixels;
+	uint64_t bytes;
+	uint64_t counters[PROFILE_NUM_COUNTERS];
+};
+
+static struct {
+	bool enabled;
+	bool json;
+	int fds[PROFILE_NUM_COUNTERS];
+	struct profile_stage stages[PROFILE_MAX_STAGES];
+	unsigned int num_stages;
+} profile;
+
+static void profile_init(bool json)
+{
+	unsigned int i;
+
+	profile.enabled = true;
+	profile.json = json;
+
+	for (i = 0; i < PROFILE_NUM_COUNTERS; ++i) {
+		struct perf_event_attr attr;
+
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = profile_counters[i].type;
+		attr.config = profile_counters[i].config;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		/* Count the worker threads too. */
+		attr.inherit = 1;
+
+		profile.fds[i] = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+	}
+}
+
+static void profile_cleanup(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < PROFILE_NUM_COUNTERS; ++i) {
+		if (profile.fds[i] >= 0)
+			close(profile.fds[i]);
+	}
+}
+
+static void profile_mark(struct profile_mark *mark)
+{
+	struct timespec ts;
+	unsigned int i;
+
+	if (!profile.enabled)
+		return;
+
+	for (i = 0; i < PROFILE_NUM_COUNTERS; ++i) {
+		mark->counters[i] = 0;
+		if (profile.fds[i] >= 0 &&
+		    read(profile.fds[i], &mark->counters[i],
+			 sizeof(mark->counters[i])) != sizeof(mark->counters[i]))
+			mark->counters[i] = 0;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	mark->ns = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Record the time and counters elapsed since the start mark for a stage that
+ * processed the given number of pixels and moved the given number of bytes
+ * (read and written).
+ */
+static void profile_record(const char *name, const struct profile_mark *start,
+			   uint64_t pixels, uint64_t bytes)
+{
+	struct profile_stage *stage = NULL;
+	struct profile_mark end;
+	unsigned int i;
+
+	if (!profile.enabled)
+		return;
+
+	profile_mark(&end);
+
+	for (i = 0; i < profile.num_stages; ++i) {
+		if (!strcmp(profile.stages[i].name, name)) {
+			stage = &profile.stages[i];
+			break;
+		}
+	}
+
+	if (!stage) {
+		if (profile.num_stages == PROFILE_MAX_STAGES)
+			return;
+
+		stage = &profile.stages[profile.num_stages++];
+		memset(stage, 0, sizeof(*stage));
+		stage->name = name;
+	}
+
+	stage->ns += end.ns - start->ns;
+	stage->pixels += pixels;
+	stage->bytes += bytes;
+
+	for (i = 0; i < PROFILE_NUM_COUNTERS; ++i)
+		stage->counters[i] += end.counters[i] - start->counters[i];
+}
+
+static void profile_report(void)
+{
+	unsigned int i, j;
+
+	if (!profile.enabled)
+		return;
+
+	if (!profile.json) {
+		printf("%-12s %12s %10s %12s", "stage", "ns", "MPix/s", "bytes");
+		for (j = 0; j < PROFILE_NUM_COUNTERS; ++j)
+			printf(" %14s", profile_counters[j].name);
+		printf("\n");
+	}
+
+	for (i = 0; i < profile.num_stages; ++i) {
+		const struct profile_stage *stage = &profile.stages[i];
+		double mpix = stage->ns ? stage->pixels * 1000.0 / stage->ns : 0.0;
+
+		if (profile.json) {
+			printf("{\"stage\": \"%s\", \"ns\": %llu, \"mpix_per_s\": %.3f, \"bytes\": %llu",
+			       stage->name, (unsigned long long)stage->ns, mpix,
+			       (unsigned long long)stage->bytes);
+
+			for (j = 0; j < PROFILE_NUM_COUNTERS; ++j) {
+				if (profile.fds[j] >= 0)
+					printf(", \"%s\": %llu", profile_counters[j].name,
+					       (unsigned long long)stage->counters[j]);
+				else
+					printf(", \"%s\": null", profile_counters[j].name);
+			}
+
+			printf("}\n");
+			continue;
+		}
+
+		printf("%-12s %12llu %10.3f %12llu", stage->name,
+		       (unsigned long long)stage->ns, mpix,
+		       (unsigned long long)stage->bytes);
+
+		for (j = 0; j < PROFILE_NUM_COUNTERS; ++j) {
+			if (profile.fds[j] >= 0)
+				printf(" %14llu", (unsigned long long)stage->counters[j]);
+			else
+				printf(" %14s", "-");
+		}
+
+		printf("\n");
+	}
+}
+
+/* -----------------------------------------------------------------------------
+ * Image initialization
+ */
+
+static void image_init(struct image *image, const struct format_info *format,
+		       unsigned int width, unsigned int height)
+{
+	memset(image, 0, sizeof(*image));
+	image->format = format;
+	image->width = width;
+	image->height = height;
+
+	switch (format->type) {
+	case FORMAT_RGB:
+		image->size = image->width * image->height
+			     * format->rgb.bpp / 8;
+		break;
+
+	case FORMAT_HSV:
+		image->size = image->width * image->height
+			     * format->hsv.bpp / 8;
+		break;
+
+	case FORMAT_YUV:
+		image->size = image->width * image->height
+			     * (8 + 2 * 8 / format->yuv.xsub / format->yuv.ysub)
+			     / 8;
+		break;
+	}
+}
+
+static struct image *image_new(const struct format_info *format,
+			       unsigned int width, unsigned int height)
+{
+	struct image *image;
+
+	image = malloc(sizeof(*image));
+	if (!image)
+		return NULL;
+
+	image_init(image, format, width, height);
+
+	image->data = malloc(image->size);
+	if (!image->data) {
+		printf("Not enough memory for image data\n");
+		free(image);
+		return NULL;
+	}
+
+	return image;
+}
+
+static void image_delete(struct image *image)
+{
+	if (!image)
+		return;
+
+	/* Wrapped images reference caller-provided memory. */
+	if (!image->wrapped)
+		free(image->data);
+	free(image);
+}
+
+struct image_plane {
+	unsigned int offset;
+	unsigned int stride;
+	unsigned int size;
+};
+
+/*
+ * Split an image in planes following the layout produced by the formatting
+ * functions. The last line of a plane may be incomplete for odd sizes.
+ */
+static unsigned int image_planes(const struct image *image,
+				 struct image_plane planes[3])
+{
+	const struct format_info *format = image->format;
+	unsigned int width = image->width;
+	unsigned int height = image->height;
+	unsigned int num_planes = 1;
+	unsigned int i;
+
+	planes[0].offset = 0;
+
+	switch (format->type) {
+	case FORMAT_RGB:
+		planes[0].stride = width * format->rgb.bpp / 8;
+		break;
+
+	case FORMAT_HSV:
+		planes[0].stride = width * format->hsv.bpp / 8;
+		break;
+
+	case FORMAT_YUV:
+		num_planes = format->yuv.num_planes;
+		if (num_planes == 1) {
+			planes[0].stride = width * (8 + 2 * 8 / format->yuv.xsub)
+					 / 8;
+			break;
+		}
+
+		planes[0].stride = width;
+		planes[1].offset = width * height;
+
+		if (num_planes == 2) {
+			planes[1].stride = width * 2 / format->yuv.xsub;
+		} else {
+			planes[1].stride = width / format->yuv.xsub;
+			planes[2].offset = planes[1].offset + width * height
+					 / format->yuv.xsub / format->yuv.ysub;
+			planes[2].stride = planes[1].stride;
+		}
+		break;
+	}
+
+	for (i = 0; i < num_planes; ++i) {
+		unsigned int end = i + 1 < num_planes
+				 ? planes[i + 1].offset : image->size;
+
+		planes[i].stride = max(planes[i].stride, 1U);
+		planes[i].size = end - planes[i].offset;
+	}
+
+	return num_planes;
+}
+
+/* -----------------------------------------------------------------------------
+ * Frame compression
+ *
+ * Frames can be stored compressed to reduce the time spent writing and reading
+ * them on slow storage. Each line of an image plane is predicted from the line
+ * above it, which only requires the plane layout and thus suits all packed and
+ * planar formats, and the byte differences are compressed in the LZ4 block
+ * format. The image is split in stripes, each made of a range of lines of every
+ * plane, compressed independently to encode and decode them in parallel. The
+ * first line of each plane of a stripe is stored as is.
+ *
+ * The compressed data starts with a struct codec_header, followed by the
+ * compressed size of each stripe as 32-bit integers and the compressed stripes,
+ * in little endian order as all supported platforms.
+ */
+
+#define CODEC_MAGIC		0x5a505356	/* "VSPZ" */
+#define CODEC_VERSION		1
+#define CODEC_MAX_STRIPES	64
+#define CODEC_STRIPE_LINES	32
+#define CODEC_HASH_BITS		14
+#define CODEC_MIN_MATCH		4
+#define CODEC_MAX_OFFSET	65535
+/* LZ4 matches must start 12 bytes before the end and end 5 bytes before. */
+#define CODEC_MATCH_LIMIT	12
+#define CODEC_LAST_LITERALS	5
+
+struct codec_header {
+	uint32_t magic;
+	uint32_t version;
+	char format[16];
+	uint32_t width;
+	uint32_t height;
+	uint32_t num_stripes;
+	uint32_t reserved;
+};
+
+struct codec_segment {
+	unsigned int offset;
+	unsigned int size;
+	unsigned int stride;
+};
+
+struct codec_job {
+	struct image *image;
+	unsigned int num_stripes;
+	unsigned int num_slices;
+	/* Compressed data and size of each stripe. */
+	uint8_t **stripes;
+	uint32_t *sizes;
+	int ret;
+};
+
+static bool codec_detect(const void *data, size_t size)
+{
+	const struct codec_header *header = data;
+
+	return size >= sizeof(*header) && header->magic == CODEC_MAGIC &&
+	       header->version == CODEC_VERSION;
+}
+
+/* Worst case compressed size of size bytes. */
+static size_t codec_bound(size_t size)
+{
+	return size + size / 255 + 16;
+}
+
+/*
+ * Compute the segments of the image covered by a stripe, one per plane, and
+ * return their total size. The last line of a plane may be incomplete.
+ */
+static unsigned int codec_stripe_segments(const struct image *image,
+					  unsigned int num_stripes,
+					  unsigned int stripe,
+					  struct codec_segment segments[3],
+					  unsigned int *num_segments)
+{
+	struct image_plane planes[3];
+	unsigned int total = 0;
+	unsigned int i;
+
+	*num_segments = image_planes(image, planes);
+
+	for (i = 0; i < *num_segments; ++i) {
+		const struct image_plane *plane = &planes[i];
+		unsigned int lines = div_round_up(plane->size, plane->stride);
+		unsigned int start, end;
+
+		parallel_slice_range(lines, num_stripes, stripe, &start, &end);
+		start *= plane->stride;
+		end = min(end * plane->stride, plane->size);
+
+		segments[i].offset = plane->offset + start;
+		segments[i].size = end > start ? end - start : 0;
+		segments[i].stride = plane->stride;
+		total += segments[i].size;
+	}
+
+	return total;
+}
+
+static inline uint32_t codec_read32(const uint8_t *p)
+{
+	uint32_t value;
+
+	memcpy(&value, p, sizeof(value));
+	return value;
+}
+
+static inline uint64_t codec_read64(const uint8_t *p)
+{
+	uint64_t value;
+
+	memcpy(&value, p, sizeof(value));
+	return value;
+}
+
+static uint8_t *codec_put_length(uint8_t *op, unsigned int length)
+{
+	for (; length >= 255; length -= 255)
+		*op++ = 255;
+
+	*op++ = length;
+	return op;
+}
+
+/*
+ * Store an LZ4 sequence of count literals followed by a match of length bytes
+ * at offset. The last sequence of a block has no match, with a zero length.
+ */
+static uint8_t *codec_put_sequence(uint8_t *op, const uint8_t *literals,
+				   unsigned int count, unsigned int offset,
+				   unsigned int length)
+{
+	uint8_t *token = op++;
+
+	*token = min(count, 15U) << 4;
+	if (count >= 15)
+		op = codec_put_length(op, count - 15);
+
+	memcpy(op, literals, count);
+	op += count;
+
+	if (!length)
+		return op;
+
+	*op++ = offset & 0xff;
+	*op++ = offset >> 8;
+
+	length -= CODEC_MIN_MATCH;
+	*token |= min(length, 15U);
+	if (length >= 15)
+		op = codec_put_length(op, length - 15);
+
+	return op;
+}
+
+/*
+ * Compress size bytes to an LZ4 block in dst, which must be at least
+ * codec_bound(size) bytes long. The match finder only tries the last position
+ * with the same 4-byte hash, and skips faster through data that doesn't
+ * compress.
+ */
+static size_t codec_lz_compress(const uint8_t *src, unsigned int size,
+				uint8_t *dst, uint32_t *table)
+{
+	const uint8_t *end = src + size;
+	const uint8_t *anchor = src;
+	const uint8_t *ip = src;
+	uint8_t *op = dst;
+
+	if (size > CODEC_MATCH_LIMIT) {
+		const uint8_t *limit = end - CODEC_MATCH_LIMIT;
+		const uint8_t *match_end = end - CODEC_LAST_LITERALS;
+
+		memset(table, 0, sizeof(*table) << CODEC_HASH_BITS);
+
+		while (ip < limit) {
+			uint32_t value = codec_read32(ip);
+			unsigned int hash = (value * 2654435761U)
+					  >> (32 - CODEC_HASH_BITS);
+			const uint8_t *ref = src + table[hash];
+			unsigned int length = CODEC_MIN_MATCH;
+
+			table[hash] = ip - src;
+
+			if (ref >= ip || ip - ref > CODEC_MAX_OFFSET ||
+			    codec_read32(ref) != value) {
+				ip += 1 + ((ip - anchor) >> 6);
+				continue;
+			}
+
+			while (ip + length + 8 <= match_end) {
+				uint64_t diff = codec_read64(ip + length)
+					      ^ codec_read64(ref + length);
+
+				if (diff) {
+					length += __builtin_ctzll(diff) / 8;
+					goto found;
+				}
+
+				length += 8;
+			}
+
+			while (ip + length < match_end && ip[length] == ref[length])
+				length++;
+
+found:
+			op = codec_put_sequence(op, anchor, ip - anchor, ip - ref,
+						length);
+			ip += length;
+			anchor = ip;
+		}
+	}
+
+	op = codec_put_sequence(op, anchor, end - anchor, 0, 0);
+	return op - dst;
+}
+
+static int codec_get_length(const uint8_t **ip, const uint8_t *end,
+			    size_t *length)
+{
+	unsigned int byte;
+
+	do {
+		if (*ip == end)
+			return -EINVAL;
+
+		byte = *(*ip)++;
+		*length += byte;
+	} while (byte == 255);
+
+	return 0;
+}
+
+/*
+ * Decompress an LZ4 block of size bytes to exactly dst_size bytes. All lengths
+ * and offsets are validated against the source and destination buffers.
+ */
+static int codec_lz_decompress(const uint8_t *src, size_t size, uint8_t *dst,
+			       size_t dst_size)
+{
+	const uint8_t *iend = src + size;
+	uint8_t *oend = dst + dst_size;
+	const uint8_t *ip = src;
+	uint8_t *op = dst;
+
+	while (ip < iend) {
+		unsigned int token = *ip++;
+		size_t length = token >> 4;
+		const uint8_t *match;
+		size_t offset;
+
+		if (length == 15 && codec_get_length(&ip, iend, &length))
+			return -EINVAL;
+
+		if (length > (size_t)(iend - ip) || length > (size_t)(oend - op))
+			return -EINVAL;
+
+		memcpy(op, ip, length);
+		ip += length;
+		op += length;
+
+		/* The last sequence has no match. */
+		if (ip == iend)
+			break;
+
+		if (iend - ip < 2)
+			return -EINVAL;
+
+		offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+
+		if (!offset || offset > (size_t)(op - dst))
+			return -EINVAL;
+
+		length = token & 15;
+		if (length == 15 && codec_get_length(&ip, iend, &length))
+			return -EINVAL;
+
+		length += CODEC_MIN_MATCH;
+		if (length > (size_t)(oend - op))
+			return -EINVAL;
+
+		/*
+		 * Overlapping matches repeat the last offset bytes. Copy them
+		 * in chunks that double in size to avoid byte copies.
+		 */
+		match = op - offset;
+		while (length > offset) {
+			memcpy(op, match, offset);
+			op += offset;
+			length -= offset;
+			offset *= 2;
+		}
+
+		memcpy(op, match, length);
+		op += length;
+	}
+
+	return op == oend ? 0 : -EINVAL;
+}
+
+static void codec_compress_slice(void *priv, unsigned int index)
+{
+	struct codec_job *job = priv;
+	struct codec_segment segments[3];
+	unsigned int num_segments;
+	unsigned int start, end;
+	uint8_t *residuals = NULL;
+	uint32_t *table;
+	unsigned int stripe;
+	unsigned int i;
+
+	parallel_slice_range(job->num_stripes, job->num_slices, index, &start,
+			     &end);
+
+	table = malloc(sizeof(*table) << CODEC_HASH_BITS);
+	if (!table)
+		goto error;
+
+	for (stripe = start; stripe < end; ++stripe) {
+		unsigned int size;
+		uint8_t *rp;
+
+		size = codec_stripe_segments(job->image, job->num_stripes,
+					     stripe, segments, &num_segments);
+
+		free(residuals);
+		residuals = malloc(size);
+		if (!residuals && size)
+			goto error;
+
+		/* Replace each byte by its difference with the byte above. */
+		for (i = 0, rp = residuals; i < num_segments; ++i) {
+			const struct codec_segment *seg = &segments[i];
+			const uint8_t *data = job->image->data + seg->offset;
+			unsigned int first = min(seg->stride, seg->size);
+			unsigned int j;
+
+			memcpy(rp, data, first);
+			for (j = first; j < seg->size; ++j)
+				rp[j] = data[j] - data[j - seg->stride];
+
+			rp += seg->size;
+		}
+
+		job->sizes[stripe] = codec_lz_compress(residuals, size,
+						       job->stripes[stripe],
+						       table);
+	}
+
+	free(residuals);
+	free(table);
+	return;
+
+error:
+	free(table);
+	job->ret = -ENOMEM;
+}
+
+static void codec_decompress_slice(void *priv, unsigned int index)
+{
+	struct codec_job *job = priv;
+	struct codec_segment segments[3];
+	unsigned int num_segments;
+	unsigned int start, end;
+	uint8_t *residuals = NULL;
+	unsigned int stripe;
+	unsigned int i;
+
+	parallel_slice_range(job->num_stripes, job->num_slices, index, &start,
+			     &end);
+
+	for (stripe = start; stripe < end; ++stripe) {
+		const uint8_t *rp;
+		unsigned int size;
+
+		size = codec_stripe_segments(job->image, job->num_stripes,
+					     stripe, segments, &num_segments);
+
+		free(residuals);
+		residuals = malloc(size);
+		if (!residuals && size) {
+			job->ret = -ENOMEM;
+			return;
+		}
+
+		if (codec_lz_decompress(job->stripes[stripe],
+					job->sizes[stripe], residuals, size)) {
+			job->ret = -EINVAL;
+			break;
+		}
+
+		for (i = 0, rp = residuals; i < num_segments; ++i) {
+			const struct codec_segment *seg = &segments[i];
+			uint8_t *data = job->image->data + seg->offset;
+			unsigned int first = min(seg->stride, seg->size);
+			unsigned int j;
+
+			memcpy(data, rp, first);
+			for (j = first; j < seg->size; ++j)
+				data[j] = rp[j] + data[j - seg->stride];
+
+			rp += seg->size;
+		}
+	}
+
+	free(residuals);
+}
+
+/*
+ * Compress an image to a newly allocated buffer holding the header, the
+ * stripe sizes and the compressed stripes.
+ */
+static int codec_compress(const struct image *image, uint8_t **data,
+			  size_t *size)
+{
+	struct codec_segment segments[3];
+	unsigned int num_segments;
+	struct codec_header *header;
+	struct codec_job job;
+	uint8_t *buffer;
+	size_t offset;
+	size_t bound;
+	unsigned int i;
+
+	job.image = (struct image *)image;
+	job.num_stripes = max(1U, min(div_round_up(image->height,
+						   CODEC_STRIPE_LINES),
+				      (unsigned int)CODEC_MAX_STRIPES));
+	job.num_slices = parallel_num_slices(job.num_stripes);
+	job.ret = 0;
+
+	/* Compress each stripe to its worst case location in the buffer. */
+	offset = sizeof(*header) + job.num_stripes * sizeof(uint32_t);
+	bound = offset;
+	for (i = 0; i < job.num_stripes; ++i)
+		bound += codec_bound(codec_stripe_segments(image, job.num_stripes,
+							   i, segments,
+							   &num_segments));
+
+	buffer = malloc(bound);
+	job.stripes = calloc(job.num_stripes, sizeof(*job.stripes));
+	if (!buffer || !job.stripes) {
+		printf("Not enough memory for compressed image\n");
+		free(job.stripes);
+		free(buffer);
+		return -ENOMEM;
+	}
+
+	header = (struct codec_header *)buffer;
+	job.sizes = (uint32_t *)(header + 1);
+
+	for (i = 0; i < job.num_stripes; ++i) {
+		job.stripes[i] = buffer + offset;
+		offset += codec_bound(codec_stripe_segments(image, job.num_stripes,
+							    i, segments,
+							    &num_segments));
+	}
+
+	parallel_run(job.num_slices, codec_compress_slice, &job);
+
+	if (job.ret) {
+		printf("Not enough memory for image compression\n");
+		free(job.stripes);
+		free(buffer);
+		return job.ret;
+	}
+
+	/* Pack the stripes after the header. */
+	offset = sizeof(*header) + job.num_stripes * sizeof(uint32_t);
+	for (i = 0; i < job.num_stripes; ++i) {
+		memmove(buffer + offset, job.stripes[i], job.sizes[i]);
+		offset += job.sizes[i];
+	}
+
+	memset(header, 0, sizeof(*header));
+	header->magic = CODEC_MAGIC;
+	header->version = CODEC_VERSION;
+	strncpy(header->format, image->format->name,
+		sizeof(header->format) - 1);
+	header->width = image->width;
+	header->height = image->height;
+	header->num_stripes = job.num_stripes;
+
+	free(job.stripes);
+
+	*data = buffer;
+	*size = offset;
+	return 0;
+}
+
+/* Decompress an image from a compressed buffer read from filename. */
+static struct image *codec_decompress(const uint8_t *data, size_t size,
+				      const char *filename)
+{
+	const struct codec_header *header = (const void *)data;
+	const struct format_info *format;
+	const uint32_t *sizes;
+	struct image *image = NULL;
+	struct codec_job job;
+	char name[sizeof(header->format) + 1] = { };
+	size_t offset;
+	unsigned int i;
+
+	memcpy(name, header->format, sizeof(header->format));
+	format = format_by_name(name);
+
+	if (!format ||
+	    !header->width || !header->height ||
+	    header->width > 16384 || header->height > 16384 ||
+	    !header->num_stripes || header->num_stripes > CODEC_MAX_STRIPES) {
+		printf("Invalid compressed frame %s: unsupported header\n",
+		       filename);
+		return NULL;
+	}
+
+	offset = sizeof(*header) + header->num_stripes * sizeof(uint32_t);
+	if (size < offset) {
+		printf("Invalid compressed frame %s: file too short\n",
+		       filename);
+		return NULL;
+	}
+
+	job.num_stripes = header->num_stripes;
+	job.num_slices = parallel_num_slices(job.num_stripes);
+	job.sizes = (uint32_t *)(header + 1);
+	job.ret = 0;
+
+	job.stripes = calloc(job.num_stripes, sizeof(*job.stripes));
+	if (!job.stripes)
+		return NULL;
+
+	sizes = job.sizes;
+	for (i = 0; i < job.num_stripes; ++i) {
+		if (sizes[i] > size - offset) {
+			printf("Invalid compressed frame %s: file too short\n",
+			       filename);
+			goto done;
+		}
+
+		job.stripes[i] = (uint8_t *)data + offset;
+		offset += sizes[i];
+	}
+
+	image = image_new(format, header->width, header->height);
+	if (!image)
+		goto done;
+
+	job.image = image;
+	parallel_run(job.num_slices, codec_decompress_slice, &job);
+
+	if (job.ret) {
+		if (job.ret == -ENOMEM)
+			printf("Not enough memory for image decompression\n");
+		else
+			printf("Invalid compressed frame %s: corrupted data\n",
+			       filename);
+		image_delete(image);
+		image = NULL;
+	}
+
+done:
+	free(job.stripes);
+	return image;
+}
+
+/* -----------------------------------------------------------------------------
+ * Deflate format
+ *
+ * Tables and checksum shared by the deflate encoder of the PNG writer and the
+ * gzip decoder of the image reader (RFC 1951 and RFC 1952).
+ */
+
+#define DEFLATE_WINDOW_SIZE	32768
+#define DEFLATE_MIN_MATCH	3
+#define DEFLATE_MAX_MATCH	258
+
+static const uint16_t deflate_length_base[29] = {
+	3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+	35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258,
+};
+
+static const uint8_t deflate_length_extra[29] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+	3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0,
+};
+
+static const uint16_t deflate_dist_base[30] = {
+	1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+	257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289,
+	16385, 24577,
+};
+
+static const uint8_t deflate_dist_extra[30] = {
+	0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+	7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13,
+};
+
+static uint32_t crc32_table[256];
+static pthread_once_t crc32_once = PTHREAD_ONCE_INIT;
+
+static uint16_t deflate_reverse(uint16_t code, unsigned int length)
+{
+	uint16_t reversed = 0;
+	unsigned int i;
+
+	for (i = 0; i < length; ++i)
+		reversed |= ((code >> i) & 1) << (length - 1 - i);
+
+	return reversed;
+}
+
+static void crc32_init_table(void)
+{
+	unsigned int i, k;
+
+	for (i = 0; i < 256; ++i) {
+		uint32_t crc = i;
+
+		for (k = 0; k < 8; ++k)
+			crc = crc & 1 ? 0xedb88320 ^ (crc >> 1) : crc >> 1;
+		crc32_table[i] = crc;
+	}
+}
+
+/* Initialize the CRC table. Can be called from any thread. */
+static void crc32_init(void)
+{
+	pthread_once(&crc32_once, crc32_init_table);
+}
+
+static uint32_t crc32_update(uint32_t crc, const uint8_t *data, size_t size)
+{
+	size_t i;
+
+	crc = ~crc;
+	for (i = 0; i < size; ++i)
+		crc = crc32_table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+
+	return ~crc;
+}
+
+/* -----------------------------------------------------------------------------
+ * Gzip decompression
+ *
+ * Gzip files are decompressed as a stream, to parse the image header from the
+ * first decompressed bytes and decompress the image data directly to the image
+ * buffer, without storing the whole file compressed or decompressed in memory.
+ * The output is produced in a window that holds the last DEFLATE_WINDOW_SIZE
+ * bytes referenced by matches as well as the bytes not read yet.
+ *
+ * Huffman codes up to INFLATE_FAST_BITS long are decoded with a single table
+ * lookup, longer codes one bit at a time from the canonical code counts.
+ */
+
+#define INFLATE_FAST_BITS	10
+#define INFLATE_INPUT_SIZE	65536
+#define INFLATE_WINDOW_SIZE	(2 * DEFLATE_WINDOW_SIZE)
+#define INFLATE_WINDOW_MASK	(INFLATE_WINDOW_SIZE - 1)
+
+struct inflate_huffman {
+	/* Symbol << 4 | length for codes up to INFLATE_FAST_BITS long. */
+	uint16_t fast[1 << INFLATE_FAST_BITS];
+	uint16_t count[16];
+	uint16_t symbol[288];
+};
+
+enum inflate_state {
+	INFLATE_BLOCK,
+	INFLATE_STORED,
+	INFLATE_HUFFMAN,
+	INFLATE_TRAILER,
+	INFLATE_DONE,
+};
+
+struct gzip_stream {
+	int fd;
+	uint8_t input[INFLATE_INPUT_SIZE];
+	unsigned int input_pos;
+	unsigned int input_size;
+	/* Number of zero bytes fed past the end of the file. */
+	unsigned int overrun;
+	uint64_t bits;
+	unsigned int num_bits;
+
+	enum inflate_state state;
+	bool last;
+	unsigned int stored;
+	struct inflate_huffman litlen;
+	struct inflate_huffman dist;
+
+	uint8_t window[INFLATE_WINDOW_SIZE];
+	uint64_t written;
+	uint64_t read;
+	/* Offset of the current member in the decompressed data. */
+	uint64_t member;
+	uint32_t crc;
+	uint32_t trailer_crc;
+	uint32_t trailer_size;
+	int error;
+};
+
+static void inflate_refill(struct gzip_stream *gz)
+{
+	while (gz->num_bits <= 56) {
+		uint8_t byte = 0;
+
+		if (gz->input_pos == gz->input_size) {
+			int ret = file_read(gz->fd, gz->input, sizeof(gz->input));
+
+			if (ret < 0)
+				gz->error = ret;
+
+			gz->input_pos = 0;
+			gz->input_size = max(ret, 0);
+		}
+
+		if (gz->input_pos < gz->input_size)
+			byte = gz->input[gz->input_pos++];
+		else
+			gz->overrun++;
+
+		gz->bits |= (uint64_t)byte << gz->num_bits;
+		gz->num_bits += 8;
+	}
+}
+
+static unsigned int inflate_bits(struct gzip_stream *gz, unsigned int count)
+{
+	unsigned int value;
+
+	if (gz->num_bits < count)
+		inflate_refill(gz);
+
+	value = gz->bits & ((1ULL << count) - 1);
+	gz->bits >>= count;
+	gz->num_bits -= count;
+	return value;
+}
+
+/* Return true if bits fed past the end of the file have been consumed. */
+static bool inflate_overrun(const struct gzip_stream *gz)
+{
+	return gz->overrun * 8 > gz->num_bits;
+}
+
+/* Return true if all bytes of the file have been consumed. */
+static bool inflate_eof(struct gzip_stream *gz)
+{
+	if (gz->num_bits < 8)
+		inflate_refill(gz);
+
+	return gz->overrun * 8 >= gz->num_bits;
+}
+
+static int inflate_build(struct inflate_huffman *huffman,
+			 const uint8_t *lengths, unsigned int num_symbols)
+{
+	uint16_t offsets[16];
+	unsigned int code = 0;
+	unsigned int index = 0;
+	unsigned int length;
+	unsigned int i, k;
+	int left = 1;
+
+	memset(huffman->count, 0, sizeof(huffman->count));
+	for (i = 0; i < num_symbols; ++i)
+		huffman->count[lengths[i]]++;
+	huffman->count[0] = 0;
+
+	/* Reject over-subscribed codes, incomplete codes are valid. */
+	for (length = 1; length < 16; ++length) {
+		left = left * 2 - huffman->count[length];
+		if (left < 0)
+			return -EINVAL;
+	}
+
+	offsets[1] = 0;
+	for (length = 1; length < 15; ++length)
+		offsets[length + 1] = offsets[length] + huffman->count[length];
+
+	for (i = 0; i < num_symbols; ++i) {
+		if (lengths[i])
+			huffman->symbol[offsets[lengths[i]]++] = i;
+	}
+
+	memset(huffman->fast, 0, sizeof(huffman->fast));
+
+	for (length = 1; length <= INFLATE_FAST_BITS; ++length) {
+		for (i = 0; i < huffman->count[length]; ++i, ++code, ++index) {
+			uint16_t entry = huffman->symbol[index] << 4 | length;
+
+			for (k = deflate_reverse(code, length);
+			     k < ARRAY_SIZE(huffman->fast); k += 1 << length)
+				huffman->fast[k] = entry;
+		}
+
+		code <<= 1;
+	}
+
+	return 0;
+}
+
+static int inflate_decode(struct gzip_stream *gz,
+			  const struct inflate_huffman *huffman)
+{
+	unsigned int code = 0;
+	unsigned int first = 0;
+	unsigned int index = 0;
+	unsigned int length;
+	unsigned int entry;
+	uint64_t bits;
+
+	if (gz->num_bits < 15)
+		inflate_refill(gz);
+
+	entry = huffman->fast[gz->bits & (ARRAY_SIZE(huffman->fast) - 1)];
+	if (entry) {
+		length = entry & 15;
+		gz->bits >>= length;
+		gz->num_bits -= length;
+		return entry >> 4;
+	}
+
+	/* Codes are stored MSB first, decode them one bit at a time. */
+	for (length = 1, bits = gz->bits; length < 16; ++length, bits >>= 1) {
+		unsigned int count = huffman->count[length];
+
+		code |= bits & 1;
+		if (code < first + count) {
+			gz->bits >>= length;
+			gz->num_bits -= length;
+			return huffman->symbol[index + code - first];
+		}
+
+		index += count;
+		first = (first + count) << 1;
+		code <<= 1;
+	}
+
+	return -EINVAL;
+}
+
+static int inflate_dynamic(struct gzip_stream *gz)
+{
+	static const uint8_t order[19] = {
+		16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15,
+	};
+	uint8_t lengths[288 + 32] = { };
+	unsigned int num_litlen;
+	unsigned int num_dist;
+	unsigned int num_codes;
+	unsigned int i;
+
+	num_litlen = inflate_bits(gz, 5) + 257;
+	num_dist = inflate_bits(gz, 5) + 1;
+	num_codes = inflate_bits(gz, 4) + 4;
+	if (num_litlen > 286 || num_dist > 30)
+		return -EINVAL;
+
+	for (i = 0; i < num_codes; ++i)
+		lengths[order[i]] = inflate_bits(gz, 3);
+
+	/* Decode the code lengths with the dist table as a temporary table. */
+	if (inflate_build(&gz->dist, lengths, 19))
+		return -EINVAL;
+
+	memset(lengths, 0, 19);
+
+	for (i = 0; i < num_litlen + num_dist; ) {
+		int symbol = inflate_decode(gz, &gz->dist);
+		unsigned int repeat;
+		uint8_t value = 0;
+
+		if (symbol < 0)
+			return symbol;
+
+		if (symbol < 16) {
+			lengths[i++] = symbol;
+			continue;
+		}
+
+		if (symbol == 16) {
+			if (!i)
+				return -EINVAL;
+			value = lengths[i - 1];
+			repeat = 3 + inflate_bits(gz, 2);
+		} else if (symbol == 17) {
+			repeat = 3 + inflate_bits(gz, 3);
+		} else {
+			repeat = 11 + inflate_bits(gz, 7);
+		}
+
+		if (i + repeat > num_litlen + num_dist)
+			return -EINVAL;
+
+		while (repeat--)
+			lengths[i++] = value;
+	}
+
+	/* The end of block code is required. */
+	if (!lengths[256])
+		return -EINVAL;
+
+	if (inflate_build(&gz->litlen, lengths, num_litlen) ||
+	    inflate_build(&gz->dist, lengths + num_litlen, num_dist))
+		return -EINVAL;
+
+	return 0;
+}
+
+static int inflate_block(struct gzip_stream *gz)
+{
+	uint8_t lengths[288];
+	unsigned int length;
+	unsigned int i;
+
+	if (gz->last) {
+		/* Read the trailer from the next byte boundary. */
+		inflate_bits(gz, gz->num_bits % 8);
+		gz->trailer_crc = inflate_bits(gz, 16);
+		gz->trailer_crc |= inflate_bits(gz, 16) << 16;
+		gz->trailer_size = inflate_bits(gz, 16);
+		gz->trailer_size |= inflate_bits(gz, 16) << 16;
+		gz->state = INFLATE_TRAILER;
+		return 0;
+	}
+
+	gz->last = inflate_bits(gz, 1);
+
+	switch (inflate_bits(gz, 2)) {
+	case 0:
+		inflate_bits(gz, gz->num_bits % 8);
+		length = inflate_bits(gz, 16);
+		if (inflate_bits(gz, 16) != (~length & 0xffff))
+			return -EINVAL;
+
+		gz->stored = length;
+		gz->state = INFLATE_STORED;
+		return 0;
+
+	case 1:
+		for (i = 0; i < 288; ++i)
+			lengths[i] = i < 144 ? 8 : i < 256 ? 9 : i < 280 ? 7 : 8;
+		inflate_build(&gz->litlen, lengths, 288);
+
+		memset(lengths, 5, 30);
+		inflate_build(&gz->dist, lengths, 30);
+		break;
+
+	case 2:
+		if (inflate_dynamic(gz))
+			return -EINVAL;
+		break;
+
+	default:
+		return -EINVAL;
+	}
+
+	gz->state = INFLATE_HUFFMAN;
+	return 0;
+}
+
+/*
+ * Decode Huffman codes until the end of the block or until the window is full
+ * of bytes not read yet.
+ */
+static int inflate_huffman(struct gzip_stream *gz)
+{
+	uint8_t *window = gz->window;
+	uint64_t written = gz->written;
+	int ret = 0;
+
+	while (written - gz->read <= INFLATE_WINDOW_SIZE - DEFLATE_MAX_MATCH) {
+		unsigned int length;
+		unsigned int dist;
+		int symbol;
+
+		symbol = inflate_decode(gz, &gz->litlen);
+		if (symbol < 256) {
+			if (symbol < 0) {
+				ret = symbol;
+				break;
+			}
+
+			window[written++ & INFLATE_WINDOW_MASK] = symbol;
+			continue;
+		}
+
+		if (symbol == 256) {
+			gz->state = INFLATE_BLOCK;
+			break;
+		}
+
+		symbol -= 257;
+		if (symbol >= 29) {
+			ret = -EINVAL;
+			break;
+		}
+
+		length = deflate_length_base[symbol]
+		       + inflate_bits(gz, deflate_length_extra[symbol]);
+
+		symbol = inflate_decode(gz, &gz->dist);
+		if (symbol < 0 || symbol >= 30) {
+			ret = -EINVAL;
+			break;
+		}
+
+		dist = deflate_dist_base[symbol]
+		     + inflate_bits(gz, deflate_dist_extra[symbol]);
+		if (dist > written) {
+			ret = -EINVAL;
+			break;
+		}
+
+		while (length--) {
+			window[written & INFLATE_WINDOW_MASK] =
+				window[(written - dist) & INFLATE_WINDOW_MASK];
+			written++;
+		}
+	}
+
+	gz->written = written;
+	return ret;
+}
+
+/* Decompress data to the window. */
+static int inflate_fill(struct gzip_stream *gz)
+{
+	int ret = 0;
+
+	switch (gz->state) {
+	case INFLATE_BLOCK:
+		ret = inflate_block(gz);
+		break;
+
+	case INFLATE_STORED:
+		while (gz->stored &&
+		       gz->written - gz->read < INFLATE_WINDOW_SIZE) {
+			gz->window[gz->written++ & INFLATE_WINDOW_MASK] =
+				inflate_bits(gz, 8);
+			gz->stored--;
+		}
+
+		if (!gz->stored)
+			gz->state = INFLATE_BLOCK;
+		break;
+
+	case INFLATE_HUFFMAN:
+		ret = inflate_huffman(gz);
+		break;
+
+	case INFLATE_TRAILER:
+	case INFLATE_DONE:
+		break;
+	}
+
+	if (gz->error)
+		return gz->error;
+	if (ret < 0 || inflate_overrun(gz))
+		return -EINVAL;
+
+	return 0;
+}
+
+/* Parse the header of a gzip member. */
+static int gzip_header(struct gzip_stream *gz)
+{
+	unsigned int flags;
+	unsigned int i;
+
+	if (inflate_bits(gz, 16) != 0x8b1f || inflate_bits(gz, 8) != 8)
+		return -EINVAL;
+
+	/* Skip the modification time, extra flags and OS. */
+	flags = inflate_bits(gz, 8);
+	for (i = 0; i < 6; ++i)
+		inflate_bits(gz, 8);
+
+	if (flags & 0x04) {
+		unsigned int size = inflate_bits(gz, 16);
+
+		while (size--)
+			inflate_bits(gz, 8);
+	}
+
+	/* Skip the file name and comment. */
+	for (i = 0x08; i <= 0x10; i <<= 1) {
+		if (!(flags & i))
+			continue;
+
+		while (inflate_bits(gz, 8) && !inflate_overrun(gz))
+			;
+	}
+
+	if (flags & 0x02)
+		inflate_bits(gz, 16);
+
+	if (gz->error)
+		return gz->error;
+	if (inflate_overrun(gz))
+		return -EINVAL;
+
+	return 0;
+}
+
+/*
+ * Start decompressing a gzip file, parsing its header. Return NULL if the file
+ * isn't a gzip file.
+ */
+static struct gzip_stream *gzip_open(int fd)
+{
+	struct gzip_stream *gz;
+
+	gz = calloc(1, sizeof(*gz));
+	if (!gz)
+		return NULL;
+
+	gz->fd = fd;
+
+	crc32_init();
+
+	if (gzip_header(gz)) {
+		free(gz);
+		return NULL;
+	}
+
+	return gz;
+}
+
+/*
+ * Verify the checksum and size of the member whose data has been read, and
+ * start decompressing the next member if the file isn't finished. Gzip files
+ * can be made of multiple members, decompressed as a single stream.
+ */
+static int gzip_next_member(struct gzip_stream *gz)
+{
+	if (gz->crc != gz->trailer_crc ||
+	    (uint32_t)(gz->written - gz->member) != gz->trailer_size)
+		return -EINVAL;
+
+	if (inflate_eof(gz)) {
+		gz->state = INFLATE_DONE;
+		return gz->error;
+	}
+
+	gz->member = gz->written;
+	gz->crc = 0;
+	gz->last = false;
+	gz->state = INFLATE_BLOCK;
+
+	return gzip_header(gz);
+}
+
+/* Read up to size decompressed bytes. Return the number of bytes read. */
+static int gzip_read(struct gzip_stream *gz, void *buffer, size_t size)
+{
+	size_t offset = 0;
+	int ret;
+
+	while (offset < size) {
+		size_t count = min(size - offset,
+				   (size_t)(gz->written - gz->read));
+		size_t pos = gz->read & INFLATE_WINDOW_MASK;
+
+		if (!count) {
+			if (gz->state == INFLATE_DONE)
+				break;
+
+			if (gz->state == INFLATE_TRAILER)
+				ret = gzip_next_member(gz);
+			else
+				ret = inflate_fill(gz);
+			if (ret < 0)
+				return ret;
+			continue;
+		}
+
+		count = min(count, INFLATE_WINDOW_SIZE - pos);
+		memcpy(buffer + offset, gz->window + pos, count);
+		gz->crc = crc32_update(gz->crc, gz->window + pos, count);
+		gz->read += count;
+		offset += count;
+	}
+
+	return offset;
+}
+
+/*
+ * Decompress the rest of the file and verify the trailer checksum and size of
+ * all members. Return 0 if they match, or a negative error code.
+ */
+static int gzip_close(struct gzip_stream *gz)
+{
+	uint8_t buffer[4096];
+	int ret;
+
+	do {
+		ret = gzip_read(gz, buffer, sizeof(buffer));
+	} while (ret > 0);
+
+	free(gz);
+	return ret;
+}
+
+/* -----------------------------------------------------------------------------
+ * Image read and write
+ */
+
+/* PNM files are read from a raw or gzip-compressed file descriptor. */
+struct pnm_source {
+	int fd;
+	struct gzip_stream *gz;
+};
+
+static int pnm_read_bytes(struct pnm_source *source, char *buffer, size_t size)
+{
+	int ret;
+
+	if (source->gz) {
+		ret = gzip_read(source->gz, buffer, size);
+		if (ret == -EINVAL) {
+			printf("Invalid PNM file: corrupted gzip data\n");
+			return ret;
+		}
+	} else {
+		ret = file_read(source->fd, buffer, size);
+	}
+
+	if (ret < 0) {
+		printf("Unable to read PNM file: %s (%d)\n", strerror(-ret),
+		       ret);
+		return ret;
+	}
+	if ((size_t)ret != size) {
+		printf("Invalid PNM file: file too short\n");
+		return -ENODATA;
+	}
+
+	return 0;
+}
+
+static int pnm_read_integer(struct pnm_source *source)
+{
+	unsigned int value = 0;
+	int ret;
+	char c;
+
+	do {
+		ret = pnm_read_bytes(source, &c, 1);
+	} while (!ret && isspace(c));
+
+	if (ret)
+		return ret;
+
+	while (!ret && isdigit(c)) {
+		value = value * 10 + c - '0';
+		ret = pnm_read_bytes(source, &c, 1);
+	}
+
+	if (ret)
+		return ret;
+
+	if (!isspace(c))
+		return -EINVAL;
+
+	return value;
+}
+
+static struct image *pnm_read(const char *filename)
+{
+	struct pnm_source source = { };
+	struct image *image = NULL;
+	unsigned int width;
+	unsigned int height;
+	uint8_t magic[2];
+	char buffer[2];
+	int ret;
+
+	source.fd = open(filename, O_RDONLY);
+	if (source.fd < 0) {
+		printf("Unable to open PNM file %s: %s (%d)\n", filename,
+		       strerror(errno), errno);
+		return NULL;
+	}
+
+	/* Decompress gzip files on the fly. */
+	if (pread(source.fd, magic, 2, 0) == 2 &&
+	    magic[0] == 0x1f && magic[1] == 0x8b) {
+		source.gz = gzip_open(source.fd);
+		if (!source.gz) {
+			printf("Invalid gzip file %s\n", filename);
+			ret = -EINVAL;
+			goto done;
+		}
+	}
+
+	/* Read and validate the header. */
+	ret = pnm_read_bytes(&source, buffer, 2);
+	if (ret < 0)
+		goto done;
+
+	if (buffer[0] != 'P' || buffer[1] != '6') {
+		printf("Invalid PNM file: invalid signature\n");
+		ret = -EINVAL;
+		goto done;
+	}
+
+	/* Read the width, height and depth. */
+	ret = pnm_read_integer(&source);
+	if (ret < 0) {
+		printf("Invalid PNM file: invalid width\n");
+		goto done;
+	}
+
+	width = ret;
+
+	ret = pnm_read_integer(&source);
+	if (ret < 0) {
+		printf("Invalid PNM file: invalid height\n");
+		goto done;
+	}
+
+	height = ret;
+
+	ret = pnm_read_integer(&source);
+	if (ret < 0) {
+		printf("Invalid PNM file: invalid depth\n");
+		goto done;
+	}
+
+	if (ret != 255) {
+		printf("Invalid PNM file: unsupported depth %u\n", ret);
+		ret = -EINVAL;
+		goto done;
+	}
+
+	/* Allocate the image and read the data. */
+	image = image_new(format_by_name("RGB24"), width, height);
+	if (!image) {
+		ret = -ENOMEM;
+		goto done;
+	}
+
+	ret = pnm_read_bytes(&source, image->data, image->size);
+
+done:
+	if (source.gz) {
+		int err = gzip_close(source.gz);
+
+		if (!ret && err) {
+			printf("Invalid gzip file %s: corrupted data\n",
+			       filename);
+			ret = err;
+		}
+	}
+
+	close(source.fd);
+
+	if (ret) {
+		image_delete(image);
+		return NULL;
+	}
+
+	return image;
+}
+
+/*
+ * Map a frame file in memory. Compressed frames are decompressed to a new image
+ * instead, which gives their format and size. The frame data and size are the
+ * contents of the raw frame in both cases.
+ */
+struct frame_file {
+	const uint8_t *data;
+	size_t size;
+	void *map;
+	size_t map_size;
+	struct image *image;
+};
+
+static int frame_open(struct frame_file *frame, const char *filename)
+{
+	struct stat st;
+	int ret = 0;
+	int fd;
+
+	memset(frame, 0, sizeof(*frame));
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		printf("Unable to open file %s: %s (%d)\n", filename,
+		       strerror(errno), errno);
+		return -errno;
+	}
+
+	if (fstat(fd, &st) < 0) {
+		ret = -errno;
+		goto done;
+	}
+
+	if (st.st_size) {
+		frame->map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd,
+				  0);
+		if (frame->map == MAP_FAILED) {
+			printf("Unable to map file %s: %s (%d)\n", filename,
+			       strerror(errno), errno);
+			frame->map = NULL;
+			ret = -errno;
+			goto done;
+		}
+
+		frame->map_size = st.st_size;
+		madvise(frame->map, frame->map_size, MADV_SEQUENTIAL);
+	}
+
+	frame->data = frame->map;
+	frame->size = st.st_size;
+
+	if (codec_detect(frame->data, frame->size)) {
+		frame->image = codec_decompress(frame->data, frame->size,
+						filename);
+		munmap(frame->map, frame->map_size);
+		frame->map = NULL;
+
+		if (!frame->image) {
+			ret = -EINVAL;
+			goto done;
+		}
+
+		frame->data = frame->image->data;
+		frame->size = frame->image->size;
+	}
+
+done:
+	close(fd);
+	return ret;
+}
+
+static void frame_close(struct frame_file *frame)
+{
+	if (frame->map)
+		munmap(frame->map, frame->map_size);
+	image_delete(frame->image);
+}
+
+/*
+ * Read a raw image, as captured from the device, of known format and size.
+ * The image may be stored compressed.
+ */
+static struct image *image_read_raw(const char *filename,
+				    const struct format_info *format,
+				    unsigned int width, unsigned int height)
+{
+	struct frame_file frame;
+	struct image *image;
+
+	if (frame_open(&frame, filename) < 0)
+		return NULL;
+
+	/* Compressed frames are already decoded to an image. */
+	image = frame.image;
+	if (image) {
+		frame.image = NULL;
+
+		if (image->format != format || image->width != width ||
+		    image->height != height) {
+			printf("Input file %s stores a %s %ux%u frame, %s %ux%u expected\n",
+			       filename, image->format->name, image->width,
+			       image->height, format->name, width, height);
+			image_delete(image);
+			image = NULL;
+		}
+
+		goto done;
+	}
+
+	image = image_new(format, width, height);
+	if (!image)
+		goto done;
+
+	if (frame.size < image->size) {
+		printf("Input file %s too small, %u bytes expected\n",
+		       filename, image->size);
+		image_delete(image);
+		image = NULL;
+		goto done;
+	}
+
+	memcpy(image->data, frame.data, image->size);
+
+done:
+	frame_close(&frame);
+	return image;
+}
+
+static int image_write(const struct image *image, const char *filename)
+{
+	int ret;
+	int fd;
+
+	fd = open(filename, O_WRONLY | O_CREAT,
+		  S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	if (fd < 0) {
+		printf("Unable to open output file %s: %s (%d)\n", filename,
+		       strerror(errno), errno);
+		return -errno;
+	}
+
+	ret = file_write(fd, image->data, image->size);
+	if (ret < 0)
+		printf("Unable to write output image: %s (%d)\n",
+		       strerror(-ret), ret);
+	else
+		ftruncate(fd, image->size);
+
+	close(fd);
+	return ret;
+}
+
+/* Store a file made of a header followed by data, replacing existing files. */
+static int file_store(const char *filename, const void *header,
+		      size_t header_size, const void *data, size_t size)
+{
+	int ret;
+	int fd;
+
+	fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC,
+		  S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	if (fd < 0) {
+		printf("Unable to open output file %s: %s (%d)\n", filename,
+		       strerror(errno), errno);
+		return -errno;
+	}
+
+	ret = file_write(fd, header, header_size);
+	if (ret >= 0)
+		ret = file_write(fd, data, size);
+	if (ret < 0)
+		printf("Unable to write output file %s: %s (%d)\n", filename,
+		       strerror(-ret), ret);
+
+	close(fd);
+	return ret < 0 ? ret : 0;
+}
+
+/*
+ * Store an image compressed with the frame codec, or raw if compression
+ * doesn't reduce its size.
+ */
+static int image_write_compressed(const struct image *image,
+				  const char *filename)
+{
+	uint8_t *data;
+	size_t size;
+	int ret;
+
+	ret = codec_compress(image, &data, &size);
+	if (ret < 0)
+		return ret;
+
+	if (size < image->size)
+		ret = file_store(filename, data, size, NULL, 0);
+	else
+		ret = file_store(filename, image->data, image->size, NULL, 0);
+
+	free(data);
+	return ret;
+}
+
+/* Store an RGB24 image in PNM format. */
+static int pnm_write(const struct image *image, const char *filename)
+{
+	char header[32];
+	int len;
+
+	len = sprintf(header, "P6\n%u %u\n255\n", image->width, image->height);
+	return file_store(filename, header, len, image->data, image->size);
+}
+
+/* Directory of the decompressed copies of gzip-compressed source images. */
+static char *source_cache;
+
+/*
+ * Compute the path of the decompressed copy of a gzip-compressed source image
+ * in the cache directory. The name records the source size and modification
+ * time to ignore stale copies. Return NULL if the source isn't compressed.
+ */
+static char *source_cache_path(const char *filename)
+{
+	const char *name = strrchr(filename, '/');
+	uint8_t magic[2];
+	struct stat st;
+	char *path;
+	size_t len;
+	int ret;
+	int fd;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+
+	ret = pread(fd, magic, 2, 0);
+	if (ret != 2 || magic[0] != 0x1f || magic[1] != 0x8b ||
+	    fstat(fd, &st) < 0) {
+		close(fd);
+		return NULL;
+	}
+
+	close(fd);
+
+	name = name ? name + 1 : filename;
+	len = strlen(name);
+	if (len > 3 && !strcmp(name + len - 3, ".gz"))
+		len -= 3;
+	if (len > 4 && !strncmp(name + len - 4, ".pnm", 4))
+		len -= 4;
+
+	path = malloc(strlen(source_cache) + len + 40);
+	if (!path)
+		return NULL;
+
+	sprintf(path, "%s/%.*s-%llx-%llx.pnm", source_cache, (int)len, name,
+		(unsigned long long)st.st_size,
+		(unsigned long long)st.st_mtime);
+	return path;
+}
+
+/*
+ * Read a source image in PNM format, possibly gzip-compressed. When a cache
+ * directory is set, compressed images are decompressed once and read from
+ * their decompressed copy afterwards.
+ */
+static struct image *image_read(const char *filename)
+{
+	struct image *image = NULL;
+	char *cache = NULL;
+
+	if (source_cache)
+		cache = source_cache_path(filename);
+
+	if (cache && !access(cache, R_OK))
+		image = pnm_read(cache);
+
+	if (!image) {
+		image = pnm_read(filename);
+
+		/* Store the copy atomically, concurrent readers may exist. */
+		if (image && cache) {
+			char tmp[strlen(cache) + 16];
+
+			sprintf(tmp, "%s.%d", cache, getpid());
+			if (pnm_write(image, tmp) || rename(tmp, cache))
+				unlink(tmp);
+		}
+	}
+
+	free(cache);
+	return image;
+}
+
+/* -----------------------------------------------------------------------------
+ * Image formatting
+ */
+
+static void image_format_rgb8(const struct image *input, struct image *output,
+			      const struct params *params)
+{
+	const uint8_t *idata = input->data;
+	uint8_t *odata = output->data;
+	uint8_t r, g, b;
+	unsigned int x, y;
+
+	idata = input->data;
+	odata = output->data;
+
+	for (y = 0; y < input->height; ++y) {
+		for (x = 0; x < input->width; ++x) {
+			/* There's only one RGB8 variant supported, hardcode it. */
+			r = *idata++ >> 5;
+			g = *idata++ >> 5;
+			b = *idata++ >> 6;
+
+			*odata++ = (r << 5) | (g << 2) | b;
+		}
+	}
+}
+
+static void image_format_rgb16(const struct image *input, struct image *output,
+			       const struct params *params)
+{
+	const struct format_info *format = output->format;
+	const uint8_t *idata = input->data;
+	uint16_t *odata = output->data;
+	uint8_t r, g, b, a;
+	unsigned int x, y;
+
+	for (y = 0; y < input->height; ++y) {
+		for (x = 0; x < input->width; ++x) {
+			r = *idata++ >> (8 - format->rgb.red.length);
+			g = *idata++ >> (8 - format->rgb.green.length);
+			b = *idata++ >> (8 - format->rgb.blue.length);
+			a = params->alpha >> (8 - format->rgb.alpha.length);
+
+			*odata++ = (r << format->rgb.red.offset)
+				 | (g << format->rgb.green.offset)
+				 | (b << format->rgb.blue.offset)
+				 | (a << format->rgb.alpha.offset);
+		}
+	}
+}
+
+static void image_format_rgb24(const struct image *input, struct image *output,
+			       const struct params *params)
+{
+	struct color_rgb24 {
+		unsigned int value:24;
+	} __attribute__((__packed__));
+
+	const struct format_info *format = output->format;
+	const uint8_t *idata = input->data;
+	struct color_rgb24 *odata = output->data;
+	uint8_t r, g, b, a;
+	unsigned int x, y;
+
+	idata = input->data;
+	odata = output->data;
+
+	for (y = 0; y < input->height; ++y) {
+		for (x = 0; x < input->width; ++x) {
+			r = *idata++ >> (8 - format->rgb.red.length);
+			g = *idata++ >> (8 - format->rgb.green.length);
+			b = *idata++ >> (8 - format->rgb.blue.length);
+			a = params->alpha >> (8 - format->rgb.alpha.length);
+
+			*odata++ = (struct color_rgb24){ .value =
+					(r << format->rgb.red.offset) |
+					(g << format->rgb.green.offset) |
+					(b << format->rgb.blue.offset) |
+					(a << format->rgb.alpha.offset) };
+		}
+	}
+}
+
+static void image_format_rgb32(const struct image *input, struct image *output,
+			       const struct params *params)
+{
+	const struct format_info *format = output->format;
+	const uint8_t *idata = input->data;
+	uint32_t *odata = output->data;
+	uint8_t r, g, b, a;
+	unsigned int x, y;
+
+	for (y = 0; y < input->height; ++y) {
+		for (x = 0; x < input->width; ++x) {
+			r = *idata++ >> (8 - format->rgb.red.length);
+			g = *idata++ >> (8 - format->rgb.green.length);
+			b = *idata++ >> (8 - format->rgb.blue.length);
+			a = params->alpha >> (8 - format->rgb.alpha.length);
+
+			*odata++ = (r << format->rgb.red.offset)
+				 | (g << format->rgb.green.offset)
+				 | (b << format->rgb.blue.offset)
+				 | (a << format->rgb.alpha.offset);
+		}
+	}
+}
+
+static void image_format_hsv24(const struct image *input, struct image *output,
+			       const struct params *params)
+{
+	memcpy(output->data, input->data, input->width * input->height * 3);
+}
+
+static void image_format_hsv32(const struct image *input, struct image *output,
+			       const struct params *params)
+{
+	const struct format_info *format = output->format;
+	const uint8_t *idata = input->data;
+	uint32_t *odata = output->data;
+	uint8_t h, s, v, a;
+	unsigned int x, y;
+
+	for (y = 0; y < input->height; ++y) {
+		for (x = 0; x < input->width; ++x) {
+			h = *idata++;
+			s = *idata++;
+			v = *idata++;
+			a = params->alpha;
+
+			*odata++ = (h << format->hsv.hue.offset)
+				 | (s << format->hsv.saturation.offset)
+				 | (v << format->hsv.value.offset)
+				 | (a << format->hsv.alpha.offset);
+		}
+	}
+}
+
+/*
+ * The YUV writers process the YUV24 input in blocks of 16 pixels, extracting
+ * the luma and chroma components with vector shuffles and averaging
+ * horizontally adjacent chroma samples when subsampling. Lines ending in a
+ * partial block are completed with scalar code.
+ *
+ * For odd widths the chroma of the last pixel of a line is averaged with the
+ * first pixel of the next line, as the input is treated as a continuous
+ * stream. The last pixel of the image is averaged with itself.
+ */
+static const vec_u8x16 yuv_mask_y = {
+	0, 3, 6, 9, 12, 15, 18, 21, 24, 27, 30, 33, 36, 39, 42, 45
+};
+
+static const vec_u8x16 yuv_mask_c444[2] = {
+	{ 1, 4, 7, 10, 13, 16, 19, 22, 25, 28, 31, 34, 37, 40, 43, 46 },
+	{ 2, 5, 8, 11, 14, 17, 20, 23, 26, 29, 32, 35, 38, 41, 44, 47 },
+};
+
+/* Cb in lanes 0-7 and Cr in lanes 8-15, for even and odd pixels. */
+static const vec_u8x16 yuv_mask_c422[2] = {
+	{ 1, 7, 13, 19, 25, 31, 37, 43, 2, 8, 14, 20, 26, 32, 38, 44 },
+	{ 4, 10, 16, 22, 28, 34, 40, 46, 5, 11, 17, 23, 29, 35, 41, 47 },
+};
+
+/* Compute the horizontally subsampled chroma of 16 pixels. */
+static inline vec_u8x16 yuv_chroma_422(const vec_u8x16 in[3], bool average)
+{
+	vec_u8x16 even = vec_shuffle48(in, yuv_mask_c422[0]);
+
+	if (!average)
+		return even;
+
+	return vec_avg_u8(even, vec_shuffle48(in, yuv_mask_c422[1]));
+}
+
+static void image_format_yuv_packed(const struct image *input, struct image *output,
+				    const struct params *params)
+{
+	const struct format_info *format = output->format;
+	const uint8_t *idata = input->data;
+	const uint8_t *iend = input->data + input->size;
+	uint8_t *odata = output->data;
+	unsigned int y_offset = (format->yuv.order & YUV_YC) ? 0 : 1;
+	unsigned int c_offset = (format->yuv.order & YUV_CY) ? 0 : 1;
+	unsigned int u_offset = c_offset + ((format->yuv.order & YUV_YCrCb) ? 2 : 0);
+	unsigned int v_offset = c_offset + ((format->yuv.order & YUV_YCbCr) ? 2 : 0);
+	unsigned int stride = output->width * 2;
+	vec_u8x16 masks[2];
+	unsigned int i;
+	unsigned int x;
+	unsigned int y;
+
+	/* Interleave the Y (0-15), Cb (16-23) and Cr (24-31) lanes. */
+	for (i = 0; i < 32; ++i) {
+		unsigned int pair = i / 4;
+		unsigned int pos = i % 4;
+		uint8_t index;
+
+		if (pos == y_offset)
+			index = pair * 2;
+		else if (pos == y_offset + 2)
+			index = pair * 2 + 1;
+		else if (pos == u_offset)
+			index = 16 + pair;
+		else
+			index = 24 + pair;
+
+		masks[i / 16][i % 16] = index;
+	}
+
+	for (y = 0; y < output->height; ++y) {
+		for (x = 0; x + 16 <= output->width; x += 16) {
+			vec_u8x16 in[3];
+			vec_u8x16 out[2];
+			vec_u8x16 luma;
+			vec_u8x16 chroma;
+
+			memcpy(in, &idata[3*x], sizeof(in));
+
+			luma = vec_shuffle48(in, yuv_mask_y);
+			chroma = yuv_chroma_422(in, !params->no_chroma_average);
+
+			out[0] = __builtin_shuffle(luma, chroma, masks[0]);
+			out[1] = __builtin_shuffle(luma, chroma, masks[1]);
+			memcpy(&odata[2*x], out, sizeof(out));
+		}
+
+		for (; x < output->width; x += 2) {
+			const uint8_t *next = &idata[3*x + 3];
+			uint8_t pixel[4];
+
+			if (next >= iend)
+				next = &idata[3*x];
+
+			pixel[y_offset] = idata[3*x];
+			pixel[y_offset + 2] = next[0];
+
+			if (params->no_chroma_average) {
+				pixel[u_offset] = idata[3*x + 1];
+				pixel[v_offset] = idata[3*x + 2];
+			} else {
+				pixel[u_offset] = (idata[3*x + 1] + next[1]) / 2;
+				pixel[v_offset] = (idata[3*x + 2] + next[2]) / 2;
+			}
+
+			/* The second pixel of the pair may fall outside of the line. */
+			for (i = 0; i < 4 && 2*x + i < stride; ++i)
+				odata[2*x + i] = pixel[i];
+		}
+
+		odata += stride;
+		idata += input->width * 3;
+	}
+}
+
+static void yuv_planar_chroma_line(const uint8_t *idata, const uint8_t *iend,
+				   uint8_t *o_u, uint8_t *o_v, unsigned int width,
+				   unsigned int xsub, unsigned int c_stride,
+				   bool average)
+{
+	uint8_t *o_c = min(o_u, o_v);
+	bool cbcr = o_u < o_v;
+	unsigned int x = 0;
+
+	for (; x + 16 <= width; x += 16) {
+		vec_u8x16 in[3];
+		vec_u8x16 u, v;
+
+		memcpy(in, &idata[3*x], sizeof(in));
+
+		if (xsub == 1) {
+			u = vec_shuffle48(in, yuv_mask_c444[0]);
+			v = vec_shuffle48(in, yuv_mask_c444[1]);
+		} else {
+			u = yuv_chroma_422(in, average);
+			v = __builtin_shuffle(u, (vec_u8x16){ 8, 9, 10, 11, 12, 13, 14, 15 });
+		}
+
+		if (c_stride == 1) {
+			memcpy(&o_u[x/xsub], &u, 16 / xsub);
+			memcpy(&o_v[x/xsub], &v, 16 / xsub);
+		} else if (xsub == 1) {
+			static const vec_u8x16 lo = { 0, 16, 1, 17, 2, 18, 3, 19,
+						      4, 20, 5, 21, 6, 22, 7, 23 };
+			vec_u8x16 out[2];
+
+			if (!cbcr)
+				swap(u, v);
+
+			out[0] = __builtin_shuffle(u, v, lo);
+			out[1] = __builtin_shuffle(u, v, lo + 8);
+			memcpy(&o_c[2*x], out, sizeof(out));
+		} else {
+			static const vec_u8x16 cbcr_mask = {
+				0, 8, 1, 9, 2, 10, 3, 11, 4, 12, 5, 13, 6, 14, 7, 15
+			};
+			vec_u8x16 out;
+
+			out = __builtin_shuffle(u, cbcr ? cbcr_mask : cbcr_mask ^ 8);
+			memcpy(&o_c[x], &out, sizeof(out));
+		}
+	}
+
+	for (; x < width; x += xsub) {
+		const uint8_t *next = &idata[3*x + 3];
+		unsigned int offset = x * c_stride / xsub;
+		uint8_t u, v;
+
+		if (next >= iend)
+			next = &idata[3*x];
+
+		if (xsub == 1 || !average) {
+			u = idata[3*x + 1];
+			v = idata[3*x + 2];
+		} else {
+			u = (idata[3*x + 1] + next[1]) / 2;
+			v = (idata[3*x + 2] + next[2]) / 2;
+		}
+
+		/*
+		 * Semi-planar chroma lines are width bytes long, the second
+		 * component of the last pair of odd width lines doesn't fit.
+		 */
+		if (c_stride == 1 || o_u + offset < o_c + width * c_stride / xsub)
+			o_u[offset] = u;
+		if (c_stride == 1 || o_v + offset < o_c + width * c_stride / xsub)
+			o_v[offset] = v;
+	}
+}
+
+static void image_format_yuv_planar(const struct image *input, struct image *output,
+				    const struct params *params)
+{
+	const struct format_info *format = output->format;
+	const uint8_t *idata = input->data;
+	const uint8_t *iend = input->data + input->size;
+	uint8_t *o_y = output->data;
+	uint8_t *o_c = o_y + output->width * output->height;
+	uint8_t *o_u;
+	uint8_t *o_v;
+	unsigned int xsub = format->yuv.xsub;
+	unsigned int ysub = format->yuv.ysub;
+	unsigned int c_stride;
+	unsigned int x;
+	unsigned int y;
+
+	if (format->yuv.num_planes == 2) {
+		o_u = (format->yuv.order & YUV_YCbCr) ? o_c : o_c + 1;
+		o_v = (format->yuv.order & YUV_YCrCb) ? o_c : o_c + 1;
+		c_stride = 2;
+	} else {
+		unsigned int c_size = output->width * output->height
+				    / xsub / ysub;
+
+		o_u = (format->yuv.order & YUV_YCbCr) ? o_c : o_c + c_size;
+		o_v = (format->yuv.order & YUV_YCrCb) ? o_c : o_c + c_size;
+		c_stride = 1;
+	}
+
+	/*
+	 * Process luma and chroma in a single pass. Chroma is sampled from the
+	 * first line of every group of ysub lines.
+	 */
+	for (y = 0; y < output->height; ++y) {
+		for (x = 0; x + 16 <= output->width; x += 16) {
+			vec_u8x16 in[3];
+			vec_u8x16 luma;
+
+			memcpy(in, &idata[3*x], sizeof(in));
+			luma = vec_shuffle48(in, yuv_mask_y);
+			memcpy(&o_y[x], &luma, sizeof(luma));
+		}
+
+		for (; x < output->width; ++x)
+			o_y[x] = idata[3*x];
+
+		if (y % ysub == 0 && y / ysub < output->height / ysub) {
+			yuv_planar_chroma_line(idata, iend, o_u, o_v,
+					       output->width, xsub, c_stride,
+					       !params->no_chroma_average);
+
+			o_u += output->width * c_stride / xsub;
+			o_v += output->width * c_stride / xsub;
+		}
+
+		o_y += output->width;
+		idata += input->width * 3;
+	}
+}
+
+static void image_format_yuv_simd(const struct image *input,
+				  struct image *output,
+				  const struct params *params)
+{
+	if (output->format->yuv.num_planes == 1)
+		image_format_yuv_packed(input, output, params);
+	else
+		image_format_yuv_planar(input, output, params);
+}
+
+/*
+ * Reference implementation of the YUV writers, one pixel at a time. The next
+ * pixel used for chroma averaging is taken from the input stream, see above.
+ */
+static void image_format_yuv_scalar(const struct image *input,
+				    struct image *output,
+				    const struct params *params)
+{
+	const struct format_info *format = output->format;
+	const uint8_t *iend = input->data + input->size;
+	const uint8_t *idata = input->data;
+	uint8_t *odata = output->data;
+	unsigned int width = output->width;
+	unsigned int height = output->height;
+	unsigned int xsub = format->yuv.xsub;
+	unsigned int ysub = format->yuv.ysub;
+	unsigned int c_stride;
+	uint8_t *o_u;
+	uint8_t *o_v;
+	unsigned int x;
+	unsigned int y;
+
+	if (format->yuv.num_planes == 1) {
+		unsigned int y0 = (format->yuv.order & YUV_YC) ? 0 : 1;
+		unsigned int c0 = (format->yuv.order & YUV_CY) ? 0 : 1;
+		bool cbcr = format->yuv.order & YUV_YCbCr;
+
+		for (y = 0; y < height; ++y) {
+			for (x = 0; x < width; x += 2) {
+				const uint8_t *pixel = &idata[3 * (y * width + x)];
+				const uint8_t *next = pixel + 3;
+				uint8_t u, v;
+
+				if (next >= iend)
+					next = pixel;
+
+				if (params->no_chroma_average) {
+					u = pixel[1];
+					v = pixel[2];
+				} else {
+					u = (pixel[1] + next[1]) / 2;
+					v = (pixel[2] + next[2]) / 2;
+				}
+
+				odata[2*x + y0] = pixel[0];
+				odata[2*x + c0] = cbcr ? u : v;
+
+				/* The second pixel may fall outside of the line. */
+				if (x + 1 < width) {
+					odata[2*x + y0 + 2] = next[0];
+					odata[2*x + c0 + 2] = cbcr ? v : u;
+				}
+			}
+
+			odata += width * 2;
+		}
+
+		return;
+	}
+
+	for (y = 0; y < height; ++y) {
+		for (x = 0; x < width; ++x)
+			odata[y * width + x] = idata[3 * (y * width + x)];
+	}
+
+	odata += width * height;
+
+	if (format->yuv.num_planes == 2) {
+		o_u = (format->yuv.order & YUV_YCbCr) ? odata : odata + 1;
+		o_v = (format->yuv.order & YUV_YCrCb) ? odata : odata + 1;
+		c_stride = 2;
+	} else {
+		unsigned int c_size = width * height / xsub / ysub;
+
+		o_u = (format->yuv.order & YUV_YCbCr) ? odata : odata + c_size;
+		o_v = (format->yuv.order & YUV_YCrCb) ? odata : odata + c_size;
+		c_stride = 1;
+	}
+
+	for (y = 0; y < height / ysub; ++y) {
+		for (x = 0; x < width; x += xsub) {
+			const uint8_t *pixel = &idata[3 * (y * ysub * width + x)];
+			const uint8_t *next = pixel + 3;
+			unsigned int offset = y * (width * c_stride / xsub)
+					    + x * c_stride / xsub;
+			/* See yuv_planar_chroma_line() for odd widths. */
+			bool last = c_stride == 2 && xsub == 2 && x + 1 == width;
+			uint8_t u, v;
+
+			if (next >= iend)
+				next = pixel;
+
+			if (xsub == 1 || params->no_chroma_average) {
+				u = pixel[1];
+				v = pixel[2];
+			} else {
+				u = (pixel[1] + next[1]) / 2;
+				v = (pixel[2] + next[2]) / 2;
+			}
+
+			if (!last || o_u < o_v)
+				o_u[offset] = u;
+			if (!last || o_v < o_u)
+				o_v[offset] = v;
+		}
+	}
+}
+
+static const struct kernel_variant format_kernels[] = {
+	KERNEL_VARIANT("simd", image_format_yuv_simd),
+	KERNEL_VARIANT("scalar", image_format_yuv_scalar),
+};
+
+/*
+ * The chroma planes of odd-sized images are larger than the chroma lines
+ * written by the formatting kernels. Clear the remaining bytes to produce the
+ * same output regardless of the previous contents of the buffer.
+ */
+static void image_format_yuv_clear(struct image *output)
+{
+	const struct format_yuv_info *yuv = &output->format->yuv;
+	unsigned int width = output->width;
+	unsigned int height = output->height;
+	unsigned int offset = width * height;
+	unsigned int c_lines = height / yuv->ysub;
+	unsigned int c_stride;
+	unsigned int c_size;
+	unsigned int i;
+
+	if (yuv->num_planes == 1)
+		return;
+
+	if (yuv->num_planes == 2) {
+		c_stride = width * 2 / yuv->xsub;
+		c_size = output->size - offset;
+	} else {
+		c_stride = width / yuv->xsub;
+		c_size = width * height / yuv->xsub / yuv->ysub;
+	}
+
+	for (i = 1; i < yuv->num_planes; ++i) {
+		unsigned int size = i + 1 < yuv->num_planes
+				  ? c_size : output->size - offset;
+		unsigned int written = c_lines * c_stride;
+
+		if (written < size)
+			memset(output->data + offset + written, 0,
+			       size - written);
+
+		offset += size;
+	}
+}
+
+static void image_format_yuv(const struct image *input, struct image *output,
+			     const struct params *params)
+{
+	image_format_yuv_clear(output);
+
+	kernel_get(format_kernels, KERNEL_FORMAT, image_format_yuv_scalar)
+		(input, output, params);
+}
+
+/* -----------------------------------------------------------------------------
+ * Colorspace handling
+ *
+ * The code is inspired by the v4l2-tpg Linux kernel driver.
+ */
+
+static void colorspace_matrix(enum v4l2_ycbcr_encoding encoding,
+			      enum v4l2_quantization quantization,
+			      int (*matrix)[3][3])
+{
+/*
+ * The coefficients are expressed in units of 1/10000 and scaled with integer
+ * arithmetic, to avoid depending on the floating point evaluation of the
+ * compiler. The results are identical to (int)(0.5 + v * r * 256.0).
+ */
+#define COEFF(v, r) (((v) * (r) * 256 + 5000) / 10000)
+
+	static const int bt601[3][3] = {
+		{ COEFF(2990, 219),  COEFF(5870, 219),  COEFF(1140, 219) },
+		{ COEFF(-1690, 224), COEFF(-3310, 224), COEFF(5000, 224) },
+		{ COEFF(5000, 224),  COEFF(-4190, 224), COEFF(-810, 224) },
+	};
+	static const int bt601_full[3][3] = {
+		{ COEFF(2990, 255),  COEFF(5870, 255),  COEFF(1140, 255) },
+		{ COEFF(-1690, 255), COEFF(-3310, 255), COEFF(5000, 255) },
+		{ COEFF(5000, 255),  COEFF(-4190, 255), COEFF(-810, 255) },
+	};
+	static const int rec709[3][3] = {
+		{ COEFF(2126, 219),  COEFF(7152, 219),  COEFF(722, 219)  },
+		{ COEFF(-1146, 224), COEFF(-3854, 224), COEFF(5000, 224) },
+		{ COEFF(5000, 224),  COEFF(-4542, 224), COEFF(-458, 224) },
+	};
+	static const int rec709_full[3][3] = {
+		{ COEFF(2126, 255),  COEFF(7152, 255),  COEFF(722, 255)  },
+		{ COEFF(-1146, 255), COEFF(-3854, 255), COEFF(5000, 255) },
+		{ COEFF(5000, 255),  COEFF(-4542, 255), COEFF(-458, 255) },
+	};
+	static const int smpte240m[3][3] = {
+		{ COEFF(2120, 219),  COEFF(7010, 219),  COEFF(870, 219)  },
+		{ COEFF(-1160, 224), COEFF(-3840, 224), COEFF(5000, 224) },
+		{ COEFF(5000, 224),  COEFF(-4450, 224), COEFF(-550, 224) },
+	};
+	static const int smpte240m_full[3][3] = {
+		{ COEFF(2120, 255),  COEFF(7010, 255),  COEFF(870, 255)  },
+		{ COEFF(-1160, 255), COEFF(-3840, 255), COEFF(5000, 255) },
+		{ COEFF(5000, 255),  COEFF(-4450, 255), COEFF(-550, 255) },
+	};
+	static const int bt2020[3][3] = {
+		{ COEFF(2627, 219),  COEFF(6780, 219),  COEFF(593, 219)  },
+		{ COEFF(-1396, 224), COEFF(-3604, 224), COEFF(5000, 224) },
+		{ COEFF(5000, 224),  COEFF(-4598, 224), COEFF(-402, 224) },
+	};
+	static const int bt2020_full[3][3] = {
+		{ COEFF(2627, 255),  COEFF(6780, 255),  COEFF(593, 255)  },
+		{ COEFF(-1396, 255), COEFF(-3604, 255), COEFF(5000, 255) },
+		{ COEFF(5000, 255),  COEFF(-4698, 255), COEFF(-402, 255) },
+	};
+
+	bool full = quantization == V4L2_QUANTIZATION_FULL_RANGE;
+	unsigned int i;
+	const int (*m)[3][3];
+
+	switch (encoding) {
+	case V4L2_YCBCR_ENC_601:
+	default:
+		m = full ? &bt601_full : &bt601;
+		break;
+	case V4L2_YCBCR_ENC_709:
+		m = full ? &rec709_full : &rec709;
+		break;
+	case V4L2_YCBCR_ENC_BT2020:
+		m = full ? &bt2020_full : &bt2020;
+		break;
+	case V4L2_YCBCR_ENC_SMPTE240M:
+		m = full ? &smpte240m_full : &smpte240m;
+		break;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(*m); ++i)
+		memcpy((*matrix)[i], (*m)[i], sizeof((*m)[i]));
+}
+
+static void colorspace_rgb2ycbcr(int m[3][3],
+				 enum v4l2_quantization quantization,
+				 const uint8_t rgb[3], uint8_t ycbcr[3])
+{
+	bool full = quantization == V4L2_QUANTIZATION_FULL_RANGE;
+	unsigned int y_offset = full ? 0 : 16;
+	int r, g, b;
+	int y, cb, cr;
+	int div;
+
+	r = rgb[0] << 4;
+	g = rgb[1] << 4;
+	b = rgb[2] << 4;
+
+	div = (1 << (8 + 4)) * 255;
+	y  = (m[0][0] * r + m[0][1] * g + m[0][2] * b + y_offset * div) / div;
+	cb = (m[1][0] * r + m[1][1] * g + m[1][2] * b + 128 * div) / div;
+	cr = (m[2][0] * r + m[2][1] * g + m[2][2] * b + 128 * div) / div;
+
+	ycbcr[0] = y;
+	ycbcr[1] = cb;
+	ycbcr[2] = cr;
+}
+
+/*
+ * The vectorized conversion precomputes the matrix coefficients premultiplied by
+ * the 4-bit input shift of colorspace_rgb2ycbcr() and the offsets premultiplied
+ * by the divisor. The division by (1 << 12) * 255 is split into a shift and a
+ * reciprocal multiplication by 255, exact for all dividends up to 16 bits. C
+ * integer division rounds towards zero, so negative values (only produced by the
+ * BT.2020 full range matrix) are divided as magnitudes.
+ */
+struct colorspace_kernel {
+	int matrix[3][3];
+	int coeffs[3][3];
+	int offsets[3];
+};
+
+static void colorspace_kernel_init(struct colorspace_kernel *kernel,
+				   const struct params *params)
+{
+	bool full = params->quantization == V4L2_QUANTIZATION_FULL_RANGE;
+	int div = (1 << (8 + 4)) * 255;
+	unsigned int i, j;
+
+	colorspace_matrix(params->encoding, params->quantization,
+			  &kernel->matrix);
+
+	for (i = 0; i < 3; ++i) {
+		for (j = 0; j < 3; ++j)
+			kernel->coeffs[i][j] = kernel->matrix[i][j] * 16;
+	}
+
+	kernel->offsets[0] = (full ? 0 : 16) * div;
+	kernel->offsets[1] = 128 * div;
+	kernel->offsets[2] = 128 * div;
+}
+
+static inline void colorspace_div(vec_s32 *n)
+{
+	vec_s32 sign = *n >> 31;
+	vec_u32 q;
+
+	q = (vec_u32)(((*n ^ sign) - sign) >> 12);
+	q = (q * 0x8081) >> 23;
+
+	*n = ((vec_s32)q ^ sign) - sign;
+}
+
+static void colorspace_rgb2ycbcr_vec(const struct colorspace_kernel *kernel,
+				     const uint8_t *rgb, vec_s32 ycbcr[3])
+{
+	vec_s32 r = { }, g = { }, b = { };
+	unsigned int i;
+
+	for (i = 0; i < VEC_LANES; ++i) {
+		r[i] = rgb[3*i];
+		g[i] = rgb[3*i + 1];
+		b[i] = rgb[3*i + 2];
+	}
+
+	for (i = 0; i < 3; ++i) {
+		ycbcr[i] = kernel->coeffs[i][0] * r + kernel->coeffs[i][1] * g
+			 + kernel->coeffs[i][2] * b + kernel->offsets[i];
+		colorspace_div(&ycbcr[i]);
+	}
+}
+
+/*
+ * Convert the image VEC_LANES pixels at a time. When the chroma is horizontally
+ * subsampled the chroma of odd pixels is replaced by the average of their two
+ * neighbours, except for the last pixel of the line. This is folded in the
+ * conversion: odd pixels inside a block are averaged with vector shuffles, and
+ * the last odd pixel of each block is fixed up when the next even pixel is
+ * computed.
+ */
+static void image_colorspace_rgb_to_yuv_simd(const struct image *input,
+					     struct image *output,
+					     const struct format_info *format,
+					     const struct params *params)
+{
+	static const vec_s32 prev_idx = {
+		0, 0, 2, 2, 4, 4, 6, 6, 8, 8, 10, 10, 12, 12, 14, 14
+	};
+	static const vec_s32 next_idx = {
+		0, 2, 2, 4, 4, 6, 6, 8, 8, 10, 10, 12, 12, 14, 14, 15
+	};
+	static const vec_s32 odd_mask = {
+		0, -1, 0, -1, 0, -1, 0, -1, 0, -1, 0, -1, 0, -1, 0, 0
+	};
+	struct colorspace_kernel kernel;
+	bool average = format->yuv.xsub == 2;
+	const uint8_t *idata = input->data;
+	uint8_t *odata = output->data;
+	unsigned int width = output->width;
+	unsigned int x;
+	unsigned int y;
+	unsigned int i;
+
+	colorspace_kernel_init(&kernel, params);
+
+	for (y = 0; y < output->height; ++y) {
+		for (x = 0; x + VEC_LANES <= width; x += VEC_LANES) {
+			vec_s32 ycbcr[3];
+
+			colorspace_rgb2ycbcr_vec(&kernel, &idata[3*x], ycbcr);
+
+			if (average) {
+				for (i = 1; i < 3; ++i) {
+					vec_s32 avg;
+
+					/* Average the 8-bit stored values. */
+					ycbcr[i] &= 0xff;
+					avg = (__builtin_shuffle(ycbcr[i], prev_idx)
+					    + __builtin_shuffle(ycbcr[i], next_idx)) >> 1;
+					ycbcr[i] = (avg & odd_mask) | (ycbcr[i] & ~odd_mask);
+				}
+			}
+
+			for (i = 0; i < VEC_LANES; ++i) {
+				odata[3*(x+i)] = ycbcr[0][i];
+				odata[3*(x+i) + 1] = ycbcr[1][i];
+				odata[3*(x+i) + 2] = ycbcr[2][i];
+			}
+
+			if (average && x) {
+				odata[3*x - 2] = (odata[3*x - 5] + odata[3*x + 1]) / 2;
+				odata[3*x - 1] = (odata[3*x - 4] + odata[3*x + 2]) / 2;
+			}
+		}
+
+		for (; x < width; ++x) {
+			colorspace_rgb2ycbcr(kernel.matrix, params->quantization,
+					     &idata[3*x], &odata[3*x]);
+
+			if (average && x && !(x & 1)) {
+				odata[3*x - 2] = (odata[3*x - 5] + odata[3*x + 1]) / 2;
+				odata[3*x - 1] = (odata[3*x - 4] + odata[3*x + 2]) / 2;
+			}
+		}
+
+		idata += 3 * width;
+		odata += 3 * width;
+	}
+}
+
+static void image_colorspace_rgb_to_yuv_scalar(const struct image *input,
+					       struct image *output,
+					       const struct format_info *format,
+					       const struct params *params)
+{
+	int matrix[3][3];
+	const uint8_t *idata = input->data;
+	uint8_t *odata = output->data;
+	unsigned int x;
+	unsigned int y;
+
+	colorspace_matrix(params->encoding, params->quantization, &matrix);
+
+	for (y = 0; y < output->height; ++y) {
+		for (x = 0; x < output->width; ++x) {
+			colorspace_rgb2ycbcr(matrix, params->quantization,
+					     &idata[3*x], &odata[3*x]);
+		}
+		if (format->yuv.xsub == 2) {
+			for (x = 1; x + 1 < output->width; x += 2) {
+				odata[3*x + 1] = (odata[3*(x-1) + 1] + odata[3*(x+1) + 1]) / 2;
+				odata[3*x + 2] = (odata[3*(x-1) + 2] + odata[3*(x+1) + 2]) / 2;
+			}
+		}
+		idata += 3 * output->width;
+		odata += 3 * output->width;
+	}
+}
+
+static const struct kernel_variant colorspace_kernels[] = {
+	KERNEL_VARIANT("simd", image_colorspace_rgb_to_yuv_simd),
+	KERNEL_VARIANT("scalar", image_colorspace_rgb_to_yuv_scalar),
+};
+
+static void image_colorspace_rgb_to_yuv(const struct image *input,
+					struct image *output,
+					const struct format_info *format,
+					const struct params *params)
+{
+	kernel_get(colorspace_kernels, KERNEL_COLORSPACE,
+		   image_colorspace_rgb_to_yuv_scalar)(input, output, format,
+						       params);
+}
+
+static void image_convert_rgb_to_rgb(const struct image *input,
+				     struct image *output,
+				     const struct format_info *format)
+{
+	const uint8_t *idata = input->data;
+	uint8_t *odata = output->data;
+	unsigned int x;
+	unsigned int y;
+	uint8_t r, g, b;
+
+	for (y = 0; y < output->height; ++y) {
+		for (x = 0; x < output->width; ++x) {
+			r = *idata++ & (0xff << (8 - format->rgb.red.length));
+			g = *idata++ & (0xff << (8 - format->rgb.green.length));
+			b = *idata++ & (0xff << (8 - format->rgb.blue.length));
+			*odata++ = r;
+			*odata++ = g;
+			*odata++ = b;
+		}
+	}
+}
+
+/* -----------------------------------------------------------------------------
+ * RGB to HSV conversion (as performed by the Renesas VSP HST)
+ */
+
+#define K 4
+static uint8_t hst_calc_h(uint8_t r, uint8_t g, uint8_t b)
+{
+	uint8_t max, min;
+	int delta;
+	int diff;
+	unsigned int third;
+	int aux;
+
+	max = max(r, max(g, b));
+	min = min(r, min(g, b));
+	delta = max - min;
+
+	if (!delta)
+		return 0;
+
+	if (max == r) {
+		diff = g - b;
+		third = 0;
+	} else if (max == g) {
+		diff = b - r;
+		third = 256 * K;
+	} else {
+		diff = r - g;
+		third = 512 * K;
+	}
+
+	aux = diff;
+	aux *= 128;
+	aux *= K;
+
+	/* Round up */
+	if (aux >= 0)
+		aux += delta - 1;
+	else
+		aux -= delta - 1;
+
+	aux /= delta;
+	aux += third;
+
+	if (diff < 0 && third)
+		aux--;
+
+	/*
+	 * Divide by three and remove K scaling
+	 */
+	if (aux > 0)
+		aux += (3 * K)/2;
+	else
+		aux -= (3 * K)/2;
+	aux /= 3 * K;
+
+	aux &= 0xff;
+
+	return  aux;
+}
+
+static uint8_t hst_calc_s(uint8_t r8, uint8_t g8, uint8_t b8)
+{
+	uint8_t max, min, delta;
+	unsigned int s;
+
+	max = max(r8, max(g8, b8));
+	min = min(r8, min(g8, b8));
+
+	delta = max - min;
+	if (!delta)
+		return 0;
+
+	s = delta * 255;
+
+	/* Special rounding,
+	 *
+	 * If the minimum RGB component is less then 128 the calculated
+	 * S value should be rounded half down else half should be
+	 * rounded up.
+	 */
+	if (min < 128)
+		return (s * 2 + max - 1) / max / 2;
+	else
+		return (s * 2 + max) / max / 2;
+}
+
+static uint8_t hst_calc_v(uint8_t r, uint8_t g, uint8_t b)
+{
+	return max(r, max(g, b));
+}
+
+static void hst_rgb_to_hsv(const uint8_t rgb[3], uint8_t hsv[3])
+{
+	hsv[0] = hst_calc_h(rgb[0], rgb[1], rgb[2]);
+	hsv[1] = hst_calc_s(rgb[0], rgb[1], rgb[2]);
+	hsv[2] = hst_calc_v(rgb[0], rgb[1], rgb[2]);
+}
+
+/*
+ * The vectorized conversion replaces the divisions by delta and max with
+ * multiplications by 31-bit fixed point reciprocals looked up from 256-entry
+ * tables, exact for all dividends lower than 2^17. The maximum component
+ * selection and the rounding steps use masks instead of branches.
+ */
+static uint32_t hst_recip_delta[256];
+static uint32_t hst_recip_max[256];
+static pthread_once_t hst_tables_once = PTHREAD_ONCE_INIT;
+
+static void hst_compute_tables(void)
+{
+	unsigned int i;
+
+	for (i = 1; i < 256; ++i) {
+		hst_recip_delta[i] = div_round_up(1ULL << 31, i);
+		hst_recip_max[i] = div_round_up(1ULL << 30, i);
+	}
+}
+
+/* The tables are used by the parallel HGT slices, initialize them once. */
+static void hst_init_tables(void)
+{
+	pthread_once(&hst_tables_once, hst_compute_tables);
+}
+
+static inline void hst_mul_recip(vec_s32 *n, const vec_u32 *recip)
+{
+	vec_u64 p;
+
+	p = __builtin_convertvector((vec_u32)*n, vec_u64)
+	  * __builtin_convertvector(*recip, vec_u64);
+	*n = (vec_s32)__builtin_convertvector(p >> 31, vec_u32);
+}
+
+static void hst_rgb_to_hsv_vec(const uint8_t *rgb, uint8_t *hsv)
+{
+	vec_s32 r, g, b;
+	vec_s32 vmax, vmin, delta, zero;
+	vec_s32 is_r, is_g;
+	vec_s32 diff, third, neg, aux, pos;
+	vec_s32 h, s;
+	vec_u32 recip_delta, recip_max;
+	unsigned int i;
+
+	for (i = 0; i < VEC_LANES; ++i) {
+		r[i] = rgb[3*i];
+		g[i] = rgb[3*i + 1];
+		b[i] = rgb[3*i + 2];
+	}
+
+	vmax = vec_max(r, vec_max(g, b));
+	vmin = vec_min(r, vec_min(g, b));
+	delta = vmax - vmin;
+	zero = delta == 0;
+
+	for (i = 0; i < VEC_LANES; ++i) {
+		recip_delta[i] = hst_recip_delta[delta[i]];
+		recip_max[i] = hst_recip_max[vmax[i]];
+	}
+
+	/* Hue, see hst_calc_h() */
+	is_r = vmax == r;
+	is_g = ~is_r & (vmax == g);
+
+	diff = vec_select(is_r, g - b, vec_select(is_g, b - r, r - g));
+	third = ~is_r & vec_select(is_g, 256 * K, 512 * K);
+	neg = diff >> 31;
+
+	aux = ((diff ^ neg) - neg) * 128 * K + delta - 1;
+	hst_mul_recip(&aux, &recip_delta);
+	aux = ((aux ^ neg) - neg) + third + (neg & (third != 0));
+
+	pos = aux > 0;
+	h = (vec_s32)(((vec_u32)(vec_select(pos, aux, -aux) + (3 * K) / 2)
+		      * 0xaaab) >> 19);
+	h = vec_select(pos, h, -h) & 0xff & ~zero;
+
+	/* Saturation, see hst_calc_s() */
+	s = delta * 255 * 2 + vmax - 1 + ((vmin >= 128) & 1);
+	hst_mul_recip(&s, &recip_max);
+	s &= ~zero;
+
+	for (i = 0; i < VEC_LANES; ++i) {
+		hsv[3*i] = h[i];
+		hsv[3*i + 1] = s[i];
+		hsv[3*i + 2] = vmax[i];
+	}
+}
+
+static void hst_convert(const uint8_t *rgb, uint8_t *hsv, unsigned int count)
+{
+	uint8_t buffer[2][3 * VEC_LANES];
+
+	hst_init_tables();
+
+	for (; count >= VEC_LANES; count -= VEC_LANES) {
+		hst_rgb_to_hsv_vec(rgb, hsv);
+		rgb += 3 * VEC_LANES;
+		hsv += 3 * VEC_LANES;
+	}
+
+	if (!count)
+		return;
+
+	memset(buffer[0], 0, sizeof(buffer[0]));
+	memcpy(buffer[0], rgb, count * 3);
+	hst_rgb_to_hsv_vec(buffer[0], buffer[1]);
+	memcpy(hsv, buffer[1], count * 3);
+}
+
+static void image_rgb_to_hsv_simd(const struct image *input,
+				  struct image *output,
+				  const struct params *params)
+{
+	hst_convert(input->data, output->data, output->width * output->height);
+}
+
+static void image_rgb_to_hsv_scalar(const struct image *input,
+				    struct image *output,
+				    const struct params *params)
+{
+	const uint8_t *idata = input->data;
+	uint8_t *odata = output->data;
+	unsigned int i;
+
+	for (i = 0; i < output->width * output->height; ++i) {
+		hst_rgb_to_hsv(idata, odata);
+		idata += 3;
+		odata += 3;
+	}
+}
+
+static const struct kernel_variant hst_kernels[] = {
+	KERNEL_VARIANT("simd", image_rgb_to_hsv_simd),
+	KERNEL_VARIANT("scalar", image_rgb_to_hsv_scalar),
+};
+
+static void image_rgb_to_hsv(const struct image *input,
+			     struct image *output,
+			     const struct params *params)
+{
+	kernel_get(hst_kernels, KERNEL_HST, image_rgb_to_hsv_scalar)
+		(input, output, params);
+}
+
+static int image_format(const struct image *input, struct image *output,
+			const struct params *params)
+{
+	int ret = 0;
+
+	switch (output->format->type) {
+	case FORMAT_RGB:
+		switch (output->format->rgb.bpp) {
+		case 8:
+			image_format_rgb8(input, output, params);
+			break;
+		case 16:
+			image_format_rgb16(input, output, params);
+			break;
+		case 24:
+			image_format_rgb24(input, output, params);
+			break;
+		case 32:
+			image_format_rgb32(input, output, params);
+			break;
+		default:
+			ret = -EINVAL;
+			break;
+		}
+		break;
+
+	case FORMAT_HSV:
+		switch (output->format->hsv.bpp) {
+		case 24:
+			image_format_hsv24(input, output, params);
+			break;
+		case 32:
+			image_format_hsv32(input, output, params);
+			break;
+		default:
+			ret = -EINVAL;
+			break;
+		}
+		break;
+
+	case FORMAT_YUV:
+		switch (output->format->yuv.num_planes) {
+		case 1:
+		case 2:
+		case 3:
+			image_format_yuv(input, output, params);
+			break;
+		default:
+			ret = -EINVAL;
+			break;
+		}
+		break;
+	}
+
+	return ret;
+}
+
+/* -----------------------------------------------------------------------------
+ * Image scaling
+ */
+
+/*
+ * The bilinear scaler is separable. Each source line is first scaled
+ * horizontally, and the two horizontally scaled lines surrounding each output
+ * line are then blended vertically. Lines are kept in a two entries ring buffer
+ * to be reused by consecutive output lines.
+ *
+ * The source coordinates and interpolation ratios only depend on the input and
+ * output sizes. They are computed once per size pair in a scale map, and cached
+ * for reuse by the horizontal and vertical passes and by further images. The
+ * cache is shared by all threads. Maps are reference-counted, as a map evicted
+ * from the cache can still be used by other scaling operations.
+ *
+ * The default implementation keeps double precision arithmetic evaluated in the
+ * same order as the original per-pixel interpolation, as the rounding errors
+ * are visible in the truncated output. The fixed point implementation uses
+ * 8-bit interpolation weights, and isn't bit-exact with the double precision
+ * implementation.
+ *
+ * The exact implementation, used in strict mode, expresses the ratios as
+ * fractions of (out - 1) and interpolates with integer arithmetic. Its output
+ * is the truncated exact interpolation, which the double precision
+ * implementation only misses when a rounding error crosses an integer, and
+ * doesn't depend on the host floating point implementation.
+ *
+ * The scalar implementations interpolate each output pixel directly from the
+ * four surrounding source pixels with the same arithmetic, and serve as the
+ * reference for the scale map implementations.
+ */
+struct scale_map {
+	unsigned int in;
+	unsigned int out;
+	unsigned int *index;
+	double *ratio;
+	double *inv_ratio;
+	uint16_t *weight;
+	unsigned int *exact_index;
+	unsigned int *frac;
+	unsigned int refcount;
+};
+
+#define SCALE_MAP_CACHE_SIZE	4
+
+static pthread_mutex_t scale_map_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct scale_map *scale_map_cache[SCALE_MAP_CACHE_SIZE];
+static unsigned int scale_map_cache_next;
+
+static void scale_map_delete(struct scale_map *map)
+{
+	if (!map)
+		return;
+
+	free(map->index);
+	free(map->ratio);
+	free(map->inv_ratio);
+	free(map->weight);
+	free(map->exact_index);
+	free(map->frac);
+	free(map);
+}
+
+/* Release a reference to a map, the caller must hold scale_map_lock. */
+static void __scale_map_put(struct scale_map *map)
+{
+	if (map && --map->refcount == 0)
+		scale_map_delete(map);
+}
+
+static void scale_map_put(struct scale_map *map)
+{
+	pthread_mutex_lock(&scale_map_lock);
+	__scale_map_put(map);
+	pthread_mutex_unlock(&scale_map_lock);
+}
+
+/*
+ * Return a reference to the map for a size pair, computing and caching it if
+ * needed. The reference must be released with scale_map_put().
+ */
+static struct scale_map *scale_map_get(unsigned int in, unsigned int out)
+{
+	struct scale_map *map;
+	unsigned int i;
+
+	pthread_mutex_lock(&scale_map_lock);
+
+	for (i = 0; i < SCALE_MAP_CACHE_SIZE; ++i) {
+		map = scale_map_cache[i];
+		if (map && map->in == in && map->out == out) {
+			map->refcount++;
+			pthread_mutex_unlock(&scale_map_lock);
+			return map;
+		}
+	}
+
+	pthread_mutex_unlock(&scale_map_lock);
+
+	map = calloc(1, sizeof(*map));
+	if (!map)
+		return NULL;
+
+	map->in = in;
+	map->out = out;
+	map->index = malloc(out * sizeof(*map->index));
+	map->ratio = malloc(out * sizeof(*map->ratio));
+	map->inv_ratio = malloc(out * sizeof(*map->inv_ratio));
+	map->weight = malloc(out * sizeof(*map->weight));
+	map->exact_index = malloc(out * sizeof(*map->exact_index));
+	map->frac = malloc(out * sizeof(*map->frac));
+	if (!map->index || !map->ratio || !map->inv_ratio || !map->weight ||
+	    !map->exact_index || !map->frac) {
+		scale_map_delete(map);
+		return NULL;
+	}
+
+	for (i = 0; i < out; ++i) {
+		double input = (double)i / (out - 1) * (in - 1);
+		unsigned int index = floor(input);
+
+		map->index[i] = index;
+		map->ratio[i] = input - index;
+		map->inv_ratio[i] = 1 - map->ratio[i];
+		map->weight[i] = round(map->ratio[i] * 256);
+		map->exact_index[i] = (uint64_t)i * (in - 1) / (out - 1);
+		map->frac[i] = (uint64_t)i * (in - 1) % (out - 1);
+	}
+
+	/* One reference for the cache and one for the caller. */
+	map->refcount = 2;
+
+	pthread_mutex_lock(&scale_map_lock);
+	__scale_map_put(scale_map_cache[scale_map_cache_next]);
+	scale_map_cache[scale_map_cache_next] = map;
+	scale_map_cache_next = (scale_map_cache_next + 1) % SCALE_MAP_CACHE_SIZE;
+	pthread_mutex_unlock(&scale_map_lock);
+
+	return map;
+}
+
+/*
+ * Source pixels past the last line or column are only referenced with a zero
+ * ratio, clamp the coordinates to avoid reading them.
+ */
+static inline unsigned int scale_next(const struct scale_map *map,
+				      unsigned int index)
+{
+	return index + 1 < map->in ? index + 1 : index;
+}
+
+static void scale_line_h(const struct scale_map *map, const uint8_t *src,
+			 double *dst)
+{
+	unsigned int u;
+
+	for (u = 0; u < map->out; ++u) {
+		const uint8_t *c0 = &src[map->index[u] * 3];
+		const uint8_t *c1 = &src[scale_next(map, map->index[u]) * 3];
+
+		dst[0] = c0[0] * map->inv_ratio[u] + c1[0] * map->ratio[u];
+		dst[1] = c0[1] * map->inv_ratio[u] + c1[1] * map->ratio[u];
+		dst[2] = c0[2] * map->inv_ratio[u] + c1[2] * map->ratio[u];
+		dst += 3;
+	}
+}
+
+static void scale_line_h_fixed(const struct scale_map *map, const uint8_t *src,
+			       uint16_t *dst)
+{
+	unsigned int u;
+
+	for (u = 0; u < map->out; ++u) {
+		const uint8_t *c0 = &src[map->index[u] * 3];
+		const uint8_t *c1 = &src[scale_next(map, map->index[u]) * 3];
+		unsigned int w = map->weight[u];
+
+		dst[0] = c0[0] * (256 - w) + c1[0] * w;
+		dst[1] = c0[1] * (256 - w) + c1[1] * w;
+		dst[2] = c0[2] * (256 - w) + c1[2] * w;
+		dst += 3;
+	}
+}
+
+static int image_scale_bilinear(const struct image *input, struct image *output)
+{
+	struct scale_map *hmap;
+	struct scale_map *vmap;
+	const uint8_t *idata = input->data;
+	uint8_t *odata = output->data;
+	unsigned int stride = output->width * 3;
+	unsigned int line_y = UINT_MAX;
+	double *lines[2];
+	unsigned int i, v;
+	int ret = 0;
+
+	hmap = scale_map_get(input->width, output->width);
+	vmap = scale_map_get(input->height, output->height);
+	lines[0] = malloc(stride * sizeof(**lines));
+	lines[1] = malloc(stride * sizeof(**lines));
+	if (!hmap || !vmap || !lines[0] || !lines[1]) {
+		ret = -ENOMEM;
+		goto done;
+	}
+
+	for (v = 0; v < output->height; ++v) {
+		unsigned int y = vmap->index[v];
+		double ratio = vmap->ratio[v];
+		double inv_ratio = vmap->inv_ratio[v];
+
+		if (y != line_y) {
+			if (line_y != UINT_MAX && y == line_y + 1)
+				swap(lines[0], lines[1]);
+			else
+				scale_line_h(hmap, idata + y * input->width * 3,
+					     lines[0]);
+
+			scale_line_h(hmap, idata + scale_next(vmap, y) * input->width * 3,
+				     lines[1]);
+			line_y = y;
+		}
+
+		for (i = 0; i < stride; ++i)
+			odata[i] = lines[0][i] * inv_ratio + lines[1][i] * ratio;
+
+		odata += stride;
+	}
+
+done:
+	free(lines[0]);
+	free(lines[1]);
+	scale_map_put(hmap);
+	scale_map_put(vmap);
+	return ret;
+}
+
+static int image_scale_bilinear_fixed(const struct image *input,
+				      struct image *output)
+{
+	struct scale_map *hmap;
+	struct scale_map *vmap;
+	const uint8_t *idata = input->data;
+	uint8_t *odata = output->data;
+	unsigned int stride = output->width * 3;
+	unsigned int line_y = UINT_MAX;
+	uint16_t *lines[2];
+	unsigned int i, v;
+	int ret = 0;
+
+	hmap = scale_map_get(input->width, output->width);
+	vmap = scale_map_get(input->height, output->height);
+	lines[0] = malloc(stride * sizeof(**lines));
+	lines[1] = malloc(stride * sizeof(**lines));
+	if (!hmap || !vmap || !lines[0] || !lines[1]) {
+		ret = -ENOMEM;
+		goto done;
+	}
+
+	for (v = 0; v < output->height; ++v) {
+		unsigned int y = vmap->index[v];
+		uint32_t w = vmap->weight[v];
+
+		if (y != line_y) {
+			if (line_y != UINT_MAX && y == line_y + 1)
+				swap(lines[0], lines[1]);
+			else
+				scale_line_h_fixed(hmap, idata + y * input->width * 3,
+						   lines[0]);
+
+			scale_line_h_fixed(hmap, idata + scale_next(vmap, y) * input->width * 3,
+					   lines[1]);
+			line_y = y;
+		}
+
+		for (i = 0; i < stride; ++i)
+			odata[i] = (lines[0][i] * (256 - w) + lines[1][i] * w) >> 16;
+
+		odata += stride;
+	}
+
+done:
+	free(lines[0]);
+	free(lines[1]);
+	scale_map_put(hmap);
+	scale_map_put(vmap);
+	return ret;
+}
+
+static void scale_line_h_exact(const struct scale_map *map, const uint8_t *src,
+			       uint32_t *dst)
+{
+	unsigned int den = map->out - 1;
+	unsigned int u;
+
+	for (u = 0; u < map->out; ++u) {
+		const uint8_t *c0 = &src[map->exact_index[u] * 3];
+		const uint8_t *c1 = &src[scale_next(map, map->exact_index[u]) * 3];
+		uint32_t f = map->frac[u];
+
+		dst[0] = c0[0] * (den - f) + c1[0] * f;
+		dst[1] = c0[1] * (den - f) + c1[1] * f;
+		dst[2] = c0[2] * (den - f) + c1[2] * f;
+		dst += 3;
+	}
+}
+
+static int image_scale_bilinear_exact(const struct image *input,
+				      struct image *output)
+{
+	struct scale_map *hmap;
+	struct scale_map *vmap;
+	const uint8_t *idata = input->data;
+	uint8_t *odata = output->data;
+	unsigned int stride = output->width * 3;
+	unsigned int line_y = UINT_MAX;
+	uint32_t *lines[2];
+	uint64_t recip = 0;
+	uint64_t div;
+	unsigned int shift = 0;
+	unsigned int den;
+	unsigned int i, v;
+	int ret = 0;
+
+	hmap = scale_map_get(input->width, output->width);
+	vmap = scale_map_get(input->height, output->height);
+	lines[0] = malloc(stride * sizeof(**lines));
+	lines[1] = malloc(stride * sizeof(**lines));
+	if (!hmap || !vmap || !lines[0] || !lines[1]) {
+		ret = -ENOMEM;
+		goto done;
+	}
+
+	/*
+	 * The interpolated values are lower than 256 * div. For divisors up to
+	 * 2^24, divide them by multiplying with a reciprocal rounded up, exact
+	 * when 2^shift >= 256 * div^2, without overflowing 64 bits.
+	 */
+	den = vmap->out - 1;
+	div = (uint64_t)(hmap->out - 1) * den;
+
+	if (div <= 1 << 24) {
+		while ((1ULL << shift) < 256 * div * div)
+			shift++;
+		recip = ((1ULL << shift) + div - 1) / div;
+	}
+
+	for (v = 0; v < output->height; ++v) {
+		unsigned int y = vmap->exact_index[v];
+		uint64_t f = vmap->frac[v];
+
+		if (y != line_y) {
+			if (line_y != UINT_MAX && y == line_y + 1)
+				swap(lines[0], lines[1]);
+			else
+				scale_line_h_exact(hmap, idata + y * input->width * 3,
+						   lines[0]);
+
+			scale_line_h_exact(hmap, idata + scale_next(vmap, y) * input->width * 3,
+					   lines[1]);
+			line_y = y;
+		}
+
+		if (recip) {
+			for (i = 0; i < stride; ++i)
+				odata[i] = (lines[0][i] * (den - f)
+					 + lines[1][i] * f) * recip >> shift;
+		} else {
+			for (i = 0; i < stride; ++i)
+				odata[i] = (lines[0][i] * (den - f)
+					 + lines[1][i] * f) / div;
+		}
+
+		odata += stride;
+	}
+
+done:
+	free(lines[0]);
+	free(lines[1]);
+	scale_map_put(hmap);
+	scale_map_put(vmap);
+	return ret;
+}
+
+static int image_scale_map(const struct image *input, struct image *output,
+			   const struct params *params)
+{
+	if (params->strict)
+		return image_scale_bilinear_exact(input, output);
+	else if (params->fixed_point)
+		return image_scale_bilinear_fixed(input, output);
+	else
+		return image_scale_bilinear(input, output);
+}
+
+static void image_scale_pixel(const struct image *input, struct image *output)
+{
+	unsigned int istride = input->width * 3;
+	uint8_t *odata = output->data;
+	unsigned int u, v, i;
+
+	for (v = 0; v < output->height; ++v) {
+		double v_input = (double)v / (output->height - 1) * (input->height - 1);
+		unsigned int y = floor(v_input);
+		double v_ratio = v_input - y;
+		const uint8_t *l0 = input->data + y * istride;
+		const uint8_t *l1 = y + 1 < input->height ? l0 + istride : l0;
+
+		for (u = 0; u < output->width; ++u) {
+			double u_input = (double)u / (output->width - 1) * (input->width - 1);
+			unsigned int x = floor(u_input);
+			double u_ratio = u_input - x;
+			unsigned int x0 = x * 3;
+			unsigned int x1 = x + 1 < input->width ? x0 + 3 : x0;
+
+			for (i = 0; i < 3; ++i)
+				*odata++ = (l0[x0+i] * (1 - u_ratio) + l0[x1+i] * u_ratio) * (1 - v_ratio)
+					 + (l1[x0+i] * (1 - u_ratio) + l1[x1+i] * u_ratio) * v_ratio;
+		}
+	}
+}
+
+static void image_scale_pixel_fixed(const struct image *input,
+				    struct image *output)
+{
+	unsigned int istride = input->width * 3;
+	uint8_t *odata = output->data;
+	unsigned int u, v, i;
+
+	for (v = 0; v < output->height; ++v) {
+		double v_input = (double)v / (output->height - 1) * (input->height - 1);
+		unsigned int y = floor(v_input);
+		unsigned int wv = round((v_input - y) * 256);
+		const uint8_t *l0 = input->data + y * istride;
+		const uint8_t *l1 = y + 1 < input->height ? l0 + istride : l0;
+
+		for (u = 0; u < output->width; ++u) {
+			double u_input = (double)u / (output->width - 1) * (input->width - 1);
+			unsigned int x = floor(u_input);
+			unsigned int wu = round((u_input - x) * 256);
+			unsigned int x0 = x * 3;
+			unsigned int x1 = x + 1 < input->width ? x0 + 3 : x0;
+
+			for (i = 0; i < 3; ++i)
+				*odata++ = ((l0[x0+i] * (256 - wu) + l0[x1+i] * wu) * (256 - wv)
+					  + (l1[x0+i] * (256 - wu) + l1[x1+i] * wu) * wv) >> 16;
+		}
+	}
+}
+
+static void image_scale_pixel_exact(const struct image *input,
+				    struct image *output)
+{
+	unsigned int istride = input->width * 3;
+	unsigned int hden = output->width - 1;
+	unsigned int vden = output->height - 1;
+	uint64_t div = (uint64_t)hden * vden;
+	uint8_t *odata = output->data;
+	unsigned int u, v, i;
+
+	for (v = 0; v < output->height; ++v) {
+		unsigned int y = (uint64_t)v * (input->height - 1) / vden;
+		uint64_t fv = (uint64_t)v * (input->height - 1) % vden;
+		const uint8_t *l0 = input->data + y * istride;
+		const uint8_t *l1 = y + 1 < input->height ? l0 + istride : l0;
+
+		for (u = 0; u < output->width; ++u) {
+			unsigned int x = (uint64_t)u * (input->width - 1) / hden;
+			uint64_t fu = (uint64_t)u * (input->width - 1) % hden;
+			unsigned int x0 = x * 3;
+			unsigned int x1 = x + 1 < input->width ? x0 + 3 : x0;
+
+			for (i = 0; i < 3; ++i) {
+				uint64_t c0 = l0[x0+i] * (hden - fu) + l0[x1+i] * fu;
+				uint64_t c1 = l1[x0+i] * (hden - fu) + l1[x1+i] * fu;
+
+				*odata++ = (c0 * (vden - fv) + c1 * fv) / div;
+			}
+		}
+	}
+}
+
+static int image_scale_scalar(const struct image *input, struct image *output,
+			      const struct params *params)
+{
+	if (params->strict)
+		image_scale_pixel_exact(input, output);
+	else if (params->fixed_point)
+		image_scale_pixel_fixed(input, output);
+	else
+		image_scale_pixel(input, output);
+
+	return 0;
+}
+
+static const struct kernel_variant scale_kernels[] = {
+	KERNEL_VARIANT("map", image_scale_map),
+	KERNEL_VARIANT("scalar", image_scale_scalar),
+};
+
+static int image_scale(const struct image *input, struct image *output,
+		       const struct params *params)
+{
+	/*
+	 * Scaling to a single line or column divides by zero when computing
+	 * the source coordinates. The resulting NaN values have always
+	 * produced a black image, keep that behaviour.
+	 */
+	if (output->width == 1 || output->height == 1) {
+		memset(output->data, 0, output->size);
+		return 0;
+	}
+
+	return kernel_get(scale_kernels, KERNEL_SCALE, image_scale_scalar)
+		(input, output, params);
+}
+
+/* -----------------------------------------------------------------------------
+ * Image composing
+ */
+
+/*
+ * The compositor blends up to COMPOSE_MAX_LAYERS layers, from bottom to top,
+ * over a black background. Each layer has a position, which may be partly or
+ * completely outside of the output, a global alpha value and an optional
+ * per-pixel alpha mask. The output is processed in tiles of COMPOSE_TILE_SIZE
+ * pixels, starting from the topmost layer that is opaque and covers the whole
+ * tile, so that only the visible parts of the layers are read.
+ *
+ * Blending computes (src * a + dst * (255 - a)) / 255 rounded to the nearest
+ * integer, for each component.
+ */
+#define COMPOSE_TILE_SIZE	64
+
+struct compose_layer {
+	const struct image *image;
+	const struct image *mask;
+	int left;
+	int top;
+	uint8_t alpha;
+};
+
+static inline unsigned int compose_div255(unsigned int x)
+{
+	return (x + 128 + ((x + 128) >> 8)) >> 8;
+}
+
+/* Blend 16 bytes with per-byte alpha values. */
+static inline void compose_blend16(uint8_t *dst, const uint8_t *src,
+				   vec_u8x16 alpha)
+{
+	vec_u8x16 d, s;
+	vec_u16x16 a, x;
+
+	memcpy(&d, dst, sizeof(d));
+	memcpy(&s, src, sizeof(s));
+
+	a = __builtin_convertvector(alpha, vec_u16x16);
+	x = __builtin_convertvector(s, vec_u16x16) * a
+	  + __builtin_convertvector(d, vec_u16x16) * (255 - a);
+	x = (x + 128 + ((x + 128) >> 8)) >> 8;
+
+	d = __builtin_convertvector(x, vec_u8x16);
+	memcpy(dst, &d, sizeof(d));
+}
+
+static void compose_blend_line(uint8_t *dst, const uint8_t *src,
+			       const uint8_t *mask, uint8_t alpha,
+			       unsigned int width)
+{
+	/* Replicate the alpha of 16 pixels over their 48 components. */
+	static const vec_u8x16 alpha_masks[3] = {
+		{  0,  0,  0,  3,  3,  3,  6,  6,  6,  9,  9,  9, 12, 12, 12, 15 },
+		{ 15, 15, 18, 18, 18, 21, 21, 21, 24, 24, 24, 27, 27, 27, 30, 30 },
+		{ 30, 33, 33, 33, 36, 36, 36, 39, 39, 39, 42, 42, 42, 45, 45, 45 },
+	};
+	unsigned int x, k;
+
+	if (!mask && alpha == 255) {
+		memcpy(dst, src, width * 3);
+		return;
+	}
+
+	for (x = 0; x + 16 <= width; x += 16) {
+		for (k = 0; k < 3; ++k) {
+			vec_u8x16 a = (vec_u8x16){ } + alpha;
+
+			if (mask) {
+				vec_u8x16 m[3];
+				vec_u16x16 ma;
+
+				memcpy(m, &mask[3*x], sizeof(m));
+				ma = __builtin_convertvector(vec_shuffle48(m, alpha_masks[k]),
+							     vec_u16x16) * alpha;
+				ma = (ma + 128 + ((ma + 128) >> 8)) >> 8;
+				a = __builtin_convertvector(ma, vec_u8x16);
+			}
+
+			compose_blend16(&dst[3*x + 16*k], &src[3*x + 16*k], a);
+		}
+	}
+
+	for (; x < width; ++x) {
+		unsigned int a = mask ? compose_div255(mask[3*x] * alpha) : alpha;
+
+		for (k = 0; k < 3; ++k)
+			dst[3*x + k] = compose_div255(src[3*x + k] * a
+						      + dst[3*x + k] * (255 - a));
+	}
+}
+
+static void image_compose_simd(struct image *output,
+			       const struct compose_layer *layers,
+			       unsigned int num_layers)
+{
+	unsigned int stride = output->width * 3;
+	unsigned int tx, ty;
+	unsigned int i;
+	int y;
+
+	for (ty = 0; ty < output->height; ty += COMPOSE_TILE_SIZE) {
+		int y0 = ty;
+		int y1 = min(ty + COMPOSE_TILE_SIZE, output->height);
+
+		for (tx = 0; tx < output->width; tx += COMPOSE_TILE_SIZE) {
+			int x0 = tx;
+			int x1 = min(tx + COMPOSE_TILE_SIZE, output->width);
+			unsigned int first = 0;
+			bool covered = false;
+
+			/* Find the topmost opaque layer covering the tile. */
+			for (i = num_layers; i > 0; --i) {
+				const struct compose_layer *layer = &layers[i - 1];
+
+				if (layer->alpha == 255 && !layer->mask &&
+				    layer->left <= x0 && layer->top <= y0 &&
+				    layer->left + (int)layer->image->width >= x1 &&
+				    layer->top + (int)layer->image->height >= y1) {
+					first = i - 1;
+					covered = true;
+					break;
+				}
+			}
+
+			if (!covered) {
+				for (y = y0; y < y1; ++y)
+					memset(output->data + y * stride + x0 * 3,
+					       0, (x1 - x0) * 3);
+			}
+
+			for (i = first; i < num_layers; ++i) {
+				const struct compose_layer *layer = &layers[i];
+				const struct image *image = layer->image;
+				unsigned int istride = image->width * 3;
+				int lx0 = max(x0, layer->left);
+				int ly0 = max(y0, layer->top);
+				int lx1 = min(x1, layer->left + (int)image->width);
+				int ly1 = min(y1, layer->top + (int)image->height);
+
+				if (lx0 >= lx1 || ly0 >= ly1)
+					continue;
+
+				for (y = ly0; y < ly1; ++y) {
+					unsigned int offset = (y - layer->top) * istride
+							    + (lx0 - layer->left) * 3;
+
+					compose_blend_line(output->data + y * stride + lx0 * 3,
+							   image->data + offset,
+							   layer->mask ? layer->mask->data + offset : NULL,
+							   layer->alpha, lx1 - lx0);
+				}
+			}
+		}
+	}
+}
+
+static void image_compose_scalar(struct image *output,
+				 const struct compose_layer *layers,
+				 unsigned int num_layers)
+{
+	uint8_t *odata = output->data;
+	unsigned int i, k;
+	int x, y;
+
+	memset(odata, 0, output->width * output->height * 3);
+
+	for (i = 0; i < num_layers; ++i) {
+		const struct compose_layer *layer = &layers[i];
+		const struct image *image = layer->image;
+
+		for (y = 0; y < (int)image->height; ++y) {
+			int oy = layer->top + y;
+
+			if (oy < 0 || oy >= (int)output->height)
+				continue;
+
+			for (x = 0; x < (int)image->width; ++x) {
+				unsigned int offset = (y * image->width + x) * 3;
+				const uint8_t *src = image->data + offset;
+				int ox = layer->left + x;
+				uint8_t *dst;
+				unsigned int a;
+
+				if (ox < 0 || ox >= (int)output->width)
+					continue;
+
+				dst = &odata[(oy * output->width + ox) * 3];
+				a = layer->alpha;
+				if (layer->mask)
+					a = compose_div255(((uint8_t *)layer->mask->data)[offset] * a);
+
+				for (k = 0; k < 3; ++k)
+					dst[k] = compose_div255(src[k] * a + dst[k] * (255 - a));
+			}
+		}
+	}
+}
+
+static const struct kernel_variant compose_kernels[] = {
+	KERNEL_VARIANT("simd", image_compose_simd),
+	KERNEL_VARIANT("scalar", image_compose_scalar),
+};
+
+static void image_compose(struct image *output,
+			  const struct compose_layer *layers,
+			  unsigned int num_layers)
+{
+	kernel_get(compose_kernels, KERNEL_COMPOSE, image_compose_scalar)
+		(output, layers, num_layers);
+}
+
+/* -----------------------------------------------------------------------------
+ * Image rotation and flipping
+ */
+
+/*
+ * Rotation is implemented as a transposition, processed in square tiles of
+ * ROTATE_TILE_SIZE pixels to keep both the input lines and the output lines
+ * of a tile in the cache. Horizontal and vertical flipping are folded in the
+ * transposition by reversing the iteration directions, covering all eight
+ * orientations in a single pass.
+ */
+#define ROTATE_TILE_SIZE	32
+
+static void image_rotate_tiled(const struct image *input,
+			       struct image *output, bool hflip, bool vflip)
+{
+	unsigned int istride = input->width * 3;
+	unsigned int ostride = output->width * 3;
+	unsigned int tx, ty;
+	unsigned int x, y;
+
+	/*
+	 * Output pixel (x, y) comes from input pixel (vflip ? W-1-y : y,
+	 * hflip ? x : H-1-x) where W and H are the input width and height.
+	 */
+	for (ty = 0; ty < output->height; ty += ROTATE_TILE_SIZE) {
+		unsigned int y1 = min(ty + ROTATE_TILE_SIZE, output->height);
+
+		for (tx = 0; tx < output->width; tx += ROTATE_TILE_SIZE) {
+			unsigned int x1 = min(tx + ROTATE_TILE_SIZE, output->width);
+
+			for (y = ty; y < y1; ++y) {
+				unsigned int ix = vflip ? input->width - 1 - y : y;
+				uint8_t *odata = output->data + y * ostride + tx * 3;
+				const uint8_t *idata;
+				int step;
+
+				if (hflip) {
+					idata = input->data + tx * istride + ix * 3;
+					step = istride;
+				} else {
+					idata = input->data
+					      + (input->height - 1 - tx) * istride
+					      + ix * 3;
+					step = -istride;
+				}
+
+				for (x = tx; x < x1; ++x) {
+					odata[0] = idata[0];
+					odata[1] = idata[1];
+					odata[2] = idata[2];
+					odata += 3;
+					idata += step;
+				}
+			}
+		}
+	}
+}
+
+static void image_rotate_scalar(const struct image *input,
+				struct image *output, bool hflip, bool vflip)
+{
+	const uint8_t *idata = input->data;
+	uint8_t *odata = output->data;
+	unsigned int x, y;
+
+	for (y = 0; y < output->height; ++y) {
+		for (x = 0; x < output->width; ++x) {
+			unsigned int ix = vflip ? input->width - 1 - y : y;
+			unsigned int iy = hflip ? x : input->height - 1 - x;
+
+			memcpy(odata, &idata[(iy * input->width + ix) * 3], 3);
+			odata += 3;
+		}
+	}
+}
+
+static const struct kernel_variant rotate_kernels[] = {
+	KERNEL_VARIANT("tiled", image_rotate_tiled),
+	KERNEL_VARIANT("scalar", image_rotate_scalar),
+};
+
+static void image_rotate(const struct image *input, struct image *output,
+			 bool hflip, bool vflip)
+{
+	kernel_get(rotate_kernels, KERNEL_ROTATE, image_rotate_scalar)
+		(input, output, hflip, vflip);
+}
+
+/*
+ * Reverse the order of the pixels of a line. Blocks of 16 pixels are reversed
+ * with vector shuffles operating on three 16 bytes vectors.
+ */
+static void flip_line(const uint8_t *input, uint8_t *output, unsigned int width)
+{
+	static const vec_u8x16 masks[3] = {
+		{ 45, 46, 47, 42, 43, 44, 39, 40, 41, 36, 37, 38, 33, 34, 35, 30 },
+		{ 31, 32, 27, 28, 29, 24, 25, 26, 21, 22, 23, 18, 19, 20, 15, 16 },
+		{ 17, 12, 13, 14,  9, 10, 11,  6,  7,  8,  3,  4,  5,  0,  1,  2 },
+	};
+	const uint8_t *idata = input + width * 3;
+	unsigned int k;
+
+	for (; width >= 16; width -= 16) {
+		vec_u8x16 in[3];
+		vec_u8x16 out[3];
+
+		idata -= 48;
+		memcpy(in, idata, sizeof(in));
+
+		for (k = 0; k < 3; ++k)
+			out[k] = vec_shuffle48(in, masks[k]);
+
+		memcpy(output, out, sizeof(out));
+		output += 48;
+	}
+
+	for (; width; --width) {
+		idata -= 3;
+		output[0] = idata[0];
+		output[1] = idata[1];
+		output[2] = idata[2];
+		output += 3;
+	}
+}
+
+static void image_flip_simd(const struct image *input, struct image *output,
+			    bool hflip, bool vflip)
+{
+	unsigned int stride = output->width * 3;
+	unsigned int y;
+
+	for (y = 0; y < output->height; ++y) {
+		unsigned int iy = vflip ? input->height - 1 - y : y;
+		const uint8_t *idata = input->data + iy * stride;
+		uint8_t *odata = output->data + y * stride;
+
+		if (hflip)
+			flip_line(idata, odata, output->width);
+		else
+			memcpy(odata, idata, stride);
+	}
+}
+
+static void image_flip_scalar(const struct image *input, struct image *output,
+			      bool hflip, bool vflip)
+{
+	const uint8_t *idata = input->data;
+	uint8_t *odata = output->data;
+	unsigned int x, y;
+
+	for (y = 0; y < output->height; ++y) {
+		for (x = 0; x < output->width; ++x) {
+			unsigned int ix = hflip ? input->width - 1 - x : x;
+			unsigned int iy = vflip ? input->height - 1 - y : y;
+
+			memcpy(odata, &idata[(iy * input->width + ix) * 3], 3);
+			odata += 3;
+		}
+	}
+}
+
+static const struct kernel_variant flip_kernels[] = {
+	KERNEL_VARIANT("simd", image_flip_simd),
+	KERNEL_VARIANT("scalar", image_flip_scalar),
+};
+
+static void image_flip(const struct image *input, struct image *output,
+		       bool hflip, bool vflip)
+{
+	kernel_get(flip_kernels, KERNEL_FLIP, image_flip_scalar)
+		(input, output, hflip, vflip);
+}
+
+/* -----------------------------------------------------------------------------
+ * Image Cropping
+ */
+
+static void image_crop(const struct image *input, const struct image *output,
+		       const struct image_rect *crop)
+{
+	unsigned int offset = (crop->top * input->width + crop->left) * 3;
+	const uint8_t *idata = input->data + offset;
+	uint8_t *odata = output->data;
+	unsigned int y;
+
+	for (y = 0; y < output->height; ++y) {
+		memcpy(odata, idata, output->width * 3);
+		odata += output->width * 3;
+		idata += input->width * 3;
+	}
+}
+
+/* -----------------------------------------------------------------------------
+ * Look Up Table
+ */
+
+/*
+ * The 1D LUT file stores 256 entries of 4 bytes, one byte per component. The
+ * table is unpacked into one 256 bytes table per byte position in the pixel,
+ * taking the component mapping into account.
+ *
+ * On ARM64, blocks of 16 pixels are deinterleaved by the load and looked up
+ * with a chain of 64-entries TBL/TBX instructions. Other architectures lack a
+ * byte shuffle wide enough to beat the scalar loop (a 16 entries PSHUFB chain
+ * is several times slower on x86), and use a scalar loop unrolled per
+ * component.
+ */
+struct lut_1d_table {
+	uint8_t table[3][256];
+};
+
+static void lut_1d_apply(const struct lut_1d_table *lut, const uint8_t *idata,
+			 uint8_t *odata, unsigned int count)
+{
+	const uint8_t *t0 = lut->table[0];
+	const uint8_t *t1 = lut->table[1];
+	const uint8_t *t2 = lut->table[2];
+
+#if defined(__aarch64__)
+	uint8x16x4_t tables[3][4];
+	unsigned int i, j, k;
+
+	for (k = 0; k < 3; ++k) {
+		for (i = 0; i < 4; ++i) {
+			for (j = 0; j < 4; ++j)
+				tables[k][i].val[j] =
+					vld1q_u8(&lut->table[k][i * 64 + j * 16]);
+		}
+	}
+
+	for (; count >= 16; count -= 16) {
+		uint8x16x3_t pixels = vld3q_u8(idata);
+
+		for (k = 0; k < 3; ++k) {
+			uint8x16_t index = pixels.val[k];
+			uint8x16_t value;
+
+			value = vqtbl4q_u8(tables[k][0], index);
+			value = vqtbx4q_u8(value, tables[k][1],
+					   vsubq_u8(index, vdupq_n_u8(64)));
+			value = vqtbx4q_u8(value, tables[k][2],
+					   vsubq_u8(index, vdupq_n_u8(128)));
+			value = vqtbx4q_u8(value, tables[k][3],
+					   vsubq_u8(index, vdupq_n_u8(192)));
+			pixels.val[k] = value;
+		}
+
+		vst3q_u8(odata, pixels);
+		idata += 48;
+		odata += 48;
+	}
+#else
+	for (; count >= 4; count -= 4) {
+		odata[0] = t0[idata[0]];
+		odata[1] = t1[idata[1]];
+		odata[2] = t2[idata[2]];
+		odata[3] = t0[idata[3]];
+		odata[4] = t1[idata[4]];
+		odata[5] = t2[idata[5]];
+		odata[6] = t0[idata[6]];
+		odata[7] = t1[idata[7]];
+		odata[8] = t2[idata[8]];
+		odata[9] = t0[idata[9]];
+		odata[10] = t1[idata[10]];
+		odata[11] = t2[idata[11]];
+		idata += 12;
+		odata += 12;
+	}
+#endif
+
+	for (; count; --count) {
+		odata[0] = t0[idata[0]];
+		odata[1] = t1[idata[1]];
+		odata[2] = t2[idata[2]];
+		idata += 3;
+		odata += 3;
+	}
+}
+
+/* Read a 1D (type "1D") or 3D (type "3D") LUT file of exactly size bytes. */
+static int lut_file_read(const char *filename, void *lut, size_t size,
+			 const char *type)
+{
+	int ret;
+	int fd;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		printf("Unable to open %s LUT file %s: %s (%d)\n", type,
+		       filename, strerror(errno), errno);
+		return -errno;
+	}
+
+	ret = file_read(fd, lut, size);
+	close(fd);
+	if (ret < 0) {
+		printf("Unable to read %s LUT file: %s (%d)\n", type,
+		       strerror(-ret), ret);
+		return ret;
+	}
+	if ((size_t)ret != size) {
+		printf("Invalid %s LUT file: file too short\n", type);
+		return -ENODATA;
+	}
+
+	return 0;
+}
+
+static void image_lut_1d_table(const struct image *input,
+			       struct image *output, const uint8_t lut[1024])
+{
+	struct lut_1d_table table;
+	unsigned int comp_map[3];
+	unsigned int c, i;
+
+	if (input->format->type == FORMAT_YUV)
+		memcpy(comp_map, (unsigned int[3]){ 1, 0, 2 },
+		       sizeof(comp_map));
+	else
+		memcpy(comp_map, (unsigned int[3]){ 2, 1, 0 },
+		       sizeof(comp_map));
+
+	for (i = 0; i < 3; ++i) {
+		for (c = 0; c < 256; ++c)
+			table.table[i][c] = lut[c*4 + comp_map[i]];
+	}
+
+	lut_1d_apply(&table, input->data, output->data,
+		     input->width * input->height);
+}
+
+static void image_lut_1d_scalar(const struct image *input,
+				struct image *output, const uint8_t lut[1024])
+{
+	const uint8_t *idata = input->data;
+	uint8_t *odata = output->data;
+	unsigned int comp_map[3];
+	uint8_t c0, c1, c2;
+	unsigned int x, y;
+
+	if (input->format->type == FORMAT_YUV)
+		memcpy(comp_map, (unsigned int[3]){ 1, 0, 2 },
+		       sizeof(comp_map));
+	else
+		memcpy(comp_map, (unsigned int[3]){ 2, 1, 0 },
+		       sizeof(comp_map));
+
+	for (y = 0; y < input->height; ++y) {
+		for (x = 0; x < input->width; ++x) {
+			c0 = *idata++;
+			c1 = *idata++;
+			c2 = *idata++;
+
+			*odata++ = lut[c0*4 + comp_map[0]];
+			*odata++ = lut[c1*4 + comp_map[1]];
+			*odata++ = lut[c2*4 + comp_map[2]];
+		}
+	}
+}
+
+static const struct kernel_variant lut_kernels[] = {
+	KERNEL_VARIANT("table", image_lut_1d_table),
+	KERNEL_VARIANT("scalar", image_lut_1d_scalar),
+};
+
+static void image_lut_1d(const struct image *input, struct image *output,
+			 const uint8_t lut[1024])
+{
+	kernel_get(lut_kernels, KERNEL_LUT, image_lut_1d_scalar)
+		(input, output, lut);
+}
+
+/*
+ * The 3D LUT is interpolated trilinearly. As the hardware only uses the 4 LSBs
+ * of each component as the interpolation ratio (plus one step of Max Value
+ * Stretch), the weights are integers in the [0, 16] range, and the interpolated
+ * value is a multiple of 1/4096 that can be computed exactly with integer
+ * arithmetic.
+ *
+ * The table is unpacked into cells that store the 8 vertices of each of the
+ * 16x16x16 interpolation cubes contiguously. Each vertex packs its three
+ * components in 21-bit fields of a 64-bit word, wide enough to hold the
+ * weighted sums without carry, so that all components are interpolated with a
+ * single multiplication per vertex.
+ */
+#define CLU_FIELD(v, n)		((uint64_t)(v) << ((n) * 21))
+
+struct clu_table {
+	uint64_t cells[16 * 16 * 16][8];
+};
+
+static void clu_table_unpack(struct clu_table *table, const uint32_t *lut)
+{
+	unsigned int a1, a2, a3;
+	unsigned int i;
+
+	for (a3 = 0; a3 < 16; ++a3) {
+		for (a2 = 0; a2 < 16; ++a2) {
+			for (a1 = 0; a1 < 16; ++a1) {
+				unsigned int cell = a1 | (a2 << 4) | (a3 << 8);
+
+				for (i = 0; i < 8; ++i) {
+					uint32_t entry;
+
+					entry = lut[(a1 + !!(i & 4))
+						  + (a2 + !!(i & 2)) * 17
+						  + (a3 + (i & 1)) * 17 * 17];
+
+					table->cells[cell][i] =
+						  CLU_FIELD((entry >> 16) & 0xff, 0)
+						| CLU_FIELD((entry >> 8) & 0xff, 1)
+						| CLU_FIELD(entry & 0xff, 2);
+				}
+			}
+		}
+	}
+}
+
+/*
+ * Interpolate VEC_LANES pixels. The weights and cell indices are computed with
+ * vector operations, the packed vertices are then accumulated per pixel as the
+ * table lookups can't be vectorized efficiently without gather instructions.
+ */
+static void clu_apply_vec(const struct clu_table *table,
+			  const unsigned int comp_map[3],
+			  const uint8_t *idata, uint8_t *odata)
+{
+	vec_s32 c[3], w[3];
+	vec_s32 weights[8];
+	vec_s32 cell;
+	unsigned int i, j, n;
+
+	for (i = 0; i < VEC_LANES; ++i) {
+		for (j = 0; j < 3; ++j)
+			c[j][i] = idata[3*i + comp_map[j]];
+	}
+
+	/*
+	 * Implement the hardware MVS (Max Value Stretch) behaviour: move the
+	 * point by one step towards the upper limit of the grid if we're
+	 * closer than 0.5 to that limit.
+	 */
+	for (j = 0; j < 3; ++j)
+		w[j] = (c[j] & 0xf) + ((c[j] >= 0xf8) & 1);
+
+	cell = (c[0] >> 4) | (c[1] & 0xf0) | ((c[2] & 0xf0) << 4);
+
+	for (n = 0; n < 8; ++n)
+		weights[n] = ((n & 4) ? w[0] : 16 - w[0])
+			   * ((n & 2) ? w[1] : 16 - w[1])
+			   * ((n & 1) ? w[2] : 16 - w[2]);
+
+	for (i = 0; i < VEC_LANES; ++i) {
+		const uint64_t *vertex = table->cells[cell[i]];
+		uint64_t sum;
+
+		/* Round half up, matching round() on positive values. */
+		sum = CLU_FIELD(2048, 0) | CLU_FIELD(2048, 1) | CLU_FIELD(2048, 2);
+
+		for (n = 0; n < 8; ++n)
+			sum += vertex[n] * (uint32_t)weights[n][i];
+
+		for (j = 0; j < 3; ++j)
+			odata[3*i + comp_map[j]] = sum >> (j * 21 + 12);
+	}
+}
+
+static int image_lut_3d_simd(const struct image *input, struct image *output,
+			     const uint32_t lut[17*17*17])
+{
+	const uint8_t *idata = input->data;
+	uint8_t *odata = output->data;
+	uint8_t buffer[2][3 * VEC_LANES];
+	struct clu_table *table;
+	unsigned int comp_map[3];
+	unsigned int count;
+
+	table = malloc(sizeof(*table));
+	if (!table)
+		return -ENOMEM;
+
+	clu_table_unpack(table, lut);
+
+	if (input->format->type == FORMAT_YUV)
+		memcpy(comp_map, (unsigned int[3]){ 2, 0, 1 },
+		       sizeof(comp_map));
+	else
+		memcpy(comp_map, (unsigned int[3]){ 0, 1, 2 },
+		       sizeof(comp_map));
+
+	for (count = input->width * input->height; count >= VEC_LANES;
+	     count -= VEC_LANES) {
+		clu_apply_vec(table, comp_map, idata, odata);
+		idata += 3 * VEC_LANES;
+		odata += 3 * VEC_LANES;
+	}
+
+	if (count) {
+		memset(buffer[0], 0, sizeof(buffer[0]));
+		memcpy(buffer[0], idata, count * 3);
+		clu_apply_vec(table, comp_map, buffer[0], buffer[1]);
+		memcpy(odata, buffer[1], count * 3);
+	}
+
+	free(table);
+	return 0;
+}
+
+/* Reference implementation, interpolating with floating point arithmetic. */
+static int image_lut_3d_scalar(const struct image *input,
+			       struct image *output,
+			       const uint32_t lut[17*17*17])
+{
+	const uint8_t *idata = input->data;
+	uint8_t *odata = output->data;
+	unsigned int comp_map[3];
+	unsigned int x, y;
+
+	if (input->format->type == FORMAT_YUV)
+		memcpy(comp_map, (unsigned int[3]){ 2, 0, 1 },
+		       sizeof(comp_map));
+	else
+		memcpy(comp_map, (unsigned int[3]){ 0, 1, 2 },
+		       sizeof(comp_map));
+
+	for (y = 0; y < input->height; ++y) {
+		for (x = 0; x < input->width; ++x) {
+			double a1_ratio, a2_ratio, a3_ratio;
+			unsigned int a1, a2, a3;
+			double c0, c1, c2;
+			uint8_t c[3];
+
+			c[0] = idata[comp_map[0]];
+			c[1] = idata[comp_map[1]];
+			c[2] = idata[comp_map[2]];
+
+			a1 = c[0] >> 4;
+			a2 = c[1] >> 4;
+			a3 = c[2] >> 4;
+
+			/*
+			 * Implement the hardware MVS (Max Value Stretch)
+			 * behaviour: move the point by one step towards the
+			 * upper limit of the grid if we're closer than 0.5 to
+			 * that limit.
+			 */
+			a1_ratio = ((c[0] & 0xf) + (c[0] >= 0xf8 ? 1 : 0)) / 16.;
+			a2_ratio = ((c[1] & 0xf) + (c[1] >= 0xf8 ? 1 : 0)) / 16.;
+			a3_ratio = ((c[2] & 0xf) + (c[2] >= 0xf8 ? 1 : 0)) / 16.;
+
+#define _LUT(a1, a2, a3, offset)	((lut[(a1)+(a2)*17+(a3)*17*17] >> (offset)) & 0xff)
+			c0 = _LUT(a1,   a2,   a3,   16) * (1 - a1_ratio) * (1 - a2_ratio) * (1 - a3_ratio)
+			   + _LUT(a1,   a2,   a3+1, 16) * (1 - a1_ratio) * (1 - a2_ratio) * a3_ratio
+			   + _LUT(a1,   a2+1, a3,   16) * (1 - a1_ratio) * a2_ratio       * (1 - a3_ratio)
+			   + _LUT(a1,   a2+1, a3+1, 16) * (1 - a1_ratio) * a2_ratio       * a3_ratio
+			   + _LUT(a1+1, a2,   a3,   16) * a1_ratio       * (1 - a2_ratio) * (1 - a3_ratio)
+			   + _LUT(a1+1, a2,   a3+1, 16) * a1_ratio       * (1 - a2_ratio) * a3_ratio
+			   + _LUT(a1+1, a2+1, a3,   16) * a1_ratio       * a2_ratio       * (1 - a3_ratio)
+			   + _LUT(a1+1, a2+1, a3+1, 16) * a1_ratio       * a2_ratio       * a3_ratio;
+			c1 = _LUT(a1,   a2,   a3,    8) * (1 - a1_ratio) * (1 - a2_ratio) * (1 - a3_ratio)
+			   + _LUT(a1,   a2,   a3+1,  8) * (1 - a1_ratio) * (1 - a2_ratio) * a3_ratio
+			   + _LUT(a1,   a2+1, a3,    8) * (1 - a1_ratio) * a2_ratio       * (1 - a3_ratio)
+			   + _LUT(a1,   a2+1, a3+1,  8) * (1 - a1_ratio) * a2_ratio       * a3_ratio
+			   + _LUT(a1+1, a2,   a3,    8) * a1_ratio       * (1 - a2_ratio) * (1 - a3_ratio)
+			   + _LUT(a1+1, a2,   a3+1,  8) * a1_ratio       * (1 - a2_ratio) * a3_ratio
+			   + _LUT(a1+1, a2+1, a3,    8) * a1_ratio       * a2_ratio       * (1 - a3_ratio)
+			   + _LUT(a1+1, a2+1, a3+1,  8) * a1_ratio       * a2_ratio       * a3_ratio;
+			c2 = _LUT(a1,   a2,   a3,    0) * (1 - a1_ratio) * (1 - a2_ratio) * (1 - a3_ratio)
+			   + _LUT(a1,   a2,   a3+1,  0) * (1 - a1_ratio) * (1 - a2_ratio) * a3_ratio
+			   + _LUT(a1,   a2+1, a3,    0) * (1 - a1_ratio) * a2_ratio       * (1 - a3_ratio)
+			   + _LUT(a1,   a2+1, a3+1,  0) * (1 - a1_ratio) * a2_ratio       * a3_ratio
+			   + _LUT(a1+1, a2,   a3,    0) * a1_ratio       * (1 - a2_ratio) * (1 - a3_ratio)
+			   + _LUT(a1+1, a2,   a3+1,  0) * a1_ratio       * (1 - a2_ratio) * a3_ratio
+			   + _LUT(a1+1, a2+1, a3,    0) * a1_ratio       * a2_ratio       * (1 - a3_ratio)
+			   + _LUT(a1+1, a2+1, a3+1,  0) * a1_ratio       * a2_ratio       * a3_ratio;
+#undef _LUT
+
+			odata[comp_map[0]] = round(c0);
+			odata[comp_map[1]] = round(c1);
+			odata[comp_map[2]] = round(c2);
+
+			idata += 3;
+			odata += 3;
+		}
+	}
+
+	return 0;
+}
+
+static const struct kernel_variant clu_kernels[] = {
+	KERNEL_VARIANT("simd", image_lut_3d_simd),
+	KERNEL_VARIANT("scalar", image_lut_3d_scalar),
+};
+
+static int image_lut_3d(const struct image *input, struct image *output,
+			const uint32_t lut[17*17*17])
+{
+	return kernel_get(clu_kernels, KERNEL_CLU, image_lut_3d_scalar)
+		(input, output, lut);
+}
+
+/* -----------------------------------------------------------------------------
+ * Histogram
+ */
+
+/*
+ * Store a 32-bit histogram value in the little endian order of all supported
+ * platforms. Histograms can be stored at unaligned offsets.
+ */
+static inline void histogram_write32(void *p, uint32_t value)
+{
+	memcpy(p, &value, sizeof(value));
+}
+
+/*
+ * The HGO statistics are computed in parallel over slices of lines. Within a
+ * slice the minimum, maximum and sum are accumulated with vector operations on
+ * 48 bytes (16 pixels) at a time, with the component of each byte given by its
+ * position modulo 3. Bins are spread over multiple banks indexed by the pixel
+ * position to avoid serializing consecutive increments of the same bin on flat
+ * areas, and merged at the end of the slice.
+ */
+#define HGO_BANKS		4
+
+struct hgo_stats {
+	uint8_t min[3];
+	uint8_t max[3];
+	uint32_t sums[3];
+	uint32_t bins[3][64];
+};
+
+struct hgo_job {
+	const struct image *image;
+	unsigned int num_slices;
+	struct hgo_stats *stats;
+};
+
+static void hgo_compute_slice(void *priv, unsigned int index)
+{
+	struct hgo_job *job = priv;
+	struct hgo_stats *stats = &job->stats[index];
+	uint32_t bins[HGO_BANKS][3][64];
+	vec_u8 vmin[3], vmax[3];
+	vec_u32 vsum[3];
+	const uint8_t *data;
+	unsigned int start, end;
+	unsigned int count;
+	unsigned int i, j, k;
+
+	parallel_slice_range(job->image->height, job->num_slices, index,
+			     &start, &end);
+
+	data = job->image->data + start * job->image->width * 3;
+	count = (end - start) * job->image->width * 3;
+
+	memset(bins, 0, sizeof(bins));
+	memset(stats, 0, sizeof(*stats));
+
+	for (k = 0; k < 3; ++k) {
+		vmin[k] = (vec_u8){ } + 255;
+		vmax[k] = (vec_u8){ };
+		vsum[k] = (vec_u32){ };
+	}
+
+	for (; count >= 3 * VEC_LANES; count -= 3 * VEC_LANES) {
+		for (k = 0; k < 3; ++k) {
+			vec_u8 v;
+
+			memcpy(&v, data + k * VEC_LANES, sizeof(v));
+
+			vmin[k] = (vec_u8)vec_min(v, vmin[k]);
+			vmax[k] = (vec_u8)vec_max(v, vmax[k]);
+			vsum[k] += __builtin_convertvector(v, vec_u32);
+		}
+
+		for (i = 0; i < VEC_LANES; ++i) {
+			uint32_t (*bank)[64] = bins[i % HGO_BANKS];
+
+			bank[0][data[0] >> 2]++;
+			bank[1][data[1] >> 2]++;
+			bank[2][data[2] >> 2]++;
+			data += 3;
+		}
+	}
+
+	/* Reduce the vector lanes, the component depends on the byte offset. */
+	for (k = 0; k < 3; ++k) {
+		stats->min[k] = 255;
+		stats->max[k] = 0;
+	}
+
+	for (k = 0; k < 3; ++k) {
+		for (i = 0; i < VEC_LANES; ++i) {
+			unsigned int comp = (k * VEC_LANES + i) % 3;
+
+			stats->min[comp] = min(stats->min[comp], vmin[k][i]);
+			stats->max[comp] = max(stats->max[comp], vmax[k][i]);
+			stats->sums[comp] += vsum[k][i];
+		}
+	}
+
+	for (; count; count -= 3) {
+		for (k = 0; k < 3; ++k) {
+			stats->min[k] = min(*data, stats->min[k]);
+			stats->max[k] = max(*data, stats->max[k]);
+			stats->sums[k] += *data;
+			bins[0][k][*data >> 2]++;
+			data++;
+		}
+	}
+
+	for (i = 0; i < HGO_BANKS; ++i) {
+		for (k = 0; k < 3; ++k) {
+			for (j = 0; j < 64; ++j)
+				stats->bins[k][j] += bins[i][k][j];
+		}
+	}
+}
+
+static void hgo_stats_format(const struct hgo_stats *stats,
+			     const struct image *image, void *histo)
+{
+	unsigned int comp_map[3];
+	unsigned int i, j;
+
+	if (image->format->type == FORMAT_YUV)
+		memcpy(comp_map, (unsigned int[3]){ 2, 0, 1 }, sizeof(comp_map));
+	else
+		memcpy(comp_map, (unsigned int[3]){ 0, 1, 2 }, sizeof(comp_map));
+
+	for (i = 0; i < ARRAY_SIZE(stats->min); ++i) {
+		*(uint8_t *)histo++ = stats->min[comp_map[i]];
+		*(uint8_t *)histo++ = 0;
+		*(uint8_t *)histo++ = stats->max[comp_map[i]];
+		*(uint8_t *)histo++ = 0;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(stats->sums); ++i) {
+		histogram_write32(histo, stats->sums[comp_map[i]]);
+		histo += 4;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(stats->bins); ++i) {
+		for (j = 0; j < ARRAY_SIZE(stats->bins[i]); ++j) {
+			histogram_write32(histo, stats->bins[comp_map[i]][j]);
+			histo += 4;
+		}
+	}
+}
+
+static int histogram_compute_hgo_parallel(const struct image *image,
+					  void *histo)
+{
+	struct hgo_stats result;
+	struct hgo_job job;
+	unsigned int i, j, k;
+
+	job.image = image;
+	job.num_slices = parallel_num_slices(image->height);
+	job.stats = calloc(job.num_slices, sizeof(*job.stats));
+	if (!job.stats)
+		return -ENOMEM;
+
+	parallel_run(job.num_slices, hgo_compute_slice, &job);
+
+	memset(&result, 0, sizeof(result));
+	memset(result.min, 255, sizeof(result.min));
+
+	for (i = 0; i < job.num_slices; ++i) {
+		const struct hgo_stats *stats = &job.stats[i];
+
+		for (k = 0; k < 3; ++k) {
+			result.min[k] = min(result.min[k], stats->min[k]);
+			result.max[k] = max(result.max[k], stats->max[k]);
+			result.sums[k] += stats->sums[k];
+
+			for (j = 0; j < 64; ++j)
+				result.bins[k][j] += stats->bins[k][j];
+		}
+	}
+
+	free(job.stats);
+
+	hgo_stats_format(&result, image, histo);
+	return 0;
+}
+
+static int histogram_compute_hgo_scalar(const struct image *image, void *histo)
+{
+	const uint8_t *data = image->data;
+	struct hgo_stats stats;
+	unsigned int x, y;
+	unsigned int i;
+
+	memset(&stats, 0, sizeof(stats));
+	memset(stats.min, 255, sizeof(stats.min));
+
+	for (y = 0; y < image->height; ++y) {
+		for (x = 0; x < image->width; ++x) {
+			for (i = 0; i < 3; ++i) {
+				stats.min[i] = min(*data, stats.min[i]);
+				stats.max[i] = max(*data, stats.max[i]);
+				stats.sums[i] += *data;
+				stats.bins[i][*data >> 2]++;
+				data++;
+			}
+		}
+	}
+
+	hgo_stats_format(&stats, image, histo);
+	return 0;
+}
+
+static const struct kernel_variant hgo_kernels[] = {
+	KERNEL_VARIANT("parallel", histogram_compute_hgo_parallel),
+	KERNEL_VARIANT("scalar", histogram_compute_hgo_scalar),
+};
+
+static int histogram_compute_hgo(const struct image *image, void *histo)
+{
+	return kernel_get(hgo_kernels, KERNEL_HGO, histogram_compute_hgo_scalar)
+		(image, histo);
+}
+
+/*
+ * The HGT histogram attributes the weight of each pixel to one or two hue
+ * areas depending on its H value only. All the per-pixel computation is thus
+ * precomputed in a 256 entries table indexed by the H value, storing the two
+ * areas and their respective weights. For H values inside a non-overlapping
+ * region the second area is identical to the first one and its weight is 0.
+ */
+struct hgt_table {
+	uint8_t area[256][2];
+	uint8_t weight[256][2];
+};
+
+struct hgt_stats {
+	uint8_t smin;
+	uint8_t smax;
+	uint32_t sum;
+	uint32_t hist[6][32];
+};
+
+struct hgt_job {
+	const struct image *image;
+	const struct hgt_table *table;
+	unsigned int num_slices;
+	struct hgt_stats *stats;
+	int ret;
+};
+
+static void hgt_table_init(struct hgt_table *table, const uint8_t hue_areas[12])
+{
+	uint8_t hue_indices[256];
+	unsigned int hue_index;
+	unsigned int h;
+
+	/*
+	 * Precompute the hue region index for all possible hue values. The
+	 * index starts at 0 for the overlapping region between hue areas 5
+	 * and 0.
+	 *
+	 * Hue area 0 can wrap around the H value space (for example include
+	 * values greater than 240 and lower than 30) depending on whether 0L
+	 * is higher than 5U or lower than 0U.
+	 *
+	 *              Area 0       Area 1       Area 2       Area 3       Area 4       Area 5       Area 0
+	 *             ________     ________     ________     ________     ________     ________     _____
+	 *        \   /|      |\   /|      |\   /|      |\   /|      |\   /|      |\   /|      |\   /|
+	 *         \ / |      | \ / |      | \ / |      | \ / |      | \ / |      | \ / |      | \ / |
+	 *          X  |      |  X  |      |  X  |      |  X  |      |  X  |      |  X  |      |  X  |
+	 *         / \ |      | / \ |      | / \ |      | / \ |      | / \ |      | / \ |      | / \ |
+	 *        /   \|      |/   \|      |/   \|      |/   \|      |/   \|      |/   \|      |/   \|
+	 *       5U   0L      0U   1L      1U   2L      2U   3L      3U   4L      4U   5L      5U   0L
+	 * RI   ]  0  ]   1  ]  2  ]   3  ]  4  ]   5  ]  6  ]   7  ]  8  ]   9  ]  10 ]  11  ]  0  ]   1
+	 *
+	 * NW  ..255><0.................................Hue Value..............................255><0.......
+	 * W   .......255><0.................................Hue Value..............................255><0..
+	 *
+	 * RI: Hue region index
+	 * W:  Area 0 wraps around the hue value space
+	 * NW: Area 0 doesn't wrap around the hue value space
+	 *
+	 * Boundary values are included in the lower-value region.
+	 */
+
+	/*
+	 * The first hue value after 5U falls in region index 0. However, if
+	 * 5U == 0L, areas 5 and 0 don't overlap, region index 0 is empty and
+	 * the first hue value falls in region index 1.
+	 *
+	 * Process the ]5U, 255] range first, followed by the [0, 5U] range.
+	 */
+	hue_index = hue_areas[11] == hue_areas[0] ? 1 : 0;
+
+	for (h = hue_areas[11] + 1; h <= 255; ++h) {
+		hue_indices[h] = hue_index;
+
+		if (h == hue_areas[hue_index])
+			hue_index++;
+	}
+
+	for (h = 0; h <= hue_areas[11]; ++h) {
+		hue_indices[h] = hue_index;
+
+		while (hue_index < 12 && h == hue_areas[hue_index])
+			hue_index++;
+	}
+
+	/*
+	 * Attribute the H value to area(s). If the H value is inside one of
+	 * the non-overlapping regions (hue_index is odd) the max weight (16)
+	 * is attributed to the corresponding area. Otherwise the weight is
+	 * split between the two adjacent areas based on the distance between
+	 * the H value and the areas boundaries.
+	 */
+	for (h = 0; h <= 255; ++h) {
+		unsigned int dist, width, weight;
+		unsigned int hue_index1, hue_index2;
+		int hue1, hue2;
+
+		hue_index = hue_indices[h];
+
+		if (hue_index % 2) {
+			table->area[h][0] = hue_index / 2;
+			table->area[h][1] = hue_index / 2;
+			table->weight[h][0] = 16;
+			table->weight[h][1] = 0;
+			continue;
+		}
+
+		hue_index1 = hue_index ? hue_index - 1 : 11;
+		hue_index2 = hue_index;
+
+		hue1 = hue_areas[hue_index1];
+		hue2 = hue_areas[hue_index2];
+
+		/*
+		 * Calculate the width to be attributed to the left area.
+		 * Handle the wraparound through modulo arithmetic.
+		 */
+		dist = (hue2 - h) & 255;
+		width = (hue2 - hue1) & 255;
+		weight = div_round_up(dist * 16, width);
+
+		/* Split weight between the two areas */
+		table->area[h][0] = hue_index1 / 2;
+		table->area[h][1] = hue_index2 / 2;
+		table->weight[h][0] = weight;
+		table->weight[h][1] = 16 - weight;
+	}
+}
+
+static void hgt_compute_slice(void *priv, unsigned int index)
+{
+	struct hgt_job *job = priv;
+	const struct image *image = job->image;
+	const struct hgt_table *table = job->table;
+	struct hgt_stats *stats = &job->stats[index];
+	const uint8_t *data;
+	uint8_t *line = NULL;
+	unsigned int start, end;
+	unsigned int x, y;
+
+	parallel_slice_range(image->height, job->num_slices, index,
+			     &start, &end);
+
+	memset(stats, 0, sizeof(*stats));
+	stats->smin = 255;
+
+	/* RGB images are converted to HSV one line at a time. */
+	if (image->format->type != FORMAT_HSV) {
+		line = malloc(image->width * 3);
+		if (!line) {
+			job->ret = -ENOMEM;
+			return;
+		}
+	}
+
+	data = image->data + start * image->width * 3;
+
+	for (y = start; y < end; ++y) {
+		const uint8_t *hsv = data;
+
+		if (line) {
+			hst_convert(data, line, image->width);
+			hsv = line;
+		}
+
+		for (x = 0; x < image->width; ++x, hsv += 3) {
+			unsigned int hist_n = hsv[1] / 8;
+			unsigned int h = hsv[0];
+
+			stats->smin = min(stats->smin, hsv[1]);
+			stats->smax = max(stats->smax, hsv[1]);
+			stats->sum += hsv[1];
+
+			stats->hist[table->area[h][0]][hist_n] += table->weight[h][0];
+			stats->hist[table->area[h][1]][hist_n] += table->weight[h][1];
+		}
+
+		data += image->width * 3;
+	}
+
+	free(line);
+}
+
+static void hgt_stats_format(const struct hgt_stats *stats, void *histo)
+{
+	unsigned int x, y;
+
+	/* Min/Max Value of S Components */
+	*(uint8_t *)histo++ = stats->smin;
+	*(uint8_t *)histo++ = 0;
+	*(uint8_t *)histo++ = stats->smax;
+	*(uint8_t *)histo++ = 0;
+
+	/* Sum of S Components */
+	histogram_write32(histo, stats->sum);
+	histo += 4;
+
+	/* Weighted Frequency of Hue Area-m and Saturation Area-n */
+	for (x = 0; x < 6; x++) {
+		for (y = 0; y < 32; y++) {
+			histogram_write32(histo, stats->hist[x][y]);
+			histo += 4;
+		}
+	}
+}
+
+static int histogram_compute_hgt_table(const struct image *image, void *histo,
+				       const uint8_t hue_areas[12])
+{
+	struct hgt_table table;
+	struct hgt_stats result;
+	struct hgt_job job;
+	unsigned int i, x, y;
+
+	hgt_table_init(&table, hue_areas);
+
+	job.image = image;
+	job.table = &table;
+	job.num_slices = parallel_num_slices(image->height);
+	job.ret = 0;
+	job.stats = calloc(job.num_slices, sizeof(*job.stats));
+	if (!job.stats)
+		return -ENOMEM;
+
+	/* The HST tables must be initialized before starting the threads. */
+	hst_init_tables();
+	parallel_run(job.num_slices, hgt_compute_slice, &job);
+
+	memset(&result, 0, sizeof(result));
+	result.smin = 255;
+
+	for (i = 0; i < job.num_slices; ++i) {
+		const struct hgt_stats *stats = &job.stats[i];
+
+		result.smin = min(result.smin, stats->smin);
+		result.smax = max(result.smax, stats->smax);
+		result.sum += stats->sum;
+
+		for (x = 0; x < 6; x++) {
+			for (y = 0; y < 32; y++)
+				result.hist[x][y] += stats->hist[x][y];
+		}
+	}
+
+	free(job.stats);
+
+	if (job.ret)
+		return job.ret;
+
+	hgt_stats_format(&result, histo);
+	return 0;
+}
+
+/*
+ * Reference implementation, computing the hue region index and the weights of
+ * every pixel.
+ */
+static int histogram_compute_hgt_scalar(const struct image *image, void *histo,
+					const uint8_t hue_areas[12])
+{
+	const uint8_t *data = image->data;
+	uint8_t hue_indices[256];
+	struct hgt_stats stats;
+	unsigned int hue_index;
+	unsigned int x, y;
+	unsigned int h;
+
+	memset(&stats, 0, sizeof(stats));
+	stats.smin = 255;
+
+	/* See hgt_table_init() for the hue regions layout. */
+	hue_index = hue_areas[11] == hue_areas[0] ? 1 : 0;
+
+	for (h = hue_areas[11] + 1; h <= 255; ++h) {
+		hue_indices[h] = hue_index;
+
+		if (h == hue_areas[hue_index])
+			hue_index++;
+	}
+
+	for (h = 0; h <= hue_areas[11]; ++h) {
+		hue_indices[h] = hue_index;
+
+		while (hue_index < 12 && h == hue_areas[hue_index])
+			hue_index++;
+	}
+
+	for (y = 0; y < image->height; ++y) {
+		for (x = 0; x < image->width; ++x) {
+			unsigned int hist_n;
+			uint8_t hsv[3];
+
+			if (image->format->type == FORMAT_HSV)
+				memcpy(hsv, data, 3);
+			else
+				hst_rgb_to_hsv(data, hsv);
+			data += 3;
+
+			stats.smin = min(stats.smin, hsv[1]);
+			stats.smax = max(stats.smax, hsv[1]);
+			stats.sum += hsv[1];
+
+			hist_n = hsv[1] / 8;
+			hue_index = hue_indices[hsv[0]];
+
+			if (hue_index % 2) {
+				stats.hist[hue_index/2][hist_n] += 16;
+			} else {
+				unsigned int dist, width, weight;
+				unsigned int hue_index1, hue_index2;
+				int hue1, hue2;
+
+				hue_index1 = hue_index ? hue_index - 1 : 11;
+				hue_index2 = hue_index;
+
+				hue1 = hue_areas[hue_index1];
+				hue2 = hue_areas[hue_index2];
+
+				dist = (hue2 - hsv[0]) & 255;
+				width = (hue2 - hue1) & 255;
+				weight = div_round_up(dist * 16, width);
+
+				stats.hist[hue_index1/2][hist_n] += weight;
+				stats.hist[hue_index2/2][hist_n] += 16 - weight;
+			}
+		}
+	}
+
+	hgt_stats_format(&stats, histo);
+	return 0;
+}
+
+static const struct kernel_variant hgt_kernels[] = {
+	KERNEL_VARIANT("table", histogram_compute_hgt_table),
+	KERNEL_VARIANT("scalar", histogram_compute_hgt_scalar),
+};
+
+static int histogram_compute_hgt(const struct image *image, void *histo,
+				 const uint8_t hue_areas[12])
+{
+	return kernel_get(hgt_kernels, KERNEL_HGT, histogram_compute_hgt_scalar)
+		(image, histo, hue_areas);
+}
+
+#define HISTOGRAM_HGO_SIZE	(3*4 + 3*4 + 3*64*4)
+#define HISTOGRAM_HGT_SIZE	(1*4 + 1*4 + 6*32*4)
+
+/*
+ * Histogram windows
+ *
+ * The HGO and HGT can compute histograms on a crop window of their input,
+ * optionally subsampled by a factor of 2 or 4 in both directions through the
+ * compose rectangle. To test many windows on the same frame, the frame is
+ * split in tiles of HISTO_TILE_SIZE x HISTO_TILE_SIZE pixels, and the tile
+ * statistics are accumulated in integral (summed-area) tables. The bins and
+ * sums of the tiles fully contained in a window are then obtained with four
+ * table lookups, and only the pixels on the window edges are processed
+ * individually.
+ *
+ * Subsampling selects the pixels at positions (left + i * N, top + j * N). A
+ * subsampled plane is created for each subsampling phase used by the windows.
+ */
+#define HISTO_TILE_SIZE		16
+#define HISTO_MAX_PLANES	(1 + 2 * 2 + 4 * 4)
+
+struct histo_cell {
+	uint32_t sums[3];
+	uint32_t bins[192];
+};
+
+struct histo_tile {
+	uint8_t min[3];
+	uint8_t max[3];
+};
+
+struct histo_plane {
+	struct image *image;
+	const uint8_t *data;
+	unsigned int width;
+	unsigned int height;
+
+	unsigned int tiles_x;
+	unsigned int tiles_y;
+	struct histo_tile *tiles;
+	struct histo_cell *integral;
+};
+
+struct histo_engine {
+	enum histogram_type type;
+	struct hgt_table hgt;
+	const struct image *image;
+	struct histo_plane *planes[HISTO_MAX_PLANES];
+};
+
+static void histo_cell_add(const struct histo_engine *engine,
+			   struct histo_cell *cell, struct histo_tile *tile,
+			   const uint8_t *pixel)
+{
+	const struct hgt_table *hgt = &engine->hgt;
+	unsigned int hist_n;
+	unsigned int k;
+
+	if (engine->type == HISTOGRAM_HGO) {
+		for (k = 0; k < 3; ++k) {
+			tile->min[k] = min(tile->min[k], pixel[k]);
+			tile->max[k] = max(tile->max[k], pixel[k]);
+			cell->sums[k] += pixel[k];
+			cell->bins[k * 64 + pixel[k] / 4]++;
+		}
+		return;
+	}
+
+	tile->min[0] = min(tile->min[0], pixel[1]);
+	tile->max[0] = max(tile->max[0], pixel[1]);
+	cell->sums[0] += pixel[1];
+
+	hist_n = pixel[1] / 8;
+	cell->bins[hgt->area[pixel[0]][0] * 32 + hist_n] += hgt->weight[pixel[0]][0];
+	cell->bins[hgt->area[pixel[0]][1] * 32 + hist_n] += hgt->weight[pixel[0]][1];
+}
+
+static void histo_plane_delete(struct histo_plane *plane)
+{
+	if (!plane)
+		return;
+
+	image_delete(plane->image);
+	free(plane->tiles);
+	free(plane->integral);
+	free(plane);
+}
+
+struct histo_plane_job {
+	const struct histo_engine *engine;
+	struct histo_plane *plane;
+	unsigned int num_slices;
+};
+
+/* Compute the statistics of each tile, stored in integral[ty + 1][tx + 1]. */
+static void histo_plane_compute_slice(void *priv, unsigned int index)
+{
+	struct histo_plane_job *job = priv;
+	struct histo_plane *plane = job->plane;
+	unsigned int start, end;
+	unsigned int tx, ty;
+	unsigned int x, y;
+
+	parallel_slice_range(plane->tiles_y, job->num_slices, index,
+			     &start, &end);
+
+	for (ty = start; ty < end; ++ty) {
+		for (tx = 0; tx < plane->tiles_x; ++tx) {
+			struct histo_tile *tile = &plane->tiles[ty * plane->tiles_x + tx];
+			struct histo_cell *cell =
+				&plane->integral[(ty + 1) * (plane->tiles_x + 1) + tx + 1];
+			unsigned int x1 = min((tx + 1) * HISTO_TILE_SIZE, plane->width);
+			unsigned int y1 = min((ty + 1) * HISTO_TILE_SIZE, plane->height);
+
+			memset(tile->min, 255, sizeof(tile->min));
+
+			for (y = ty * HISTO_TILE_SIZE; y < y1; ++y) {
+				const uint8_t *pixel = plane->data
+						     + (y * plane->width + tx * HISTO_TILE_SIZE) * 3;
+
+				for (x = tx * HISTO_TILE_SIZE; x < x1; ++x, pixel += 3)
+					histo_cell_add(job->engine, cell, tile, pixel);
+			}
+		}
+	}
+}
+
+static struct histo_plane *histo_plane_new(const struct histo_engine *engine,
+					   unsigned int subsample,
+					   unsigned int phase_x,
+					   unsigned int phase_y)
+{
+	const struct image *image = engine->image;
+	struct histo_plane_job job;
+	struct histo_plane *plane;
+	unsigned int stride;
+	unsigned int x, y, i;
+
+	plane = calloc(1, sizeof(*plane));
+	if (!plane)
+		return NULL;
+
+	if (subsample == 1) {
+		plane->data = image->data;
+		plane->width = image->width;
+		plane->height = image->height;
+	} else {
+		uint8_t *data;
+
+		plane->width = (image->width - phase_x + subsample - 1) / subsample;
+		plane->height = (image->height - phase_y + subsample - 1) / subsample;
+		plane->image = image_new(image->format, plane->width,
+					 plane->height);
+		if (!plane->image)
+			goto error;
+
+		data = plane->image->data;
+
+		for (y = 0; y < plane->height; ++y) {
+			const uint8_t *src = image->data
+					   + ((y * subsample + phase_y) * image->width
+					      + phase_x) * 3;
+
+			for (x = 0; x < plane->width; ++x) {
+				memcpy(data, src, 3);
+				src += subsample * 3;
+				data += 3;
+			}
+		}
+
+		plane->data = plane->image->data;
+	}
+
+	plane->tiles_x = div_round_up(plane->width, HISTO_TILE_SIZE);
+	plane->tiles_y = div_round_up(plane->height, HISTO_TILE_SIZE);
+	stride = plane->tiles_x + 1;
+
+	plane->tiles = calloc(plane->tiles_x * plane->tiles_y,
+			      sizeof(*plane->tiles));
+	plane->integral = calloc(stride * (plane->tiles_y + 1),
+				 sizeof(*plane->integral));
+	if (!plane->tiles || !plane->integral)
+		goto error;
+
+	job.engine = engine;
+	job.plane = plane;
+	job.num_slices = parallel_num_slices(plane->tiles_y);
+	parallel_run(job.num_slices, histo_plane_compute_slice, &job);
+
+	/*
+	 * Turn the tile statistics into integral tables. The sums wrap around
+	 * modulo 2^32, which the subtractions in histo_plane_query() undo.
+	 */
+	for (y = 1; y <= plane->tiles_y; ++y) {
+		for (x = 1; x <= plane->tiles_x; ++x) {
+			struct histo_cell *cell = &plane->integral[y * stride + x];
+			const struct histo_cell *left = cell - 1;
+			const struct histo_cell *top = cell - stride;
+			const struct histo_cell *diag = cell - stride - 1;
+
+			for (i = 0; i < ARRAY_SIZE(cell->sums); ++i)
+				cell->sums[i] += left->sums[i] + top->sums[i]
+					       - diag->sums[i];
+			for (i = 0; i < ARRAY_SIZE(cell->bins); ++i)
+				cell->bins[i] += left->bins[i] + top->bins[i]
+					       - diag->bins[i];
+		}
+	}
+
+	return plane;
+
+error:
+	histo_plane_delete(plane);
+	return NULL;
+}
+
+/*
+ * Compute the statistics of the (x0,y0)/wxh rectangle of the plane. The tiles
+ * fully covered by the rectangle are looked up in the integral tables, the
+ * remaining pixels are accumulated individually.
+ */
+static void histo_plane_query(const struct histo_engine *engine,
+			      const struct histo_plane *plane,
+			      unsigned int x0, unsigned int y0,
+			      unsigned int w, unsigned int h,
+			      struct histo_cell *cell, struct histo_tile *range)
+{
+	unsigned int stride = plane->tiles_x + 1;
+	unsigned int tx0 = div_round_up(x0, HISTO_TILE_SIZE);
+	unsigned int ty0 = div_round_up(y0, HISTO_TILE_SIZE);
+	unsigned int tx1 = (x0 + w) / HISTO_TILE_SIZE;
+	unsigned int ty1 = (y0 + h) / HISTO_TILE_SIZE;
+	unsigned int ix0, ix1, iy0, iy1;
+	unsigned int x, y, i;
+
+	memset(cell, 0, sizeof(*cell));
+	memset(range->min, 255, sizeof(range->min));
+	memset(range->max, 0, sizeof(range->max));
+
+	if (tx0 < tx1 && ty0 < ty1) {
+		const struct histo_cell *c00 = &plane->integral[ty0 * stride + tx0];
+		const struct histo_cell *c01 = &plane->integral[ty0 * stride + tx1];
+		const struct histo_cell *c10 = &plane->integral[ty1 * stride + tx0];
+		const struct histo_cell *c11 = &plane->integral[ty1 * stride + tx1];
+
+		for (i = 0; i < ARRAY_SIZE(cell->sums); ++i)
+			cell->sums[i] = c11->sums[i] - c01->sums[i]
+				      - c10->sums[i] + c00->sums[i];
+		for (i = 0; i < ARRAY_SIZE(cell->bins); ++i)
+			cell->bins[i] = c11->bins[i] - c01->bins[i]
+				      - c10->bins[i] + c00->bins[i];
+
+		for (y = ty0; y < ty1; ++y) {
+			for (x = tx0; x < tx1; ++x) {
+				const struct histo_tile *tile =
+					&plane->tiles[y * plane->tiles_x + x];
+
+				for (i = 0; i < ARRAY_SIZE(range->min); ++i) {
+					range->min[i] = min(range->min[i], tile->min[i]);
+					range->max[i] = max(range->max[i], tile->max[i]);
+				}
+			}
+		}
+
+		ix0 = tx0 * HISTO_TILE_SIZE;
+		ix1 = tx1 * HISTO_TILE_SIZE;
+		iy0 = ty0 * HISTO_TILE_SIZE;
+		iy1 = ty1 * HISTO_TILE_SIZE;
+	} else {
+		ix0 = ix1 = x0;
+		iy0 = iy1 = y0;
+	}
+
+	/* Accumulate the pixels outside of the [ix0, ix1[ x [iy0, iy1[ area. */
+	for (y = y0; y < y0 + h; ++y) {
+		const uint8_t *line = plane->data + y * plane->width * 3;
+		bool inner = y >= iy0 && y < iy1;
+
+		for (x = x0; x < x0 + w; ++x) {
+			if (inner && x == ix0)
+				x = ix1;
+			if (x >= x0 + w)
+				break;
+
+			histo_cell_add(engine, cell, range, &line[x * 3]);
+		}
+	}
+}
+
+static int histogram_write(const char *filename, const void *data, size_t size)
+{
+	int ret;
+	int fd;
+
+	fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC,
+		  S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	if (fd < 0) {
+		printf("Unable to open histogram file %s: %s (%d)\n", filename,
+		       strerror(errno), errno);
+		return -errno;
+	}
+
+	ret = file_write(fd, data, size);
+	if (ret < 0)
+		printf("Unable to write histogram: %s (%d)\n",
+		       strerror(-ret), ret);
+
+	close(fd);
+	return ret;
+}
+
+/* Replace the first '#' in the file name template with the window index. */
+static char *histogram_window_filename(const char *template, unsigned int index)
+{
+	const char *hash = strchr(template, '#');
+	size_t size = strlen(template) + 11;
+	char *filename;
+
+	filename = malloc(size);
+	if (!filename)
+		return NULL;
+
+	snprintf(filename, size, "%.*s%u%s", (int)(hash - template), template,
+		 index, hash + 1);
+	return filename;
+}
+
+static size_t histogram_size(enum histogram_type type)
+{
+	return type == HISTOGRAM_HGO ? HISTOGRAM_HGO_SIZE : HISTOGRAM_HGT_SIZE;
+}
+
+/*
+ * Compute the histograms of all windows, storing them consecutively in the data
+ * buffer.
+ */
+static int histogram_windows(const struct image *image, void *data,
+			     enum histogram_type type,
+			     const uint8_t hgt_hue_areas[12],
+			     const struct histogram_window *windows,
+			     unsigned int num_windows)
+{
+	struct image *hsv = NULL;
+	struct histo_engine *engine;
+	unsigned int i, k;
+	int ret = 0;
+
+	engine = calloc(1, sizeof(*engine));
+	if (!engine)
+		return -ENOMEM;
+
+	engine->type = type;
+	engine->image = image;
+
+	/* The HGT operates on HSV data, convert the image once if needed. */
+	if (type == HISTOGRAM_HGT) {
+		hgt_table_init(&engine->hgt, hgt_hue_areas);
+
+		if (image->format->type != FORMAT_HSV) {
+			hsv = image_new(format_by_name("HSV24"), image->width,
+					image->height);
+			if (!hsv) {
+				ret = -ENOMEM;
+				goto done;
+			}
+
+			image_rgb_to_hsv(image, hsv, NULL);
+			engine->image = hsv;
+		}
+	}
+
+	for (i = 0; i < num_windows; ++i) {
+		const struct histogram_window *window = &windows[i];
+		const struct image_rect *crop = &window->crop;
+		unsigned int n = window->subsample;
+		unsigned int phase_x = crop->left % n;
+		unsigned int phase_y = crop->top % n;
+		unsigned int index = n == 1 ? 0 : n == 2 ? 1 : 5;
+		struct histo_plane *plane;
+		struct histo_cell cell;
+		struct histo_tile range;
+		uint8_t *histo = (uint8_t *)data + i * histogram_size(type);
+
+		if (crop->left + crop->width > image->width ||
+		    crop->top + crop->height > image->height) {
+			printf("Histogram window %u (%d,%d)/%ux%u out of image bounds\n",
+			       i, crop->left, crop->top, crop->width,
+			       crop->height);
+			ret = -EINVAL;
+			goto done;
+		}
+
+		index += phase_y * n + phase_x;
+		plane = engine->planes[index];
+		if (!plane) {
+			plane = histo_plane_new(engine, n, phase_x, phase_y);
+			if (!plane) {
+				ret = -ENOMEM;
+				goto done;
+			}
+
+			engine->planes[index] = plane;
+		}
+
+		histo_plane_query(engine, plane, crop->left / n, crop->top / n,
+				  crop->width / n, crop->height / n, &cell,
+				  &range);
+
+		if (type == HISTOGRAM_HGO) {
+			struct hgo_stats stats;
+
+			memcpy(stats.min, range.min, sizeof(stats.min));
+			memcpy(stats.max, range.max, sizeof(stats.max));
+			memcpy(stats.sums, cell.sums, sizeof(stats.sums));
+			memcpy(stats.bins, cell.bins, sizeof(stats.bins));
+
+			hgo_stats_format(&stats, image, histo);
+		} else {
+			struct hgt_stats stats;
+
+			stats.smin = range.min[0];
+			stats.smax = range.max[0];
+			stats.sum = cell.sums[0];
+			memcpy(stats.hist, cell.bins, sizeof(stats.hist));
+
+			hgt_stats_format(&stats, histo);
+		}
+	}
+
+done:
+	for (k = 0; k < ARRAY_SIZE(engine->planes); ++k)
+		histo_plane_delete(engine->planes[k]);
+	image_delete(hsv);
+	free(engine);
+	return ret < 0 ? ret : 0;
+}
+
+/*
+ * Compute the histogram of the whole image. The data buffer must be
+ * histogram_size(type) bytes long.
+ *
+ * HGO: (3 + 3 + 3*64) * 4 = 792
+ * HGT: (1 + 1 + 6*32) * 4 = 776
+ */
+static int histogram(const struct image *image, void *data,
+		     enum histogram_type type, const uint8_t hgt_hue_areas[12])
+{
+	switch (type) {
+	case HISTOGRAM_HGO:
+		return histogram_compute_hgo(image, data);
+	case HISTOGRAM_HGT:
+		return histogram_compute_hgt(image, data, hgt_hue_areas);
+	default:
+		printf("Unknown histogram type\n");
+		return -EINVAL;
+	}
+}
+
+/* -----------------------------------------------------------------------------
+ * Processing pipeline
+ */
+
+/* Size of the histogram data produced by the pipeline, for all windows. */
+static size_t process_histogram_size(const struct options *options)
+{
+	return histogram_size(options->histo_type)
+	     * max(options->num_histo_windows, 1U);
+}
+
+static int process_histogram(const struct image *image,
+			     const struct options *options, void *histo)
+{
+	if (options->num_histo_windows)
+		return histogram_windows(image, histo, options->histo_type,
+					 options->histo_areas,
+					 options->histo_windows,
+					 options->num_histo_windows);
+
+	return histogram(image, histo, options->histo_type,
+			 options->histo_areas);
+}
+
+/*
+ * Store the histogram data to a file, or to one file per window with the '#' in
+ * the file name replaced by the window index. The histogram of a single window
+ * is stored to the file name as-is if it contains no '#'.
+ */
+static int process_histogram_write(const char *filename,
+				   const struct options *options,
+				   const uint8_t *histo)
+{
+	size_t size = histogram_size(options->histo_type);
+	unsigned int i;
+	int ret;
+
+	if (!options->num_histo_windows ||
+	    (options->num_histo_windows == 1 && !strchr(filename, '#')))
+		return histogram_write(filename, histo, size);
+
+	for (i = 0; i < options->num_histo_windows; ++i) {
+		char *name;
+
+		name = histogram_window_filename(filename, i);
+		if (!name)
+			return -ENOMEM;
+
+		ret = histogram_write(name, histo + i * size, size);
+		free(name);
+		if (ret < 0)
+			return ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Compute the size of the pipeline output for an input of the given size. The
+ * image is scaled to the transposed size before rotation, the output size is
+ * thus never swapped.
+ */
+static void process_output_size(const struct options *options,
+				unsigned int width, unsigned int height,
+				unsigned int *output_width,
+				unsigned int *output_height)
+{
+	if (options->output_width && options->output_height) {
+		width = options->output_width;
+		height = options->output_height;
+	} else if (options->crop) {
+		width = options->inputcrop.width;
+		height = options->inputcrop.height;
+	}
+
+	*output_width = width;
+	*output_height = height;
+}
+
+/*
+ * Convert an input image to the YUV24 or RGB24 format used by the processing
+ * pipeline. Return the input image itself if no conversion is needed.
+ */
+static struct image *process_convert(const struct image *input,
+				     const struct options *options)
+{
+	struct profile_mark mark;
+	struct image *converted;
+
+	profile_mark(&mark);
+
+	if (options->input_format->type == FORMAT_YUV) {
+		converted = image_new(format_by_name("YUV24"), input->width,
+				      input->height);
+		if (converted)
+			image_colorspace_rgb_to_yuv(input, converted,
+						    options->input_format,
+						    &options->params);
+	} else if (options->input_format->rgb.bpp < 24) {
+		converted = image_new(format_by_name("RGB24"), input->width,
+				      input->height);
+		if (converted)
+			image_convert_rgb_to_rgb(input, converted,
+						 options->input_format);
+	} else {
+		return (struct image *)input;
+	}
+
+	if (converted)
+		profile_record("colorspace", &mark,
+			       input->width * input->height,
+			       input->size + converted->size);
+
+	return converted;
+}
+
+/* Read an input image and convert it for the processing pipeline. */
+static struct image *process_read(const char *filename,
+				  const struct options *options)
+{
+	struct profile_mark mark;
+	struct image *input;
+	struct image *converted;
+
+	profile_mark(&mark);
+	input = image_read(filename);
+	if (!input)
+		return NULL;
+
+	profile_record("read", &mark, input->width * input->height,
+		       input->size);
+
+	converted = process_convert(input, options);
+	if (converted != input)
+		image_delete(input);
+
+	return converted;
+}
+
+/*
+ * Replace the pipeline image with the output of a stage. The source image is
+ * owned by the caller and is never freed.
+ */
+static void process_replace(struct image **input, struct image *image,
+			    const struct image *source)
+{
+	if (*input != source)
+		image_delete(*input);
+	*input = image;
+}
+
+/*
+ * Build the compositor layers from the --compose and --layer options. Layers
+ * without a file name use the pipeline input image. Images allocated for the
+ * layers are stored in the images array for the caller to free.
+ */
+static int process_layers(struct image *input, const struct options *options,
+			  struct compose_layer *layers, struct image **images,
+			  unsigned int *num_layers)
+{
+	unsigned int offset = 50;
+	unsigned int count = 0;
+	unsigned int n = 0;
+	unsigned int i;
+
+	for (i = 0; i < options->compose; ++i) {
+		if (offset >= input->width || offset >= input->height)
+			break;
+
+		layers[count].image = input;
+		layers[count].mask = NULL;
+		layers[count].left = offset;
+		layers[count].top = offset;
+		layers[count].alpha = 255;
+		count++;
+
+		offset += 50;
+	}
+
+	for (i = 0; i < options->num_layers; ++i) {
+		const struct layer_spec *spec = &options->layers[i];
+		struct compose_layer *layer = &layers[count++];
+		struct image *image;
+		struct image *mask = NULL;
+		unsigned int width;
+		unsigned int height;
+		int ret;
+
+		if (spec->filename) {
+			image = process_read(spec->filename, options);
+			if (!image)
+				return -EINVAL;
+			images[n++] = image;
+		} else {
+			image = input;
+		}
+
+		if (spec->mask_filename) {
+			mask = image_read(spec->mask_filename);
+			if (!mask)
+				return -EINVAL;
+			images[n++] = mask;
+		}
+
+		width = spec->width ? spec->width : image->width;
+		height = spec->height ? spec->height : image->height;
+
+		if (image->width != width || image->height != height) {
+			struct image *scaled;
+
+			scaled = image_new(image->format, width, height);
+			if (!scaled)
+				return -ENOMEM;
+			images[n++] = scaled;
+
+			ret = image_scale(image, scaled, &options->params);
+			if (ret)
+				return ret;
+
+			image = scaled;
+		}
+
+		if (mask && (mask->width != width || mask->height != height)) {
+			struct image *scaled;
+
+			scaled = image_new(mask->format, width, height);
+			if (!scaled)
+				return -ENOMEM;
+			images[n++] = scaled;
+
+			ret = image_scale(mask, scaled, &options->params);
+			if (ret)
+				return ret;
+
+			mask = scaled;
+		}
+
+		layer->image = image;
+		layer->mask = mask;
+		layer->left = spec->left;
+		layer->top = spec->top;
+		layer->alpha = spec->alpha;
+	}
+
+	*num_layers = count;
+	return 0;
+}
+
+/*
+ * Run the processing pipeline on the source image and format the result into
+ * the output image, which must match the output format and size. The
+ * histogram is computed into histo when not NULL.
+ */
+static int process(const struct options *options, const struct image *source,
+		   struct image *output, void *histo)
+{
+	struct image *input;
+	unsigned int output_width;
+	unsigned int output_height;
+	struct profile_mark mark;
+	bool hgt_deferred;
+	unsigned int i;
+	int ret = 0;
+
+	process_output_size(options, source->width, source->height,
+			    &output_width, &output_height);
+
+	if (output->format != options->output_format ||
+	    output->width != output_width || output->height != output_height) {
+		printf("Output image %s %ux%u doesn't match pipeline output %s %ux%u\n",
+		       output->format->name, output->width, output->height,
+		       options->output_format->name, output_width,
+		       output_height);
+		return -EINVAL;
+	}
+
+	/* Convert the input image */
+	input = process_convert(source, options);
+	if (!input)
+		return -ENOMEM;
+
+	/* Crop */
+	if (options->crop) {
+		struct image *cropped;
+
+		cropped = image_new(input->format, options->inputcrop.width,
+				options->inputcrop.height);
+		if (!cropped) {
+			ret = -ENOMEM;
+			goto done;
+		}
+
+		profile_mark(&mark);
+		image_crop(input, cropped, &options->inputcrop);
+		profile_record("crop", &mark, cropped->width * cropped->height,
+			       cropped->size * 2);
+		process_replace(&input, cropped, source);
+	}
+
+	/* Scale */
+	if (options->rotate)
+		swap(output_width, output_height);
+
+	if (input->width != output_width ||
+	    input->height != output_height) {
+		struct image *scaled;
+
+		scaled = image_new(input->format, output_width, output_height);
+		if (!scaled) {
+			ret = -ENOMEM;
+			goto done;
+		}
+
+		profile_mark(&mark);
+		ret = image_scale(input, scaled, &options->params);
+		profile_record("scale", &mark, scaled->width * scaled->height,
+			       input->size + scaled->size);
+		process_replace(&input, scaled, source);
+		if (ret)
+			goto done;
+	}
+
+	/* Compose */
+	if (options->compose || options->num_layers) {
+		struct compose_layer *layers;
+		struct image **images;
+		struct image *composed;
+		unsigned int num_layers;
+
+		layers = calloc(options->compose + options->num_layers,
+				sizeof(*layers));
+		images = calloc(options->num_layers * 4 + 1, sizeof(*images));
+		composed = image_new(input->format, input->width, input->height);
+		if (!layers || !images || !composed) {
+			ret = -ENOMEM;
+		} else {
+			ret = process_layers(input, options, layers, images,
+					     &num_layers);
+			if (!ret) {
+				profile_mark(&mark);
+				image_compose(composed, layers, num_layers);
+				profile_record("compose", &mark,
+					       composed->width * composed->height,
+					       composed->size * (num_layers + 1));
+			}
+		}
+
+		for (i = 0; images && images[i]; ++i)
+			image_delete(images[i]);
+		free(images);
+		free(layers);
+
+		process_replace(&input, composed, source);
+		if (ret)
+			goto done;
+	}
+
+	/* Look-up tables */
+	if (options->lut_filename) {
+		uint8_t table[1024];
+		struct image *lut;
+
+		ret = lut_file_read(options->lut_filename, table, sizeof(table),
+				    "1D");
+		if (ret)
+			goto done;
+
+		lut = image_new(input->format, input->width, input->height);
+		if (!lut) {
+			ret = -ENOMEM;
+			goto done;
+		}
+
+		profile_mark(&mark);
+		image_lut_1d(input, lut, table);
+		profile_record("lut", &mark, lut->width * lut->height,
+			       lut->size * 2);
+		process_replace(&input, lut, source);
+	}
+
+	if (options->clu_filename) {
+		uint32_t table[17*17*17];
+		struct image *clu;
+
+		ret = lut_file_read(options->clu_filename, table, sizeof(table),
+				    "3D");
+		if (ret)
+			goto done;
+
+		clu = image_new(input->format, input->width, input->height);
+		if (!clu) {
+			ret = -ENOMEM;
+			goto done;
+		}
+
+		/*
+		 * The scalar 3D LUT interpolates with floating point
+		 * arithmetic, use the integer implementation in strict mode
+		 * regardless of the kernel selection.
+		 */
+		profile_mark(&mark);
+		if (options->params.strict)
+			ret = image_lut_3d_simd(input, clu, table);
+		else
+			ret = image_lut_3d(input, clu, table);
+		profile_record("clu", &mark, clu->width * clu->height,
+			       clu->size * 2);
+		process_replace(&input, clu, source);
+		if (ret)
+			goto done;
+	}
+
+	/*
+	 * Compute the histogram. The HGT histogram operates on HSV data. If
+	 * the output format is HSV, defer the computation until after the
+	 * conversion to avoid converting the image twice. The histogram
+	 * doesn't depend on the pixels order, rotation and flipping don't
+	 * affect it.
+	 */
+	hgt_deferred = histo &&
+		       options->histo_type == HISTOGRAM_HGT &&
+		       options->output_format->type == FORMAT_HSV;
+
+	if (histo && !hgt_deferred) {
+		profile_mark(&mark);
+		ret = process_histogram(input, options, histo);
+		profile_record("histogram", &mark, input->width * input->height,
+			       input->size);
+		if (ret)
+			goto done;
+	}
+
+	/* Rotation and flipping */
+	if (options->rotate) {
+		struct image *rotated;
+
+		rotated = image_new(input->format, input->height, input->width);
+		if (!rotated) {
+			ret = -ENOMEM;
+			goto done;
+		}
+
+		profile_mark(&mark);
+		image_rotate(input, rotated, options->hflip, options->vflip);
+		profile_record("rotate", &mark, rotated->width * rotated->height,
+			       rotated->size * 2);
+		process_replace(&input, rotated, source);
+	} else if (options->hflip || options->vflip) {
+		struct image *flipped;
+
+		flipped = image_new(input->format, input->width, input->height);
+		if (!flipped) {
+			ret = -ENOMEM;
+			goto done;
+		}
+
+		profile_mark(&mark);
+		image_flip(input, flipped, options->hflip, options->vflip);
+		profile_record("flip", &mark, flipped->width * flipped->height,
+			       flipped->size * 2);
+		process_replace(&input, flipped, source);
+	}
+
+	/* Format the output */
+	if (input->format->type != options->output_format->type &&
+	    input->format->type != FORMAT_RGB) {
+		printf("Format conversion with non-RGB input not supported\n");
+		ret = -EINVAL;
+		goto done;
+	}
+
+	if (input->format->type != options->output_format->type) {
+		const struct format_info *format;
+		struct image *converted;
+
+		if (options->output_format->type == FORMAT_YUV)
+			format = format_by_name("YUV24");
+		else
+			format = format_by_name("HSV24");
+
+		converted = image_new(format, input->width, input->height);
+		if (!converted) {
+			ret = -ENOMEM;
+			goto done;
+		}
+
+		profile_mark(&mark);
+
+		if (options->output_format->type == FORMAT_YUV)
+			image_colorspace_rgb_to_yuv(input, converted, format,
+						    &options->params);
+		else
+			image_rgb_to_hsv(input, converted, &options->params);
+
+		profile_record("colorspace", &mark,
+			       converted->width * converted->height,
+			       input->size + converted->size);
+		process_replace(&input, converted, source);
+	}
+
+	if (hgt_deferred) {
+		profile_mark(&mark);
+		ret = process_histogram(input, options, histo);
+		profile_record("histogram", &mark, input->width * input->height,
+			       input->size);
+		if (ret)
+			goto done;
+	}
+
+	profile_mark(&mark);
+	ret = image_format(input, output, &options->params);
+	if (ret < 0) {
+		printf("Output formatting failed\n");
+		goto done;
+	}
+
+	profile_record("format", &mark, output->width * output->height,
+		       input->size + output->size);
+
+	ret = 0;
+
+done:
+	if (input != source)
+		image_delete(input);
+	return ret;
+}
+
+/* -----------------------------------------------------------------------------
+ * Frame verification
+ *
+ * Captured frames are compared with a reference image line by line. The lines
+ * of the reference are hashed once, each captured frame is then mapped in
+ * memory and its lines hashed and compared with the reference hashes. Only the
+ * lines whose hash differs are compared byte by byte to locate the
+ * differences.
+ */
+
+static uint64_t compare_hash(const uint8_t *data, unsigned int size)
+{
+	uint64_t hash = 0x9e3779b97f4a7c15ULL ^ size;
+	uint64_t value;
+
+	for (; size >= 8; data += 8, size -= 8) {
+		memcpy(&value, data, 8);
+		hash = (hash ^ value) * 0xff51afd7ed558ccdULL;
+		hash ^= hash >> 29;
+	}
+
+	value = 0;
+	memcpy(&value, data, size);
+	hash = (hash ^ value) * 0xff51afd7ed558ccdULL;
+
+	return hash ^ (hash >> 32);
+}
+
+struct compare_reference {
+	const struct image *image;
+	struct image_plane planes[3];
+	unsigned int num_planes;
+	uint64_t *hashes;
+};
+
+/* Bounding box of the differences in a plane, in lines and byte columns. */
+struct compare_region {
+	unsigned int lines;
+	unsigned int first_line;
+	unsigned int first_column;
+	unsigned int left;
+	unsigned int right;
+	unsigned int top;
+	unsigned int bottom;
+};
+
+static int compare_reference_init(struct compare_reference *ref,
+				  const struct image *image)
+{
+	unsigned int num_lines = 0;
+	unsigned int i, y;
+
+	ref->image = image;
+	ref->num_planes = image_planes(image, ref->planes);
+
+	for (i = 0; i < ref->num_planes; ++i)
+		num_lines += div_round_up(ref->planes[i].size,
+					  ref->planes[i].stride);
+
+	ref->hashes = malloc(max(num_lines, 1U) * sizeof(*ref->hashes));
+	if (!ref->hashes)
+		return -ENOMEM;
+
+	for (i = 0, num_lines = 0; i < ref->num_planes; ++i) {
+		const struct image_plane *plane = &ref->planes[i];
+		const uint8_t *data = image->data + plane->offset;
+
+		for (y = 0; y * plane->stride < plane->size; ++y) {
+			unsigned int offset = y * plane->stride;
+
+			ref->hashes[num_lines++] =
+				compare_hash(data + offset,
+					     min(plane->stride,
+						 plane->size - offset));
+		}
+	}
+
+	return 0;
+}
+
+/* Locate the differences in a line and extend the region to include them. */
+static void compare_line(struct compare_region *region, const uint8_t *a,
+			 const uint8_t *b, unsigned int size, unsigned int y)
+{
+	unsigned int left = 0;
+	unsigned int right = size;
+
+	while (left < size && a[left] == b[left])
+		left++;
+
+	/* Colliding hashes, the line is identical. */
+	if (left == size)
+		return;
+
+	while (a[right - 1] == b[right - 1])
+		right--;
+
+	if (!region->lines) {
+		region->first_line = y;
+		region->first_column = left;
+		region->left = left;
+		region->right = right;
+		region->top = y;
+	}
+
+	region->left = min(region->left, left);
+	region->right = max(region->right, right);
+	region->bottom = y + 1;
+	region->lines++;
+}
+
+/*
+ * Compare a captured frame with the reference. Return 0 if the frame matches,
+ * 1 if it differs, or a negative error code.
+ */
+static int compare_frame(const struct compare_reference *ref,
+			 const char *filename)
+{
+	struct compare_region regions[3] = { };
+	const struct image *image = ref->image;
+	const uint64_t *hash = ref->hashes;
+	struct frame_file frame;
+	const uint8_t *data;
+	bool differs = false;
+	unsigned int i, y;
+	int ret = 0;
+
+	ret = frame_open(&frame, filename);
+	if (ret < 0)
+		return ret;
+
+	if (frame.size != image->size) {
+		printf("Compared %s: fail (size %zu, expected %u)\n", filename,
+		       frame.size, image->size);
+		ret = 1;
+		goto done;
+	}
+
+	data = frame.data;
+
+	for (i = 0; i < ref->num_planes; ++i) {
+		const struct image_plane *plane = &ref->planes[i];
+		const uint8_t *ref_data = image->data + plane->offset;
+		const uint8_t *cap_data = data + plane->offset;
+
+		for (y = 0; y * plane->stride < plane->size; ++y, ++hash) {
+			unsigned int offset = y * plane->stride;
+			unsigned int size = min(plane->stride,
+						plane->size - offset);
+
+			if (compare_hash(cap_data + offset, size) == *hash)
+				continue;
+
+			compare_line(&regions[i], ref_data + offset,
+				     cap_data + offset, size, y);
+		}
+
+		differs |= regions[i].lines != 0;
+	}
+
+	if (!differs) {
+		printf("Compared %s: pass\n", filename);
+		goto done;
+	}
+
+	printf("Compared %s: fail\n", filename);
+
+	for (i = 0; i < ref->num_planes; ++i) {
+		const struct compare_region *region = &regions[i];
+
+		if (!region->lines)
+			continue;
+
+		printf("  plane %u: first difference at line %u column %u, region (%u,%u)/%ux%u, %u lines differ\n",
+		       i, region->first_line, region->first_column,
+		       region->left, region->top, region->right - region->left,
+		       region->bottom - region->top, region->lines);
+	}
+
+	ret = 1;
+
+done:
+	frame_close(&frame);
+	return ret;
+}
+
+/* -----------------------------------------------------------------------------
+ * Fuzzy frame comparison
+ *
+ * Compare two images of the same format and size pixel by pixel, to tolerate
+ * the rounding errors of the hardware. Both images are unpacked line by line
+ * to 8-bit components, in R, G, B, H, S, V or Y, Cb, Cr order, and compared
+ * in a single pass. Subsampled chroma components are compared for every pixel
+ * they apply to.
+ */
+
+struct compare_stats {
+	uint64_t pixels;
+	uint64_t sum;
+	uint64_t sum_sq;
+};
+
+/* Expand a component of length bits to 8 bits. */
+static uint8_t compare_expand(uint32_t value, unsigned int length)
+{
+	uint32_t maxval = (1 << length) - 1;
+
+	return (value * 255 + maxval / 2) / maxval;
+}
+
+static void compare_unpack_packed(const struct image *image, unsigned int y,
+				  uint8_t *comp[3])
+{
+	const struct format_color_component *info[3];
+	unsigned int bpp;
+	const uint8_t *line;
+	unsigned int x, i, k;
+
+	if (image->format->type == FORMAT_RGB) {
+		bpp = image->format->rgb.bpp;
+		info[0] = &image->format->rgb.red;
+		info[1] = &image->format->rgb.green;
+		info[2] = &image->format->rgb.blue;
+	} else {
+		bpp = image->format->hsv.bpp;
+		info[0] = &image->format->hsv.hue;
+		info[1] = &image->format->hsv.saturation;
+		info[2] = &image->format->hsv.value;
+	}
+
+	line = image->data + y * image->width * bpp / 8;
+
+	for (x = 0; x < image->width; ++x) {
+		uint32_t pixel = 0;
+
+		for (i = 0; i < bpp / 8; ++i)
+			pixel |= (uint32_t)line[x * bpp / 8 + i] << (i * 8);
+
+		for (k = 0; k < 3; ++k) {
+			unsigned int length = info[k]->length;
+			uint32_t value = (pixel >> info[k]->offset)
+				       & ((1 << length) - 1);
+
+			comp[k][x] = length == 8 ? value
+				   : compare_expand(value, length);
+		}
+	}
+}
+
+/* Unpack YUV data following the layout of image_format_yuv_scalar(). */
+static void compare_unpack_yuv(const struct image *image, unsigned int y,
+			       uint8_t *comp[3])
+{
+	const struct format_info *format = image->format;
+	unsigned int width = image->width;
+	unsigned int height = image->height;
+	unsigned int xsub = format->yuv.xsub;
+	unsigned int ysub = format->yuv.ysub;
+	bool cbcr = format->yuv.order & YUV_YCbCr;
+	const uint8_t *data = image->data;
+	const uint8_t *luma;
+	const uint8_t *cb;
+	const uint8_t *cr;
+	unsigned int c_stride;
+	unsigned int cy;
+	unsigned int x;
+
+	if (format->yuv.num_planes == 1 && xsub == 1) {
+		luma = data + y * width * 3;
+
+		for (x = 0; x < width; ++x) {
+			comp[0][x] = luma[3 * x];
+			comp[1][x] = luma[3 * x + (cbcr ? 1 : 2)];
+			comp[2][x] = luma[3 * x + (cbcr ? 2 : 1)];
+		}
+		return;
+	}
+
+	if (format->yuv.num_planes == 1) {
+		unsigned int y0 = (format->yuv.order & YUV_YC) ? 0 : 1;
+		unsigned int c0 = (format->yuv.order & YUV_CY) ? 0 : 1;
+
+		luma = data + y * width * 2;
+
+		for (x = 0; x < width; ++x) {
+			unsigned int base = 2 * (x & ~1);
+			/* The second chroma sample of an odd last pixel is missing. */
+			uint8_t c1 = (x | 1) < width ? luma[base + c0 + 2] : 0;
+			uint8_t c = luma[base + c0];
+
+			comp[0][x] = luma[2 * x + y0];
+			comp[1][x] = cbcr ? c : c1;
+			comp[2][x] = cbcr ? c1 : c;
+		}
+		return;
+	}
+
+	luma = data + y * width;
+	for (x = 0; x < width; ++x)
+		comp[0][x] = luma[x];
+
+	/* Images smaller than the subsampling factor have no chroma. */
+	if (height < ysub) {
+		memset(comp[1], 0, width);
+		memset(comp[2], 0, width);
+		return;
+	}
+
+	/* The last line of odd height images reuses the last chroma line. */
+	cy = min(y / ysub, height / ysub - 1);
+	data += width * height;
+
+	if (format->yuv.num_planes == 2) {
+		cb = cbcr ? data : data + 1;
+		cr = cbcr ? data + 1 : data;
+		c_stride = 2;
+	} else {
+		unsigned int c_size = width * height / xsub / ysub;
+
+		cb = cbcr ? data : data + c_size;
+		cr = cbcr ? data + c_size : data;
+		c_stride = 1;
+	}
+
+	for (x = 0; x < width; ++x) {
+		unsigned int offset = cy * (width * c_stride / xsub)
+				    + (x - x % xsub) * c_stride / xsub;
+
+		/*
+		 * The second chroma sample of the last pixel of odd width
+		 * semi-planar lines is missing.
+		 */
+		if (c_stride == 2 && xsub == 2 && (x | 1) >= width) {
+			comp[1][x] = cbcr ? cb[offset] : 0;
+			comp[2][x] = cbcr ? 0 : cr[offset];
+			continue;
+		}
+
+		comp[1][x] = cb[offset];
+		comp[2][x] = cr[offset];
+	}
+}
+
+static void compare_unpack(const struct image *image, unsigned int y,
+			   uint8_t *comp[3])
+{
+	if (image->format->type == FORMAT_YUV)
+		compare_unpack_yuv(image, y, comp);
+	else
+		compare_unpack_packed(image, y, comp);
+}
+
+static void compare_line_simd(uint8_t *const a[3], uint8_t *const b[3],
+			      unsigned int width, struct compare_stats *stats)
+{
+	vec_u32 vsum = { };
+	vec_u32 vsum_sq = { };
+	vec_s32 vpixels = { };
+	unsigned int x = 0;
+	unsigned int i, k;
+
+	for (; x + VEC_LANES <= width; x += VEC_LANES) {
+		vec_u8x16 diff = { };
+
+		for (k = 0; k < 3; ++k) {
+			vec_u8x16 va, vb, d;
+			vec_u32 d32;
+
+			memcpy(&va, a[k] + x, sizeof(va));
+			memcpy(&vb, b[k] + x, sizeof(vb));
+
+			d = (vec_u8x16)vec_max(va, vb) - (vec_u8x16)vec_min(va, vb);
+			d32 = __builtin_convertvector(d, vec_u32);
+			vsum += d32;
+			vsum_sq += d32 * d32;
+			diff |= d;
+		}
+
+		vpixels -= __builtin_convertvector(diff != 0, vec_s32);
+	}
+
+	for (i = 0; i < VEC_LANES; ++i) {
+		stats->pixels += vpixels[i];
+		stats->sum += vsum[i];
+		stats->sum_sq += vsum_sq[i];
+	}
+
+	for (; x < width; ++x) {
+		bool differs = false;
+
+		for (k = 0; k < 3; ++k) {
+			int d = abs(a[k][x] - b[k][x]);
+
+			stats->sum += d;
+			stats->sum_sq += d * d;
+			differs |= d != 0;
+		}
+
+		stats->pixels += differs;
+	}
+}
+
+static void compare_line_scalar(uint8_t *const a[3], uint8_t *const b[3],
+				unsigned int width, struct compare_stats *stats)
+{
+	unsigned int x, k;
+
+	for (x = 0; x < width; ++x) {
+		bool differs = false;
+
+		for (k = 0; k < 3; ++k) {
+			int d = abs(a[k][x] - b[k][x]);
+
+			stats->sum += d;
+			stats->sum_sq += d * d;
+			differs |= d != 0;
+		}
+
+		stats->pixels += differs;
+	}
+}
+
+static const struct kernel_variant compare_kernels[] = {
+	KERNEL_VARIANT("simd", compare_line_simd),
+	KERNEL_VARIANT("scalar", compare_line_scalar),
+};
+
+struct compare_job {
+	const struct image *a;
+	const struct image *b;
+	unsigned int num_slices;
+	struct compare_stats *stats;
+};
+
+static void compare_slice(void *priv, unsigned int index)
+{
+	struct compare_job *job = priv;
+	struct compare_stats *stats = &job->stats[index];
+	unsigned int width = job->a->width;
+	unsigned int start, end;
+	uint8_t *comp_a[3];
+	uint8_t *comp_b[3];
+	uint8_t *lines;
+	unsigned int y, k;
+
+	parallel_slice_range(job->a->height, job->num_slices, index, &start,
+			     &end);
+
+	memset(stats, 0, sizeof(*stats));
+
+	lines = malloc(width * 6);
+	if (!lines) {
+		stats->pixels = UINT64_MAX;
+		return;
+	}
+
+	for (k = 0; k < 3; ++k) {
+		comp_a[k] = lines + width * k;
+		comp_b[k] = lines + width * (k + 3);
+	}
+
+	for (y = start; y < end; ++y) {
+		compare_unpack(job->a, y, comp_a);
+		compare_unpack(job->b, y, comp_b);
+
+		kernel_get(compare_kernels, KERNEL_COMPARE, compare_line_scalar)
+			(comp_a, comp_b, width, stats);
+	}
+
+	free(lines);
+}
+
+static int compare_images(const struct image *a, const struct image *b,
+			  struct compare_stats *result)
+{
+	struct compare_job job;
+	unsigned int i;
+	int ret = 0;
+
+	if (a->format != b->format || a->width != b->width ||
+	    a->height != b->height) {
+		printf("Can't compare %s %ux%u and %s %ux%u images\n",
+		       a->format->name, a->width, a->height, b->format->name,
+		       b->width, b->height);
+		return -EINVAL;
+	}
+
+	job.a = a;
+	job.b = b;
+	job.num_slices = parallel_num_slices(a->height);
+	job.stats = calloc(job.num_slices, sizeof(*job.stats));
+	if (!job.stats)
+		return -ENOMEM;
+
+	parallel_run(job.num_slices, compare_slice, &job);
+
+	memset(result, 0, sizeof(*result));
+
+	for (i = 0; i < job.num_slices; ++i) {
+		const struct compare_stats *stats = &job.stats[i];
+
+		if (stats->pixels == UINT64_MAX) {
+			ret = -ENOMEM;
+			break;
+		}
+
+		result->pixels += stats->pixels;
+		result->sum += stats->sum;
+		result->sum_sq += stats->sum_sq;
+	}
+
+	free(job.stats);
+	return ret;
+}
+
+/* -----------------------------------------------------------------------------
+ * Frame checksums
+ *
+ * Exact comparison only needs to prove that a captured frame is identical to
+ * the reference, which a checksum of both does without the reference pixels.
+ * Frames are hashed with BLAKE3, producing the same digests as b3sum. The 1kB
+ * input chunks are hashed independently in parallel slices, and their chaining
+ * values are then merged into the root of the hash tree.
+ */
+
+#define BLAKE3_BLOCK_SIZE	64
+#define BLAKE3_CHUNK_SIZE	1024
+
+#define BLAKE3_CHUNK_START	(1 << 0)
+#define BLAKE3_CHUNK_END	(1 << 1)
+#define BLAKE3_PARENT		(1 << 2)
+#define BLAKE3_ROOT		(1 << 3)
+
+#define CHECKSUM_SIZE		32
+
+static const uint32_t blake3_iv[8] = {
+	0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+	0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+};
+
+/* Message word permutation applied before each round. */
+static const uint8_t blake3_schedule[7][16] = {
+	{ 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 },
+	{ 2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8 },
+	{ 3, 4, 10, 12, 13, 2, 7, 14, 6, 5, 9, 0, 11, 15, 8, 1 },
+	{ 10, 7, 12, 9, 14, 3, 13, 15, 4, 0, 11, 2, 5, 8, 1, 6 },
+	{ 12, 13, 9, 11, 15, 10, 14, 8, 7, 2, 5, 3, 0, 1, 6, 4 },
+	{ 9, 14, 11, 5, 8, 12, 15, 1, 13, 3, 0, 10, 2, 6, 4, 7 },
+	{ 11, 15, 5, 0, 1, 9, 8, 6, 14, 10, 2, 12, 3, 4, 7, 13 },
+};
+
+#define blake3_rotr(v, n)	(((v) >> (n)) | ((v) << (32 - (n))))
+
+/* The mixing function, shared by the scalar and vector implementations. */
+#define blake3_g(s, a, b, c, d, x, y) do {			\
+	s[a] = s[a] + s[b] + (x);				\
+	s[d] = blake3_rotr(s[d] ^ s[a], 16);			\
+	s[c] = s[c] + s[d];					\
+	s[b] = blake3_rotr(s[b] ^ s[c], 12);			\
+	s[a] = s[a] + s[b] + (y);				\
+	s[d] = blake3_rotr(s[d] ^ s[a], 8);			\
+	s[c] = s[c] + s[d];					\
+	s[b] = blake3_rotr(s[b] ^ s[c], 7);			\
+} while (0)
+
+#define blake3_round(s, m, w) do {				\
+	blake3_g(s, 0, 4, 8, 12, m[w[0]], m[w[1]]);		\
+	blake3_g(s, 1, 5, 9, 13, m[w[2]], m[w[3]]);		\
+	blake3_g(s, 2, 6, 10, 14, m[w[4]], m[w[5]]);		\
+	blake3_g(s, 3, 7, 11, 15, m[w[6]], m[w[7]]);		\
+	blake3_g(s, 0, 5, 10, 15, m[w[8]], m[w[9]]);		\
+	blake3_g(s, 1, 6, 11, 12, m[w[10]], m[w[11]]);		\
+	blake3_g(s, 2, 7, 8, 13, m[w[12]], m[w[13]]);		\
+	blake3_g(s, 3, 4, 9, 14, m[w[14]], m[w[15]]);		\
+} while (0)
+
+static inline uint32_t blake3_load(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/* Compress the 16 message words m into the chaining value cv. */
+static void blake3_compress(uint32_t cv[8], const uint32_t m[16],
+			    unsigned int len, uint64_t counter,
+			    unsigned int flags)
+{
+	uint32_t s[16];
+	unsigned int i;
+
+	memcpy(s, cv, sizeof(*s) * 8);
+	memcpy(s + 8, blake3_iv, sizeof(*s) * 4);
+	s[12] = counter;
+	s[13] = counter >> 32;
+	s[14] = len;
+	s[15] = flags;
+
+	for (i = 0; i < ARRAY_SIZE(blake3_schedule); ++i)
+		blake3_round(s, m, blake3_schedule[i]);
+
+	for (i = 0; i < 8; ++i)
+		cv[i] = s[i] ^ s[i + 8];
+}
+
+/*
+ * Compute the chaining value of the chunk of size bytes (at most
+ * BLAKE3_CHUNK_SIZE) at index counter. The flags are added to the last block.
+ */
+static void blake3_chunk(const uint8_t *data, size_t size, uint64_t counter,
+			 unsigned int flags, uint32_t cv[8])
+{
+	unsigned int offset = 0;
+
+	memcpy(cv, blake3_iv, sizeof(blake3_iv));
+
+	do {
+		unsigned int len = min(size - offset, (size_t)BLAKE3_BLOCK_SIZE);
+		unsigned int block_flags = 0;
+		uint8_t block[BLAKE3_BLOCK_SIZE] = { 0 };
+		uint32_t m[16];
+		unsigned int i;
+
+		if (len)
+			memcpy(block, data + offset, len);
+		for (i = 0; i < 16; ++i)
+			m[i] = blake3_load(&block[i * 4]);
+
+		if (!offset)
+			block_flags |= BLAKE3_CHUNK_START;
+		offset += len;
+		if (offset == size)
+			block_flags |= BLAKE3_CHUNK_END | flags;
+
+		blake3_compress(cv, m, len, counter, block_flags);
+	} while (offset < size);
+}
+
+/* Compute the chaining values of count complete chunks, starting at counter. */
+static void blake3_chunks_scalar(const uint8_t *data, unsigned int count,
+				 uint64_t counter, uint32_t (*cvs)[8])
+{
+	unsigned int i;
+
+	for (i = 0; i < count; ++i)
+		blake3_chunk(data + i * BLAKE3_CHUNK_SIZE, BLAKE3_CHUNK_SIZE,
+			     counter + i, 0, cvs[i]);
+}
+
+/* Hash VEC_LANES chunks at a time, one chunk per vector lane. */
+static void blake3_chunks_simd(const uint8_t *data, unsigned int count,
+			       uint64_t counter, uint32_t (*cvs)[8])
+{
+	for (; count >= VEC_LANES; count -= VEC_LANES) {
+		vec_u32 counter_lo;
+		vec_u32 counter_hi;
+		vec_u32 cv[8];
+		unsigned int block, i, lane;
+
+		for (lane = 0; lane < VEC_LANES; ++lane) {
+			counter_lo[lane] = counter + lane;
+			counter_hi[lane] = (counter + lane) >> 32;
+		}
+
+		for (i = 0; i < 8; ++i)
+			cv[i] = (vec_u32){ } + blake3_iv[i];
+
+		for (block = 0; block < BLAKE3_CHUNK_SIZE / BLAKE3_BLOCK_SIZE;
+		     ++block) {
+			const uint8_t *p = data + block * BLAKE3_BLOCK_SIZE;
+			unsigned int flags = 0;
+			vec_u32 m[16];
+			vec_u32 s[16];
+
+			for (i = 0; i < 16; ++i) {
+				for (lane = 0; lane < VEC_LANES; ++lane)
+					m[i][lane] = blake3_load(p + lane * BLAKE3_CHUNK_SIZE + i * 4);
+			}
+
+			if (block == 0)
+				flags |= BLAKE3_CHUNK_START;
+			if (block == BLAKE3_CHUNK_SIZE / BLAKE3_BLOCK_SIZE - 1)
+				flags |= BLAKE3_CHUNK_END;
+
+			for (i = 0; i < 8; ++i)
+				s[i] = cv[i];
+			for (i = 0; i < 4; ++i)
+				s[i + 8] = (vec_u32){ } + blake3_iv[i];
+			s[12] = counter_lo;
+			s[13] = counter_hi;
+			s[14] = (vec_u32){ } + BLAKE3_BLOCK_SIZE;
+			s[15] = (vec_u32){ } + flags;
+
+			for (i = 0; i < ARRAY_SIZE(blake3_schedule); ++i)
+				blake3_round(s, m, blake3_schedule[i]);
+
+			for (i = 0; i < 8; ++i)
+				cv[i] = s[i] ^ s[i + 8];
+		}
+
+		for (lane = 0; lane < VEC_LANES; ++lane) {
+			for (i = 0; i < 8; ++i)
+				cvs[lane][i] = cv[i][lane];
+		}
+
+		data += VEC_LANES * BLAKE3_CHUNK_SIZE;
+		counter += VEC_LANES;
+		cvs += VEC_LANES;
+	}
+
+	blake3_chunks_scalar(data, count, counter, cvs);
+}
+
+static const struct kernel_variant checksum_kernels[] = {
+	KERNEL_VARIANT("simd", blake3_chunks_simd),
+	KERNEL_VARIANT("scalar", blake3_chunks_scalar),
+};
+
+/*
+ * Merge the chaining values of count chunks. The tree is left-balanced, the
+ * left subtree holds the largest power of two number of chunks smaller than
+ * count.
+ */
+static void blake3_tree(const uint32_t (*cvs)[8], unsigned int count,
+			unsigned int flags, uint32_t cv[8])
+{
+	unsigned int left = 1;
+	uint32_t m[16];
+
+	if (count == 1) {
+		memcpy(cv, cvs[0], sizeof(cvs[0]));
+		return;
+	}
+
+	while (left * 2 < count)
+		left *= 2;
+
+	blake3_tree(cvs, left, 0, m);
+	blake3_tree(cvs + left, count - left, 0, m + 8);
+
+	memcpy(cv, blake3_iv, sizeof(blake3_iv));
+	blake3_compress(cv, m, BLAKE3_BLOCK_SIZE, 0, BLAKE3_PARENT | flags);
+}
+
+struct checksum_job {
+	const uint8_t *data;
+	size_t size;
+	unsigned int num_chunks;
+	unsigned int num_slices;
+	uint32_t (*cvs)[8];
+};
+
+static void checksum_slice(void *priv, unsigned int index)
+{
+	struct checksum_job *job = priv;
+	unsigned int start, end;
+
+	parallel_slice_range(job->num_chunks, job->num_slices, index, &start,
+			     &end);
+
+	/* The last chunk can be incomplete. */
+	if (end == job->num_chunks) {
+		size_t offset = (size_t)--end * BLAKE3_CHUNK_SIZE;
+
+		blake3_chunk(job->data + offset, job->size - offset, end, 0,
+			     job->cvs[end]);
+	}
+
+	kernel_get(checksum_kernels, KERNEL_CHECKSUM, blake3_chunks_scalar)
+		(job->data + (size_t)start * BLAKE3_CHUNK_SIZE, end - start,
+		 start, &job->cvs[start]);
+}
+
+/* Compute the BLAKE3 digest of size bytes of data. */
+static int checksum(const void *data, size_t size,
+		    uint8_t digest[CHECKSUM_SIZE])
+{
+	struct checksum_job job;
+	uint32_t cv[8];
+	unsigned int i;
+
+	job.data = data;
+	job.size = size;
+	job.num_chunks = max(div_round_up(size, BLAKE3_CHUNK_SIZE), (size_t)1);
+
+	if (job.num_chunks == 1) {
+		blake3_chunk(data, size, 0, BLAKE3_ROOT, cv);
+	} else {
+		job.cvs = malloc(job.num_chunks * sizeof(*job.cvs));
+		if (!job.cvs)
+			return -ENOMEM;
+
+		job.num_slices = parallel_num_slices(job.num_chunks);
+		parallel_run(job.num_slices, checksum_slice, &job);
+
+		blake3_tree((const uint32_t (*)[8])job.cvs, job.num_chunks,
+			    BLAKE3_ROOT, cv);
+		free(job.cvs);
+	}
+
+	for (i = 0; i < CHECKSUM_SIZE; ++i)
+		digest[i] = cv[i / 4] >> (i % 4 * 8);
+
+	return 0;
+}
+
+/* Format the digest as a NUL-terminated hexadecimal string. */
+static void checksum_format(const uint8_t digest[CHECKSUM_SIZE], char *str)
+{
+	unsigned int i;
+
+	for (i = 0; i < CHECKSUM_SIZE; ++i)
+		sprintf(str + i * 2, "%02x", digest[i]);
+}
+
+/*
+ * Compute the checksum of the contents of a file. Compressed frames are hashed
+ * decompressed, to match the checksum of the raw frame.
+ */
+static int checksum_file(const char *filename, uint8_t digest[CHECKSUM_SIZE])
+{
+	struct frame_file frame;
+	int ret;
+
+	ret = frame_open(&frame, filename);
+	if (ret < 0)
+		return ret;
+
+	ret = checksum(frame.data, frame.size, digest);
+
+	frame_close(&frame);
+	return ret;
+}
+
+/* -----------------------------------------------------------------------------
+ * PNG encoding
+ *
+ * Images are stored as 8-bit RGB PNG files. Each line is filtered with the
+ * PNG filter that minimizes the sum of the absolute filtered values, and the
+ * filtered data is compressed in a single deflate block with the fixed Huffman
+ * codes. The LZ77 match finder only tries the last position with the same
+ * 3-byte hash, trading compression ratio for speed.
+ */
+
+#define DEFLATE_HASH_BITS	15
+
+struct deflate_code {
+	uint16_t code;
+	uint8_t length;
+};
+
+/* Fixed Huffman codes, bit-reversed as deflate stores them LSB first. */
+static struct deflate_code deflate_litlen_codes[288];
+static struct deflate_code deflate_dist_codes[30];
+/* Length code index for each match length. */
+static uint8_t deflate_length_codes[DEFLATE_MAX_MATCH + 1];
+
+static pthread_once_t png_tables_once = PTHREAD_ONCE_INIT;
+
+static void png_compute_tables(void)
+{
+	unsigned int i, k;
+
+	for (i = 0; i < 288; ++i) {
+		struct deflate_code *code = &deflate_litlen_codes[i];
+
+		if (i < 144) {
+			code->length = 8;
+			code->code = deflate_reverse(0x30 + i, 8);
+		} else if (i < 256) {
+			code->length = 9;
+			code->code = deflate_reverse(0x190 + i - 144, 9);
+		} else if (i < 280) {
+			code->length = 7;
+			code->code = deflate_reverse(i - 256, 7);
+		} else {
+			code->length = 8;
+			code->code = deflate_reverse(0xc0 + i - 280, 8);
+		}
+	}
+
+	for (i = 0; i < ARRAY_SIZE(deflate_dist_codes); ++i) {
+		deflate_dist_codes[i].length = 5;
+		deflate_dist_codes[i].code = deflate_reverse(i, 5);
+	}
+
+	for (i = 0, k = 0; i <= DEFLATE_MAX_MATCH; ++i) {
+		while (k < ARRAY_SIZE(deflate_length_base) - 1 &&
+		       deflate_length_base[k + 1] <= i)
+			k++;
+		deflate_length_codes[i] = k;
+	}
+
+	crc32_init();
+}
+
+/* Initialize the tables once, library users can encode from multiple threads. */
+static void png_init_tables(void)
+{
+	pthread_once(&png_tables_once, png_compute_tables);
+}
+
+static uint32_t zlib_adler32(const uint8_t *data, size_t size)
+{
+	uint32_t a = 1;
+	uint32_t b = 0;
+
+	while (size) {
+		/* 5552 bytes is the largest block that can't overflow b. */
+		size_t count = min(size, (size_t)5552);
+
+		size -= count;
+		while (count--) {
+			a += *data++;
+			b += a;
+		}
+
+		a %= 65521;
+		b %= 65521;
+	}
+
+	return (b << 16) | a;
+}
+
+struct deflate_stream {
+	uint8_t *data;
+	size_t size;
+	uint64_t bits;
+	unsigned int num_bits;
+};
+
+static inline void deflate_put(struct deflate_stream *stream, uint32_t bits,
+			       unsigned int count)
+{
+	stream->bits |= (uint64_t)bits << stream->num_bits;
+	stream->num_bits += count;
+
+	while (stream->num_bits >= 8) {
+		stream->data[stream->size++] = stream->bits;
+		stream->bits >>= 8;
+		stream->num_bits -= 8;
+	}
+}
+
+static inline void deflate_put_code(struct deflate_stream *stream,
+				    const struct deflate_code *code)
+{
+	deflate_put(stream, code->code, code->length);
+}
+
+static inline uint32_t deflate_hash(const uint8_t *data)
+{
+	uint32_t v = data[0] | (data[1] << 8) | (data[2] << 16);
+
+	return (v * 2654435761U) >> (32 - DEFLATE_HASH_BITS);
+}
+
+/*
+ * Compress size bytes of data in a single final block with the fixed Huffman
+ * codes. The output buffer must be large enough for the worst case of 9 bits
+ * per byte, plus 3 bytes of block header and end of block code.
+ */
+static int deflate(const uint8_t *data, size_t size, uint8_t *output,
+		   size_t *output_size)
+{
+	struct deflate_stream stream = { .data = output };
+	uint32_t *head;
+	size_t pos = 0;
+
+	/* The hash table stores positions plus one, 0 marks empty entries. */
+	head = calloc(1 << DEFLATE_HASH_BITS, sizeof(*head));
+	if (!head)
+		return -ENOMEM;
+
+	/* BFINAL = 1, BTYPE = 01 (fixed Huffman codes). */
+	deflate_put(&stream, 3, 3);
+
+	while (pos < size) {
+		unsigned int lcode;
+		unsigned int dcode;
+		size_t match = 0;
+		size_t dist = 0;
+
+		if (pos + DEFLATE_MIN_MATCH <= size) {
+			uint32_t hash = deflate_hash(data + pos);
+			size_t candidate = head[hash];
+
+			head[hash] = pos + 1;
+
+			if (candidate && pos - candidate < DEFLATE_WINDOW_SIZE) {
+				size_t max_match = min(size - pos,
+						       (size_t)DEFLATE_MAX_MATCH);
+				const uint8_t *ref = data + candidate - 1;
+
+				dist = pos - candidate + 1;
+				while (match < max_match &&
+				       ref[match] == data[pos + match])
+					match++;
+			}
+		}
+
+		if (match < DEFLATE_MIN_MATCH) {
+			deflate_put_code(&stream,
+					 &deflate_litlen_codes[data[pos]]);
+			pos++;
+			continue;
+		}
+
+		lcode = deflate_length_codes[match];
+		dcode = ARRAY_SIZE(deflate_dist_base) - 1;
+		while (deflate_dist_base[dcode] > dist)
+			dcode--;
+
+		deflate_put_code(&stream, &deflate_litlen_codes[257 + lcode]);
+		deflate_put(&stream, match - deflate_length_base[lcode],
+			    deflate_length_extra[lcode]);
+		deflate_put_code(&stream, &deflate_dist_codes[dcode]);
+		deflate_put(&stream, dist - deflate_dist_base[dcode],
+			    deflate_dist_extra[dcode]);
+
+		/* Index the positions covered by the match. */
+		while (--match) {
+			pos++;
+			if (pos + DEFLATE_MIN_MATCH <= size)
+				head[deflate_hash(data + pos)] = pos + 1;
+		}
+		pos++;
+	}
+
+	/* End of block, and flush the last partial byte. */
+	deflate_put_code(&stream, &deflate_litlen_codes[256]);
+	deflate_put(&stream, 0, 7);
+
+	free(head);
+	*output_size = stream.size;
+	return 0;
+}
+
+/*
+ * Filter a line of size bytes with the None, Sub and Up PNG filters, and store
+ * the filter type and the filtered line with the smallest sum of absolute
+ * values (as signed bytes) to out. The Average and Paeth filters compress
+ * slightly better but are much slower to evaluate. The previous line is NULL
+ * for the first line.
+ */
+static void png_filter_line(const uint8_t *line, const uint8_t *prev,
+			    unsigned int size, uint8_t *out, uint8_t *tmp)
+{
+	unsigned int best_sum = UINT_MAX;
+	unsigned int type;
+	unsigned int x;
+
+	for (type = 0; type < 3; ++type) {
+		uint8_t *dst = type ? tmp : out + 1;
+		unsigned int sum = 0;
+
+		switch (type) {
+		case 0:
+			memcpy(dst, line, size);
+			break;
+		case 1:
+			memcpy(dst, line, 3);
+			for (x = 3; x < size; ++x)
+				dst[x] = line[x] - line[x - 3];
+			break;
+		case 2:
+			/* Up matches None for the first line. */
+			if (!prev)
+				continue;
+			for (x = 0; x < size; ++x)
+				dst[x] = line[x] - prev[x];
+			break;
+		}
+
+		for (x = 0; x < size; ++x)
+			sum += abs((int8_t)dst[x]);
+
+		if (sum < best_sum) {
+			best_sum = sum;
+			out[0] = type;
+			if (type)
+				memcpy(out + 1, tmp, size);
+		}
+	}
+}
+
+static uint8_t *png_put_u32(uint8_t *p, uint32_t value)
+{
+	p[0] = value >> 24;
+	p[1] = value >> 16;
+	p[2] = value >> 8;
+	p[3] = value;
+	return p + 4;
+}
+
+/* Store a chunk with its length, type and CRC. Return the end of the chunk. */
+static uint8_t *png_put_chunk(uint8_t *p, const char *type,
+			      const uint8_t *data, size_t size)
+{
+	uint8_t *start = p + 4;
+
+	p = png_put_u32(p, size);
+	memcpy(p, type, 4);
+	if (size && p + 4 != data)
+		memmove(p + 4, data, size);
+	p += 4 + size;
+
+	return png_put_u32(p, crc32_update(0, start, size + 4));
+}
+
+/* Store an RGB24 image in PNG format. */
+static int png_write(const struct image *image, const char *filename)
+{
+	static const uint8_t signature[8] = {
+		0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n',
+	};
+	unsigned int stride = image->width * 3;
+	size_t raw_size = (size_t)(stride + 1) * image->height;
+	uint8_t *raw = NULL;
+	uint8_t *png = NULL;
+	uint8_t header[13];
+	size_t zsize;
+	uint8_t *idat;
+	uint8_t *p;
+	unsigned int y;
+	int ret;
+
+	png_init_tables();
+
+	raw = malloc(raw_size + stride);
+	/* Signature, IHDR, IDAT with zlib header and footer, and IEND. */
+	png = malloc(raw_size + raw_size / 8 + 128);
+	if (!raw || !png) {
+		ret = -ENOMEM;
+		goto done;
+	}
+
+	for (y = 0; y < image->height; ++y) {
+		const uint8_t *line = image->data + y * stride;
+
+		png_filter_line(line, y ? line - stride : NULL, stride,
+				raw + y * (stride + 1), raw + raw_size);
+	}
+
+	/* The compressed data is stored in place in the IDAT chunk. */
+	p = png;
+	memcpy(p, signature, sizeof(signature));
+	p += sizeof(signature);
+
+	png_put_u32(header, image->width);
+	png_put_u32(header + 4, image->height);
+	header[8] = 8;		/* Bit depth */
+	header[9] = 2;		/* Color type: RGB */
+	header[10] = 0;		/* Compression method: deflate */
+	header[11] = 0;		/* Filter method */
+	header[12] = 0;		/* Interlace method: none */
+	p = png_put_chunk(p, "IHDR", header, sizeof(header));
+
+	idat = p + 8;
+	idat[0] = 0x78;		/* zlib header: deflate, 32kB window */
+	idat[1] = 0x01;
+	ret = deflate(raw, raw_size, idat + 2, &zsize);
+	if (ret < 0)
+		goto done;
+	png_put_u32(idat + 2 + zsize, zlib_adler32(raw, raw_size));
+
+	p = png_put_chunk(p, "IDAT", idat, zsize + 6);
+	p = png_put_chunk(p, "IEND", NULL, 0);
+
+	ret = file_store(filename, png, p - png, NULL, 0);
+
+done:
+	free(raw);
+	free(png);
+	return ret;
+}
+
+/* -----------------------------------------------------------------------------
+ * Frame decoding
+ *
+ * Convert raw frames, as stored by the test scripts, to RGB images that can be
+ * inspected with standard tools. The frame components are unpacked with the
+ * fuzzy comparison helpers, and YCbCr converted to RGB with the inverse of the
+ * colorspace conversion matrix. HSV components are stored unmodified in the R,
+ * G and B channels. A pool of threads converts the files, each thread taking
+ * the next file from a shared index until all files are converted.
+ */
+
+enum decode_mode {
+	DECODE_FRAME,
+	DECODE_SIDE,
+	DECODE_DIFF,
+};
+
+struct decode_matrix {
+	int coeffs[3][3];
+	int offsets[3];
+};
+
+struct decode_file {
+	char *path;
+	char *reference;
+	const struct format_info *format;
+	unsigned int width;
+	unsigned int height;
+};
+
+struct decode_job {
+	struct decode_matrix matrix;
+	enum decode_mode mode;
+	bool pnm;
+	struct decode_file *files;
+	unsigned int num_files;
+	unsigned int next;
+	int ret;
+};
+
+/* Invert the RGB to YCbCr matrix into 16-bit fixed point coefficients. */
+static void decode_matrix_init(struct decode_matrix *matrix,
+			       const struct params *params)
+{
+	bool full = params->quantization == V4L2_QUANTIZATION_FULL_RANGE;
+	double f[3][3];
+	int m[3][3];
+	double det;
+	unsigned int i, j;
+
+	colorspace_matrix(params->encoding, params->quantization, &m);
+
+	/* Scale the coefficients as colorspace_rgb2ycbcr() does. */
+	for (i = 0; i < 3; ++i) {
+		for (j = 0; j < 3; ++j)
+			f[i][j] = m[i][j] / (256.0 * 255.0);
+	}
+
+	det = f[0][0] * (f[1][1] * f[2][2] - f[1][2] * f[2][1])
+	    - f[0][1] * (f[1][0] * f[2][2] - f[1][2] * f[2][0])
+	    + f[0][2] * (f[1][0] * f[2][1] - f[1][1] * f[2][0]);
+
+	/* The cyclic index order accounts for the sign of the cofactors. */
+	for (i = 0; i < 3; ++i) {
+		for (j = 0; j < 3; ++j) {
+			unsigned int r0 = (j + 1) % 3, r1 = (j + 2) % 3;
+			unsigned int c0 = (i + 1) % 3, c1 = (i + 2) % 3;
+			double cofactor = f[r0][c0] * f[r1][c1]
+					- f[r0][c1] * f[r1][c0];
+
+			matrix->coeffs[i][j] = lround(cofactor / det * 65536);
+		}
+	}
+
+	matrix->offsets[0] = full ? 0 : 16;
+	matrix->offsets[1] = 128;
+	matrix->offsets[2] = 128;
+}
+
+/* Convert a line of unpacked components to RGB24. */
+static void decode_line(const struct decode_matrix *matrix,
+			const struct image *image, uint8_t *const comp[3],
+			uint8_t *rgb)
+{
+	unsigned int x, k;
+
+	for (x = 0; x < image->width; ++x) {
+		int ycbcr[3];
+
+		if (image->format->type != FORMAT_YUV) {
+			for (k = 0; k < 3; ++k)
+				rgb[3 * x + k] = comp[k][x];
+			continue;
+		}
+
+		for (k = 0; k < 3; ++k)
+			ycbcr[k] = comp[k][x] - matrix->offsets[k];
+
+		for (k = 0; k < 3; ++k) {
+			const int *c = matrix->coeffs[k];
+			int value = (c[0] * ycbcr[0] + c[1] * ycbcr[1]
+				  + c[2] * ycbcr[2] + (1 << 15)) >> 16;
+
+			rgb[3 * x + k] = clamp(value, 0, 255);
+		}
+	}
+}
+
+/* Return the path with the .bin extension replaced by suffix. */
+static char *decode_filename(const char *path, const char *suffix)
+{
+	size_t len = strlen(path);
+	char *filename;
+
+	if (len > 4 && !strcmp(path + len - 4, ".bin"))
+		len -= 4;
+
+	filename = malloc(len + strlen(suffix) + 1);
+	if (!filename)
+		return NULL;
+
+	memcpy(filename, path, len);
+	strcpy(filename + len, suffix);
+	return filename;
+}
+
+static int decode_store(const struct decode_job *job, const struct image *image,
+			const char *path, const char *suffix)
+{
+	char *filename;
+	int ret;
+
+	filename = decode_filename(path, suffix);
+	if (!filename)
+		return -ENOMEM;
+
+	if (job->pnm)
+		ret = pnm_write(image, filename);
+	else
+		ret = png_write(image, filename);
+
+	free(filename);
+	return ret;
+}
+
+/*
+ * Convert a frame, and store the comparison with its reference when set. The
+ * side by side image shows the frame on the left and the reference on the
+ * right. The difference image shows the frame dimmed, with the pixels that
+ * differ from the reference in red.
+ */
+static int decode_file(const struct decode_job *job,
+		       const struct decode_file *file)
+{
+	const struct format_info *rgb24 = format_by_name("RGB24");
+	unsigned int width = file->width;
+	unsigned int stride = width * 3;
+	struct image *frame;
+	struct image *reference = NULL;
+	struct image *output = NULL;
+	struct image *compared = NULL;
+	uint8_t *comp_a[3];
+	uint8_t *comp_b[3];
+	uint8_t *lines = NULL;
+	unsigned int x, y, k;
+	int ret = -ENOMEM;
+
+	frame = image_read_raw(file->path, file->format, width, file->height);
+	if (!frame)
+		return -EINVAL;
+
+	output = image_new(rgb24, width, file->height);
+	if (!output)
+		goto done;
+
+	if (file->reference) {
+		reference = image_read_raw(file->reference, file->format,
+					   width, file->height);
+		if (!reference) {
+			ret = -EINVAL;
+			goto done;
+		}
+
+		compared = image_new(rgb24, job->mode == DECODE_SIDE
+				     ? width * 2 : width, file->height);
+		if (!compared)
+			goto done;
+	}
+
+	lines = malloc(width * 9);
+	if (!lines)
+		goto done;
+
+	for (k = 0; k < 3; ++k) {
+		comp_a[k] = lines + width * k;
+		comp_b[k] = lines + width * (k + 3);
+	}
+
+	for (y = 0; y < file->height; ++y) {
+		uint8_t *rgb = output->data + y * stride;
+		uint8_t *ref_rgb = lines + width * 6;
+		uint8_t *line;
+
+		compare_unpack(frame, y, comp_a);
+		decode_line(&job->matrix, frame, comp_a, rgb);
+
+		if (!reference)
+			continue;
+
+		compare_unpack(reference, y, comp_b);
+		line = compared->data + y * compared->width * 3;
+
+		if (job->mode == DECODE_SIDE) {
+			decode_line(&job->matrix, reference, comp_b, ref_rgb);
+			memcpy(line, rgb, stride);
+			memcpy(line + stride, ref_rgb, stride);
+			continue;
+		}
+
+		for (x = 0; x < width; ++x) {
+			bool differs = comp_a[0][x] != comp_b[0][x] ||
+				       comp_a[1][x] != comp_b[1][x] ||
+				       comp_a[2][x] != comp_b[2][x];
+
+			for (k = 0; k < 3; ++k)
+				line[3 * x + k] = differs ? (k ? 0 : 255)
+						: rgb[3 * x + k] / 4;
+		}
+	}
+
+	ret = decode_store(job, output, file->path, job->pnm ? ".pnm" : ".png");
+	if (ret < 0 || !compared)
+		goto done;
+
+	if (job->mode == DECODE_SIDE)
+		ret = decode_store(job, compared, file->path,
+				   job->pnm ? "-side.pnm" : "-side.png");
+	else
+		ret = decode_store(job, compared, file->path,
+				   job->pnm ? "-diff.pnm" : "-diff.png");
+
+done:
+	free(lines);
+	image_delete(frame);
+	image_delete(reference);
+	image_delete(output);
+	image_delete(compared);
+	return ret;
+}
+
+static void decode_worker(void *priv, unsigned int index)
+{
+	struct decode_job *job = priv;
+	unsigned int i;
+	int ret;
+
+	while ((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED))
+	       < job->num_files) {
+		ret = decode_file(job, &job->files[i]);
+		if (ret < 0)
+			__atomic_store_n(&job->ret, ret, __ATOMIC_RELAXED);
+	}
+}
+
+/*
+ * Parse the format and size of a frame from its file name. The test scripts
+ * name frames <test>-<pipe>-<input format>-<output format>-<size>[-<args>]-
+ * [ref-]frame[-<index>].bin, the output format is the first format name
+ * followed by a WxH size.
+ */
+static int decode_parse_name(const char *path, struct decode_file *file)
+{
+	const char *name = strrchr(path, '/');
+	char *tokens;
+	char *token;
+	char *prev = NULL;
+	char *save;
+	int ret = -EINVAL;
+
+	tokens = strdup(name ? name + 1 : path);
+	if (!tokens)
+		return -ENOMEM;
+
+	for (token = strtok_r(tokens, "-", &save); token;
+	     prev = token, token = strtok_r(NULL, "-", &save)) {
+		unsigned int width, height;
+		char end;
+		char *p;
+
+		if (!prev || sscanf(token, "%ux%u%c", &width, &height, &end) != 2)
+			continue;
+
+		for (p = prev; *p; ++p)
+			*p = toupper(*p);
+
+		file->format = format_by_name(prev);
+		if (file->format && width && height) {
+			file->width = width;
+			file->height = height;
+			ret = 0;
+			break;
+		}
+	}
+
+	free(tokens);
+	return ret;
+}
+
+/*
+ * Return the path of the reference matching a frame, replacing the last
+ * frame in its file name with ref-frame.bin, or NULL if the reference doesn't
+ * exist or the frame is a reference itself.
+ */
+static char *decode_reference(const char *path)
+{
+	const char *name = strrchr(path, '/');
+	const char *frame = NULL;
+	const char *p;
+	char *reference;
+	size_t len;
+
+	name = name ? name + 1 : path;
+	for (p = name; (p = strstr(p, "frame")); ++p)
+		frame = p;
+
+	if (!frame || (frame - name >= 4 && !strncmp(frame - 4, "ref-", 4)))
+		return NULL;
+
+	len = frame - path;
+	reference = malloc(len + sizeof("ref-frame.bin"));
+	if (!reference)
+		return NULL;
+
+	memcpy(reference, path, len);
+	strcpy(reference + len, "ref-frame.bin");
+
+	if (access(reference, R_OK)) {
+		free(reference);
+		return NULL;
+	}
+
+	return reference;
+}
+
+/*
+ * Add a file to the job. Files whose name can't be parsed are an error when
+ * specified explicitly, and skipped when found in a directory.
+ */
+static int decode_add_file(struct decode_job *job, const char *path,
+			   bool explicit)
+{
+	struct decode_file *files;
+	struct decode_file *file;
+	int ret;
+
+	files = realloc(job->files, (job->num_files + 1) * sizeof(*files));
+	if (!files)
+		return -ENOMEM;
+
+	job->files = files;
+	file = &files[job->num_files];
+	memset(file, 0, sizeof(*file));
+
+	ret = decode_parse_name(path, file);
+	if (ret < 0) {
+		if (ret != -EINVAL || !explicit)
+			return ret == -EINVAL ? 0 : ret;
+
+		printf("Unable to parse the format and size from %s\n", path);
+		return ret;
+	}
+
+	file->path = strdup(path);
+	if (!file->path)
+		return -ENOMEM;
+
+	if (job->mode != DECODE_FRAME)
+		file->reference = decode_reference(path);
+
+	job->num_files++;
+	return 0;
+}
+
+/* Add all .bin files of a directory to the job. */
+static int decode_add_directory(struct decode_job *job, const char *path)
+{
+	struct dirent *entry;
+	DIR *dir;
+	int ret = 0;
+
+	dir = opendir(path);
+	if (!dir) {
+		printf("Unable to open directory %s: %s (%d)\n", path,
+		       strerror(errno), errno);
+		return -errno;
+	}
+
+	while (!ret && (entry = readdir(dir))) {
+		size_t len = strlen(entry->d_name);
+		char *filename;
+
+		if (len < 4 || strcmp(entry->d_name + len - 4, ".bin"))
+			continue;
+
+		filename = malloc(strlen(path) + len + 2);
+		if (!filename) {
+			ret = -ENOMEM;
+			break;
+		}
+
+		sprintf(filename, "%s/%s", path, entry->d_name);
+		ret = decode_add_file(job, filename, false);
+		free(filename);
+	}
+
+	closedir(dir);
+	return ret;
+}
+
+static int decode_frames(const struct params *params,
+			 const char *const *paths, unsigned int count,
+			 enum decode_mode mode, bool pnm)
+{
+	struct decode_job job;
+	struct stat st;
+	unsigned int i;
+	int ret = 0;
+
+	memset(&job, 0, sizeof(job));
+	decode_matrix_init(&job.matrix, params);
+	job.mode = mode;
+	job.pnm = pnm;
+
+	for (i = 0; i < count && !ret; ++i) {
+		if (stat(paths[i], &st) < 0) {
+			printf("Unable to access %s: %s (%d)\n", paths[i],
+			       strerror(errno), errno);
+			ret = -errno;
+		} else if (S_ISDIR(st.st_mode)) {
+			ret = decode_add_directory(&job, paths[i]);
+		} else {
+			ret = decode_add_file(&job, paths[i], true);
+		}
+	}
+
+	if (!ret && job.num_files) {
+		png_init_tables();
+		parallel_run(parallel_num_slices(job.num_files), decode_worker,
+			     &job);
+		ret = job.ret;
+	}
+
+	for (i = 0; i < job.num_files; ++i) {
+		free(job.files[i].path);
+		free(job.files[i].reference);
+	}
+	free(job.files);
+
+	return ret;
+}
+
+/* -----------------------------------------------------------------------------
+ * Frame deltas
+ *
+ * Frames that fail the comparison usually differ from the reference in a few
+ * pixels only. They are stored as a delta that records the identity of the
+ * reference, typically the gen-image options that generate it, and the
+ * contents of the frame tiles that differ from the reference. Tiles are
+ * rectangles of DELTA_TILE_WIDTH bytes by DELTA_TILE_HEIGHT lines of the image
+ * planes, numbered in plane, row and column order. The BLAKE3 checksums of the
+ * reference and of the frame guarantee that the frame is reconstructed from
+ * the right reference, bit for bit.
+ *
+ * The delta file stores a struct delta_header, the identity string, and the
+ * index and contents of each differing tile, in little endian order as all
+ * supported platforms.
+ */
+
+#define DELTA_MAGIC		0x44505356	/* "VSPD" */
+#define DELTA_VERSION		1
+#define DELTA_TILE_WIDTH	64
+#define DELTA_TILE_HEIGHT	16
+
+struct delta_header {
+	uint32_t magic;
+	uint32_t version;
+	char format[16];
+	uint32_t width;
+	uint32_t height;
+	uint32_t num_tiles;
+	uint32_t identity_size;
+	uint8_t reference_checksum[CHECKSUM_SIZE];
+	uint8_t frame_checksum[CHECKSUM_SIZE];
+};
+
+struct delta_tiles {
+	struct image_plane planes[3];
+	unsigned int num_planes;
+	unsigned int lines[3];
+	unsigned int columns[3];
+	/* Index of the first tile of each plane, and total number of tiles. */
+	unsigned int first[4];
+};
+
+static void delta_tiles_init(struct delta_tiles *tiles,
+			     const struct image *image)
+{
+	unsigned int i;
+
+	tiles->num_planes = image_planes(image, tiles->planes);
+	tiles->first[0] = 0;
+
+	for (i = 0; i < tiles->num_planes; ++i) {
+		const struct image_plane *plane = &tiles->planes[i];
+		unsigned int rows;
+
+		tiles->lines[i] = div_round_up(plane->size, plane->stride);
+		tiles->columns[i] = div_round_up(plane->stride, DELTA_TILE_WIDTH);
+		rows = div_round_up(tiles->lines[i], DELTA_TILE_HEIGHT);
+		tiles->first[i + 1] = tiles->first[i] + rows * tiles->columns[i];
+	}
+}
+
+/*
+ * Compute the offset in the image and the size of a line of a tile. Return
+ * false if the tile has no such line.
+ */
+static bool delta_tile_line(const struct delta_tiles *tiles,
+			    unsigned int index, unsigned int line,
+			    unsigned int *offset, unsigned int *size)
+{
+	const struct image_plane *plane;
+	unsigned int column;
+	unsigned int start;
+	unsigned int y;
+	unsigned int i;
+
+	for (i = 0; index >= tiles->first[i + 1]; ++i)
+		;
+
+	plane = &tiles->planes[i];
+	index -= tiles->first[i];
+	column = index % tiles->columns[i] * DELTA_TILE_WIDTH;
+	y = index / tiles->columns[i] * DELTA_TILE_HEIGHT + line;
+
+	if (line >= DELTA_TILE_HEIGHT || y >= tiles->lines[i])
+		return false;
+
+	/* The last line of a plane may be incomplete. */
+	start = y * plane->stride + column;
+	if (start >= plane->size)
+		return false;
+
+	*offset = plane->offset + start;
+	*size = min(plane->stride - column, (unsigned int)DELTA_TILE_WIDTH);
+	*size = min(*size, plane->size - start);
+	return true;
+}
+
+static unsigned int delta_tile_size(const struct delta_tiles *tiles,
+				    unsigned int index)
+{
+	unsigned int offset, size;
+	unsigned int total = 0;
+	unsigned int line;
+
+	for (line = 0; delta_tile_line(tiles, index, line, &offset, &size);
+	     ++line)
+		total += size;
+
+	return total;
+}
+
+struct delta_job {
+	const struct delta_tiles *tiles;
+	const uint8_t *frame;
+	const uint8_t *reference;
+	unsigned int num_slices;
+	bool *differs;
+};
+
+static void delta_compare_slice(void *priv, unsigned int index)
+{
+	struct delta_job *job = priv;
+	unsigned int offset, size;
+	unsigned int start, end;
+	unsigned int line;
+	unsigned int i;
+
+	parallel_slice_range(job->tiles->first[job->tiles->num_planes],
+			     job->num_slices, index, &start, &end);
+
+	for (i = start; i < end; ++i) {
+		for (line = 0; delta_tile_line(job->tiles, i, line, &offset,
+					       &size); ++line) {
+			if (memcmp(job->frame + offset,
+				   job->reference + offset, size)) {
+				job->differs[i] = true;
+				break;
+			}
+		}
+	}
+}
+
+/*
+ * Store the delta between a frame and its reference to a file. Return the
+ * number of differing tiles, or a negative error code.
+ */
+static int delta_create(const struct image *frame,
+			const struct image *reference, const char *identity,
+			const char *filename)
+{
+	struct delta_header header;
+	struct delta_tiles tiles;
+	struct delta_job job;
+	unsigned int num_tiles;
+	unsigned int offset, size;
+	unsigned int line;
+	unsigned int i;
+	uint8_t *data = NULL;
+	uint8_t *p;
+	size_t data_size;
+	int ret;
+
+	if (frame->format != reference->format ||
+	    frame->width != reference->width ||
+	    frame->height != reference->height) {
+		printf("Can't compute the delta of %s %ux%u and %s %ux%u images\n",
+		       frame->format->name, frame->width, frame->height,
+		       reference->format->name, reference->width,
+		       reference->height);
+		return -EINVAL;
+	}
+
+	delta_tiles_init(&tiles, frame);
+	num_tiles = tiles.first[tiles.num_planes];
+
+	job.tiles = &tiles;
+	job.frame = frame->data;
+	job.reference = reference->data;
+	job.num_slices = parallel_num_slices(num_tiles);
+	job.differs = calloc(max(num_tiles, 1U), sizeof(*job.differs));
+	if (!job.differs)
+		return -ENOMEM;
+
+	parallel_run(job.num_slices, delta_compare_slice, &job);
+
+	memset(&header, 0, sizeof(header));
+	header.magic = DELTA_MAGIC;
+	header.version = DELTA_VERSION;
+	strncpy(header.format, frame->format->name, sizeof(header.format) - 1);
+	header.width = frame->width;
+	header.height = frame->height;
+	header.identity_size = identity ? strlen(identity) : 0;
+
+	data_size = header.identity_size;
+	for (i = 0; i < num_tiles; ++i) {
+		if (!job.differs[i])
+			continue;
+
+		header.num_tiles++;
+		data_size += 4 + delta_tile_size(&tiles, i);
+	}
+
+	ret = checksum(reference->data, reference->size,
+		       header.reference_checksum);
+	if (ret < 0)
+		goto done;
+
+	ret = checksum(frame->data, frame->size, header.frame_checksum);
+	if (ret < 0)
+		goto done;
+
+	data = malloc(max(data_size, (size_t)1));
+	if (!data) {
+		ret = -ENOMEM;
+		goto done;
+	}
+
+	p = data;
+	if (identity)
+		memcpy(p, identity, header.identity_size);
+	p += header.identity_size;
+
+	for (i = 0; i < num_tiles; ++i) {
+		uint32_t index = i;
+
+		if (!job.differs[i])
+			continue;
+
+		memcpy(p, &index, sizeof(index));
+		p += sizeof(index);
+
+		for (line = 0; delta_tile_line(&tiles, i, line, &offset,
+					       &size); ++line) {
+			memcpy(p, frame->data + offset, size);
+			p += size;
+		}
+	}
+
+	ret = file_store(filename, &header, sizeof(header), data, data_size);
+	if (!ret)
+		ret = header.num_tiles;
+
+done:
+	free(job.differs);
+	free(data);
+	return ret;
+}
+
+struct delta {
+	const struct delta_header *header;
+	const uint8_t *data;
+	size_t size;
+	const struct format_info *format;
+	char *identity;
+};
+
+static void delta_close(struct delta *delta)
+{
+	if (delta->data)
+		munmap((void *)delta->data, delta->size);
+	free(delta->identity);
+}
+
+/* Map a delta file in memory and validate its header. */
+static int delta_open(struct delta *delta, const char *filename)
+{
+	const struct delta_header *header;
+	struct stat st;
+	void *data;
+	int ret = 0;
+	int fd;
+
+	memset(delta, 0, sizeof(*delta));
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		printf("Unable to open delta file %s: %s (%d)\n", filename,
+		       strerror(errno), errno);
+		return -errno;
+	}
+
+	if (fstat(fd, &st) < 0) {
+		ret = -errno;
+		goto done;
+	}
+
+	if ((size_t)st.st_size < sizeof(*header)) {
+		printf("Invalid delta file %s: file too short\n", filename);
+		ret = -EINVAL;
+		goto done;
+	}
+
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (data == MAP_FAILED) {
+		printf("Unable to map delta file %s: %s (%d)\n", filename,
+		       strerror(errno), errno);
+		ret = -errno;
+		goto done;
+	}
+
+	delta->data = data;
+	delta->size = st.st_size;
+	delta->header = header = data;
+
+	if (header->magic != DELTA_MAGIC || header->version != DELTA_VERSION ||
+	    header->identity_size > st.st_size - sizeof(*header) ||
+	    !memchr(header->format, 0, sizeof(header->format))) {
+		printf("Invalid delta file %s: invalid header\n", filename);
+		ret = -EINVAL;
+		goto done;
+	}
+
+	delta->format = format_by_name(header->format);
+	if (!delta->format || !header->width || !header->height) {
+		printf("Invalid delta file %s: unsupported format %s %ux%u\n",
+		       filename, header->format, header->width, header->height);
+		ret = -EINVAL;
+		goto done;
+	}
+
+	delta->identity = strndup(data + sizeof(*header),
+				  header->identity_size);
+	if (!delta->identity)
+		ret = -ENOMEM;
+
+done:
+	close(fd);
+	if (ret)
+		delta_close(delta);
+	return ret;
+}
+
+/*
+ * Reconstruct a frame from a delta file and the reference stored in a raw
+ * file. Return NULL if the reference doesn't match the delta.
+ */
+static struct image *delta_apply(const char *filename,
+				 const char *reference_filename)
+{
+	uint8_t digest[CHECKSUM_SIZE];
+	struct delta_tiles tiles;
+	struct delta delta;
+	struct image *frame = NULL;
+	const uint8_t *p;
+	const uint8_t *end;
+	unsigned int offset, size;
+	unsigned int line;
+	unsigned int i;
+	int ret;
+
+	ret = delta_open(&delta, filename);
+	if (ret < 0)
+		return NULL;
+
+	frame = image_read_raw(reference_filename, delta.format,
+			       delta.header->width, delta.header->height);
+	if (!frame)
+		goto error;
+
+	ret = checksum(frame->data, frame->size, digest);
+	if (ret < 0)
+		goto error;
+
+	if (memcmp(digest, delta.header->reference_checksum, sizeof(digest))) {
+		printf("Reference %s doesn't match the reference of %s\n",
+		       reference_filename, filename);
+		goto error;
+	}
+
+	delta_tiles_init(&tiles, frame);
+
+	p = delta.data + sizeof(*delta.header) + delta.header->identity_size;
+	end = delta.data + delta.size;
+
+	for (i = 0; i < delta.header->num_tiles; ++i) {
+		uint32_t index;
+
+		if (end - p < (ptrdiff_t)sizeof(index))
+			goto invalid;
+
+		memcpy(&index, p, sizeof(index));
+		p += sizeof(index);
+
+		if (index >= tiles.first[tiles.num_planes] ||
+		    (size_t)(end - p) < delta_tile_size(&tiles, index))
+			goto invalid;
+
+		for (line = 0; delta_tile_line(&tiles, index, line, &offset,
+					       &size); ++line) {
+			memcpy(frame->data + offset, p, size);
+			p += size;
+		}
+	}
+
+	ret = checksum(frame->data, frame->size, digest);
+	if (ret < 0)
+		goto error;
+
+	if (memcmp(digest, delta.header->frame_checksum, sizeof(digest))) {
+		printf("Frame reconstructed from %s doesn't match its checksum\n",
+		       filename);
+		goto error;
+	}
+
+	delta_close(&delta);
+	return frame;
+
+invalid:
+	printf("Invalid delta file %s: invalid tile data\n", filename);
+error:
+	image_delete(frame);
+	delta_close(&delta);
+	return NULL;
+}
+
+static int delta_info(const char *filename)
+{
+	struct delta_tiles tiles;
+	struct delta delta;
+	struct image image;
+	int ret;
+
+	ret = delta_open(&delta, filename);
+	if (ret < 0)
+		return ret;
+
+	image_init(&image, delta.format, delta.header->width,
+		   delta.header->height);
+	delta_tiles_init(&tiles, &image);
+
+	printf("Format: %s %ux%u\n", delta.format->name, image.width,
+	       image.height);
+	printf("Tiles: %u/%u\n", delta.header->num_tiles,
+	       tiles.first[tiles.num_planes]);
+	printf("Identity: %s\n", delta.identity);
+
+	delta_close(&delta);
+	return 0;
+}
+
+/* -----------------------------------------------------------------------------
+ * Self tests
+ *
+ * Validate the optimized kernels against the scalar reference implementations.
+ */
+
+static int self_test_hst(void)
+{
+	uint8_t rgb[256 * 3];
+	uint8_t hsv[256 * 3];
+	unsigned int r, g, b;
+
+	/* Test all 2^24 RGB values, 256 at a time. */
+	for (r = 0; r < 256; ++r) {
+		for (g = 0; g < 256; ++g) {
+			for (b = 0; b < 256; ++b) {
+				rgb[b*3] = r;
+				rgb[b*3 + 1] = g;
+				rgb[b*3 + 2] = b;
+			}
+
+			hst_convert(rgb, hsv, 256);
+
+			for (b = 0; b < 256; ++b) {
+				uint8_t ref[3];
+
+				hst_rgb_to_hsv(&rgb[b*3], ref);
+				if (memcmp(ref, &hsv[b*3], 3)) {
+					printf("HST mismatch for RGB (%u,%u,%u): got HSV (%u,%u,%u), expected (%u,%u,%u)\n",
+					       r, g, b, hsv[b*3], hsv[b*3 + 1],
+					       hsv[b*3 + 2], ref[0], ref[1], ref[2]);
+					return -EINVAL;
+				}
+			}
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Check the BLAKE3 implementation against the official test vectors, computed
+ * on inputs made of the repeating byte sequence 0, 1, ..., 250.
+ */
+static int self_test_checksum(void)
+{
+	static const struct {
+		unsigned int size;
+		const char *digest;
+	} vectors[] = {
+		{ 0, "af1349b9f5f9a1a6a0404dea36dcc9499bcb25c9adc112b7cc9a93cae41f3262" },
+		{ 1, "2d3adedff11b61f14c886e35afa036736dcd87a74d27b5c1510225d0f592e213" },
+		{ 64, "4eed7141ea4a5cd4b788606bd23f46e212af9cacebacdc7d1f4c6dc7f2511b98" },
+		{ 1023, "10108970eeda3eb932baac1428c7a2163b0e924c9a9e25b35bba72b28f70bd11" },
+		{ 1024, "42214739f095a406f3fc83deb889744ac00df831c10daa55189b5d121c855af7" },
+		{ 1025, "d00278ae47eb27b34faecf67b4fe263f82d5412916c1ffd97c8cb7fb814b8444" },
+		{ 2048, "e776b6028c7cd22a4d0ba182a8bf62205d2ef576467e838ed6f2529b85fba24a" },
+		{ 2049, "5f4d72f40d7a5f82b15ca2b2e44b1de3c2ef86c426c95c1af0b6879522563030" },
+		{ 3072, "b98cb0ff3623be03326b373de6b9095218513e64f1ee2edd2525c7ad1e5cffd2" },
+		{ 3073, "7124b49501012f81cc7f11ca069ec9226cecb8a2c850cfe644e327d22d3e1cd3" },
+		{ 4096, "015094013f57a5277b59d8475c0501042c0b642e531b0a1c8f58d2163229e969" },
+		{ 4097, "9b4052b38f1c5fc8b1f9ff7ac7b27cd242487b3d890d15c96a1c25b8aa0fb995" },
+		{ 8193, "bab6c09cb8ce8cf459261398d2e7aef35700bf488116ceb94a36d0f5f1b7bc3b" },
+		{ 31744, "62b6960e1a44bcc1eb1a611a8d6235b6b4b78f32e7abc4fb4c6cdcce94895c47" },
+		{ 102400, "bc3e3d41a1146b069abffad3c0d44860cf664390afce4d9661f7902e7943e085" },
+	};
+	uint8_t digest[CHECKSUM_SIZE];
+	char str[CHECKSUM_SIZE * 2 + 1];
+	uint8_t *data;
+	unsigned int i;
+	int ret = 0;
+
+	data = malloc(vectors[ARRAY_SIZE(vectors) - 1].size);
+	if (!data)
+		return -ENOMEM;
+
+	for (i = 0; i < vectors[ARRAY_SIZE(vectors) - 1].size; ++i)
+		data[i] = i % 251;
+
+	for (i = 0; i < ARRAY_SIZE(vectors); ++i) {
+		ret = checksum(data, vectors[i].size, digest);
+		if (ret < 0)
+			break;
+
+		checksum_format(digest, str);
+		if (strcmp(str, vectors[i].digest)) {
+			printf("Checksum mismatch for %u bytes: got %s, expected %s\n",
+			       vectors[i].size, str, vectors[i].digest);
+			ret = -EINVAL;
+			break;
+		}
+	}
+
+	free(data);
+	return ret;
+}
+
+static int self_test_png(void)
+{
+	static const uint8_t data[] = "123456789";
+	uint32_t crc;
+	uint32_t adler;
+
+	png_init_tables();
+
+	crc = crc32_update(0, data, 9);
+	adler = zlib_adler32(data, 9);
+	if (crc != 0xcbf43926 || adler != 0x091e01de) {
+		printf("PNG checksums mismatch: got crc %08x adler %08x\n",
+		       crc, adler);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+/*
+ * Compress and decompress images of all formats filled with flat areas,
+ * gradients and noise, with odd sizes and fewer lines than stripes, and check
+ * that truncated blocks are rejected.
+ */
+static int self_test_codec(void)
+{
+	static const struct {
+		unsigned int width;
+		unsigned int height;
+	} sizes[] = {
+		{ 1, 1 },
+		{ 7, 3 },
+		{ 333, 99 },
+		{ 640, 2047 },
+	};
+	uint8_t src[4096];
+	uint8_t block[4096 + 4096 / 255 + 16];
+	uint8_t output[4097];
+	uint32_t *table;
+	uint32_t seed = 1;
+	unsigned int i, j, k;
+	size_t size;
+	int ret = 0;
+
+	for (i = 0; i < ARRAY_SIZE(format_info) && !ret; ++i) {
+		for (j = 0; j < ARRAY_SIZE(sizes) && !ret; ++j) {
+			struct image *image;
+			struct image *decoded;
+			uint8_t *pixels;
+			uint8_t *data;
+
+			/* Limit the largest size to a few formats. */
+			if (sizes[j].height > 1000 && i % 8)
+				continue;
+
+			image = image_new(&format_info[i], sizes[j].width,
+					  sizes[j].height);
+			if (!image)
+				return -ENOMEM;
+
+			pixels = image->data;
+			for (k = 0; k < image->size; ++k) {
+				seed = seed * 1103515245 + 12345;
+				if (k % 1000 < 300)
+					pixels[k] = 0x80;
+				else if (k % 1000 < 700)
+					pixels[k] = k / 7;
+				else
+					pixels[k] = seed >> 24;
+			}
+
+			ret = codec_compress(image, &data, &size);
+			if (ret < 0) {
+				image_delete(image);
+				break;
+			}
+
+			decoded = codec_decompress(data, size, "test");
+			if (!decoded || decoded->format != image->format ||
+			    decoded->size != image->size ||
+			    memcmp(decoded->data, image->data, image->size)) {
+				printf("Codec mismatch for %s %ux%u\n",
+				       format_info[i].name, sizes[j].width,
+				       sizes[j].height);
+				ret = -EINVAL;
+			}
+
+			image_delete(decoded);
+			free(data);
+			image_delete(image);
+		}
+	}
+
+	if (ret)
+		return ret;
+
+	/* Blocks must decompress to exactly the expected size. */
+	table = malloc(sizeof(*table) << CODEC_HASH_BITS);
+	if (!table)
+		return -ENOMEM;
+
+	for (k = 0; k < sizeof(src); ++k)
+		src[k] = k % 1000 < 500 ? k / 3 : k * k;
+
+	size = codec_lz_compress(src, sizeof(src), block, table);
+	if (!codec_lz_decompress(block, size - 1, output, sizeof(src)) ||
+	    !codec_lz_decompress(block, size, output, sizeof(src) - 1) ||
+	    !codec_lz_decompress(block, size, output, sizeof(src) + 1) ||
+	    codec_lz_decompress(block, size, output, sizeof(src)) ||
+	    memcmp(output, src, sizeof(src))) {
+		printf("Codec block validation failed\n");
+		ret = -EINVAL;
+	}
+
+	free(table);
+	return ret;
+}
+
+/* Decompress gzip data stored in a temporary file and compare the result. */
+static int self_test_gzip_file(const uint8_t *gzip, size_t gzip_size,
+			       const uint8_t *data, size_t size)
+{
+	struct gzip_stream *gz;
+	uint8_t *output;
+	FILE *file;
+	int ret = -EINVAL;
+
+	output = malloc(size + 1);
+	file = tmpfile();
+	if (!output || !file) {
+		ret = -ENOMEM;
+		goto done;
+	}
+
+	if (fwrite(gzip, gzip_size, 1, file) != 1 || fflush(file))
+		goto done;
+
+	lseek(fileno(file), 0, SEEK_SET);
+
+	gz = gzip_open(fileno(file));
+	if (!gz)
+		goto done;
+
+	if (gzip_read(gz, output, size + 1) != (int)size ||
+	    memcmp(output, data, size)) {
+		gzip_close(gz);
+		goto done;
+	}
+
+	ret = gzip_close(gz);
+
+done:
+	if (file)
+		fclose(file);
+	free(output);
+	return ret;
+}
+
+/*
+ * Store a gzip member to p, with the first stored bytes of data in a stored
+ * block followed, if stored is smaller than size, by the rest of the data in a
+ * block compressed by the PNG deflate encoder. Return the end of the member.
+ */
+static uint8_t *self_test_gzip_member(uint8_t *p, const uint8_t *data,
+				      size_t size, size_t stored)
+{
+	static const uint8_t header[] = {
+		0x1f, 0x8b, 8, 0x08, 0, 0, 0, 0, 0, 3, 't', 'e', 's', 't', 0,
+	};
+	size_t deflated;
+	uint32_t crc;
+	unsigned int i;
+
+	memcpy(p, header, sizeof(header));
+	p += sizeof(header);
+
+	if (stored) {
+		/* Stored block, BTYPE = 00. */
+		*p++ = stored == size ? 1 : 0;
+		*p++ = stored & 0xff;
+		*p++ = stored >> 8;
+		*p++ = ~stored & 0xff;
+		*p++ = (~stored >> 8) & 0xff;
+		memcpy(p, data, stored);
+		p += stored;
+	}
+
+	if (stored < size) {
+		if (deflate(data + stored, size - stored, p, &deflated) < 0)
+			return NULL;
+		p += deflated;
+	}
+
+	crc = crc32_update(0, data, size);
+	for (i = 0; i < 4; ++i)
+		*p++ = crc >> (i * 8);
+	for (i = 0; i < 4; ++i)
+		*p++ = size >> (i * 8);
+
+	return p;
+}
+
+/*
+ * Decompress a gzip file made of a stored block followed by a block compressed
+ * by the PNG deflate encoder, and check that a corrupted checksum is detected.
+ * Then decompress the same data split in two members.
+ */
+static int self_test_gzip(void)
+{
+	const size_t size = 20000;
+	const size_t stored = 1000;
+	uint8_t *data;
+	uint8_t *gzip;
+	uint8_t *p;
+	unsigned int i;
+	int ret;
+
+	data = malloc(size);
+	gzip = malloc(2 * (15 + 5 + 8) + size * 9 / 8 + 16);
+	if (!data || !gzip) {
+		ret = -ENOMEM;
+		goto done;
+	}
+
+	for (i = 0; i < size; ++i)
+		data[i] = i < size / 2 ? (i % 251) ^ (i / 1000) : i * i >> 7;
+
+	png_init_tables();
+
+	p = self_test_gzip_member(gzip, data, size, stored);
+	if (!p) {
+		ret = -ENOMEM;
+		goto done;
+	}
+
+	ret = self_test_gzip_file(gzip, p - gzip, data, size);
+	if (ret) {
+		printf("Gzip decompression failed\n");
+		goto done;
+	}
+
+	gzip[p - gzip - 8] ^= 1;
+	if (!self_test_gzip_file(gzip, p - gzip, data, size)) {
+		printf("Gzip checksum mismatch not detected\n");
+		ret = -EINVAL;
+		goto done;
+	}
+
+	p = self_test_gzip_member(gzip, data, stored, stored);
+	p = self_test_gzip_member(p, data + stored, size - stored, 0);
+	if (!p) {
+		ret = -ENOMEM;
+		goto done;
+	}
+
+	ret = self_test_gzip_file(gzip, p - gzip, data, size);
+	if (ret)
+		printf("Gzip multiple members decompression failed\n");
+
+done:
+	free(gzip);
+	free(data);
+	return ret;
+}
+
+/*
+ * Store the histogram of a single window to a file name without '#', over a
+ * larger existing file, and check that multiple windows require a '#'.
+ */
+static int self_test_histogram(void)
+{
+	static const char header[] = "P6\n16 8\n255\n";
+	char dir[] = "/tmp/vspref-histo-XXXXXX";
+	char input[64];
+	char histogram[64];
+	uint8_t pixels[16 * 8 * 3];
+	uint8_t expected[HISTOGRAM_HGO_SIZE];
+	uint8_t data[HISTOGRAM_HGO_SIZE * 2];
+	struct vspref_plan *plan = NULL;
+	struct image *source = NULL;
+	struct image *output = NULL;
+	struct stat st;
+	unsigned int i;
+	int ret;
+	int fd;
+
+	if (!mkdtemp(dir))
+		return -errno;
+
+	snprintf(input, sizeof(input), "%s/input.pnm", dir);
+	snprintf(histogram, sizeof(histogram), "%s/histo.bin", dir);
+
+	for (i = 0; i < sizeof(pixels); ++i)
+		pixels[i] = i * 7;
+
+	fd = open(input, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+	if (fd < 0) {
+		ret = -errno;
+		goto done;
+	}
+
+	ret = file_write(fd, header, strlen(header));
+	if (!ret)
+		ret = file_write(fd, pixels, sizeof(pixels));
+	close(fd);
+	if (ret < 0)
+		goto done;
+
+	memset(data, 0xff, sizeof(data));
+	ret = histogram_write(histogram, data, sizeof(data));
+	if (ret < 0)
+		goto done;
+
+	plan = vspref_plan_new();
+	source = image_read(input);
+	if (!plan || !source) {
+		ret = -ENOMEM;
+		goto done;
+	}
+
+	ret = vspref_plan_set(plan, "histogram-window", "(2,1)/8x4");
+	if (!ret)
+		ret = vspref_plan_process(plan, input, NULL, histogram);
+	if (ret)
+		goto done;
+
+	output = image_new(plan->options.output_format, source->width,
+			   source->height);
+	if (!output) {
+		ret = -ENOMEM;
+		goto done;
+	}
+
+	ret = process(&plan->options, source, output, expected);
+	if (ret)
+		goto done;
+
+	fd = open(histogram, O_RDONLY);
+	if (fd < 0) {
+		ret = -errno;
+		goto done;
+	}
+
+	if (fstat(fd, &st) < 0 || st.st_size != sizeof(expected) ||
+	    file_read(fd, data, sizeof(data)) != sizeof(expected) ||
+	    memcmp(data, expected, sizeof(expected))) {
+		printf("Single window histogram file mismatch\n");
+		ret = -EINVAL;
+	}
+	close(fd);
+	if (ret)
+		goto done;
+
+	ret = vspref_plan_set(plan, "histogram-window", "(0,0)/4x4");
+	if (ret)
+		goto done;
+
+	if (vspref_plan_process(plan, input, NULL, histogram) != -EINVAL) {
+		printf("Multiple windows accepted without '#' in the file name\n");
+		ret = -EINVAL;
+	}
+
+done:
+	image_delete(output);
+	image_delete(source);
+	vspref_plan_delete(plan);
+	unlink(histogram);
+	unlink(input);
+	rmdir(dir);
+	return ret;
+}
+
+/* Write a LUT file for the strict mode test to a temporary file. */
+static int self_test_strict_lut(char *filename, const void *lut, size_t size)
+{
+	int ret;
+	int fd;
+
+	strcpy(filename, "/tmp/vspref-lut-XXXXXX");
+	fd = mkstemp(filename);
+	if (fd < 0) {
+		filename[0] = '\0';
+		return -errno;
+	}
+
+	ret = file_write(fd, lut, size);
+	close(fd);
+	return ret;
+}
+
+/*
+ * Process a fixed corpus in strict mode, covering all processing stages, and
+ * compare the digests of the output images and histograms with the digests
+ * recorded on the build host. Strict mode only uses integer arithmetic, a
+ * mismatch means that references generated on another host can't be trusted.
+ */
+static int self_test_strict(void)
+{
+	static const struct {
+		const char *options;
+		const char *digest;
+	} cases[] = {
+		{ "format=NV12M size=333x201",
+		  "cc5f8185bb35e1ca0c7ba683e98e88b9a01ab5b4c35a07e4bf22f84ec0519c5b" },
+		{ "format=YUYV size=97x61 encoding=REC.709 quantization=full",
+		  "56f67405ae45be8b633897ff9b93d3f0de2e2201670d430d51b9a3857ab8c75e" },
+		{ "format=RGB565 crop=(7,5)/100x80 size=51x150 rotate hflip",
+		  "08f5a736358a2532105c99811c8753e496ae026ae14f015630e8195944241255" },
+		{ "format=HSV24 histogram-type=hgt histogram-areas=0,20,40,60,80,100,120,140,160,180,200,220",
+		  "b772f01c96ee872411f5d9346acfc230501afdd0dcf110fcf7aaccea7ceef3ac" },
+		{ "format=ARGB32 alpha=200 compose=2 vflip",
+		  "e22528e1b39af32f78b7a3c97e6e534a7af5d5326b0999a4bc695837336bceef" },
+		{ "format=XRGB555 layer=-:(10,20)/64x48:alpha=128 layer=-:(90,-7)/200x30",
+		  "a03af1d673c556c32a29c5ae3be5a57dd24af1a419012cdaa8152950b98d8669" },
+		{ "format=YUV444M lut=@ clu=@ encoding=BT.2020",
+		  "851d956f3d9122fdf4b567ede975f513459efbe5b7c03568f2a439458b2b0109" },
+		{ "in-format=YVU420M format=NV61M size=160x119 encoding=SMPTE240M",
+		  "123377f56288e8d85f088fc57551d8aa85ac12d259de97538cdf0f4d526629ca" },
+		{ "format=RGB24 histogram-window=(8,8)/64x32:2 histogram-window=(100,60)/59x59",
+		  "e16e410741a0a7fdf16a3ff05d07d91589859e47210f5930d8d488b6f7494926" },
+		{ "format=YUV420M size=75x45 vflip",
+		  "aa5def4d6a9edcce719eed84f45a4ab8d8dc446395ee53528447de131d0bd852" },
+	};
+	const unsigned int width = 160;
+	const unsigned int height = 120;
+	char lut_filename[32] = "";
+	char clu_filename[32] = "";
+	struct image *source;
+	uint8_t lut[1024];
+	uint32_t *clu;
+	uint32_t seed = 1;
+	uint8_t *pixels;
+	bool mismatch = false;
+	unsigned int i;
+	int ret;
+
+	/* Gradients with noise in the lower half. */
+	source = image_new(format_by_name("RGB24"), width, height);
+	clu = malloc(17 * 17 * 17 * sizeof(*clu));
+	if (!source || !clu) {
+		ret = -ENOMEM;
+		goto done;
+	}
+
+	pixels = source->data;
+	for (i = 0; i < source->size; ++i) {
+		unsigned int x = i / 3 % width;
+		unsigned int y = i / 3 / width;
+
+		seed = seed * 1103515245 + 12345;
+		if (y < height / 2)
+			pixels[i] = i % 3 == 0 ? x * 255 / (width - 1)
+				  : i % 3 == 1 ? y * 4 : (x + y) & 0xff;
+		else
+			pixels[i] = seed >> 24;
+	}
+
+	for (i = 0; i < sizeof(lut); ++i)
+		lut[i] = 255 - (i / 4) * (i / 4) / 255 - i % 4;
+	for (i = 0; i < 17 * 17 * 17; ++i) {
+		seed = seed * 1103515245 + 12345;
+		clu[i] = seed >> 8;
+	}
+
+	ret = self_test_strict_lut(lut_filename, lut, sizeof(lut));
+	if (!ret)
+		ret = self_test_strict_lut(clu_filename, clu,
+					   17 * 17 * 17 * sizeof(*clu));
+	if (ret) {
+		printf("Unable to create LUT files: %s (%d)\n", strerror(-ret),
+		       ret);
+		goto done;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(cases) && !ret; ++i) {
+		uint8_t digest[CHECKSUM_SIZE];
+		char str[CHECKSUM_SIZE * 2 + 1];
+		const struct options *options;
+		struct vspref_plan *plan;
+		struct image *output = NULL;
+		unsigned int output_width;
+		unsigned int output_height;
+		size_t histo_size;
+		uint8_t *data = NULL;
+		char *spec;
+		char *token;
+		char *next;
+
+		plan = vspref_plan_new();
+		spec = strdup(cases[i].options);
+		if (!plan || !spec) {
+			ret = -ENOMEM;
+			goto next;
+		}
+
+		ret = vspref_plan_set(plan, "strict", NULL);
+		for (token = spec; token && !ret; token = next) {
+			char *value;
+
+			next = strchr(token, ' ');
+			if (next)
+				*next++ = '\0';
+
+			value = strchr(token, '=');
+			if (value)
+				*value++ = '\0';
+			if (value && !strcmp(value, "@"))
+				value = !strcmp(token, "lut") ? lut_filename
+							      : clu_filename;
+
+			ret = vspref_plan_set(plan, token, value);
+		}
+		if (ret)
+			goto next;
+
+		options = &plan->options;
+		process_output_size(options, width, height, &output_width,
+				    &output_height);
+		histo_size = process_histogram_size(options);
+
+		output = image_new(options->output_format, output_width,
+				   output_height);
+		if (!output) {
+			ret = -ENOMEM;
+			goto next;
+		}
+
+		/* Catch output bytes that processing leaves unwritten. */
+		memset(output->data, 0xa5, output->size);
+
+		/* Hash the output image followed by the histogram. */
+		data = malloc(output->size + histo_size);
+		if (!data) {
+			ret = -ENOMEM;
+			goto next;
+		}
+
+		ret = process(options, source, output, data + output->size);
+		if (ret)
+			goto next;
+
+		memcpy(data, output->data, output->size);
+		ret = checksum(data, output->size + histo_size, digest);
+		if (ret < 0)
+			goto next;
+
+		checksum_format(digest, str);
+		if (strcmp(str, cases[i].digest)) {
+			printf("Strict digest mismatch for '%s': got %s, expected %s\n",
+			       cases[i].options, str, cases[i].digest);
+			mismatch = true;
+		}
+
+next:
+		free(data);
+		image_delete(output);
+		free(spec);
+		vspref_plan_delete(plan);
+	}
+
+done:
+	if (lut_filename[0])
+		unlink(lut_filename);
+	if (clu_filename[0])
+		unlink(clu_filename);
+	free(clu);
+	image_delete(source);
+	return ret ? ret : mismatch ? -EINVAL : 0;
+}
+
+static int self_test(void)
+{
+	static const struct {
+		const char *name;
+		int (*test)(void);
+	} tests[] = {
+		{ "hst", self_test_hst },
+		{ "checksum", self_test_checksum },
+		{ "png", self_test_png },
+		{ "codec", self_test_codec },
+		{ "gzip", self_test_gzip },
+		{ "histogram", self_test_histogram },
+		{ "strict", self_test_strict },
+	};
+	unsigned int failed = 0;
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(tests); ++i) {
+		int ret = tests[i].test();
+
+		printf("Self test %s: %s\n", tests[i].name, ret ? "fail" : "pass");
+		if (ret)
+			failed++;
+	}
+
+	return failed ? -EINVAL : 0;
+}
+
+/* -----------------------------------------------------------------------------
+ * Benchmarks
+ *
+ * Time each processing kernel on synthetic images of increasing sizes. Every
+ * kernel and size combination runs for at least BENCH_MIN_ITERATIONS
+ * iterations and BENCH_MIN_TIME nanoseconds, and the median and 95th
+ * percentile iteration times are reported. Results can be saved as JSON lines
+ * and compared against a baseline file to detect regressions.
+ */
+
+#define BENCH_MIN_ITERATIONS	5
+#define BENCH_MAX_ITERATIONS	1000
+#define BENCH_MIN_TIME		50000000ULL
+/* Regressions are reported above this ratio and absolute difference. */
+#define BENCH_THRESHOLD		1.10
+#define BENCH_THRESHOLD_NS	1000
+
+enum bench_op {
+	BENCH_FORMAT,
+	BENCH_COLORSPACE,
+	BENCH_HST,
+	BENCH_LUT,
+	BENCH_CLU,
+	BENCH_SCALE_UP,
+	BENCH_SCALE_DOWN,
+	BENCH_ROTATE,
+	BENCH_FLIP,
+	BENCH_HGO,
+	BENCH_HGT,
+	BENCH_COMPARE,
+	BENCH_CHECKSUM,
+};
+
+struct bench_kernel {
+	char name[32];
+	enum bench_op op;
+	const struct format_info *in_format;
+	const struct format_info *out_format;
+	unsigned int encoding;
+	bool fixed_point;
+	bool strict;
+};
+
+struct bench_context {
+	const struct bench_kernel *kernel;
+	struct image *input;
+	struct image *output;
+	struct params params;
+	uint8_t lut[1024];
+	uint32_t clu[17*17*17];
+	uint8_t histo[HISTOGRAM_HGO_SIZE];
+};
+
+struct bench_result {
+	char kernel[32];
+	char size[16];
+	unsigned int iterations;
+	uint64_t median;
+	uint64_t p95;
+	double mpix;
+};
+
+static const struct {
+	unsigned int width;
+	unsigned int height;
+} bench_sizes[] = {
+	{ 1, 1 },
+	{ 640, 480 },
+	{ 1024, 768 },
+	{ 1920, 1080 },
+	{ 3840, 2160 },
+};
+
+static unsigned int bench_kernels(struct bench_kernel *kernels)
+{
+	static const struct {
+		const char *name;
+		unsigned int encoding;
+	} encodings[] = {
+		{ "BT.601", V4L2_YCBCR_ENC_601 },
+		{ "REC.709", V4L2_YCBCR_ENC_709 },
+		{ "BT.2020", V4L2_YCBCR_ENC_BT2020 },
+		{ "SMPTE240M", V4L2_YCBCR_ENC_SMPTE240M },
+	};
+	static const struct {
+		const char *name;
+		enum bench_op op;
+		bool fixed_point;
+		bool strict;
+	} ops[] = {
+		{ "hst", BENCH_HST, false, false },
+		{ "lut", BENCH_LUT, false, false },
+		{ "clu", BENCH_CLU, false, false },
+		{ "scale-up", BENCH_SCALE_UP, false, false },
+		{ "scale-down", BENCH_SCALE_DOWN, false, false },
+		{ "scale-up-fixed", BENCH_SCALE_UP, true, false },
+		{ "scale-down-fixed", BENCH_SCALE_DOWN, true, false },
+		{ "scale-up-strict", BENCH_SCALE_UP, false, true },
+		{ "scale-down-strict", BENCH_SCALE_DOWN, false, true },
+		{ "rotate", BENCH_ROTATE, false, false },
+		{ "flip", BENCH_FLIP, false, false },
+		{ "hgo", BENCH_HGO, false, false },
+		{ "hgt", BENCH_HGT, false, false },
+		{ "compare", BENCH_COMPARE, false, false },
+		{ "checksum", BENCH_CHECKSUM, false, false },
+	};
+	const struct format_info *rgb24 = format_by_name("RGB24");
+	const struct format_info *yuv24 = format_by_name("YUV24");
+	const struct format_info *hsv24 = format_by_name("HSV24");
+	struct bench_kernel *kernel = kernels;
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(format_info); ++i) {
+		const struct format_info *format = &format_info[i];
+
+		snprintf(kernel->name, sizeof(kernel->name), "format-%s",
+			 format->name);
+		kernel->op = BENCH_FORMAT;
+		kernel->out_format = format;
+		kernel->in_format = format->type == FORMAT_YUV ? yuv24
+				  : format->type == FORMAT_HSV ? hsv24 : rgb24;
+		kernel++;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(encodings); ++i) {
+		snprintf(kernel->name, sizeof(kernel->name), "colorspace-%s",
+			 encodings[i].name);
+		kernel->op = BENCH_COLORSPACE;
+		kernel->in_format = rgb24;
+		kernel->out_format = yuv24;
+		kernel->encoding = encodings[i].encoding;
+		kernel++;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(ops); ++i) {
+		snprintf(kernel->name, sizeof(kernel->name), "%s", ops[i].name);
+		kernel->op = ops[i].op;
+		kernel->in_format = rgb24;
+		kernel->out_format = ops[i].op == BENCH_HST ? hsv24 : rgb24;
+		kernel->fixed_point = ops[i].fixed_point;
+		kernel->strict = ops[i].strict;
+		kernel++;
+	}
+
+	return kernel - kernels;
+}
+
+static void bench_fill(uint8_t *data, size_t size, uint32_t seed)
+{
+	size_t i;
+
+	/* xorshift32, the content only needs to be deterministic. */
+	for (i = 0; i < size; ++i) {
+		seed ^= seed << 13;
+		seed ^= seed >> 17;
+		seed ^= seed << 5;
+		data[i] = seed;
+	}
+}
+
+static int bench_setup(struct bench_context *ctx,
+		       const struct bench_kernel *kernel,
+		       unsigned int width, unsigned int height)
+{
+	unsigned int in_width = width;
+	unsigned int in_height = height;
+	unsigned int out_width = width;
+	unsigned int out_height = height;
+
+	memset(ctx, 0, sizeof(*ctx));
+	ctx->kernel = kernel;
+	ctx->params.alpha = 255;
+	ctx->params.encoding = kernel->encoding ? kernel->encoding
+			     : V4L2_YCBCR_ENC_601;
+	ctx->params.quantization = V4L2_QUANTIZATION_LIM_RANGE;
+	ctx->params.fixed_point = kernel->fixed_point;
+	ctx->params.strict = kernel->strict;
+
+	switch (kernel->op) {
+	case BENCH_SCALE_UP:
+		in_width = max(1U, width / 2);
+		in_height = max(1U, height / 2);
+		break;
+	case BENCH_SCALE_DOWN:
+		in_width = width * 2;
+		in_height = height * 2;
+		break;
+	case BENCH_ROTATE:
+		out_width = height;
+		out_height = width;
+		break;
+	default:
+		break;
+	}
+
+	ctx->input = image_new(kernel->in_format, in_width, in_height);
+	ctx->output = image_new(kernel->out_format, out_width, out_height);
+	if (!ctx->input || !ctx->output)
+		return -ENOMEM;
+
+	bench_fill(ctx->input->data, ctx->input->size, 0x12345678);
+	bench_fill(ctx->output->data, ctx->output->size, 0x12345678);
+	bench_fill(ctx->lut, sizeof(ctx->lut), 0x9abcdef0);
+	bench_fill((uint8_t *)ctx->clu, sizeof(ctx->clu), 0x0fedcba9);
+
+	return 0;
+}
+
+static void bench_cleanup(struct bench_context *ctx)
+{
+	image_delete(ctx->input);
+	image_delete(ctx->output);
+}
+
+static int bench_iterate(struct bench_context *ctx)
+{
+	static const uint8_t hue_areas[12] = {
+		0, 20, 40, 60, 80, 100, 120, 140, 160, 180, 200, 220
+	};
+
+	switch (ctx->kernel->op) {
+	case BENCH_FORMAT:
+		return image_format(ctx->input, ctx->output, &ctx->params);
+	case BENCH_COLORSPACE:
+		image_colorspace_rgb_to_yuv(ctx->input, ctx->output,
+					    ctx->output->format, &ctx->params);
+		return 0;
+	case BENCH_HST:
+		image_rgb_to_hsv(ctx->input, ctx->output, &ctx->params);
+		return 0;
+	case BENCH_LUT:
+		image_lut_1d(ctx->input, ctx->output, ctx->lut);
+		return 0;
+	case BENCH_CLU:
+		return image_lut_3d(ctx->input, ctx->output, ctx->clu);
+	case BENCH_SCALE_UP:
+	case BENCH_SCALE_DOWN:
+		return image_scale(ctx->input, ctx->output, &ctx->params);
+	case BENCH_ROTATE:
+		image_rotate(ctx->input, ctx->output, false, false);
+		return 0;
+	case BENCH_FLIP:
+		image_flip(ctx->input, ctx->output, true, false);
+		return 0;
+	case BENCH_HGO:
+		return histogram_compute_hgo(ctx->input, ctx->histo);
+	case BENCH_HGT:
+		return histogram_compute_hgt(ctx->input, ctx->histo, hue_areas);
+	case BENCH_COMPARE: {
+		struct compare_stats stats;
+
+		return compare_images(ctx->input, ctx->output, &stats);
+	}
+	case BENCH_CHECKSUM: {
+		uint8_t digest[CHECKSUM_SIZE];
+
+		return checksum(ctx->input->data, ctx->input->size, digest);
+	}
+	}
+
+	return -EINVAL;
+}
+
+static uint64_t bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int bench_compare_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static int bench_run(const struct bench_kernel *kernel, unsigned int width,
+		     unsigned int height, struct bench_result *result)
+{
+	uint64_t samples[BENCH_MAX_ITERATIONS];
+	struct bench_context ctx;
+	uint64_t total = 0;
+	unsigned int count;
+	int ret;
+
+	ret = bench_setup(&ctx, kernel, width, height);
+	if (ret < 0)
+		goto done;
+
+	/* Warm up the caches and lazily initialized tables. */
+	ret = bench_iterate(&ctx);
+	if (ret < 0)
+		goto done;
+
+	for (count = 0; count < BENCH_MAX_ITERATIONS; ++count) {
+		uint64_t start;
+
+		if (count >= BENCH_MIN_ITERATIONS && total >= BENCH_MIN_TIME)
+			break;
+
+		start = bench_now();
+		ret = bench_iterate(&ctx);
+		samples[count] = bench_now() - start;
+		total += samples[count];
+
+		if (ret < 0)
+			goto done;
+	}
+
+	qsort(samples, count, sizeof(*samples), bench_compare_u64);
+
+	memcpy(result->kernel, kernel->name, sizeof(result->kernel));
+	snprintf(result->size, sizeof(result->size), "%ux%u", width, height);
+	result->iterations = count;
+	result->median = samples[count / 2];
+	result->p95 = samples[min(count - 1, (count * 95 + 99) / 100 - 1)];
+	result->mpix = result->median
+		     ? (double)width * height * 1000.0 / result->median : 0.0;
+
+done:
+	bench_cleanup(&ctx);
+	return ret;
+}
+
+/* Load baseline results stored as JSON lines by a previous run. */
+static struct bench_result *bench_load(const char *filename,
+				       unsigned int *count)
+{
+	struct bench_result *results = NULL;
+	unsigned int num_results = 0;
+	char line[256];
+	FILE *file;
+
+	file = fopen(filename, "r");
+	if (!file) {
+		printf("Unable to open benchmark baseline %s: %s (%d)\n",
+		       filename, strerror(errno), errno);
+		return NULL;
+	}
+
+	while (fgets(line, sizeof(line), file)) {
+		struct bench_result result;
+		unsigned long long median;
+		struct bench_result *tmp;
+
+		if (sscanf(line, "{\"kernel\": \"%31[^\"]\", \"size\": \"%15[^\"]\", \"iterations\": %u, \"median_ns\": %llu",
+			   result.kernel, result.size, &result.iterations,
+			   &median) != 4)
+			continue;
+
+		result.median = median;
+
+		tmp = realloc(results, (num_results + 1) * sizeof(*results));
+		if (!tmp)
+			break;
+
+		results = tmp;
+		results[num_results++] = result;
+	}
+
+	fclose(file);
+
+	*count = num_results;
+	return results ? results : calloc(1, sizeof(*results));
+}
+
+static int bench(const char *output_filename, const char *compare,
+		 const char *filter)
+{
+	struct bench_kernel kernels[ARRAY_SIZE(format_info) + 32];
+	struct bench_result *baseline = NULL;
+	unsigned int num_baseline = 0;
+	unsigned int num_kernels;
+	unsigned int regressions = 0;
+	FILE *output = NULL;
+	unsigned int i, j, k;
+	int ret = 0;
+
+	if (compare) {
+		baseline = bench_load(compare, &num_baseline);
+		if (!baseline)
+			return -EINVAL;
+	}
+
+	if (output_filename) {
+		output = fopen(output_filename, "w");
+		if (!output) {
+			printf("Unable to open benchmark output %s: %s (%d)\n",
+			       output_filename, strerror(errno), errno);
+			free(baseline);
+			return -errno;
+		}
+	}
+
+	num_kernels = bench_kernels(kernels);
+
+	printf("%-20s %10s %12s %12s %10s%s\n", "kernel", "size", "median (ns)",
+	       "p95 (ns)", "MPix/s", baseline ? "   baseline (ns)" : "");
+
+	for (i = 0; i < num_kernels; ++i) {
+		if (filter && !strstr(kernels[i].name, filter))
+			continue;
+
+		for (j = 0; j < ARRAY_SIZE(bench_sizes); ++j) {
+			struct bench_result result;
+			const struct bench_result *ref = NULL;
+
+			ret = bench_run(&kernels[i], bench_sizes[j].width,
+					bench_sizes[j].height, &result);
+			if (ret < 0) {
+				printf("Benchmark %s failed: %s (%d)\n",
+				       kernels[i].name, strerror(-ret), ret);
+				goto done;
+			}
+
+			printf("%-20s %10s %12llu %12llu %10.2f", kernels[i].name,
+			       result.size, (unsigned long long)result.median,
+			       (unsigned long long)result.p95, result.mpix);
+
+			for (k = 0; k < num_baseline; ++k) {
+				if (!strcmp(baseline[k].kernel, result.kernel) &&
+				    !strcmp(baseline[k].size, result.size)) {
+					ref = &baseline[k];
+					break;
+				}
+			}
+
+			if (ref) {
+				bool regression =
+					result.median > ref->median * BENCH_THRESHOLD &&
+					result.median - ref->median > BENCH_THRESHOLD_NS;
+
+				printf("   %12llu %+6.1f%%%s",
+				       (unsigned long long)ref->median,
+				       ref->median ? (result.median * 100.0 / ref->median) - 100.0 : 0.0,
+				       regression ? " REGRESSION" : "");
+				if (regression)
+					regressions++;
+			}
+
+			printf("\n");
+
+			if (output)
+				fprintf(output, "{\"kernel\": \"%s\", \"size\": \"%s\", \"iterations\": %u, \"median_ns\": %llu, \"p95_ns\": %llu, \"mpix_per_s\": %.3f}\n",
+					result.kernel, result.size,
+					result.iterations,
+					(unsigned long long)result.median,
+					(unsigned long long)result.p95,
+					result.mpix);
+		}
+	}
+
+	if (regressions) {
+		printf("%u benchmark regression(s) detected\n", regressions);
+		ret = -EINVAL;
+	}
+
+done:
+	if (output)
+		fclose(output);
+	free(baseline);
+	return ret;
+}
+
+/* -----------------------------------------------------------------------------
+ * Kernel verification
+ *
+ * Run every variant of the registered stages and compare its output with the
+ * scalar variant. Each stage is run in all its configurations (formats,
+ * encodings, orientations, ...) on images of a set of fixed and random sizes,
+ * including odd and single pixel dimensions, filled with random and edge case
+ * patterns, and with one and multiple threads. The first difference is
+ * reported with its location.
+ */
+
+/* Extra bytes allocated after the output images, see verify_image_new(). */
+#define VERIFY_SLACK		16
+#define VERIFY_CANARY		0xa5
+#define VERIFY_RANDOM_SIZES	8
+
+enum verify_pattern {
+	VERIFY_RANDOM,
+	VERIFY_ZERO,
+	VERIFY_SATURATED,
+	VERIFY_CHECKER,
+	VERIFY_RAMP,
+	VERIFY_NUM_PATTERNS,
+};
+
+static const char * const verify_patterns[VERIFY_NUM_PATTERNS] = {
+	"random", "zero", "saturated", "checker", "ramp",
+};
+
+struct verify_case {
+	unsigned int width;
+	unsigned int height;
+	enum verify_pattern pattern;
+	uint32_t seed;
+};
+
+struct verify_output {
+	struct image *image;
+	enum histogram_type histo_type;
+	uint8_t histo[HISTOGRAM_HGO_SIZE];
+	size_t histo_size;
+	bool stats;
+	bool digest;
+	char config[64];
+};
+
+static uint32_t verify_rand(uint32_t *state)
+{
+	*state ^= *state << 13;
+	*state ^= *state >> 17;
+	*state ^= *state << 5;
+	return *state;
+}
+
+/*
+ * Allocate a zeroed image followed by VERIFY_SLACK canary bytes, to catch
+ * kernels that store data past the end of odd-sized images.
+ */
+static struct image *verify_image_new(const struct format_info *format,
+				      unsigned int width, unsigned int height)
+{
+	struct image *image;
+	void *data;
+
+	image = image_new(format, width, height);
+	if (!image)
+		return NULL;
+
+	data = realloc(image->data, image->size + VERIFY_SLACK);
+	if (!data) {
+		image_delete(image);
+		return NULL;
+	}
+
+	image->data = data;
+	memset(image->data, 0, image->size);
+	memset(image->data + image->size, VERIFY_CANARY, VERIFY_SLACK);
+	return image;
+}
+
+/* Check whether the canary bytes after the output image were overwritten. */
+static bool verify_overrun(const struct verify_output *out)
+{
+	const uint8_t *data;
+	unsigned int i;
+
+	if (!out->image)
+		return false;
+
+	data = out->image->data + out->image->size;
+
+	for (i = 0; i < VERIFY_SLACK; ++i) {
+		if (data[i] != VERIFY_CANARY)
+			return true;
+	}
+
+	return false;
+}
+
+/* Create a 24-bit image filled with the test case pattern. */
+static struct image *verify_input_new(const char *format,
+				      unsigned int width, unsigned int height,
+				      const struct verify_case *vc,
+				      uint32_t salt)
+{
+	struct image *image;
+	uint8_t *data;
+	unsigned int i;
+
+	image = verify_image_new(format_by_name(format), width, height);
+	if (!image)
+		return NULL;
+
+	data = image->data;
+
+	switch (vc->pattern) {
+	case VERIFY_RANDOM:
+		bench_fill(data, image->size, vc->seed ^ salt);
+		break;
+	case VERIFY_ZERO:
+		break;
+	case VERIFY_SATURATED:
+		memset(data, 0xff, image->size);
+		break;
+	case VERIFY_CHECKER:
+		for (i = 0; i < image->size; ++i) {
+			unsigned int x = i / 3 % width;
+			unsigned int y = i / 3 / width;
+
+			data[i] = (x + y) & 1 ? 0xff : 0x00;
+		}
+		break;
+	case VERIFY_RAMP:
+		for (i = 0; i < image->size; ++i)
+			data[i] = i + salt;
+		break;
+	default:
+		break;
+	}
+
+	return image;
+}
+
+static const struct {
+	const char *name;
+	enum v4l2_ycbcr_encoding encoding;
+} verify_encodings[] = {
+	{ "BT.601", V4L2_YCBCR_ENC_601 },
+	{ "REC.709", V4L2_YCBCR_ENC_709 },
+	{ "BT.2020", V4L2_YCBCR_ENC_BT2020 },
+	{ "SMPTE240M", V4L2_YCBCR_ENC_SMPTE240M },
+};
+
+static const uint8_t verify_hue_areas[][12] = {
+	{ 0, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255 },
+	{ 0, 40, 40, 80, 80, 120, 120, 160, 160, 200, 200, 255 },
+	{ 220, 40, 40, 80, 80, 120, 120, 160, 160, 200, 200, 220 },
+	{ 0, 10, 50, 60, 100, 110, 150, 160, 200, 210, 250, 255 },
+	{ 10, 20, 50, 60, 100, 110, 150, 160, 200, 210, 230, 240 },
+	{ 240, 20, 60, 80, 100, 120, 140, 160, 180, 200, 210, 220 },
+};
+
+/* Every output format, with and without chroma averaging. */
+static int verify_format(const struct verify_case *vc, unsigned int config,
+			 struct verify_output *out)
+{
+	const struct format_info *format = &format_info[config / 2];
+	struct params params;
+	struct image *input;
+	int ret;
+
+	memset(&params, 0, sizeof(params));
+	params.alpha = vc->seed & 0xff;
+	params.no_chroma_average = config & 1;
+
+	snprintf(out->config, sizeof(out->config), "%s%s", format->name,
+		 params.no_chroma_average ? ", no chroma average" : "");
+
+	input = verify_input_new(format->type == FORMAT_YUV ? "YUV24" :
+				 format->type == FORMAT_HSV ? "HSV24" : "RGB24",
+				 vc->width, vc->height, vc, 0);
+	out->image = verify_image_new(format, vc->width, vc->height);
+	if (!input || !out->image) {
+		image_delete(input);
+		return -ENOMEM;
+	}
+
+	ret = image_format(input, out->image, &params);
+	image_delete(input);
+	return ret;
+}
+
+/* Every encoding and quantization, with and without chroma subsampling. */
+static int verify_colorspace(const struct verify_case *vc, unsigned int config,
+			     struct verify_output *out)
+{
+	const struct format_info *format;
+	struct params params;
+	struct image *input;
+
+	memset(&params, 0, sizeof(params));
+	params.encoding = verify_encodings[config % 4].encoding;
+	params.quantization = config / 4 % 2 ? V4L2_QUANTIZATION_FULL_RANGE
+			    : V4L2_QUANTIZATION_LIM_RANGE;
+	format = format_by_name(config / 8 ? "YUYV" : "YUV24");
+
+	snprintf(out->config, sizeof(out->config), "%s, %s range, %s",
+		 verify_encodings[config % 4].name,
+		 config / 4 % 2 ? "full" : "limited", format->name);
+
+	input = verify_input_new("RGB24", vc->width, vc->height, vc, 0);
+	out->image = verify_image_new(format_by_name("YUV24"), vc->width,
+				      vc->height);
+	if (!input || !out->image) {
+		image_delete(input);
+		return -ENOMEM;
+	}
+
+	image_colorspace_rgb_to_yuv(input, out->image, format, &params);
+	image_delete(input);
+	return 0;
+}
+
+static int verify_hst(const struct verify_case *vc, unsigned int config,
+		      struct verify_output *out)
+{
+	struct image *input;
+
+	input = verify_input_new("RGB24", vc->width, vc->height, vc, 0);
+	out->image = verify_image_new(format_by_name("HSV24"), vc->width,
+				      vc->height);
+	if (!input || !out->image) {
+		image_delete(input);
+		return -ENOMEM;
+	}
+
+	image_rgb_to_hsv(input, out->image, NULL);
+	image_delete(input);
+	return 0;
+}
+
+/*
+ * Output sizes computed from the input size as size * num / den + add, with
+ * the 1-pixel and odd sizes that are prone to edge errors.
+ */
+static const struct {
+	unsigned int num;
+	unsigned int den;
+	unsigned int add;
+} verify_scale_sizes[] = {
+	{ 5, 2, 1 },
+	{ 1, 3, 0 },
+	{ 1, 1, 0 },
+	{ 1, 1, 1 },
+	{ 0, 1, 1 },
+	{ 0, 1, 2 },
+	{ 0, 1, 33 },
+};
+
+/* Upscaling and downscaling in floating point, fixed point and strict mode. */
+static int verify_scale(const struct verify_case *vc, unsigned int config,
+			struct verify_output *out)
+{
+	unsigned int num = verify_scale_sizes[config / 3].num;
+	unsigned int den = verify_scale_sizes[config / 3].den;
+	unsigned int add = verify_scale_sizes[config / 3].add;
+	unsigned int width = max(vc->width * num / den + add, 1U);
+	unsigned int height = max(vc->height * num / den + add, 1U);
+	struct params params;
+	struct image *input;
+	int ret;
+
+	memset(&params, 0, sizeof(params));
+	params.fixed_point = config % 3 == 1;
+	params.strict = config % 3 == 2;
+
+	snprintf(out->config, sizeof(out->config), "%ux%u%s", width, height,
+		 params.strict ? ", strict" :
+		 params.fixed_point ? ", fixed point" : "");
+
+	input = verify_input_new("RGB24", vc->width, vc->height, vc, 0);
+	out->image = verify_image_new(format_by_name("RGB24"), width, height);
+	if (!input || !out->image) {
+		image_delete(input);
+		return -ENOMEM;
+	}
+
+	ret = image_scale(input, out->image, &params);
+	image_delete(input);
+	return ret;
+}
+
+/* Random layers positions, sizes, alpha values and masks. */
+static int verify_compose(const struct verify_case *vc, unsigned int config,
+			  struct verify_output *out)
+{
+	struct compose_layer layers[COMPOSE_MAX_LAYERS];
+	struct image *images[COMPOSE_MAX_LAYERS * 2] = { NULL };
+	unsigned int num_layers = config + 1;
+	uint32_t state = vc->seed + config;
+	unsigned int width = vc->width;
+	unsigned int height = vc->height;
+	unsigned int i;
+	int ret = 0;
+
+	snprintf(out->config, sizeof(out->config), "%u layer(s)", num_layers);
+
+	for (i = 0; i < num_layers; ++i) {
+		struct compose_layer *layer = &layers[i];
+		unsigned int w, h;
+
+		/* The first layer covers the whole output. */
+		if (i == 0) {
+			w = width;
+			h = height;
+			layer->left = 0;
+			layer->top = 0;
+			layer->alpha = 255;
+		} else {
+			w = verify_rand(&state) % (width * 2) + 1;
+			h = verify_rand(&state) % (height * 2) + 1;
+			layer->left = (int)(verify_rand(&state) % (width + w)) - (int)w + 1;
+			layer->top = (int)(verify_rand(&state) % (height + h)) - (int)h + 1;
+			layer->alpha = i % 3 == 1 ? 255 : verify_rand(&state);
+		}
+
+		images[i * 2] = verify_input_new("RGB24", w, h, vc, i);
+		if (!images[i * 2]) {
+			ret = -ENOMEM;
+			goto done;
+		}
+
+		layer->image = images[i * 2];
+		layer->mask = NULL;
+
+		if (i % 2 == 0 && i) {
+			images[i * 2 + 1] = verify_input_new("RGB24", w, h, vc,
+							     i + 0x100);
+			if (!images[i * 2 + 1]) {
+				ret = -ENOMEM;
+				goto done;
+			}
+
+			layer->mask = images[i * 2 + 1];
+		}
+	}
+
+	out->image = verify_image_new(format_by_name("RGB24"), width, height);
+	if (!out->image) {
+		ret = -ENOMEM;
+		goto done;
+	}
+
+	image_compose(out->image, layers, num_layers);
+
+done:
+	for (i = 0; i < ARRAY_SIZE(images); ++i)
+		image_delete(images[i]);
+	return ret;
+}
+
+static int verify_rotate(const struct verify_case *vc, unsigned int config,
+			 struct verify_output *out)
+{
+	bool hflip = config & 1;
+	bool vflip = config & 2;
+	struct image *input;
+
+	snprintf(out->config, sizeof(out->config), "%s%s%s",
+		 hflip ? "hflip" : "", hflip && vflip ? " " : "",
+		 vflip ? "vflip" : "");
+
+	input = verify_input_new("RGB24", vc->width, vc->height, vc, 0);
+	out->image = verify_image_new(format_by_name("RGB24"), vc->height,
+				      vc->width);
+	if (!input || !out->image) {
+		image_delete(input);
+		return -ENOMEM;
+	}
+
+	image_rotate(input, out->image, hflip, vflip);
+	image_delete(input);
+	return 0;
+}
+
+static int verify_flip(const struct verify_case *vc, unsigned int config,
+		       struct verify_output *out)
+{
+	bool hflip = (config + 1) & 1;
+	bool vflip = (config + 1) & 2;
+	struct image *input;
+
+	snprintf(out->config, sizeof(out->config), "%s%s%s",
+		 hflip ? "hflip" : "", hflip && vflip ? " " : "",
+		 vflip ? "vflip" : "");
+
+	input = verify_input_new("RGB24", vc->width, vc->height, vc, 0);
+	out->image = verify_image_new(format_by_name("RGB24"), vc->width,
+				      vc->height);
+	if (!input || !out->image) {
+		image_delete(input);
+		return -ENOMEM;
+	}
+
+	image_flip(input, out->image, hflip, vflip);
+	image_delete(input);
+	return 0;
+}
+
+/* RGB and YUV inputs select different component orders. */
+static int verify_lut(const struct verify_case *vc, unsigned int config,
+		      struct verify_output *out)
+{
+	const char *format = config ? "YUV24" : "RGB24";
+	struct image *input;
+	uint8_t lut[1024];
+
+	snprintf(out->config, sizeof(out->config), "%s", format);
+	bench_fill(lut, sizeof(lut), vc->seed ^ 0x1d);
+
+	input = verify_input_new(format, vc->width, vc->height, vc, 0);
+	out->image = verify_image_new(format_by_name(format), vc->width,
+				      vc->height);
+	if (!input || !out->image) {
+		image_delete(input);
+		return -ENOMEM;
+	}
+
+	image_lut_1d(input, out->image, lut);
+	image_delete(input);
+	return 0;
+}
+
+static int verify_clu(const struct verify_case *vc, unsigned int config,
+		      struct verify_output *out)
+{
+	const char *format = config ? "YUV24" : "RGB24";
+	struct image *input;
+	uint32_t *lut;
+	int ret;
+
+	snprintf(out->config, sizeof(out->config), "%s", format);
+
+	lut = malloc(17 * 17 * 17 * sizeof(*lut));
+	input = verify_input_new(format, vc->width, vc->height, vc, 0);
+	out->image = verify_image_new(format_by_name(format), vc->width,
+				      vc->height);
+	if (!lut || !input || !out->image) {
+		ret = -ENOMEM;
+		goto done;
+	}
+
+	bench_fill((uint8_t *)lut, 17 * 17 * 17 * sizeof(*lut), vc->seed ^ 0x3d);
+	ret = image_lut_3d(input, out->image, lut);
+
+done:
+	image_delete(input);
+	free(lut);
+	return ret;
+}
+
+static int verify_hgo(const struct verify_case *vc, unsigned int config,
+		      struct verify_output *out)
+{
+	const char *format = config ? "YUV24" : "RGB24";
+	struct image *input;
+	int ret;
+
+	snprintf(out->config, sizeof(out->config), "%s", format);
+
+	input = verify_input_new(format, vc->width, vc->height, vc, 0);
+	if (!input)
+		return -ENOMEM;
+
+	out->histo_type = HISTOGRAM_HGO;
+	out->histo_size = HISTOGRAM_HGO_SIZE;
+	ret = histogram_compute_hgo(input, out->histo);
+	image_delete(input);
+	return ret;
+}
+
+/* RGB and HSV inputs, with the hue areas used by the HGT tests. */
+static int verify_hgt(const struct verify_case *vc, unsigned int config,
+		      struct verify_output *out)
+{
+	const uint8_t *areas = verify_hue_areas[config / 2];
+	const char *format = config % 2 ? "HSV24" : "RGB24";
+	struct image *input;
+	int ret;
+
+	snprintf(out->config, sizeof(out->config),
+		 "%s, areas %u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u", format,
+		 areas[0], areas[1], areas[2], areas[3], areas[4], areas[5],
+		 areas[6], areas[7], areas[8], areas[9], areas[10], areas[11]);
+
+	input = verify_input_new(format, vc->width, vc->height, vc, 0);
+	if (!input)
+		return -ENOMEM;
+
+	out->histo_type = HISTOGRAM_HGT;
+	out->histo_size = HISTOGRAM_HGT_SIZE;
+	ret = histogram_compute_hgt(input, out->histo, areas);
+	image_delete(input);
+	return ret;
+}
+
+/*
+ * Compare an image with a copy with sparse or dense differences, for all
+ * formats.
+ */
+static int verify_compare_stats(const struct verify_case *vc,
+				unsigned int config, struct verify_output *out)
+{
+	const struct format_info *format = &format_info[config / 2];
+	struct compare_stats stats;
+	struct image *a;
+	struct image *b;
+	uint8_t *noise;
+	unsigned int i;
+	int ret;
+
+	snprintf(out->config, sizeof(out->config), "%s, %s", format->name,
+		 config % 2 ? "dense" : "sparse");
+
+	a = verify_input_new(format->name, vc->width, vc->height, vc, 0);
+	b = verify_input_new(format->name, vc->width, vc->height, vc, 0);
+	noise = a ? malloc(a->size) : NULL;
+	if (!a || !b || !noise) {
+		ret = -ENOMEM;
+		goto done;
+	}
+
+	bench_fill(noise, a->size, vc->seed ^ 0x5c);
+
+	for (i = 0; i < a->size; ++i) {
+		if (config % 2 || noise[i] < 8)
+			((uint8_t *)b->data)[i] += noise[i] | 1;
+	}
+
+	ret = compare_images(a, b, &stats);
+	if (ret < 0)
+		goto done;
+
+	memcpy(out->histo, &stats, sizeof(stats));
+	out->histo_size = sizeof(stats);
+	out->stats = true;
+
+done:
+	free(noise);
+	image_delete(a);
+	image_delete(b);
+	return ret;
+}
+
+/* Checksum of 24-bit and 32-bit images, covering partial vector groups. */
+static int verify_checksum(const struct verify_case *vc, unsigned int config,
+			   struct verify_output *out)
+{
+	const char *format = config ? "ARGB32" : "RGB24";
+	struct image *input;
+	int ret;
+
+	snprintf(out->config, sizeof(out->config), "%s", format);
+
+	input = verify_input_new(format, vc->width, vc->height, vc, 0);
+	if (!input)
+		return -ENOMEM;
+
+	ret = checksum(input->data, input->size, out->histo);
+	out->histo_size = CHECKSUM_SIZE;
+	out->digest = true;
+
+	image_delete(input);
+	return ret;
+}
+
+static const struct kernel_stage {
+	const char *name;
+	const struct kernel_variant *variants;
+	unsigned int num_variants;
+	unsigned int num_configs;
+	int (*verify)(const struct verify_case *vc, unsigned int config,
+		      struct verify_output *out);
+} kernel_stages[KERNEL_NUM_STAGES] = {
+#define KERNEL_STAGE(id, n, v, c, f) \
+	[id] = { n, v, ARRAY_SIZE(v), c, f }
+	KERNEL_STAGE(KERNEL_COLORSPACE, "colorspace", colorspace_kernels,
+		     2 * 2 * ARRAY_SIZE(verify_encodings), verify_colorspace),
+	KERNEL_STAGE(KERNEL_HST, "hst", hst_kernels, 1, verify_hst),
+	KERNEL_STAGE(KERNEL_FORMAT, "format", format_kernels,
+		     2 * ARRAY_SIZE(format_info), verify_format),
+	KERNEL_STAGE(KERNEL_SCALE, "scale", scale_kernels,
+		     3 * ARRAY_SIZE(verify_scale_sizes), verify_scale),
+	KERNEL_STAGE(KERNEL_COMPOSE, "compose", compose_kernels,
+		     COMPOSE_MAX_LAYERS, verify_compose),
+	KERNEL_STAGE(KERNEL_ROTATE, "rotate", rotate_kernels, 4, verify_rotate),
+	KERNEL_STAGE(KERNEL_FLIP, "flip", flip_kernels, 3, verify_flip),
+	KERNEL_STAGE(KERNEL_LUT, "lut", lut_kernels, 2, verify_lut),
+	KERNEL_STAGE(KERNEL_CLU, "clu", clu_kernels, 2, verify_clu),
+	KERNEL_STAGE(KERNEL_HGO, "hgo", hgo_kernels, 2, verify_hgo),
+	KERNEL_STAGE(KERNEL_HGT, "hgt", hgt_kernels,
+		     2 * ARRAY_SIZE(verify_hue_areas), verify_hgt),
+	KERNEL_STAGE(KERNEL_COMPARE, "compare", compare_kernels,
+		     2 * ARRAY_SIZE(format_info), verify_compare_stats),
+	KERNEL_STAGE(KERNEL_CHECKSUM, "checksum", checksum_kernels, 2,
+		     verify_checksum),
+#undef KERNEL_STAGE
+};
+
+static void kernel_list(void)
+{
+	unsigned int i, j;
+
+	for (i = 0; i < ARRAY_SIZE(kernel_stages); ++i) {
+		const struct kernel_stage *stage = &kernel_stages[i];
+
+		printf("%s:", stage->name);
+		for (j = 0; j < stage->num_variants; ++j)
+			printf(" %s", stage->variants[j].name);
+		printf("\n");
+	}
+}
+
+/* Select a stage variant from a stage=variant string. */
+static int kernel_select(const char *spec)
+{
+	const char *variant = strchr(spec, '=');
+	unsigned int i, j;
+
+	if (!variant) {
+		printf("Invalid kernel '%s', expected stage=variant\n", spec);
+		return -EINVAL;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(kernel_stages); ++i) {
+		const struct kernel_stage *stage = &kernel_stages[i];
+
+		if (strlen(stage->name) != (size_t)(variant - spec) ||
+		    strncmp(stage->name, spec, variant - spec))
+			continue;
+
+		for (j = 0; j < stage->num_variants; ++j) {
+			if (!strcmp(stage->variants[j].name, variant + 1)) {
+				kernel_selection[i] = j;
+				return 0;
+			}
+		}
+
+		printf("Unknown %s kernel variant '%s'\n", stage->name,
+		       variant + 1);
+		return -EINVAL;
+	}
+
+	printf("Unknown kernel stage '%.*s'\n", (int)(variant - spec), spec);
+	return -EINVAL;
+}
+
+/* Describe the location of byte offset in the image. */
+static void verify_locate(const struct image *image, size_t offset,
+			  char *buf, size_t size)
+{
+	const struct format_info *format = image->format;
+	unsigned int width = image->width;
+	unsigned int plane = 0;
+	unsigned int bpp = 3;
+	unsigned int xsub = 1;
+	unsigned int ysub = 1;
+
+	switch (format->type) {
+	case FORMAT_RGB:
+		bpp = format->rgb.bpp / 8;
+		break;
+	case FORMAT_HSV:
+		bpp = format->hsv.bpp / 8;
+		break;
+	case FORMAT_YUV:
+		if (format->yuv.num_planes == 1) {
+			bpp = format == format_by_name("YUV24") ? 3 : 2;
+			break;
+		}
+
+		bpp = 1;
+		if (offset < width * image->height)
+			break;
+
+		/* Chroma planes, locate the pixel in the luma plane. */
+		offset -= width * image->height;
+		xsub = format->yuv.xsub;
+		ysub = format->yuv.ysub;
+		plane = 1;
+
+		if (format->yuv.num_planes == 2) {
+			bpp = 2;
+		} else if (offset >= width * image->height / xsub / ysub) {
+			offset -= width * image->height / xsub / ysub;
+			plane = 2;
+		}
+
+		width = width * bpp / xsub;
+		snprintf(buf, size, "plane %u pixel (%zu,%zu) byte %zu", plane,
+			 offset % width / bpp * xsub, offset / width * ysub,
+			 offset % bpp);
+		return;
+	}
+
+	snprintf(buf, size, "plane %u pixel (%zu,%zu) byte %zu", plane,
+		 offset / bpp % width, offset / bpp / width, offset % bpp);
+}
+
+/* Describe the histogram field stored at byte offset. */
+static void verify_locate_histo(enum histogram_type type, size_t offset,
+				char *buf, size_t size)
+{
+	if (type == HISTOGRAM_HGO) {
+		if (offset < 12)
+			snprintf(buf, size, "component %zu min/max", offset / 4);
+		else if (offset < 24)
+			snprintf(buf, size, "component %zu sum", (offset - 12) / 4);
+		else
+			snprintf(buf, size, "component %zu bin %zu",
+				 (offset - 24) / 4 / 64, (offset - 24) / 4 % 64);
+	} else {
+		if (offset < 4)
+			snprintf(buf, size, "S min/max");
+		else if (offset < 8)
+			snprintf(buf, size, "S sum");
+		else
+			snprintf(buf, size, "hue area %zu S bin %zu",
+				 (offset - 8) / 4 / 32, (offset - 8) / 4 % 32);
+	}
+}
+
+/*
+ * Compare the output of a variant with the reference output. Return true and
+ * describe the first difference in buf if they differ.
+ */
+static bool verify_compare(const struct verify_output *ref,
+			   const struct verify_output *out,
+			   char *buf, size_t size)
+{
+	const uint8_t *expected;
+	const uint8_t *data;
+	char where[64];
+	size_t length;
+	size_t i;
+
+	if (ref->image) {
+		expected = ref->image->data;
+		data = out->image->data;
+		length = ref->image->size;
+	} else {
+		expected = ref->histo;
+		data = out->histo;
+		length = ref->histo_size;
+	}
+
+	for (i = 0; i < length; ++i) {
+		if (data[i] != expected[i])
+			break;
+	}
+
+	if (i == length)
+		return false;
+
+	if (ref->image)
+		verify_locate(ref->image, i, where, sizeof(where));
+	else if (ref->stats)
+		snprintf(where, sizeof(where), "%s",
+			 (const char *[]){ "pixels", "sum", "squared sum" }[i / 8]);
+	else if (ref->digest)
+		snprintf(where, sizeof(where), "digest byte %zu", i);
+	else
+		verify_locate_histo(ref->histo_type, i, where, sizeof(where));
+
+	snprintf(buf, size, "%s: 0x%02x, expected 0x%02x", where, data[i],
+		 expected[i]);
+	return true;
+}
+
+static int verify_variant(unsigned int id, unsigned int scalar,
+			  unsigned int variant, const struct verify_case *cases,
+			  unsigned int num_cases)
+{
+	static const unsigned int threads[] = { 1, 3 };
+	const struct kernel_stage *stage = &kernel_stages[id];
+	unsigned int saved_threads = parallel_threads;
+	unsigned int saved_selection = kernel_selection[id];
+	unsigned int count = 0;
+	unsigned int i, j, k;
+	int ret = 0;
+
+	for (i = 0; i < num_cases && !ret; ++i) {
+		const struct verify_case *vc = &cases[i];
+
+		for (j = 0; j < stage->num_configs && !ret; ++j) {
+			for (k = 0; k < ARRAY_SIZE(threads) && !ret; ++k) {
+				struct verify_output ref;
+				struct verify_output out;
+				char diff[128];
+
+				memset(&ref, 0, sizeof(ref));
+				memset(&out, 0, sizeof(out));
+				parallel_threads = threads[k];
+
+				kernel_selection[id] = scalar;
+				ret = stage->verify(vc, j, &ref);
+				if (!ret) {
+					kernel_selection[id] = variant;
+					ret = stage->verify(vc, j, &out);
+				}
+
+				if (ret < 0) {
+					printf("Kernel %s/%s: failed to run: %s (%d)\n",
+					       stage->name,
+					       stage->variants[variant].name,
+					       strerror(-ret), ret);
+				} else if (verify_overrun(&ref) || verify_overrun(&out)) {
+					printf("Kernel %s/%s: write past the end of %ux%u image%s%s\n",
+					       stage->name,
+					       verify_overrun(&ref) ?
+					       stage->variants[scalar].name :
+					       stage->variants[variant].name,
+					       vc->width, vc->height,
+					       *ref.config ? ", " : "", ref.config);
+					ret = -EINVAL;
+				} else if (verify_compare(&ref, &out, diff,
+							  sizeof(diff))) {
+					printf("Kernel %s/%s: mismatch with %s for %ux%u %s (seed 0x%08x)%s%s, %u thread(s)\n",
+					       stage->name,
+					       stage->variants[variant].name,
+					       stage->variants[scalar].name,
+					       vc->width, vc->height,
+					       verify_patterns[vc->pattern],
+					       vc->seed, *ref.config ? ", " : "",
+					       ref.config, threads[k]);
+					printf("  first difference at %s\n", diff);
+					ret = -EINVAL;
+				}
+
+				image_delete(ref.image);
+				image_delete(out.image);
+				count++;
+			}
+		}
+	}
+
+	parallel_threads = saved_threads;
+	kernel_selection[id] = saved_selection;
+
+	if (!ret)
+		printf("Kernel %s/%s: pass (%u tests)\n", stage->name,
+		       stage->variants[variant].name, count);
+
+	return ret;
+}
+
+static int verify_kernels(void)
+{
+	static const struct {
+		unsigned int width;
+		unsigned int height;
+	} sizes[] = {
+		{ 1, 1 }, { 1, 7 }, { 7, 1 }, { 2, 2 }, { 3, 5 }, { 15, 4 },
+		{ 16, 3 }, { 17, 9 }, { 33, 17 }, { 33, 31 }, { 64, 48 },
+		{ 127, 65 },
+	};
+	struct verify_case cases[ARRAY_SIZE(sizes) * VERIFY_NUM_PATTERNS
+				 + VERIFY_RANDOM_SIZES];
+	unsigned int num_cases = 0;
+	unsigned int failed = 0;
+	uint32_t state = 0x2545f491;
+	unsigned int i, j;
+
+	for (i = 0; i < ARRAY_SIZE(sizes); ++i) {
+		for (j = 0; j < VERIFY_NUM_PATTERNS; ++j) {
+			struct verify_case *vc = &cases[num_cases++];
+
+			vc->width = sizes[i].width;
+			vc->height = sizes[i].height;
+			vc->pattern = j;
+			vc->seed = verify_rand(&state);
+		}
+	}
+
+	for (i = 0; i < VERIFY_RANDOM_SIZES; ++i) {
+		struct verify_case *vc = &cases[num_cases++];
+
+		vc->width = verify_rand(&state) % 200 + 1;
+		vc->height = verify_rand(&state) % 100 + 1;
+		vc->pattern = VERIFY_RANDOM;
+		vc->seed = verify_rand(&state);
+	}
+
+	for (i = 0; i < ARRAY_SIZE(kernel_stages); ++i) {
+		const struct kernel_stage *stage = &kernel_stages[i];
+		unsigned int scalar;
+
+		for (scalar = 0; scalar < stage->num_variants; ++scalar) {
+			if (!strcmp(stage->variants[scalar].name, "scalar"))
+				break;
+		}
+
+		if (scalar == stage->num_variants) {
+			printf("Kernel %s: no scalar variant\n", stage->name);
+			failed++;
+			continue;
+		}
+
+		for (j = 0; j < stage->num_variants; ++j) {
+			if (j == scalar)
+				continue;
+
+			if (verify_variant(i, scalar, j, cases, num_cases))
+				failed++;
+		}
+	}
+
+	return failed ? -EINVAL : 0;
+}
+
+/* -----------------------------------------------------------------------------
+ * Option parsing
+ */
+
+static void parser_print_error(const char *p, const char *end)
+{
+	int pos;
+
+	pos = end - p + 1;
+
+	if (pos < 0)
+		pos = 0;
+	if (pos > (int) strlen(p) + 1)
+		pos = strlen(p) + 1;
+
+	printf("\n");
+	printf(" %s\n", p);
+	printf(" %*s\n", pos, "^");
+}
+
+static int parse_crop(struct image_rect *crop, const char *string);
+
+/*
+ * Parse an alpha value expressed as a floating point value ([0.0 - 1.0]), a
+ * fixed point value ([0-255]) or a percentage ([0% - 100%]). Return -1 if the
+ * value is invalid.
+ */
+static int parse_alpha(const char *string)
+{
+	char *endptr;
+	int alpha;
+
+	if (strchr(string, '.')) {
+		alpha = strtod(string, &endptr) * 255;
+		if (*endptr != 0)
+			alpha = -1;
+	} else {
+		alpha = strtoul(string, &endptr, 10);
+		if (*endptr == '%')
+			alpha = alpha * 255 / 100;
+		else if (*endptr != 0)
+			alpha = -1;
+	}
+
+	if (alpha < 0 || alpha > 255)
+		return -1;
+
+	return alpha;
+}
+
+static int parse_layer(struct options *options, const char *string)
+{
+	/* file[:(X,Y)[/WxH]][:alpha=A][:mask=file] */
+	struct layer_spec *layer;
+	char *spec;
+	char *token;
+	char *next;
+
+	if (options->num_layers == COMPOSE_MAX_LAYERS) {
+		printf("Too many layers, at most %u are supported\n",
+		       COMPOSE_MAX_LAYERS);
+		return 1;
+	}
+
+	/* The spec string is referenced by the layer, freed with the plan. */
+	spec = strdup(string);
+	if (!spec)
+		return 1;
+
+	layer = &options->layers[options->num_layers];
+	memset(layer, 0, sizeof(*layer));
+	layer->spec = spec;
+	layer->alpha = 255;
+
+	next = strchr(spec, ':');
+	if (next)
+		*next++ = '\0';
+
+	if (strcmp(spec, "-"))
+		layer->filename = spec;
+
+	while (next) {
+		token = next;
+		next = strchr(token, ':');
+		if (next)
+			*next++ = '\0';
+
+		if (token[0] == '(') {
+			char rect_spec[strlen(token) + 5];
+			struct image_rect rect;
+
+			/* Reuse the crop parser, with a dummy size if needed. */
+			sprintf(rect_spec, strchr(token, '/') ? "%s" : "%s/0x0",
+				token);
+
+			if (parse_crop(&rect, rect_spec))
+				return 1;
+
+			layer->left = rect.left;
+			layer->top = rect.top;
+			layer->width = rect.width;
+			layer->height = rect.height;
+
+			if (!layer->width != !layer->height) {
+				printf("Invalid layer size in '%s'\n", string);
+				return 1;
+			}
+		} else if (!strncmp(token, "alpha=", 6)) {
+			int alpha = parse_alpha(token + 6);
+
+			if (alpha < 0) {
+				printf("Invalid layer alpha value '%s'\n", token + 6);
+				return 1;
+			}
+
+			layer->alpha = alpha;
+		} else if (!strncmp(token, "mask=", 5)) {
+			layer->mask_filename = token + 5;
+		} else {
+			printf("Invalid layer parameter '%s'\n", token);
+			return 1;
+		}
+	}
+
+	options->num_layers++;
+	return 0;
+}
+
+static int parse_histogram_window(struct options *options, const char *string)
+{
+	/* (X,Y)/WxH[:N] */
+	struct histogram_window *windows;
+	struct histogram_window window;
+	char *spec, *sep;
+	char *endptr;
+	int ret;
+
+	spec = strdup(string);
+	if (!spec)
+		return 1;
+
+	window.subsample = 1;
+
+	sep = strchr(spec, ':');
+	if (sep) {
+		*sep++ = '\0';
+		window.subsample = strtoul(sep, &endptr, 10);
+		if (*endptr != 0 || endptr == sep ||
+		    (window.subsample != 1 && window.subsample != 2 &&
+		     window.subsample != 4)) {
+			printf("Invalid histogram window subsampling factor '%s'\n",
+			       sep);
+			free(spec);
+			return 1;
+		}
+	}
+
+	ret = parse_crop(&window.crop, spec);
+	free(spec);
+	if (ret)
+		return 1;
+
+	if (window.crop.left < 0 || window.crop.top < 0) {
+		printf("Invalid histogram window '%s': coordinates must be positive\n",
+		       string);
+		return 1;
+	}
+
+	/* Smaller windows would contain no sample. */
+	if (window.crop.width < window.subsample ||
+	    window.crop.height < window.subsample) {
+		printf("Invalid histogram window '%s': size smaller than the subsampling factor\n",
+		       string);
+		return 1;
+	}
+
+	windows = realloc(options->histo_windows,
+			  (options->num_histo_windows + 1) * sizeof(*windows));
+	if (!windows)
+		return 1;
+
+	windows[options->num_histo_windows++] = window;
+	options->histo_windows = windows;
+	return 0;
+}
+
+/* Read histogram windows from a file, one per line. */
+static int parse_histogram_windows(struct options *options,
+				   const char *filename)
+{
+	char line[256];
+	FILE *file;
+	int ret = 0;
+
+	file = fopen(filename, "r");
+	if (!file) {
+		printf("Unable to open histogram windows file %s: %s (%d)\n",
+		       filename, strerror(errno), errno);
+		return 1;
+	}
+
+	while (fgets(line, sizeof(line), file)) {
+		line[strcspn(line, "\r\n")] = '\0';
+		if (line[0] == '\0' || line[0] == '#')
+			continue;
+
+		ret = parse_histogram_window(options, line);
+		if (ret)
+			break;
+	}
+
+	fclose(file);
+	return ret;
+}
+
+static int parse_crop(struct image_rect *crop, const char *string)
+{
+	/* (X,Y)/WxH */
+	const char *p = string;
+	char *endptr;
+	int value;
+
+	if (*p != '(') {
+		printf("Invalid crop format, expected '('\n");
+		goto error;
+	}
+
+	p++;
+	crop->left = strtol(p, &endptr, 10);
+	if (p == endptr) {
+		printf("Invalid crop format, expected x coordinate\n");
+		goto error;
+	}
+
+	p = endptr;
+	if (*p != ',') {
+		printf("Invalid crop format, expected ','\n");
+		goto error;
+	}
+
+	p++;
+	crop->top = strtol(p, &endptr, 10);
+	if (p == endptr) {
+		printf("Invalid crop format, expected y coordinate\n");
+		goto error;
+	}
+
+	p = endptr;
+	if (*p != ')') {
+		printf("Invalid crop format, expected ')'\n");
+		goto error;
+	}
+
+	p++;
+	if (*p != '/') {
+		printf("Invalid crop format, expected '/'\n");
+		goto error;
+	}
+
+	p++;
+	value = strtol(p, &endptr, 10);
+	if (p == endptr) {
+		printf("Invalid crop format, expected width\n");
+		goto error;
+	}
+
+	if (value < 0) {
+		printf("width must be positive\n");
+		goto error;
+	}
+
+	crop->width = value;
+
+	p = endptr;
+	if (*p != 'x') {
+		printf("Invalid crop format, expected 'x'\n");
+		goto error;
+	}
+
+	p++;
+	value = strtol(p, &endptr, 10);
+	if (p == endptr) {
+		printf("Invalid crop format, expected height\n");
+		goto error;
+	}
+
+	if (value < 0) {
+		printf("height must be positive\n");
+		goto error;
+	}
+
+	crop->height = value;
+
+	p = endptr;
+	if (*p != 0) {
+		printf("Invalid crop format, garbage at end of input\n");
+		goto error;
+	}
+
+	return 0;
+
+error:
+	parser_print_error(string, p);
+	return 1;
+}
+
+
+enum plan_option_id {
+	PLAN_ALPHA,
+	PLAN_CLU,
+	PLAN_COMPOSE,
+	PLAN_COMPRESS,
+	PLAN_CROP,
+	PLAN_ENCODING,
+	PLAN_FIXED_POINT,
+	PLAN_FORMAT,
+	PLAN_HFLIP,
+	PLAN_HISTOGRAM_AREAS,
+	PLAN_HISTOGRAM_TYPE,
+	PLAN_HISTOGRAM_WINDOW,
+	PLAN_HISTOGRAM_WINDOWS,
+	PLAN_IN_FORMAT,
+	PLAN_KERNEL,
+	PLAN_LAYER,
+	PLAN_LUT,
+	PLAN_NO_CHROMA_AVERAGE,
+	PLAN_PROFILE,
+	PLAN_QUANTIZATION,
+	PLAN_ROTATE,
+	PLAN_SIZE,
+	PLAN_SOURCE_CACHE,
+	PLAN_STRICT,
+	PLAN_THREADS,
+	PLAN_VFLIP,
+};
+
+/* Plan options are named after the gen-image long options. */
+static const struct plan_option {
+	const char *name;
+	enum plan_option_id id;
+	bool has_value;
+} plan_options[] = {
+	{ "alpha", PLAN_ALPHA, true },
+	{ "clu", PLAN_CLU, true },
+	{ "compose", PLAN_COMPOSE, true },
+	{ "compress", PLAN_COMPRESS, false },
+	{ "crop", PLAN_CROP, true },
+	{ "encoding", PLAN_ENCODING, true },
+	{ "fixed-point", PLAN_FIXED_POINT, false },
+	{ "format", PLAN_FORMAT, true },
+	{ "hflip", PLAN_HFLIP, false },
+	{ "histogram-areas", PLAN_HISTOGRAM_AREAS, true },
+	{ "histogram-type", PLAN_HISTOGRAM_TYPE, true },
+	{ "histogram-window", PLAN_HISTOGRAM_WINDOW, true },
+	{ "histogram-windows", PLAN_HISTOGRAM_WINDOWS, true },
+	{ "in-format", PLAN_IN_FORMAT, true },
+	{ "kernel", PLAN_KERNEL, true },
+	{ "layer", PLAN_LAYER, true },
+	{ "lut", PLAN_LUT, true },
+	{ "no-chroma-average", PLAN_NO_CHROMA_AVERAGE, false },
+	{ "profile", PLAN_PROFILE, false },
+	{ "quantization", PLAN_QUANTIZATION, true },
+	{ "rotate", PLAN_ROTATE, false },
+	{ "size", PLAN_SIZE, true },
+	{ "source-cache", PLAN_SOURCE_CACHE, true },
+	{ "strict", PLAN_STRICT, false },
+	{ "threads", PLAN_THREADS, true },
+	{ "vflip", PLAN_VFLIP, false },
+};
+
+int vspref_plan_set(struct vspref_plan *plan, const char *name,
+		    const char *value)
+{
+	struct options *options = &plan->options;
+	const struct plan_option *option = NULL;
+	char *endptr;
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(plan_options); ++i) {
+		if (!strcmp(plan_options[i].name, name)) {
+			option = &plan_options[i];
+			break;
+		}
+	}
+
+	if (!option) {
+		printf("Unknown option '%s'\n", name);
+		return -EINVAL;
+	}
+
+	if (option->has_value && !value) {
+		printf("Option '%s' requires a value\n", name);
+		return -EINVAL;
+	}
+
+	switch (option->id) {
+	case PLAN_ALPHA: {
+		int alpha = parse_alpha(value);
+
+		if (alpha < 0) {
+			printf("Invalid alpha value '%s'\n", value);
+			return -EINVAL;
+		}
+
+		options->params.alpha = alpha;
+		break;
+	}
+
+	case PLAN_CLU:
+		free(options->clu_filename);
+		options->clu_filename = strdup(value);
+		if (!options->clu_filename)
+			return -ENOMEM;
+		break;
+
+	case PLAN_COMPOSE:
+		options->compose = strtoul(value, &endptr, 10);
+		if (*endptr != 0) {
+			printf("Invalid compose value '%s'\n", value);
+			return -EINVAL;
+		}
+		break;
+
+	case PLAN_COMPRESS:
+		options->compress = true;
+		break;
+
+	case PLAN_CROP:
+		if (parse_crop(&options->inputcrop, value))
+			return -EINVAL;
+
+		if (options->inputcrop.left < 0 || options->inputcrop.top < 0) {
+			printf("Invalid crop rectangle '%s': coordinates must be positive\n",
+			       value);
+			return -EINVAL;
+		}
+
+		options->crop = true;
+		break;
+
+	case PLAN_ENCODING:
+		if (!strcmp(value, "BT.601")) {
+			options->params.encoding = V4L2_YCBCR_ENC_601;
+		} else if (!strcmp(value, "REC.709")) {
+			options->params.encoding = V4L2_YCBCR_ENC_709;
+		} else if (!strcmp(value, "BT.2020")) {
+			options->params.encoding = V4L2_YCBCR_ENC_BT2020;
+		} else if (!strcmp(value, "SMPTE240M")) {
+			options->params.encoding = V4L2_YCBCR_ENC_SMPTE240M;
+		} else {
+			printf("Invalid encoding value '%s'\n", value);
+			return -EINVAL;
+		}
+		break;
+
+	case PLAN_FIXED_POINT:
+		options->params.fixed_point = true;
+		break;
+
+	case PLAN_FORMAT:
+		options->output_format = format_by_name(value);
+		if (!options->output_format) {
+			printf("Unsupported output format '%s'\n", value);
+			options->output_format = format_by_name("RGB24");
+			return -EINVAL;
+		}
+		break;
+
+	case PLAN_HFLIP:
+		options->hflip = true;
+		break;
+
+	case PLAN_HISTOGRAM_AREAS: {
+		int matched;
+
+		matched = sscanf(value, "%hhu,%hhu,%hhu,%hhu,%hhu,%hhu,%hhu,%hhu,%hhu,%hhu,%hhu,%hhu",
+				 &options->histo_areas[0], &options->histo_areas[1],
+				 &options->histo_areas[2], &options->histo_areas[3],
+				 &options->histo_areas[4], &options->histo_areas[5],
+				 &options->histo_areas[6], &options->histo_areas[7],
+				 &options->histo_areas[8], &options->histo_areas[9],
+				 &options->histo_areas[10], &options->histo_areas[11]);
+		if (matched != 12) {
+			printf("Invalid hgt hue areas '%s'\n", value);
+			return -EINVAL;
+		}
+		break;
+	}
+
+	case PLAN_HISTOGRAM_TYPE:
+		if (!strcmp(value, "hgo")) {
+			options->histo_type = HISTOGRAM_HGO;
+		} else if (!strcmp(value, "hgt")) {
+			options->histo_type = HISTOGRAM_HGT;
+		} else {
+			printf("Invalid histogram type '%s'\n", value);
+			return -EINVAL;
+		}
+		break;
+
+	case PLAN_HISTOGRAM_WINDOW:
+		if (parse_histogram_window(options, value))
+			return -EINVAL;
+		break;
+
+	case PLAN_HISTOGRAM_WINDOWS:
+		if (parse_histogram_windows(options, value))
+			return -EINVAL;
+		break;
+
+	case PLAN_IN_FORMAT:
+		options->input_format = format_by_name(value);
+		if (!options->input_format) {
+			printf("Unsupported input format '%s'\n", value);
+			options->input_format = format_by_name("RGB24");
+			return -EINVAL;
+		}
+		break;
+
+	case PLAN_KERNEL:
+		return kernel_select(value);
+
+	case PLAN_LAYER:
+		if (parse_layer(options, value))
+			return -EINVAL;
+		break;
+
+	case PLAN_LUT:
+		free(options->lut_filename);
+		options->lut_filename = strdup(value);
+		if (!options->lut_filename)
+			return -ENOMEM;
+		break;
+
+	case PLAN_NO_CHROMA_AVERAGE:
+		options->params.no_chroma_average = true;
+		break;
+
+	case PLAN_PROFILE:
+		if (!value) {
+			options->profile_json = false;
+		} else if (!strcmp(value, "json")) {
+			options->profile_json = true;
+		} else {
+			printf("Invalid profile output format '%s'\n", value);
+			return -EINVAL;
+		}
+
+		options->profile = true;
+		break;
+
+	case PLAN_QUANTIZATION:
+		if (!strcmp(value, "limited")) {
+			options->params.quantization = V4L2_QUANTIZATION_LIM_RANGE;
+		} else if (!strcmp(value, "full")) {
+			options->params.quantization = V4L2_QUANTIZATION_FULL_RANGE;
+		} else {
+			printf("Invalid quantization value '%s'\n", value);
+			return -EINVAL;
+		}
+		break;
+
+	case PLAN_ROTATE:
+		options->rotate = true;
+		break;
+
+	case PLAN_SIZE:
+		options->output_width = strtol(value, &endptr, 10);
+		if (*endptr != 'x' || endptr == value) {
+			printf("Invalid size '%s'\n", value);
+			return -EINVAL;
+		}
+
+		options->output_height = strtol(endptr + 1, &endptr, 10);
+		if (*endptr != 0) {
+			printf("Invalid size '%s'\n", value);
+			return -EINVAL;
+		}
+		break;
+
+	case PLAN_SOURCE_CACHE:
+		free(source_cache);
+		source_cache = strdup(value);
+		if (!source_cache)
+			return -ENOMEM;
+		break;
+
+	case PLAN_STRICT:
+		options->params.strict = true;
+		break;
+
+	case PLAN_THREADS: {
+		unsigned int threads;
+
+		threads = strtoul(value, &endptr, 10);
+		if (*endptr != 0 || endptr == value || !threads) {
+			printf("Invalid number of threads '%s'\n", value);
+			return -EINVAL;
+		}
+
+		parallel_threads = threads;
+		break;
+	}
+
+	case PLAN_VFLIP:
+		options->vflip = true;
+		break;
+	}
+
+	return 0;
+}
+
+/* -----------------------------------------------------------------------------
+ * Library API
+ */
+
+struct vspref_image *vspref_image_new(const char *format, unsigned int width,
+				      unsigned int height)
+{
+	const struct format_info *info = format_by_name(format);
+
+	if (!info) {
+		printf("Unsupported format '%s'\n", format);
+		return NULL;
+	}
+
+	return (struct vspref_image *)image_new(info, width, height);
+}
+
+struct vspref_image *vspref_image_wrap(const char *format, unsigned int width,
+				       unsigned int height, void *data,
+				       size_t size)
+{
+	const struct format_info *info = format_by_name(format);
+	struct image *image;
+
+	if (!info) {
+		printf("Unsupported format '%s'\n", format);
+		return NULL;
+	}
+
+	image = malloc(sizeof(*image));
+	if (!image)
+		return NULL;
+
+	image_init(image, info, width, height);
+
+	if (size < image->size) {
+		printf("Buffer too small for %s %ux%u image, %u bytes needed\n",
+		       format, width, height, image->size);
+		free(image);
+		return NULL;
+	}
+
+	image->data = data;
+	image->wrapped = true;
+
+	return (struct vspref_image *)image;
+}
+
+struct vspref_image *vspref_image_read(const char *filename)
+{
+	return (struct vspref_image *)image_read(filename);
+}
+
+struct vspref_image *vspref_image_read_raw(const char *filename,
+					   const char *format,
+					   unsigned int width,
+					   unsigned int height)
+{
+	const struct format_info *info = format_by_name(format);
+
+	if (!info) {
+		printf("Unsupported format '%s'\n", format);
+		return NULL;
+	}
+
+	return (struct vspref_image *)image_read_raw(filename, info, width,
+						     height);
+}
+
+int vspref_image_write(const struct vspref_image *image, const char *filename)
+{
+	return image_write(&image->image, filename);
+}
+
+int vspref_image_write_compressed(const struct vspref_image *image,
+				  const char *filename)
+{
+	return image_write_compressed(&image->image, filename);
+}
+
+void vspref_image_delete(struct vspref_image *image)
+{
+	image_delete(image ? &image->image : NULL);
+}
+
+const char *vspref_image_format(const struct vspref_image *image)
+{
+	return image->image.format->name;
+}
+
+unsigned int vspref_image_width(const struct vspref_image *image)
+{
+	return image->image.width;
+}
+
+unsigned int vspref_image_height(const struct vspref_image *image)
+{
+	return image->image.height;
+}
+
+size_t vspref_image_size(const struct vspref_image *image)
+{
+	return image->image.size;
+}
+
+void *vspref_image_data(const struct vspref_image *image)
+{
+	return image->image.data;
+}
+
+size_t vspref_format_size(const char *format, unsigned int width,
+			  unsigned int height)
+{
+	const struct format_info *info = format_by_name(format);
+	struct image image;
+
+	if (!info)
+		return 0;
+
+	image_init(&image, info, width, height);
+	return image.size;
+}
+
+void vspref_list_formats(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(format_info); i++)
+		printf("%s\n", format_info[i].name);
+}
+
+struct vspref_plan *vspref_plan_new(void)
+{
+	struct vspref_plan *plan;
+	struct options *options;
+
+	plan = calloc(1, sizeof(*plan));
+	if (!plan)
+		return NULL;
+
+	options = &plan->options;
+	options->input_format = format_by_name("RGB24");
+	options->output_format = format_by_name("RGB24");
+	options->params.alpha = 255;
+	options->params.encoding = V4L2_YCBCR_ENC_601;
+	options->params.quantization = V4L2_QUANTIZATION_LIM_RANGE;
+	options->histo_type = HISTOGRAM_HGO;
+
+	return plan;
+}
+
+void vspref_plan_delete(struct vspref_plan *plan)
+{
+	struct options *options;
+	unsigned int i;
+
+	if (!plan)
+		return;
+
+	options = &plan->options;
+
+	for (i = 0; i < options->num_layers; ++i)
+		free(options->layers[i].spec);
+
+	free(options->histo_windows);
+	free(options->clu_filename);
+	free(options->lut_filename);
+	free(plan);
+}
+
+const char *vspref_plan_output_format(const struct vspref_plan *plan)
+{
+	return plan->options.output_format->name;
+}
+
+void vspref_plan_output_size(const struct vspref_plan *plan,
+			     unsigned int width, unsigned int height,
+			     unsigned int *output_width,
+			     unsigned int *output_height)
+{
+	process_output_size(&plan->options, width, height, output_width,
+			    output_height);
+}
+
+size_t vspref_plan_histogram_size(const struct vspref_plan *plan)
+{
+	return process_histogram_size(&plan->options);
+}
+
+int vspref_plan_run(const struct vspref_plan *plan,
+		    const struct vspref_image *input,
+		    struct vspref_image *output, void *histogram,
+		    size_t histogram_size)
+{
+	const struct options *options = &plan->options;
+	int ret;
+
+	if (input->image.format != format_by_name("RGB24")) {
+		printf("Pipeline input must be in RGB24 format\n");
+		return -EINVAL;
+	}
+
+	if (histogram && histogram_size < process_histogram_size(options)) {
+		printf("Histogram buffer too small, %zu bytes needed\n",
+		       process_histogram_size(options));
+		return -EINVAL;
+	}
+
+	if (options->profile)
+		profile_init(options->profile_json);
+
+	ret = process(options, &input->image, &output->image, histogram);
+
+	profile_report();
+	profile_cleanup();
+
+	return ret;
+}
+
+int vspref_plan_process(const struct vspref_plan *plan, const char *input,
+			const char *output, const char *histogram)
+{
+	const struct options *options = &plan->options;
+	struct image *source = NULL;
+	struct image *result = NULL;
+	uint8_t *histo = NULL;
+	unsigned int width;
+	unsigned int height;
+	struct profile_mark mark;
+	int ret;
+
+	if (options->num_histo_windows && !histogram) {
+		printf("Histogram windows require a histogram file name\n");
+		return -EINVAL;
+	}
+
+	if (options->num_histo_windows > 1 && !strchr(histogram, '#')) {
+		printf("Multiple histogram windows require a histogram file name containing '#'\n");
+		return -EINVAL;
+	}
+
+	if (options->profile)
+		profile_init(options->profile_json);
+
+	/* Read the input image */
+	profile_mark(&mark);
+	source = image_read(input);
+	if (!source) {
+		ret = -EINVAL;
+		goto done;
+	}
+
+	profile_record("read", &mark, source->width * source->height,
+		       source->size);
+
+	process_output_size(options, source->width, source->height, &width,
+			    &height);
+
+	result = image_new(options->output_format, width, height);
+	if (!result) {
+		ret = -ENOMEM;
+		goto done;
+	}
+
+	if (histogram) {
+		histo = malloc(process_histogram_size(options));
+		if (!histo) {
+			ret = -ENOMEM;
+			goto done;
+		}
+	}
+
+	ret = process(options, source, result, histo);
+	if (ret)
+		goto done;
+
+	if (histogram) {
+		ret = process_histogram_write(histogram, options, histo);
+		if (ret)
+			goto done;
+	}
+
+	/* Write the output image */
+	if (output) {
+		profile_mark(&mark);
+		if (options->compress)
+			ret = image_write_compressed(result, output);
+		else
+			ret = image_write(result, output);
+		profile_record("write", &mark, result->width * result->height,
+			       result->size);
+		if (ret)
+			goto done;
+	}
+
+done:
+	profile_report();
+	profile_cleanup();
+
+	free(histo);
+	image_delete(result);
+	image_delete(source);
+	return ret;
+}
+
+int vspref_histogram(const struct vspref_image *image, const char *type,
+		     const uint8_t *hue_areas, void *data, size_t size)
+{
+	static const uint8_t no_areas[12];
+	enum histogram_type histo_type;
+	int ret;
+
+	if (!strcmp(type, "hgo")) {
+		histo_type = HISTOGRAM_HGO;
+	} else if (!strcmp(type, "hgt")) {
+		histo_type = HISTOGRAM_HGT;
+	} else {
+		printf("Invalid histogram type '%s'\n", type);
+		return -EINVAL;
+	}
+
+	if (image->image.format != format_by_name("RGB24") &&
+	    image->image.format != format_by_name("YUV24") &&
+	    image->image.format != format_by_name("HSV24")) {
+		printf("Histograms require an RGB24, YUV24 or HSV24 image\n");
+		return -EINVAL;
+	}
+
+	if (size < histogram_size(histo_type)) {
+		printf("Histogram buffer too small, %zu bytes needed\n",
+		       histogram_size(histo_type));
+		return -EINVAL;
+	}
+
+	ret = histogram(&image->image, data, histo_type,
+			hue_areas ? hue_areas : no_areas);
+	if (ret < 0)
+		return ret;
+
+	return histogram_size(histo_type);
+}
+
+int vspref_verify_frames(const struct vspref_image *reference,
+			 const char *const *filenames, unsigned int count)
+{
+	struct compare_reference ref;
+	unsigned int i;
+	int ret = 0;
+
+	ret = compare_reference_init(&ref, &reference->image);
+	if (ret < 0)
+		return ret;
+
+	for (i = 0; i < count; ++i) {
+		ret = compare_frame(&ref, filenames[i]);
+		if (ret)
+			break;
+	}
+
+	/* Stop at the first mismatch, the remaining frames are skipped. */
+	for (i = i + 1; i < count; ++i)
+		printf("Compared %s: skipped\n", filenames[i]);
+
+	free(ref.hashes);
+	return ret;
+}
+
+int vspref_compare(const struct vspref_image *a, const struct vspref_image *b,
+		   uint64_t *ae, double *mae, double *psnr)
+{
+	struct compare_stats stats;
+	uint64_t samples;
+	int ret;
+
+	ret = compare_images(&a->image, &b->image, &stats);
+	if (ret < 0)
+		return ret;
+
+	samples = max((uint64_t)a->image.width * a->image.height * 3, 1ULL);
+
+	*ae = stats.pixels;
+	*mae = (double)stats.sum / samples / 255;
+	*psnr = stats.sum_sq ? 10 * log10(255.0 * 255 * samples / stats.sum_sq)
+	      : INFINITY;
+
+	return 0;
+}
+
+int vspref_image_checksum(const struct vspref_image *image, char *str)
+{
+	uint8_t digest[CHECKSUM_SIZE];
+	int ret;
+
+	ret = checksum(image->image.data, image->image.size, digest);
+	if (ret < 0)
+		return ret;
+
+	checksum_format(digest, str);
+	return 0;
+}
+
+int vspref_file_checksum(const char *filename, char *str)
+{
+	uint8_t digest[CHECKSUM_SIZE];
+	int ret;
+
+	ret = checksum_file(filename, digest);
+	if (ret < 0)
+		return ret;
+
+	checksum_format(digest, str);
+	return 0;
+}
+
+int vspref_decode_frames(const struct vspref_plan *plan,
+			 const char *const *paths, unsigned int count,
+			 const char *compare, const char *type)
+{
+	enum decode_mode mode = DECODE_FRAME;
+	bool pnm = false;
+
+	if (compare && !strcmp(compare, "side")) {
+		mode = DECODE_SIDE;
+	} else if (compare && !strcmp(compare, "diff")) {
+		mode = DECODE_DIFF;
+	} else if (compare) {
+		printf("Invalid comparison mode %s\n", compare);
+		return -EINVAL;
+	}
+
+	if (type && !strcmp(type, "pnm")) {
+		pnm = true;
+	} else if (type && strcmp(type, "png")) {
+		printf("Invalid image type %s\n", type);
+		return -EINVAL;
+	}
+
+	return decode_frames(&plan->options.params, paths, count, mode, pnm);
+}
+
+int vspref_delta_create(const struct vspref_image *frame,
+			const struct vspref_image *reference,
+			const char *identity, const char *filename)
+{
+	return delta_create(&frame->image, &reference->image, identity,
+			    filename);
+}
+
+struct vspref_image *vspref_delta_apply(const char *filename,
+					const char *reference)
+{
+	return (struct vspref_image *)delta_apply(filename, reference);
+}
+
+int vspref_delta_info(const char *filename)
+{
+	return delta_info(filename);
+}
+
+void vspref_list_kernels(void)
+{
+	kernel_list();
+}
+
+int vspref_self_test(void)
+{
+	return self_test();
+}
+
+int vspref_verify_kernels(void)
+{
+	return verify_kernels();
+}
+
+int vspref_bench(const char *output, const char *compare, const char *filter)
+{
+	return bench(output, compare, filter);
+}
@@ -0,0 +1,209 @@
+/*
+ * Copyright (C) 2016 Laurent Pinchart <laurent.pinchart@ideasonboard.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef __VSPREF_H__
+#define __VSPREF_H__
+
+/*
+ * libvspref - VSP reference frame and histogram generation
+ *
+ * The library exposes the gen-image processing engine. The API only uses
+ * opaque handles, C strings, integers and raw buffers, and can be called
+ * directly through a foreign function interface such as Python ctypes.
+ *
+ * Functions returning an int return 0 (or a size) on success and a negative
+ * error code on failure. Error messages are printed to stdout.
+ *
+ * Plans and images can be used from multiple threads concurrently, provided
+ * that an image isn't written by a thread while other threads access it. The
+ * "kernel", "source-cache", "threads" and "profile" plan options control
+ * process-wide state shared by all plans. They are not thread-safe, and must
+ * not be set while other threads use the library.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Maximum number of layers set with the "layer" plan option */
+#define VSPREF_MAX_LAYERS	5
+
+struct vspref_image;
+struct vspref_plan;
+
+/*
+ * Images
+ *
+ * Formats are identified by the names printed by vspref_list_formats(). Images
+ * created by vspref_image_wrap() reference the caller's buffer, which must be
+ * at least vspref_format_size() bytes long and outlive the image, allowing
+ * results to be produced in place without copies.
+ *
+ * vspref_image_write_compressed() stores the image with the lossless frame
+ * codec, which records the image format and size, or raw if it doesn't
+ * compress. All functions that read raw frame files accept compressed files.
+ */
+struct vspref_image *vspref_image_new(const char *format, unsigned int width,
+				      unsigned int height);
+struct vspref_image *vspref_image_wrap(const char *format, unsigned int width,
+				       unsigned int height, void *data,
+				       size_t size);
+struct vspref_image *vspref_image_read(const char *filename);
+struct vspref_image *vspref_image_read_raw(const char *filename,
+					   const char *format,
+					   unsigned int width,
+					   unsigned int height);
+int vspref_image_write(const struct vspref_image *image, const char *filename);
+int vspref_image_write_compressed(const struct vspref_image *image,
+				  const char *filename);
+void vspref_image_delete(struct vspref_image *image);
+
+const char *vspref_image_format(const struct vspref_image *image);
+unsigned int vspref_image_width(const struct vspref_image *image);
+unsigned int vspref_image_height(const struct vspref_image *image);
+size_t vspref_image_size(const struct vspref_image *image);
+void *vspref_image_data(const struct vspref_image *image);
+
+size_t vspref_format_size(const char *format, unsigned int width,
+			  unsigned int height);
+void vspref_list_formats(void);
+
+/*
+ * Processing plans
+ *
+ * A plan describes the processing stages applied to an RGB24 input image, as
+ * read from a PNM file. Options are set with the gen-image long option names
+ * and values (for instance "format", "NV12M" or "rotate", NULL). The "kernel",
+ * "source-cache" and "threads" options apply to all plans, and the "profile"
+ * option reports the processing of all plans run concurrently. Input images
+ * can be gzip-compressed.
+ *
+ * vspref_plan_run() formats the result into the output image, which must have
+ * the plan output format and size, and computes the histogram into the
+ * histogram buffer if not NULL. With histogram windows the buffer stores the
+ * histograms of all windows consecutively. With the "compress" option
+ * vspref_plan_process() stores the output image compressed. With the "strict"
+ * option the plan only uses integer arithmetic, and produces the same results
+ * on all hosts.
+ */
+struct vspref_plan *vspref_plan_new(void);
+void vspref_plan_delete(struct vspref_plan *plan);
+int vspref_plan_set(struct vspref_plan *plan, const char *name,
+		    const char *value);
+
+const char *vspref_plan_output_format(const struct vspref_plan *plan);
+void vspref_plan_output_size(const struct vspref_plan *plan,
+			     unsigned int width, unsigned int height,
+			     unsigned int *output_width,
+			     unsigned int *output_height);
+size_t vspref_plan_histogram_size(const struct vspref_plan *plan);
+
+int vspref_plan_run(const struct vspref_plan *plan,
+		    const struct vspref_image *input,
+		    struct vspref_image *output, void *histogram,
+		    size_t histogram_size);
+int vspref_plan_process(const struct vspref_plan *plan, const char *input,
+			const char *output, const char *histogram);
+
+/*
+ * Histograms
+ *
+ * Compute the HGO or HGT histogram ("hgo" or "hgt") of a whole RGB24, YUV24 or
+ * HSV24 image. The HGT hue areas are 12 area boundaries. Return the histogram
+ * size in bytes.
+ */
+int vspref_histogram(const struct vspref_image *image, const char *type,
+		     const uint8_t *hue_areas, void *data, size_t size);
+
+/*
+ * Frame verification
+ *
+ * Compare captured frames stored in files with a reference image, printing
+ * the result for each frame and the location of the differences. Stop at the
+ * first frame that differs. Return 0 if all frames match, 1 if a frame
+ * differs, or a negative error code.
+ */
+int vspref_verify_frames(const struct vspref_image *reference,
+			 const char *const *filenames, unsigned int count);
+
+/*
+ * Fuzzy frame comparison
+ *
+ * Compare two images of the same format and size on their 8-bit components
+ * (RGB, HSV or YCbCr). Return the number of differing pixels in ae, the mean
+ * absolute error normalized to [0, 1] in mae and the peak signal to noise
+ * ratio in dB in psnr, infinite for identical images.
+ */
+int vspref_compare(const struct vspref_image *a, const struct vspref_image *b,
+		   uint64_t *ae, double *mae, double *psnr);
+
+/*
+ * Frame checksums
+ *
+ * Compute the BLAKE3 checksum of an image or of the contents of a file into
+ * str, as a string of hexadecimal digits identical to the b3sum output. The
+ * str buffer must be at least VSPREF_CHECKSUM_SIZE bytes long, including the
+ * terminating NUL character.
+ */
+#define VSPREF_CHECKSUM_SIZE	65
+
+int vspref_image_checksum(const struct vspref_image *image, char *str);
+int vspref_file_checksum(const char *filename, char *str);
+
+/*
+ * Frame decoding
+ *
+ * Convert raw frame files to RGB images in PNG format, or in PNM format if
+ * type is "pnm". Paths name frame files or directories, in which all frame
+ * files are converted. The frame format and size are parsed from the file
+ * names stored by the test scripts, and YCbCr frames are converted with the
+ * plan encoding and quantization. The image is stored next to the frame with
+ * a .png or .pnm extension.
+ *
+ * When compare is "side" or "diff", frames are also compared with the
+ * ref-frame.bin reference stored with them, in an image suffixed with -side
+ * showing the frame and the reference side by side, or with -diff showing the
+ * pixels that differ in red. Files are converted in parallel.
+ */
+int vspref_decode_frames(const struct vspref_plan *plan,
+			 const char *const *paths, unsigned int count,
+			 const char *compare, const char *type);
+
+/*
+ * Frame deltas
+ *
+ * Store a frame as the tiles that differ from its reference frame, along with
+ * an identity string for the reference, such as the gen-image options that
+ * generate it. vspref_delta_create() returns the number of differing tiles.
+ * vspref_delta_apply() reconstructs the frame from the delta and the reference
+ * stored in a raw file, and fails if the reference or the reconstructed frame
+ * doesn't match the checksums recorded in the delta. vspref_delta_info()
+ * prints the delta format, size, number of tiles and reference identity.
+ */
+int vspref_delta_create(const struct vspref_image *frame,
+			const struct vspref_image *reference,
+			const char *identity, const char *filename);
+struct vspref_image *vspref_delta_apply(const char *filename,
+					const char *reference);
+int vspref_delta_info(const char *filename);
+
+/* Kernels, self tests and benchmarks */
+void vspref_list_kernels(void);
+int vspref_self_test(void);
+int vspref_verify_kernels(void);
+int vspref_bench(const char *output, const char *compare, const char *filter);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __VSPREF_H__ */
@@ -77,6 +77,12 @@ test_suspend_resume() {
 test_main() {
 	local mode
 
+	# Suspending the system doesn't exercise the simulated devices
+	if [ x$VSP_SIMULATOR = x1 ] ; then
+		echo "$0: suspend/resume testing requires VSP hardware"
+		return
+	fi
+
 	# Check for pm-suspend test option
 	if [ ! -e /sys/power/pm_test ] ; then
 		echo "$0: suspend/resume testing requires CONFIG_PM_DEBUG"